@@ -0,0 +1,418 @@
+/* -*- project-c -*- */
+/**
+ * \file aggregate.c
+ * \brief Taking events from many sensors and looking across segments.
+ *
+ * With options.aggregate set, antidote also listens for sensors - other
+ * antidotes with Forward set (see forward.c) - on a TCP port, or on a Unix
+ * socket if it's given as a path. Up to AGGREGATE_SENSORS can be connected at
+ * once; each is read without blocking, from the event loop, a batch at a time.
+ *
+ * What comes in is handled two ways:
+ *
+ * - Alerts a sensor raised are raised here too, so the aggregator's sinks
+ *   (event log, remote syslog, email...) see everything, from everywhere.
+ * - Every ARP observation updates a merged table of which MAC each IP address
+ *   was last claimed by, and on which sensor. Addresses are told apart by
+ *   VLAN, as the sensors' own tables are (see vlan.c): 10.0.0.1 in VLAN 10
+ *   and 10.0.0.1 in VLAN 20 are two different hosts, wherever they're seen. An address claimed by different
+ *   MACs on different sensors within options.timeout is the kind of thing no
+ *   single sensor can spot - the same address in use on two segments, or a
+ *   poisoner that's learned to keep its head down on each one - and raises
+ *   ALERT_CONFLICT (at most once every AGGREGATE_REPEAT seconds per address).
+ *
+ * The merged table is an open-addressed hash on the VLAN and IP address, sized at twice
+ * options.max_records; when it's full the slot an address hashes to is simply
+ * reused, so memory stays bounded.
+ */
+
+#include "antidote.h"
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#if HAVE_LIBZ && HAVE_ZLIB_H
+#include <zlib.h>
+#define USE_ZLIB 1
+#endif
+
+#define AGGREGATE_NAMES 256 /* different sensor names remembered */
+#define AGGREGATE_NAMELEN 64 /* longest sensor name kept */
+#define AGGREGATE_PROBE 8 /* slots looked at before an address takes over its own */
+#define AGGREGATE_REPEAT 60 /* seconds between conflict alerts for one address */
+
+struct sensor {
+	int fd; /* -1 if not connected */
+	unsigned int serial;
+	int name; /* index into names, -1 until it's said hello */
+	u_int8_t *in; /* FORWARD_MAXBATCH + FORWARD_HEADER bytes */
+	size_t inlen;
+	unsigned long batches, events;
+};
+
+struct binding {
+	u_int32_t vlan; /* VLAN_KEY(), 0 for untagged frames */
+	u_int8_t ip_address[4];
+	u_int8_t mac_address[ETH_ALEN];
+	u_int16_t sensor; /* names index + 1; 0 for an empty slot */
+	long lastseen;
+	long conflicted; /* when we last alerted on it */
+};
+
+static int listenfd = -1;
+static struct sensor sensors[AGGREGATE_SENSORS];
+static unsigned int serials = 0;
+static char names[AGGREGATE_NAMES][AGGREGATE_NAMELEN + 1];
+static int namecount = 0;
+static struct binding *bindings = NULL;
+static u_int32_t bindingmask = 0;
+static u_int8_t unpacked[FORWARD_MAXBATCH];
+
+static u_int32_t get32(const u_int8_t *src){
+	return ((u_int32_t)src[0] << 24) | ((u_int32_t)src[1] << 16) | ((u_int32_t)src[2] << 8) | src[3];
+}
+
+/**
+ * Stop listening, and remove the socket file if there is one.
+ */
+static void closeaggregate(){
+	int lp;
+	for (lp = 0; lp < AGGREGATE_SENSORS; lp++) {
+		if (sensors[lp].fd != -1)
+			close(sensors[lp].fd);
+		sensors[lp].fd = -1;
+	}
+	if (listenfd != -1) {
+		close(listenfd);
+		if (options.aggregate[0] == '/')
+			unlink(options.aggregate);
+	}
+	listenfd = -1;
+}
+
+/**
+ * Listen on a Unix socket for sensors on this machine.
+ */
+static int listenlocal(){
+	struct sockaddr_un address;
+	mode_t oldmask;
+	int result;
+	if (strlen(options.aggregate) >= sizeof(address.sun_path))
+		return ERR_AGGREGATE;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, options.aggregate);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd == -1)
+		return ERR_AGGREGATE;
+	unlink(options.aggregate);
+	oldmask = umask(0177);
+	result = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
+	umask(oldmask);
+	return (result == -1) ? ERR_AGGREGATE : OK;
+}
+
+/**
+ * Listen on a TCP port, IPv6 and IPv4 both if we can.
+ */
+static int listennetwork(){
+	struct sockaddr_in6 address6;
+	struct sockaddr_in address;
+	int port, on = 1, off = 0;
+	port = atoi(options.aggregate);
+	if ((port < 1) || (port > 65535))
+		return ERR_AGGREGATE;
+	listenfd = socket(AF_INET6, SOCK_STREAM, 0);
+	if (listenfd != -1) {
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+		memset(&address6, 0, sizeof(address6));
+		address6.sin6_family = AF_INET6;
+		address6.sin6_addr = in6addr_any;
+		address6.sin6_port = htons(port);
+		if (bind(listenfd, (struct sockaddr *)&address6, sizeof(address6)) == 0)
+			return OK;
+		close(listenfd);
+	}
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (listenfd == -1)
+		return ERR_AGGREGATE;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	return (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) == 0) ? OK : ERR_AGGREGATE;
+}
+
+/**
+ * Start listening for sensors on options.aggregate.
+ *
+ * RETURN VALUES:
+ * \return OK - Listening, or we're not an aggregator.
+ * \return ERR_NOMEM
+ * \return ERR_AGGREGATE
+ */
+int openaggregate(){
+	u_int32_t size;
+	int lp, result;
+	for (lp = 0; lp < AGGREGATE_SENSORS; lp++)
+		sensors[lp].fd = -1;
+	if (options.aggregate[0] == '\0')
+		return OK;
+	for (size = 1024; (size < 2 * options.max_records) && (size < 0x40000000); size *= 2)
+		;
+	bindings = calloc(size, sizeof(struct binding));
+	if (bindings == NULL)
+		return ERR_NOMEM;
+	bindingmask = size - 1;
+	result = (options.aggregate[0] == '/') ? listenlocal() : listennetwork();
+	if ((result != OK) || (listen(listenfd, AGGREGATE_SENSORS) == -1)) {
+		if (listenfd != -1)
+			close(listenfd);
+		listenfd = -1;
+		return ERR_AGGREGATE;
+	}
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+	atexit(closeaggregate);
+	return OK;
+}
+
+/**
+ * \return The index of a sensor's name, remembering it if it's new.
+ */
+static int sensorname(const u_int8_t *name, int length){
+	int lp;
+	if (length > AGGREGATE_NAMELEN)
+		length = AGGREGATE_NAMELEN;
+	for (lp = 0; lp < namecount; lp++) {
+		if ((strncmp(names[lp], (const char *)name, length) == 0) && (names[lp][length] == '\0'))
+			return lp;
+	}
+	if (namecount == AGGREGATE_NAMES)
+		lp = AGGREGATE_NAMES - 1; /* lumped together, but still told apart from the rest */
+	else
+		lp = namecount++;
+	memcpy(names[lp], name, length);
+	names[lp][length] = '\0';
+	return lp;
+}
+
+/**
+ * Fold one observation into the merged table, alerting if it contradicts what
+ * another sensor saw.
+ */
+static void observe(struct sensor *sensor, const u_int8_t *event, long now){
+	struct binding *slot, *found = NULL, *empty = NULL;
+	struct alertrecord record;
+	const u_int8_t *mac = event + 2, *ip = event + 8;
+	u_int32_t hash, vlan = get32(event + 24);
+	int lp;
+	if (sumbytes((u_int8_t *)ip, 4) == 0)
+		return; /* a probe - the sender isn't claiming anything */
+	hash = hashbytes(ip, 4, vlan);
+	for (lp = 0; (lp < AGGREGATE_PROBE) && (found == NULL); lp++) {
+		slot = &bindings[(hash + lp) & bindingmask];
+		if (slot->sensor == 0) {
+			if (empty == NULL)
+				empty = slot;
+		} else if ((slot->vlan == vlan) && (memcmp(slot->ip_address, ip, 4) == 0)) {
+			found = slot;
+		}
+	}
+	if (found == NULL) {
+		found = (empty != NULL) ? empty : &bindings[hash & bindingmask];
+		found->vlan = vlan;
+		memcpy(found->ip_address, ip, 4);
+		found->conflicted = 0;
+	} else if ((found->sensor != sensor->name + 1) && (memcmp(found->mac_address, mac, ETH_ALEN) != 0)
+			&& (now - found->lastseen <= options.timeout)
+			&& (now - found->conflicted >= AGGREGATE_REPEAT)) {
+		memset(&record, 0, sizeof(record));
+		record.kind = ALERT_CONFLICT;
+		record.flags = ALERTREC_IP | ALERTREC_OLDMAC | ALERTREC_NEWMAC | ALERTREC_VLAN;
+		record.vlan = vlan;
+		memcpy(record.ip_address, ip, 4);
+		memcpy(record.old_mac, found->mac_address, ETH_ALEN);
+		memcpy(record.new_mac, mac, ETH_ALEN);
+		gettimeofday(&record.when, NULL);
+		relayalert(&record);
+		found->conflicted = now;
+	}
+	memcpy(found->mac_address, mac, ETH_ALEN);
+	found->sensor = sensor->name + 1;
+	found->lastseen = now;
+}
+
+/**
+ * Handle one batch from a sensor. \return OK, or ERR_BADUSAGE if the sensor
+ * is talking nonsense and should be dropped.
+ */
+static int handlebatch(struct sensor *sensor, const u_int8_t *data, size_t length){
+	struct alertrecord record;
+	const u_int8_t *event, *end;
+	unsigned long size;
+	long now;
+	if ((length < FORWARD_HEADER - 4) || (data[0] != FORWARD_VERSION))
+		return ERR_BADUSAGE;
+	size = get32(data + 4);
+	if (size > FORWARD_MAXBATCH)
+		return ERR_BADUSAGE;
+	if (data[1] & FORWARD_COMPRESSED) {
+#ifdef USE_ZLIB
+		uLongf unpackedlen = sizeof(unpacked);
+		if ((uncompress(unpacked, &unpackedlen, data + FORWARD_HEADER - 4, length - (FORWARD_HEADER - 4)) != Z_OK)
+				|| (unpackedlen != size))
+			return ERR_BADUSAGE;
+		event = unpacked;
+#else
+		return ERR_BADUSAGE; /* we can't read it, and it won't stop sending them */
+#endif
+	} else {
+		if (size != length - (FORWARD_HEADER - 4))
+			return ERR_BADUSAGE;
+		event = data + FORWARD_HEADER - 4;
+	}
+	end = event + size;
+	now = time(NULL);
+	sensor->batches++;
+	while (event < end) {
+		switch (*event) {
+		case FWD_HELLO:
+			if ((event + 2 > end) || (event + 2 + event[1] > end))
+				return ERR_BADUSAGE;
+			sensor->name = sensorname(event + 2, event[1]);
+			event += 2 + event[1];
+			break;
+		case FWD_OBSERVATION:
+			if (event + FWD_OBSERVATIONSIZE > end)
+				return ERR_BADUSAGE;
+			if (sensor->name == -1)
+				sensor->name = sensorname((const u_int8_t *)"-", 1);
+			observe(sensor, event, now);
+			event += FWD_OBSERVATIONSIZE;
+			break;
+		case FWD_ALERT:
+			if (event + 1 + ALERT_WIRESIZE > end)
+				return ERR_BADUSAGE;
+			parsealertbinary(event + 1, &record);
+			relayalert(&record);
+			event += 1 + ALERT_WIRESIZE;
+			break;
+		default:
+			return ERR_BADUSAGE;
+		}
+		sensor->events++;
+	}
+	return OK;
+}
+
+static void dropsensor(struct sensor *sensor, const char *why){
+	char msg[ADOTE_ERR_BUFF];
+	snprintf(msg, sizeof(msg), "Sensor %s %s after %lu events in %lu batches.",
+		 (sensor->name != -1) ? names[sensor->name] : "(unnamed)", why, sensor->events, sensor->batches);
+	notice(msg);
+	close(sensor->fd);
+	sensor->fd = -1;
+	free(sensor->in);
+	sensor->in = NULL;
+}
+
+/**
+ * Read everything a sensor has sent, handling each complete batch as it
+ * arrives.
+ */
+static void servicesensor(struct sensor *sensor){
+	size_t length, used;
+	ssize_t done;
+	for (;;) {
+		done = recv(sensor->fd, sensor->in + sensor->inlen, FORWARD_HEADER + FORWARD_MAXBATCH - sensor->inlen, 0);
+		if (done == 0) {
+			dropsensor(sensor, "disconnected");
+			return;
+		} else if (done < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+				dropsensor(sensor, "failed");
+			return;
+		}
+		sensor->inlen += done;
+		used = 0;
+		while (sensor->inlen - used >= 4) {
+			length = get32(sensor->in + used);
+			if (length > FORWARD_HEADER - 4 + FORWARD_MAXBATCH) {
+				dropsensor(sensor, "sent an oversized batch");
+				return;
+			}
+			if (sensor->inlen - used < 4 + length)
+				break;
+			if (handlebatch(sensor, sensor->in + used + 4, length) != OK) {
+				dropsensor(sensor, "sent a batch we can't read");
+				return;
+			}
+			used += 4 + length;
+		}
+		sensor->inlen -= used;
+		memmove(sensor->in, sensor->in + used, sensor->inlen);
+	}
+}
+
+/**
+ * Accept any sensors waiting to connect, and read from one or all of them.
+ * Never blocks.
+ *
+ * ARGUMENTS:
+ * \arg \c fd - The descriptor the event loop says is readable, or -1 to try
+ * everything.
+ */
+void serviceaggregate(int fd){
+	struct sensor *sensor;
+	int newfd, lp;
+	if (listenfd == -1)
+		return;
+	if ((fd == -1) || (fd == listenfd)) {
+		while ((newfd = accept(listenfd, NULL, NULL)) != -1) {
+			for (lp = 0; (lp < AGGREGATE_SENSORS) && (sensors[lp].fd != -1); lp++)
+				;
+			if (lp == AGGREGATE_SENSORS) {
+				close(newfd); /* full - it'll try again */
+				continue;
+			}
+			sensor = &sensors[lp];
+			sensor->in = malloc(FORWARD_HEADER + FORWARD_MAXBATCH);
+			if (sensor->in == NULL) {
+				close(newfd);
+				continue;
+			}
+			fcntl(newfd, F_SETFL, fcntl(newfd, F_GETFL, 0) | O_NONBLOCK);
+			sensor->fd = newfd;
+			sensor->serial = ++serials;
+			sensor->name = -1;
+			sensor->inlen = 0;
+			sensor->batches = sensor->events = 0;
+		}
+	}
+	for (lp = 0; lp < AGGREGATE_SENSORS; lp++) {
+		if ((sensors[lp].fd != -1) && ((fd == -1) || (sensors[lp].fd == fd)))
+			servicesensor(&sensors[lp]);
+	}
+}
+
+/**
+ * List the descriptors the event loop should watch for us, in the same way as
+ * controlfds(). We never have anything to write.
+ */
+int aggregatefds(int *fds, unsigned int *serial, int *writing, int max){
+	int lp, count = 0;
+	if ((listenfd == -1) || (max < 1))
+		return 0;
+	fds[count] = listenfd;
+	serial[count] = 0;
+	writing[count++] = 0;
+	for (lp = 0; (lp < AGGREGATE_SENSORS) && (count < max); lp++) {
+		if (sensors[lp].fd == -1)
+			continue;
+		fds[count] = sensors[lp].fd;
+		serial[count] = sensors[lp].serial;
+		writing[count++] = 0;
+	}
+	return count;
+}
@@ -50,6 +50,146 @@ void notice(const char *err){
 #endif
 }
 
+/**
+ * Alerts waiting to be sent. raisealert() adds to the head, flushalerts()
+ * takes from the tail; both only ever increase, and are taken modulo ALERTQUEUE.
+ */
+static struct alertrecord alertqueue[ALERTQUEUE];
+static unsigned int queuehead = 0, queuetail = 0;
+
+/**
+ * Raise an alert. Nothing is formatted or sent here - the details are copied
+ * into a record and queued, and flushalerts() hands them to each sink later.
+ * That keeps the cost of alerting off the path that spots the problem.
+ *
+ * If the queue is full, it's flushed first. Alerts are never dropped - except
+ * those about records a Policy line says to ignore (see policy.c).
+ *
+ * ARGUMENTS:
+ * \arg \c kind - One of the ALERT_ kinds in antidote.h.
+ * \arg \c *ip - The record concerned (for its IP address, counts and VLAN), or NULL.
+ * \arg \c *oldmac - The MAC previously held (or claimed by the Ethernet frame), or NULL.
+ * \arg \c *newmac - The MAC now seen (or claimed by the ARP packet), or NULL.
+ * \arg \c count - Frames, addresses or whatever else the kind of alert counts.
+ */
+void raisealert(int kind, struct ipdetails *ip, const u_int8_t *oldmac, const u_int8_t *newmac, unsigned long count){
+	struct alertrecord *record;
+	if ((ip != NULL) && (ip->policy != NULL) && ip->policy->ignore)
+		return;
+	if (queuehead - queuetail >= ALERTQUEUE)
+		flushalerts();
+	record = &alertqueue[queuehead % ALERTQUEUE];
+	record->kind = kind;
+	record->flags = 0;
+	record->count = count;
+	record->vlan = 0;
+	memset(record->ip_address, 0, IP_KEYSIZE); /* so alerts about no address group together */
+	if (ip != NULL) {
+		memcpy(record->ip_address, ip->ip_address, IP_KEYSIZE);
+		record->requests = ip->requests;
+		record->replies = ip->replies;
+		record->vlan = ip->partition->vlan;
+		record->flags |= ALERTREC_IP | ALERTREC_COUNTS | ALERTREC_VLAN;
+		if (ip->partition->family == AF_INET6)
+			record->flags |= ALERTREC_IPV6;
+	}
+	if (oldmac != NULL) {
+		memcpy(record->old_mac, oldmac, ETH_ALEN);
+		record->flags |= ALERTREC_OLDMAC;
+	}
+	if (newmac != NULL) {
+		memcpy(record->new_mac, newmac, ETH_ALEN);
+		record->flags |= ALERTREC_NEWMAC;
+	}
+	gettimeofday(&record->when, NULL);
+	evidencealert(record);
+	queuehead++;
+}
+
+/**
+ * Raise an alert about an address we deliberately keep no record for - a
+ * scanner, say (see scan.c), or a DHCP lease (see dhcp.c). Just like
+ * raisealert(), but with the address, family and VLAN given instead of taken
+ * from a record, and no counts.
+ *
+ * ARGUMENTS:
+ * \arg \c kind - One of the ALERT_ kinds in antidote.h.
+ * \arg \c *address - The address concerned, IP_KEYSIZE bytes as a record keeps it.
+ * \arg \c family - AF_INET or AF_INET6.
+ * \arg \c vlan - The VLAN it was seen on.
+ * \arg \c *oldmac - The MAC it had before, or NULL.
+ * \arg \c *newmac - The MAC it was seen with, or NULL.
+ * \arg \c count - Frames, addresses or whatever else the kind of alert counts.
+ */
+void raiseaddressalert(int kind, const u_int8_t *address, int family, u_int32_t vlan, const u_int8_t *oldmac, const u_int8_t *newmac, unsigned long count){
+	struct alertrecord *record;
+	if (queuehead - queuetail >= ALERTQUEUE)
+		flushalerts();
+	record = &alertqueue[queuehead % ALERTQUEUE];
+	memset(record, 0, sizeof(struct alertrecord));
+	record->kind = kind;
+	record->flags = ALERTREC_IP | ALERTREC_VLAN;
+	if (family == AF_INET6)
+		record->flags |= ALERTREC_IPV6;
+	record->count = count;
+	record->vlan = vlan;
+	memcpy(record->ip_address, address, IP_KEYSIZE);
+	if (oldmac != NULL) {
+		memcpy(record->old_mac, oldmac, ETH_ALEN);
+		record->flags |= ALERTREC_OLDMAC;
+	}
+	if (newmac != NULL) {
+		memcpy(record->new_mac, newmac, ETH_ALEN);
+		record->flags |= ALERTREC_NEWMAC;
+	}
+	gettimeofday(&record->when, NULL);
+	evidencealert(record);
+	queuehead++;
+}
+
+/**
+ * Queue an alert which was raised somewhere else - by a sensor, and forwarded
+ * to us (see aggregate.c) - exactly as it came.
+ */
+void relayalert(const struct alertrecord *record){
+	if (queuehead - queuetail >= ALERTQUEUE)
+		flushalerts();
+	alertqueue[queuehead % ALERTQUEUE] = *record;
+	queuehead++;
+}
+
+/**
+ * Send everything that's been raised. Each alert is rendered as text for syslog
+ * (and email, if it's urgent enough - see maildigest.c) and as JSON for the
+ * event log; kinds with no priority only go to the event log. Everything is
+ * also queued for the remote syslog server and the aggregator, if there are
+ * any.
+ */
+void flushalerts(){
+	struct alertrecord *record;
+	char text[ALERT_TEXTSIZE];
+	int priority;
+	while (queuetail != queuehead) {
+		record = &alertqueue[queuetail % ALERTQUEUE];
+		queuetail++;
+		priority = alertkindpriority(record->kind);
+		if (priority == HIGHEST) {
+			formatalerttext(record, text);
+			redlog(text);
+			digestalert(record, text); /* email, now or later */
+		} else if (priority != 0) {
+			formatalerttext(record, text);
+			sendalert(priority, text);
+		}
+		logalert(record);
+		rsyslogalert(record);
+		forwardalert(record);
+	}
+	flushrsyslog();
+	flushforward(0);
+	flushdigest(0);
+}
+
 /**
  * Alert when an IP address has a different MAC to that previously logged.
  *
@@ -64,36 +204,7 @@ void notice(const char *err){
  * \arg \c *arp_mac - A pointer to an array of 8 bit unsigned integers holding the new MAC address. 
  */
 void alertchangedmacs(struct ipdetails *ip_details, u_int8_t *arp_mac){
-	char *err, *err2;
-	int lp;
-	err = malloc(ADOTE_ERR_BUFF);
-	err2 = malloc(ADOTE_ERR_BUFF);
-
-	if (err != NULL){
-		sprintf(err, "%d.%d.%d.%d has different MAC details. ", ip_details->ip_address[0], ip_details->ip_address[1], ip_details->ip_address[2], ip_details->ip_address[3]);
-	
-		if (err2 != NULL) {
-			strcat(err, " Previous MAC: ");
-			for (lp = 0; lp <= ETH_ALEN-1; lp++){
-				sprintf(err2, "%X", ip_details->mac_address[lp]);
-				strcat(err, err2);
-				if (lp < ETH_ALEN-1)
-					strcat(err, ":");
-			}
-		        strcat(err, " New MAC: ");
-			for (lp = 0; lp <= ETH_ALEN-1; lp++){
-				sprintf(err2, "%X", arp_mac[lp]);
-				strcat(err, err2);
-				if (lp < ETH_ALEN-1)
-					strcat(err, ":");
-			}
-		}
-		redalert(err);
-	}else{
-		redalert("A machine appears to have changed MAC details. Insufficient memory to give full information.");
-	}
-	free(err);
-	free(err2);
+	raisealert(ALERT_MACCHANGED, ip_details, ip_details->mac_address, arp_mac, 0);
 }
 
 /**
@@ -114,36 +225,7 @@ void alertdodgymacs(struct ipdetails *ip_details, u_int8_t *arp_mac){
 /* I'm sorry, but...
  * ALERT: SOMEONE IS WEARING AN ANORAK!
  */
-
-	char *err, *err2;
-	int lp;
-	err = malloc(ADOTE_ERR_BUFF);
-	err2 = malloc(ADOTE_ERR_BUFF);
-	if (err != NULL){
-		sprintf(err, "%d.%d.%d.%d gives conflicting MAC details. ", ip_details->ip_address[0], ip_details->ip_address[1], ip_details->ip_address[2], ip_details->ip_address[3]);
-	
-		if (err2 != NULL) {
-			strcat(err, " Ethernet MAC: ");
-			for (lp = 0; lp <= ETH_ALEN-1; lp++){
-				sprintf(err2, "%X", ip_details->mac_address[lp]);
-				strcat(err, err2);
-				if (lp < ETH_ALEN-1)
-					strcat(err, ":");
-			}
-		        strcat(err, " ARP body MAC: ");
-			for (lp = 0; lp <= ETH_ALEN-1; lp++){
-				sprintf(err2, "%X", arp_mac[lp]);
-				strcat(err, err2);
-				if (lp < ETH_ALEN-1)
-					strcat(err, ":");
-			}
-		}
-		redalert(err);
-	}else{
-		redalert("A machine appears to be giving conflicting MAC details. Insufficient memory to give full information.");
-	}
-	free(err);
-	free(err2);
+	raisealert(ALERT_MACMISMATCH, ip_details, ip_details->mac_address, arp_mac, 0);
 }
 
 /**
@@ -178,6 +260,14 @@ void bluealert(const char *err) {
  * Do not use lightly! 
  */
 void redalert(const char *err){
+	redlog(err);
+	netalert(err);
+}
+
+/**
+ * The logging half of redalert(), for callers which deal with email themselves.
+ */
+void redlog(const char *err){
 #if HAVE_SYSLOG_H
 	int ALERT = LOG_CONS | LOG_PERROR;
 	openlog(PROGNAME, ALERT, LOG_AUTHPRIV);
@@ -186,7 +276,6 @@ void redalert(const char *err){
 #else
 	printf(stderr,"URGENT ALERT FROM %s: %s", PROGNAME, err);
 #endif
-	netalert(err);
 }
 
 /**
@@ -216,9 +305,19 @@ void redalert(const char *err){
  *    are pretty high.
  */
 int netalert(const char *err) {
+	return netmail("Network Alert from Antidote", err);
+}
+
+/**
+ * Does the work for netalert(), with a subject of your choosing. Failures are
+ * logged rather than returned - there's not much else anyone can do with them.
+ *
+ * Email is disabled if the recipient is blank or "NO".
+ */
+int netmail(const char *subject, const char *msg) {
 	int error;
-	if (options.root_email != "NO") {
-		error = mailalert(options.root_email, "Network Alert from Antidote", err);
+	if ((options.root_email[0] != '\0') && (strcasecmp(options.root_email, "NO") != 0)) {
+		error = mailalert(options.root_email, subject, msg);
 		switch (error) {
 		case ERR_NOMEM: 
 #if HAVE_SYSLOG_H
@@ -239,6 +338,16 @@ int netalert(const char *err) {
 #endif
 			break;
 	       
+		case ERR_CONNECTMAILSERVER: 
+#if HAVE_SYSLOG_H
+			openlog(PROGNAME, LOG_PERROR, LOG_AUTHPRIV);
+			syslog(LOG_ERR, "Cannot connect to mail server.");
+			closelog();
+#else
+			fprintf(stderr, "Cannot connect to mail server.\n");
+#endif
+			break;
+
 		case ERR_CONNECTCLOSED: 
 #if HAVE_SYSLOG_H
 			openlog(PROGNAME, LOG_PERROR, LOG_AUTHPRIV);
@@ -327,6 +436,7 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return ERR_CANNOTGETMAILSERVER;
 	}
         destination.sin_addr = *((struct in_addr *)mailserver_ip->h_addr);
@@ -335,12 +445,14 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return ERR_CONNECTMAILSERVER;
 	}	
 	if ((errcode = netwait("220", 3, mailserver)) != OK){	
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	bufsize = sprintf(buf, "HELO %s\r\n", hostname);
@@ -349,6 +461,7 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	bufsize = sprintf(buf, "MAIL FROM:%s\r\n", options.antidote_email);
@@ -357,6 +470,7 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	bufsize = sprintf(buf, "RCPT TO:%s\r\n", recipient);
@@ -365,6 +479,7 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	bufsize = sprintf(buf, "DATA\r\n");
@@ -373,10 +488,12 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	time(&currenttime);
-        timestr = ctime(&currenttime);
+	/* timestr is ours to free, so copy into it rather than pointing it at ctime()'s buffer */
+	strftime(timestr, ADOTE_ERR_BUFF, "%a, %d %b %Y %H:%M:%S %z", localtime(&currenttime));
 	bufsize = sprintf(buf, "Date: %s\r\n", timestr);
 	netsend(buf, &bufsize, mailserver);    
 	bufsize = sprintf(buf, "From: %s\r\n", options.antidote_email);
@@ -385,12 +502,18 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 	netsend(buf, &bufsize, mailserver);	
 	bufsize = sprintf(buf, "To: %s\r\n", recipient);
 	netsend(buf, &bufsize, mailserver);
-	bufsize = sprintf(buf, "%s\r\n.\r\n", msg); // Is this safe or is it subject to a buffer overflow?
+	/* a digest can be far longer than buf, so the body goes straight out */
+	bufsize = sprintf(buf, "\r\n");
+	netsend(buf, &bufsize, mailserver);
+	bufsize = strlen(msg);
+	netsend((char *)msg, &bufsize, mailserver);
+	bufsize = sprintf(buf, "\r\n.\r\n");
 	netsend(buf, &bufsize, mailserver);
 	if ((errcode = netwait("250", 3, mailserver)) != OK){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	bufsize = sprintf(buf, "QUIT\r\n");
@@ -399,9 +522,13 @@ int mailalert(const char *recipient, const char *subject, const char *msg){
 		free(buf);
 		free(hostname);
 		free(timestr);
+		close(mailserver);
 		return errcode;
 	}
 	close(mailserver);
+	free(buf);
+	free(hostname);
+	free(timestr);
 #endif
 	return OK;
 }
@@ -0,0 +1,529 @@
+/* -*- project-c -*- */
+/**
+ * \file alertformat.c
+ * \brief Turning alert records into text, JSON or bytes on the wire.
+ *
+ * Alerts are raised as fixed-size struct alertrecord's (see alert.c) and only
+ * turned into something readable when a sink actually wants to emit them. This
+ * module holds the renderers. They're table driven - every octet of an IP
+ * address, every nibble of an IPv6 one and every byte of a MAC is a lookup and
+ * a copy, rather than a trip through sprintf() - since a flood can put a lot
+ * of alerts through here.
+ */
+
+#include "antidote.h"
+
+/**
+ * What we know about each kind of alert: the name it goes by in structured
+ * output, and the priority it's raised at (0 for events which are logged but
+ * not alerted on).
+ */
+struct alertkind {
+	const char *name;
+	int priority;
+};
+
+static const struct alertkind alertkinds[ALERT_KINDS] = {
+	{ "unknown", NOTICE },
+	{ "mac_changed", HIGHEST },
+	{ "mac_mismatch", HIGHEST },
+	{ "unsolicited_replies", HIGHEST },
+	{ "unanswered_requests", HIGHEST },
+	{ "flood", HIGHEST },
+	{ "sweep", HIGHEST },
+	{ "new_host", 0 },
+	{ "baseline_deviation", MEDIUM },
+	{ "segment_conflict", HIGHEST },
+	{ "neighbour_mismatch", HIGHEST },
+	{ "scan", HIGHEST },
+	{ "dhcp_mismatch", HIGHEST },
+	{ "dhcp_rogue", HIGHEST },
+	{ "dhcp_rebind", HIGHEST }
+};
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* Our RFC 5424 SD-ID. 32473 is the enterprise number set aside for examples. */
+#define SD_ID "antidote@32473"
+
+/**
+ * Decimal text for every possible octet, filled in on first use. Three
+ * characters each, with the length in the fourth.
+ */
+static char octets[256][4];
+
+static void buildoctets(){
+	int lp;
+	if (octets[255][3] != 0)
+		return;
+	for (lp = 0; lp < 256; lp++) {
+		if (lp >= 100) {
+			octets[lp][0] = '0' + lp / 100;
+			octets[lp][1] = '0' + (lp / 10) % 10;
+			octets[lp][2] = '0' + lp % 10;
+			octets[lp][3] = 3;
+		} else if (lp >= 10) {
+			octets[lp][0] = '0' + lp / 10;
+			octets[lp][1] = '0' + lp % 10;
+			octets[lp][3] = 2;
+		} else {
+			octets[lp][0] = '0' + lp;
+			octets[lp][3] = 1;
+		}
+	}
+}
+
+static char *putstring(char *dest, const char *src){
+	while (*src != '\0')
+		*dest++ = *src++;
+	return dest;
+}
+
+static char *putipv4(char *dest, const u_int8_t *ipaddress){
+	int lp;
+	for (lp = 0; lp < 4; lp++) {
+		memcpy(dest, octets[ipaddress[lp]], 3);
+		dest += octets[ipaddress[lp]][3];
+		if (lp < 3)
+			*dest++ = '.';
+	}
+	return dest;
+}
+
+/**
+ * Write an IPv6 address as RFC 5952 would have it: lower case, no leading
+ * zeros in a group, and the longest run of two or more zero groups (the first,
+ * if there's a tie) squeezed to "::".
+ */
+static char *putipv6(char *dest, const u_int8_t *ipaddress){
+	unsigned int group[8];
+	int lp, run = 0, longest = 0, skip = -1, shift;
+	for (lp = 0; lp < 8; lp++) {
+		group[lp] = (ipaddress[2 * lp] << 8) | ipaddress[2 * lp + 1];
+		run = (group[lp] == 0) ? run + 1 : 0;
+		if ((run > longest) && (run >= 2)) {
+			longest = run;
+			skip = lp + 1 - run;
+		}
+	}
+	for (lp = 0; lp < 8; lp++) {
+		if (lp == skip) {
+			*dest++ = ':';
+			*dest++ = ':';
+			lp += longest - 1;
+			continue;
+		}
+		if ((lp > 0) && (lp != skip + longest))
+			*dest++ = ':';
+		for (shift = 12; (shift > 0) && ((group[lp] >> shift) == 0); shift -= 4)
+			;
+		for (; shift >= 0; shift -= 4)
+			*dest++ = hexdigits[(group[lp] >> shift) & 0xf];
+	}
+	return dest;
+}
+
+/**
+ * Write an alert's IP address, whichever family it's in.
+ */
+static char *putip(char *dest, const struct alertrecord *record){
+	if (record->flags & ALERTREC_IPV6)
+		return putipv6(dest, record->ip_address);
+	return putipv4(dest, record->ip_address);
+}
+
+static char *putmac(char *dest, const u_int8_t *mac){
+	int lp;
+	for (lp = 0; lp < ETH_ALEN; lp++) {
+		*dest++ = hexdigits[mac[lp] >> 4];
+		*dest++ = hexdigits[mac[lp] & 0xf];
+		if (lp < ETH_ALEN - 1)
+			*dest++ = ':';
+	}
+	return dest;
+}
+
+static char *putulong(char *dest, unsigned long value){
+	char digits[24];
+	int count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	while (count > 0)
+		*dest++ = digits[--count];
+	return dest;
+}
+
+/**
+ * Write an alert's VLAN as formatvlan() would - "100", "100.20" for QinQ, or
+ * "other".
+ */
+static char *putvlan(char *dest, u_int32_t vlan){
+	if (vlan == VLAN_OVERFLOW)
+		return putstring(dest, "other");
+	if (VLAN_OUTER(vlan) != 0) {
+		dest = putulong(dest, VLAN_OUTER(vlan));
+		*dest++ = '.';
+	}
+	return putulong(dest, VLAN_INNER(vlan));
+}
+
+/**
+ * \return Non-zero if an alert's VLAN is worth mentioning: it has one, and it
+ * isn't just untagged frames.
+ */
+static int hasvlan(const struct alertrecord *record){
+	return (record->flags & ALERTREC_VLAN) && (record->vlan != 0);
+}
+
+/**
+ * \return The name an alert kind goes by in structured output.
+ */
+const char *alertkindname(int kind){
+	if ((kind < 0) || (kind >= ALERT_KINDS))
+		kind = ALERT_UNKNOWN;
+	return alertkinds[kind].name;
+}
+
+/**
+ * \return The priority (HIGHEST, MEDIUM, LOWEST, NOTICE) an alert kind is raised
+ * at, or 0 if it should only be logged.
+ */
+int alertkindpriority(int kind){
+	if ((kind < 0) || (kind >= ALERT_KINDS))
+		kind = ALERT_UNKNOWN;
+	return alertkinds[kind].priority;
+}
+
+/**
+ * Render an alert as a sentence for syslog, email and the like. If the
+ * record's on a VLAN, the sentence ends by saying which.
+ *
+ * ARGUMENTS:
+ * \arg \c *record - The alert.
+ * \arg \c *dest - Where to put the text. Must hold at least ALERT_TEXTSIZE bytes.
+ *
+ * \return The length of the text, not counting the terminating null.
+ */
+int formatalerttext(const struct alertrecord *record, char *dest){
+	char *p = dest;
+	buildoctets();
+	switch (record->kind) {
+	case ALERT_MACCHANGED:
+		p = putip(p, record);
+		p = putstring(p, " has different MAC details. Previous MAC: ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, " New MAC: ");
+		p = putmac(p, record->new_mac);
+		break;
+	case ALERT_MACMISMATCH:
+		p = putip(p, record);
+		p = putstring(p, " gives conflicting MAC details. Ethernet MAC: ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, (record->flags & ALERTREC_IPV6) ? " ND link-layer MAC: " : " ARP body MAC: ");
+		p = putmac(p, record->new_mac);
+		break;
+	case ALERT_POISONER:
+		p = putstring(p, "Suspected poisoner impersonating IP address: ");
+		p = putip(p, record);
+		if (record->count != 0) {
+			p = putstring(p, " (");
+			p = putulong(p, record->count);
+			p = putstring(p, " replies nobody asked for)");
+		}
+		break;
+	case ALERT_BADNET:
+		p = putstring(p, (record->flags & ALERTREC_IPV6) ? "An unusual number of neighbour solicitations for: " : "An unusual number of ARP requests for: ");
+		p = putip(p, record);
+		p = putstring(p, " have not been replied to");
+		if (record->count != 0) {
+			p = putstring(p, " (");
+			p = putulong(p, record->count);
+			p = putstring(p, " timed out)");
+		}
+		break;
+	case ALERT_FLOOD:
+		p = putstring(p, "Possible ARP flood from ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, ": over ");
+		p = putulong(p, record->count);
+		p = putstring(p, " frames in ");
+		p = putulong(p, options.sketch_window);
+		p = putstring(p, " seconds");
+		break;
+	case ALERT_SWEEP:
+		p = putstring(p, "Possible ARP sweep from ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, ": about ");
+		p = putulong(p, record->count);
+		p = putstring(p, " distinct addresses in ");
+		p = putulong(p, options.sketch_window);
+		p = putstring(p, " seconds");
+		break;
+	case ALERT_NEWHOST:
+		p = putstring(p, "New host ");
+		p = putip(p, record);
+		p = putstring(p, " at ");
+		p = putmac(p, record->new_mac);
+		break;
+	case ALERT_CONFLICT:
+		p = putip(p, record);
+		p = putstring(p, " is claimed on more than one segment. Previously: ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, " Now: ");
+		p = putmac(p, record->new_mac);
+		break;
+	case ALERT_NEIGHBOUR:
+		p = putstring(p, "This host's ARP cache has ");
+		p = putip(p, record);
+		p = putstring(p, " at ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, ", not its owner ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, " - poisoning has reached it");
+		break;
+	case ALERT_DHCPMISMATCH:
+		p = putip(p, record);
+		p = putstring(p, " is leased by DHCP to ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, " but was claimed by ");
+		p = putmac(p, record->new_mac);
+		break;
+	case ALERT_DHCPROGUE:
+		p = putstring(p, "DHCP server ");
+		p = putip(p, record);
+		p = putstring(p, " at ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, " is not a DhcpServer - ");
+		p = putulong(p, record->count);
+		p = putstring(p, " of its replies ignored");
+		break;
+	case ALERT_DHCPREBIND:
+		p = putip(p, record);
+		p = putstring(p, " was leased by DHCP to ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, " while ");
+		p = putmac(p, record->old_mac);
+		p = putstring(p, " still held it - the lease was not moved");
+		break;
+	case ALERT_SCAN:
+		p = putstring(p, "Possible address scan by ");
+		p = putip(p, record);
+		p = putstring(p, " at ");
+		p = putmac(p, record->new_mac);
+		p = putstring(p, ": asked for ");
+		p = putulong(p, record->count);
+		p = putstring(p, " distinct addresses in ");
+		p = putulong(p, options.sketch_window);
+		p = putstring(p, " seconds");
+		break;
+	case ALERT_BASELINE:
+		p = putstring(p, "ARP traffic for ");
+		p = putip(p, record);
+		p = putstring(p, " is unlike its own baseline: ");
+		p = putulong(p, record->count);
+		p = putstring(p, " frames in its last window");
+		break;
+	default:
+		p = putstring(p, "Unrecognised alert");
+		break;
+	}
+	if (hasvlan(record)) {
+		p = putstring(p, " (VLAN ");
+		p = putvlan(p, record->vlan);
+		*p++ = ')';
+	}
+	*p = '\0';
+	return p - dest;
+}
+
+/**
+ * Render an alert as a single line of JSON, newline included.
+ *
+ * ARGUMENTS:
+ * \arg \c *record - The alert.
+ * \arg \c *device - The interface name, already escaped for JSON.
+ * \arg \c *dest - Where to put the text. Must hold at least ALERT_JSONSIZE bytes
+ * plus the length of *device.
+ *
+ * \return The length of the line, not counting the terminating null.
+ */
+int formatalertjson(const struct alertrecord *record, const char *device, char *dest){
+	struct tm brokendown;
+	time_t seconds;
+	char *p = dest;
+	char usec[7];
+	long fraction;
+	int lp;
+	buildoctets();
+	seconds = record->when.tv_sec;
+	gmtime_r(&seconds, &brokendown);
+	p = putstring(p, "{\"ts\":\"");
+	p += strftime(p, 24, "%Y-%m-%dT%H:%M:%S", &brokendown);
+	fraction = record->when.tv_usec;
+	for (lp = 5; lp >= 0; lp--) {
+		usec[lp] = '0' + fraction % 10;
+		fraction /= 10;
+	}
+	*p++ = '.';
+	memcpy(p, usec, 6);
+	p += 6;
+	p = putstring(p, "Z\",\"kind\":\"");
+	p = putstring(p, alertkindname(record->kind));
+	p = putstring(p, "\",\"interface\":\"");
+	p = putstring(p, device);
+	*p++ = '"';
+	if (record->flags & ALERTREC_IP) {
+		p = putstring(p, ",\"ip\":\"");
+		p = putip(p, record);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_OLDMAC) {
+		p = putstring(p, ",\"old_mac\":\"");
+		p = putmac(p, record->old_mac);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_NEWMAC) {
+		p = putstring(p, ",\"new_mac\":\"");
+		p = putmac(p, record->new_mac);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_COUNTS) {
+		p = putstring(p, ",\"requests\":");
+		p = putulong(p, record->requests);
+		p = putstring(p, ",\"replies\":");
+		p = putulong(p, record->replies);
+	}
+	if (record->count != 0) {
+		p = putstring(p, ",\"count\":");
+		p = putulong(p, record->count);
+	}
+	if (hasvlan(record)) {
+		p = putstring(p, ",\"vlan\":\"");
+		p = putvlan(p, record->vlan);
+		*p++ = '"';
+	}
+	p = putstring(p, "}\n");
+	*p = '\0';
+	return p - dest;
+}
+
+/**
+ * Render an alert as an RFC 5424 STRUCTURED-DATA element, for syslog sinks.
+ * None of the values can contain anything that needs escaping.
+ *
+ * ARGUMENTS:
+ * \arg \c *record - The alert.
+ * \arg \c *dest - Where to put the text. Must hold at least ALERT_JSONSIZE bytes.
+ *
+ * \return The length of the element.
+ */
+int formatalertsd(const struct alertrecord *record, char *dest){
+	char *p = dest;
+	buildoctets();
+	p = putstring(p, "[" SD_ID " kind=\"");
+	p = putstring(p, alertkindname(record->kind));
+	*p++ = '"';
+	if (record->flags & ALERTREC_IP) {
+		p = putstring(p, " ip=\"");
+		p = putip(p, record);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_OLDMAC) {
+		p = putstring(p, " old_mac=\"");
+		p = putmac(p, record->old_mac);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_NEWMAC) {
+		p = putstring(p, " new_mac=\"");
+		p = putmac(p, record->new_mac);
+		*p++ = '"';
+	}
+	if (record->flags & ALERTREC_COUNTS) {
+		p = putstring(p, " requests=\"");
+		p = putulong(p, record->requests);
+		p = putstring(p, "\" replies=\"");
+		p = putulong(p, record->replies);
+		*p++ = '"';
+	}
+	if (record->count != 0) {
+		p = putstring(p, " count=\"");
+		p = putulong(p, record->count);
+		*p++ = '"';
+	}
+	if (hasvlan(record)) {
+		p = putstring(p, " vlan=\"");
+		p = putvlan(p, record->vlan);
+		*p++ = '"';
+	}
+	*p++ = ']';
+	*p = '\0';
+	return p - dest;
+}
+
+static u_int8_t *put32(u_int8_t *dest, u_int32_t value){
+	*dest++ = (value >> 24) & 0xff;
+	*dest++ = (value >> 16) & 0xff;
+	*dest++ = (value >> 8) & 0xff;
+	*dest++ = value & 0xff;
+	return dest;
+}
+
+/**
+ * Render an alert as ALERT_WIRESIZE bytes in network byte order, for anything
+ * that wants to ship alerts elsewhere without agreeing on a struct layout.
+ *
+ * Layout: kind, flags (1 byte each), IP (16 - an IPv4 address is the first 4),
+ * old MAC (6), new MAC (6), requests, replies, count, seconds, microseconds,
+ * VLAN (4 each).
+ *
+ * \return ALERT_WIRESIZE.
+ */
+int formatalertbinary(const struct alertrecord *record, u_int8_t *dest){
+	u_int8_t *p = dest;
+	*p++ = record->kind;
+	*p++ = record->flags;
+	memcpy(p, record->ip_address, IP_KEYSIZE);
+	p += IP_KEYSIZE;
+	memcpy(p, record->old_mac, ETH_ALEN);
+	p += ETH_ALEN;
+	memcpy(p, record->new_mac, ETH_ALEN);
+	p += ETH_ALEN;
+	p = put32(p, record->requests);
+	p = put32(p, record->replies);
+	p = put32(p, record->count);
+	p = put32(p, (u_int32_t)record->when.tv_sec);
+	p = put32(p, (u_int32_t)record->when.tv_usec);
+	p = put32(p, record->vlan);
+	return p - dest;
+}
+
+static u_int32_t get32(const u_int8_t *src){
+	return ((u_int32_t)src[0] << 24) | ((u_int32_t)src[1] << 16) | ((u_int32_t)src[2] << 8) | src[3];
+}
+
+/**
+ * The reverse of formatalertbinary().
+ *
+ * \return ALERT_WIRESIZE.
+ */
+int parsealertbinary(const u_int8_t *src, struct alertrecord *record){
+	const u_int8_t *p = src;
+	memset(record, 0, sizeof(struct alertrecord));
+	record->kind = *p++;
+	record->flags = *p++;
+	memcpy(record->ip_address, p, IP_KEYSIZE);
+	p += IP_KEYSIZE;
+	memcpy(record->old_mac, p, ETH_ALEN);
+	p += ETH_ALEN;
+	memcpy(record->new_mac, p, ETH_ALEN);
+	p += ETH_ALEN;
+	record->requests = get32(p);
+	record->replies = get32(p + 4);
+	record->count = get32(p + 8);
+	record->when.tv_sec = get32(p + 12);
+	record->when.tv_usec = get32(p + 16);
+	record->vlan = get32(p + 20);
+	return ALERT_WIRESIZE;
+}
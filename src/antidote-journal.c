@@ -0,0 +1,294 @@
+/* -*- project-c -*- */
+/**
+ * \file antidote-journal.c
+ * \brief Answer questions from antidote's journal of ARP frames.
+ *
+ * Reads the journal antidote keeps when Journal is set (see journal.h) and
+ * prints every frame in a time range, optionally only those involving one IP
+ * address (as sender or target) or sent from one MAC address:
+ *
+ *	antidote-journal -d /var/lib/antidote -s "2026-10-13 14:00" -e "2026-10-13 14:05" -i 10.1.2.3
+ *
+ * Only the day files the range covers are opened, only their indexes are read
+ * in full, and only the blocks whose times overlap the range - and, given -i,
+ * whose filter says the address may be there - are read and unpacked. So a
+ * question about five minutes, or about one address, costs about the same
+ * whether the journal holds a day or a year.
+ *
+ * Usage: antidote-journal -d directory [-s start] [-e end] [-i ip] [-m mac] [-c count] [-v]
+ */
+
+#include "config.h"
+#include "journal.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#if HAVE_LIBZ && HAVE_ZLIB_H
+#include <zlib.h>
+#define USE_ZLIB 1
+#endif
+
+#define QUERY_SPAN 3600 /* seconds before the end time the range starts at, if not told */
+
+struct query {
+	time_t start, end;
+	int byip, bymac;
+	u_int8_t ip[4];
+	u_int8_t mac[6];
+	unsigned long limit; /* 0 for no limit */
+};
+
+static unsigned long shown = 0, blocksread = 0, blocksindexed = 0;
+
+/**
+ * Take a time as "YYYY-MM-DD HH:MM[:SS]" or "YYYY-MM-DD" (local time), or as
+ * "@seconds" since the epoch. \return -1 if it's neither.
+ */
+static time_t parsetime(const char *text){
+	struct tm when;
+	int fields;
+	if (text[0] == '@')
+		return (time_t)strtoll(text + 1, NULL, 10);
+	memset(&when, 0, sizeof(when));
+	fields = sscanf(text, "%d-%d-%d%*[ T]%d:%d:%d", &when.tm_year, &when.tm_mon, &when.tm_mday,
+			&when.tm_hour, &when.tm_min, &when.tm_sec);
+	if ((fields != 3) && (fields != 5) && (fields != 6))
+		return -1;
+	when.tm_year -= 1900;
+	when.tm_mon--;
+	when.tm_isdst = -1;
+	return mktime(&when);
+}
+
+static int parsemac(const char *text, u_int8_t *mac){
+	unsigned int parts[6];
+	int lp;
+	if (sscanf(text, "%x:%x:%x:%x:%x:%x", &parts[0], &parts[1], &parts[2], &parts[3], &parts[4], &parts[5]) != 6)
+		return 0;
+	for (lp = 0; lp < 6; lp++) {
+		if (parts[lp] > 0xff)
+			return 0;
+		mac[lp] = parts[lp];
+	}
+	return 1;
+}
+
+static const char *opname(u_int8_t op){
+	switch (op) {
+	case 1: return "request";
+	case 2: return "reply";
+	case 3: return "rarp-req";
+	case 4: return "rarp-rep";
+	}
+	return "other";
+}
+
+static void showrecord(const struct journalrecord *record, const char *interface){
+	char when[32], sender[16], target[16];
+	time_t seconds = record->seconds;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+	inet_ntop(AF_INET, record->sender_ip, sender, sizeof(sender));
+	inet_ntop(AF_INET, record->target_ip, target, sizeof(target));
+	printf("%s.%06u %-8s %-8s %-15s %02x:%02x:%02x:%02x:%02x:%02x %s\n", when, record->microseconds,
+	       interface, opname(record->op), sender,
+	       record->sender_mac[0], record->sender_mac[1], record->sender_mac[2],
+	       record->sender_mac[3], record->sender_mac[4], record->sender_mac[5], target);
+}
+
+/**
+ * Read one block, unpack it and show whatever in it matches.
+ * \return 0, or 1 if the limit has been reached.
+ */
+static int searchblock(int datafd, const struct journalindex *entry, const struct query *query,
+		       u_int8_t *packed, struct journalrecord *records, const char *name){
+	struct journalblock *header = (struct journalblock *)packed;
+	const struct journalrecord *record;
+	char interface[sizeof(header->interface) + 1];
+	u_int32_t lp;
+#ifdef USE_ZLIB
+	uLongf unpacked;
+#endif
+	if ((entry->length < sizeof(struct journalblock))
+			|| (entry->length > sizeof(struct journalblock) + JOURNAL_BLOCK + JOURNAL_BLOCK / 100 + 64 + JOURNAL_ALIGN)
+			|| (pread(datafd, packed, entry->length, entry->offset) != (ssize_t)entry->length)) {
+		fprintf(stderr, "%s: cannot read the block at %llu.\n", name, (unsigned long long)entry->offset);
+		return 0;
+	}
+	blocksread++;
+	if ((header->magic != JOURNAL_MAGIC) || (header->version != JOURNAL_VERSION)
+			|| (header->unpackedlen > JOURNAL_BLOCK)
+			|| (header->unpackedlen != header->count * sizeof(struct journalrecord))
+			|| (header->packedlen > entry->length - sizeof(struct journalblock))) {
+		fprintf(stderr, "%s: the block at %llu isn't one this antidote-journal understands.\n",
+			name, (unsigned long long)entry->offset);
+		return 0;
+	}
+	if (header->flags & JOURNAL_COMPRESSED) {
+#ifdef USE_ZLIB
+		unpacked = JOURNAL_BLOCK;
+		if ((uncompress((u_int8_t *)records, &unpacked, packed + sizeof(struct journalblock), header->packedlen) != Z_OK)
+				|| (unpacked != header->unpackedlen)) {
+			fprintf(stderr, "%s: the block at %llu is damaged.\n", name, (unsigned long long)entry->offset);
+			return 0;
+		}
+#else
+		fprintf(stderr, "%s: the block at %llu is compressed, and antidote-journal was built without zlib.\n",
+			name, (unsigned long long)entry->offset);
+		return 0;
+#endif
+	} else {
+		memcpy(records, packed + sizeof(struct journalblock), header->unpackedlen);
+	}
+	memcpy(interface, header->interface, sizeof(header->interface));
+	interface[sizeof(header->interface)] = '\0';
+
+	for (lp = 0; lp < header->count; lp++) {
+		record = &records[lp];
+		if ((record->seconds < query->start) || (record->seconds > query->end))
+			continue;
+		if (query->byip && (memcmp(record->sender_ip, query->ip, 4) != 0)
+				&& (memcmp(record->target_ip, query->ip, 4) != 0))
+			continue;
+		if (query->bymac && (memcmp(record->sender_mac, query->mac, 6) != 0))
+			continue;
+		showrecord(record, interface);
+		if ((++shown >= query->limit) && (query->limit > 0))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Answer the query from one day's files, if there are any.
+ * \return 0, or 1 if the limit has been reached.
+ */
+static int searchday(const char *directory, time_t day, const struct query *query,
+		     u_int8_t *packed, struct journalrecord *records){
+	char dataname[1024], indexname[1024];
+	struct journalindex *entries;
+	struct stat details;
+	struct tm utc;
+	size_t count, lp;
+	int datafd, indexfd, done = 0;
+	gmtime_r(&day, &utc);
+	snprintf(dataname, sizeof(dataname), JOURNAL_NAME, directory, utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, "jnl");
+	snprintf(indexname, sizeof(indexname), JOURNAL_NAME, directory, utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, "idx");
+	indexfd = open(indexname, O_RDONLY);
+	if (indexfd == -1)
+		return 0; /* nothing seen that day */
+	datafd = open(dataname, O_RDONLY);
+	if ((datafd == -1) || (fstat(indexfd, &details) == -1)) {
+		fprintf(stderr, "Cannot open %s.\n", dataname);
+		close(indexfd);
+		if (datafd != -1)
+			close(datafd);
+		return 0;
+	}
+	count = details.st_size / sizeof(struct journalindex);
+	entries = malloc(count * sizeof(struct journalindex) + 1);
+	if ((entries == NULL) || (pread(indexfd, entries, count * sizeof(struct journalindex), 0)
+				  != (ssize_t)(count * sizeof(struct journalindex)))) {
+		fprintf(stderr, "Cannot read %s.\n", indexname);
+		free(entries);
+		close(indexfd);
+		close(datafd);
+		return 0;
+	}
+	blocksindexed += count;
+	for (lp = 0; (lp < count) && !done; lp++) {
+		if ((entries[lp].last < query->start) || (entries[lp].first > query->end))
+			continue;
+		if (query->byip && !journalbloomtest(entries[lp].bloom, query->ip))
+			continue;
+		done = searchblock(datafd, &entries[lp], query, packed, records, dataname);
+	}
+	free(entries);
+	close(indexfd);
+	close(datafd);
+	return done;
+}
+
+static void showusage(char *name){
+	printf("Usage: %s -d directory [-s start] [-e end] [-i ip] [-m mac] [-c count] [-v]\n\n", name);
+	printf("-d : The journal directory (antidote's Journal).\n");
+	printf("-s : Show frames from this time, as \"YYYY-MM-DD HH:MM[:SS]\" or @seconds. The default is an hour before the end.\n");
+	printf("-e : Show frames up to this time. The default is now.\n");
+	printf("-i : Only frames with this IP address as sender or target.\n");
+	printf("-m : Only frames sent from this MAC address.\n");
+	printf("-c : Stop after this many frames.\n");
+	printf("-v : Say how much of the journal was read.\n");
+}
+
+int main(int argc, char **argv){
+	struct query query;
+	struct in_addr address;
+	char *directory = NULL, *starttext = NULL;
+	u_int8_t *packed;
+	struct journalrecord *records;
+	time_t day;
+	int option, verbose = 0;
+	memset(&query, 0, sizeof(query));
+	query.end = time(NULL);
+	while ((option = getopt(argc, argv, "d:s:e:i:m:c:vh")) != -1) {
+		switch (option) {
+		case 'd': directory = optarg;
+			break;
+		case 's': starttext = optarg;
+			break;
+		case 'e': query.end = parsetime(optarg);
+			if (query.end == -1) {
+				fprintf(stderr, "Cannot make sense of the time %s.\n", optarg);
+				return 1;
+			}
+			break;
+		case 'i': if (inet_pton(AF_INET, optarg, &address) != 1) {
+				fprintf(stderr, "%s is not an IPv4 address.\n", optarg);
+				return 1;
+			}
+			memcpy(query.ip, &address, 4);
+			query.byip = 1;
+			break;
+		case 'm': if (!parsemac(optarg, query.mac)) {
+				fprintf(stderr, "%s is not a MAC address.\n", optarg);
+				return 1;
+			}
+			query.bymac = 1;
+			break;
+		case 'c': query.limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'v': verbose = 1;
+			break;
+		default: showusage(argv[0]);
+			return 1;
+		}
+	}
+	if (directory == NULL) {
+		showusage(argv[0]);
+		return 1;
+	}
+	query.start = query.end - QUERY_SPAN;
+	if ((starttext != NULL) && ((query.start = parsetime(starttext)) == -1)) {
+		fprintf(stderr, "Cannot make sense of the time %s.\n", starttext);
+		return 1;
+	}
+
+	packed = malloc(sizeof(struct journalblock) + JOURNAL_BLOCK + JOURNAL_BLOCK / 100 + 64 + JOURNAL_ALIGN);
+	records = malloc(JOURNAL_BLOCK);
+	if ((packed == NULL) || (records == NULL))
+		return 1;
+	/* day files are named for UTC days */
+	for (day = query.start - query.start % 86400; day <= query.end; day += 86400) {
+		if (searchday(directory, day, &query, packed, records))
+			break;
+	}
+	if (verbose)
+		fprintf(stderr, "%lu frames shown; %lu of %lu blocks read.\n", shown, blocksread, blocksindexed);
+	free(packed);
+	free(records);
+	return 0;
+}
@@ -0,0 +1,223 @@
+/* -*- project-c -*- */
+/**
+ * \file antidote-top.c
+ * \brief Show the busiest and most suspicious hosts antidote is watching.
+ *
+ * Reads the shared-memory view of the IP table which antidote publishes when
+ * SharedState is set (see sharedstate.h), and shows two tables, a little like
+ * top(1):
+ *
+ * - the hosts with the largest imbalance between ARP replies and requests, the
+ *   same figure antidote's poisoning and bad network checks use; and
+ * - the hosts with the most ARP traffic altogether.
+ *
+ * If antidote has ever had to shed ARP requests to keep up (see overload.c),
+ * it says how many, and whether it still is.
+ *
+ * The segment is only ever read, so running this has no effect on capture.
+ *
+ * Usage: antidote-top [-n name] [-d seconds] [-c rows] [-1]
+ */
+
+#include "config.h"
+#include "sharedstate.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define TOP_ROWS 15
+#define TOP_DELAY 2
+
+static const char *segmentname = SHAREDSTATENAME;
+
+/**
+ * Map the segment read-only and check it's one we understand.
+ * \return The header, or NULL (with a message on stderr).
+ */
+static struct sharedheader *opensegment(size_t *size){
+	struct sharedheader *header;
+	struct stat details;
+	int fd;
+	fd = shm_open(segmentname, O_RDONLY, 0);
+	if (fd == -1) {
+		fprintf(stderr, "Cannot open %s - is antidote running with SharedState = %s?\n", segmentname, segmentname);
+		return NULL;
+	}
+	if ((fstat(fd, &details) == -1) || (details.st_size < (off_t)sizeof(struct sharedheader))) {
+		fprintf(stderr, "%s is too small to be antidote's shared state.\n", segmentname);
+		close(fd);
+		return NULL;
+	}
+	*size = details.st_size;
+	header = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s.\n", segmentname);
+		return NULL;
+	}
+	if ((__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC)
+			|| (header->version != SHARED_VERSION)
+			|| (header->recordsize != sizeof(struct sharedrecord))
+			|| (*size < sizeof(struct sharedheader) + (size_t)header->capacity * sizeof(struct sharedrecord))) {
+		fprintf(stderr, "%s isn't a shared state segment this antidote-top understands.\n", segmentname);
+		munmap(header, *size);
+		return NULL;
+	}
+	return header;
+}
+
+static int net(const struct sharedrecord *record){
+	return (int)record->replies - (int)record->requests;
+}
+
+/* most suspicious first: biggest imbalance either way */
+static int bysuspicion(const void *first, const void *second){
+	int a = abs(net(first)), b = abs(net(second));
+	return (a < b) - (a > b);
+}
+
+/* busiest first */
+static int bytraffic(const void *first, const void *second){
+	const struct sharedrecord *a = first, *b = second;
+	unsigned long x = (unsigned long)a->requests + a->replies, y = (unsigned long)b->requests + b->replies;
+	return (x < y) - (x > y);
+}
+
+/**
+ * Write a record's VLAN the way antidote does: "100", "100.20" for QinQ,
+ * "other" for VLANs sharing its overflow table, or "-" for untagged frames.
+ */
+static void formatvlan(u_int32_t vlan, char *dest, size_t size){
+	if (vlan == 0)
+		snprintf(dest, size, "-");
+	else if (vlan == 0xffffffffu)
+		snprintf(dest, size, "other");
+	else if ((vlan >> 12) != 0)
+		snprintf(dest, size, "%u.%u", (vlan >> 12) & 0x0fff, vlan & 0x0fff);
+	else
+		snprintf(dest, size, "%u", vlan);
+}
+
+static void showrows(const struct sharedheader *header, const struct sharedrecord *records, int count, int rows, time_t now){
+	const struct sharedrecord *record;
+	const char *flag;
+	char address[INET6_ADDRSTRLEN], vlan[12];
+	int lp;
+	printf("%-39s %-9s %-18s %9s %9s %7s %7s\n", "IP address", "VLAN", "MAC address", "Requests", "Replies", "Net", "Age");
+	for (lp = 0; (lp < count) && (lp < rows); lp++) {
+		record = &records[lp];
+		if (net(record) > header->poison_threshold)
+			flag = " POISON?";
+		else if (net(record) < header->badnet_threshold)
+			flag = " BADNET?";
+		else
+			flag = "";
+		inet_ntop((record->ipversion == 6) ? AF_INET6 : AF_INET, record->ip_address, address, sizeof(address));
+		formatvlan(record->vlan, vlan, sizeof(vlan));
+		printf("%-39s %-9s %02x:%02x:%02x:%02x:%02x:%02x %9u %9u %7d %6lds%s\n", address, vlan,
+		       record->mac_address[0], record->mac_address[1], record->mac_address[2],
+		       record->mac_address[3], record->mac_address[4], record->mac_address[5],
+		       record->requests, record->replies, net(record), (long)(now - record->lastreset), flag);
+	}
+}
+
+/**
+ * Take a consistent copy of everything in the segment and show it.
+ * \return 0, or 1 if the segment couldn't be read.
+ */
+static int showtop(int rows, int clear){
+	struct sharedheader *header, counters;
+	const struct sharedrecord *slots;
+	struct sharedrecord *records;
+	u_int32_t highwater, lp;
+	size_t size;
+	int count = 0;
+	time_t now, updated;
+	char when[32];
+
+	header = opensegment(&size);
+	if (header == NULL)
+		return 1;
+	slots = (const struct sharedrecord *)(header + 1);
+	highwater = __atomic_load_n(&header->highwater, __ATOMIC_ACQUIRE);
+	if (highwater > header->capacity)
+		highwater = header->capacity;
+	records = malloc((highwater + 1) * sizeof(struct sharedrecord));
+	if (records == NULL) {
+		munmap(header, size);
+		return 1;
+	}
+	for (lp = 0; lp < highwater; lp++) {
+		if (sharedread(&slots[lp].sequence, &slots[lp], &records[count], sizeof(struct sharedrecord))
+				&& records[count].inuse)
+			count++;
+	}
+	if (sharedread(&header->sequence, header, &counters, sizeof(counters)) == 0)
+		memset(&counters, 0, sizeof(counters));
+
+	now = time(NULL);
+	updated = counters.updated;
+	strftime(when, sizeof(when), "%H:%M:%S", localtime(&updated));
+	if (clear)
+		printf("\033[H\033[2J");
+	printf("antidote-top: pid %d, %llu records (%d shown), %llu evicted, %llu unpublished, %llu duplicates, updated %s\n\n",
+	       (int)header->pid, (unsigned long long)counters.records, count,
+	       (unsigned long long)counters.evictions, (unsigned long long)counters.unpublished,
+	       (unsigned long long)counters.duplicates, when);
+	if (counters.overloaded)
+		printf("OVERLOADED: counting 1 in %u ARP requests. ", (unsigned int)counters.shedrate);
+	if (counters.overloads > 0)
+		printf("%llu requests shed, %llu sampled, in %llu overloads\n\n",
+		       (unsigned long long)counters.shed, (unsigned long long)counters.sampled,
+		       (unsigned long long)counters.overloads);
+	qsort(records, count, sizeof(struct sharedrecord), bysuspicion);
+	printf("Most suspicious (replies - requests):\n");
+	showrows(header, records, count, rows, now);
+	qsort(records, count, sizeof(struct sharedrecord), bytraffic);
+	printf("\nBusiest:\n");
+	showrows(header, records, count, rows, now);
+	fflush(stdout);
+	free(records);
+	munmap(header, size);
+	return 0;
+}
+
+static void showusage(char *name){
+	printf("Usage: %s [-n name] [-d seconds] [-c rows] [-1]\n\n", name);
+	printf("-n : Shared memory segment to read (antidote's SharedState). The default is %s.\n", SHAREDSTATENAME);
+	printf("-d : Seconds between updates. The default is %d.\n", TOP_DELAY);
+	printf("-c : Hosts shown in each table. The default is %d.\n", TOP_ROWS);
+	printf("-1 : Show the tables once and exit.\n");
+}
+
+int main(int argc, char **argv){
+	int option, rows = TOP_ROWS, delay = TOP_DELAY, once = 0;
+	while ((option = getopt(argc, argv, "n:d:c:1h")) != -1) {
+		switch (option) {
+		case 'n': segmentname = optarg;
+			break;
+		case 'd': delay = atoi(optarg);
+			break;
+		case 'c': rows = atoi(optarg);
+			break;
+		case '1': once = 1;
+			break;
+		default: showusage(argv[0]);
+			return 1;
+		}
+	}
+	if (delay < 1)
+		delay = 1;
+	/* the segment is reopened every time, so restarting antidote doesn't confuse us */
+	while (showtop(rows, !once) == 0) {
+		if (once)
+			return 0;
+		sleep(delay);
+	}
+	return 1;
+}
@@ -32,38 +32,39 @@
  * \arg \c **info - On finishing, this will be a pointer to the area of memory 
  * containing the IP details for the IP address checked.
  *
- * \arg \c *frame - A pointer to a raw Ethernet frame to process.
+ * \arg \c *seen - What the frame says (see processobservation()).
+ *
+ * \arg \c mayadd - Zero if no new record should be created for this frame
+ * (because its sender is flooding, say).
  *
  * RETURN VALUES:
  * \return OK
  * \return ERR_NOMEM
+ * \return ERR_NORECORD - No record is held and mayadd was zero.
  *
  */
 		
-int handlerequest(struct ipdetails **info, const char *frame) {
-	u_int8_t *ipaddress;
+int handlerequest(struct ipdetails **info, const struct observation *seen, int mayadd) {
 	struct ipdetails *temp;
-	struct ether_arp *arpbody;
-	arpbody = (struct ether_arp *) (frame + sizeof(struct ether_header));  /* we'll need ether_arp->arp_sha later */
-	ipaddress = arpbody->arp_tpa;
-	/* ipaddress = getipaddress(frame);*/
-	temp = checkip(*info, ipaddress);
+	temp = checkip((*info)->partition, seen->key); /* the recipient, for a request */
+	if ((temp == NULL) && (mayadd == 0))
+		return ERR_NORECORD;
 	if (temp == NULL) { // the IP given does not exist in the data
-		temp = createipspace();	 // create space for it
+		makeroom((*info)->partition, *info); // keep under max_records
+		temp = createipspace((*info)->partition);	 // create space for it
 		if (temp == NULL) 
 			return ERR_NOMEM;				
-		populateipspacereq(temp, frame);      	
-		temp->previous = *info; //link into the data
-		temp->next = (*info)->next;
-		(*info)->next = temp;		
+		populateipspacereq(temp, seen);
+		linkip(*info, temp); //link into the data
 	}
+	temp->referenced = 1;
 	*info = temp;
-	addrequest(temp);
+	addrequest(temp, seen->weight);
 	return OK;
 }
 
 /**
- * Do the donkey work for handling an ARP reply.
+ * Do the donkey work for handling an ARP reply (or a neighbour advertisement).
  *
  * If details for the machine expressed in the ARP reply aren't currently in 
  * memory, add them.
@@ -74,39 +75,44 @@ int handlerequest(struct ipdetails **info, const char *frame) {
  * \arg \c **info - On finishing, this will be a pointer to the area of memory 
  * containing the IP details for the IP address checked.
  *
- * \arg \c *frame - A pointer to a raw Ethernet frame to process.
+ * \arg \c *seen - What the frame says.
+ *
+ * \arg \c mayadd - As for handlerequest().
  *
  * RETURN VALUES:
  * \return OK
  * \return ERR_NOMEM
+ * \return ERR_NORECORD
  */	
 
-int handlereply(struct ipdetails **info, const char *frame) {
-	u_int8_t *ipaddress;
+int handlereply(struct ipdetails **info, const struct observation *seen, int mayadd) {
 	int loop;
 	struct ipdetails *temp;	
-	struct ether_arp *arpbody;
-	struct ether_header *etherhead;
-  	arpbody = (struct ether_arp *) (frame + sizeof(struct ether_header));  /* we'll need ether_arp->arp_sha later */
-	ipaddress = arpbody->arp_spa; /* we want the sender for a reply, the recipient  for a request*/
-	temp = checkip(*info, ipaddress);
+	temp = checkip((*info)->partition, seen->key); /* we want the sender for a reply, the recipient  for a request*/
+	if ((temp == NULL) && (mayadd == 0))
+		return ERR_NORECORD;
 	if (temp == NULL) { // the IP given does not exist in the data
-		temp = createipspace();	 // create space for it
+		makeroom((*info)->partition, *info);
+		temp = createipspace((*info)->partition);	 // create space for it
 		if (temp == NULL) 
 			return ERR_NOMEM;				
-		populateipspacerep(temp, frame);	      	
-		temp->previous = *info; //link into the data
-		temp->next = (*info)->next;
-		(*info)->next = temp;
+		populateipspacerep(temp, seen);
+		linkip(*info, temp); //link into the data
+		raisealert(ALERT_NEWHOST, temp, NULL, temp->mac_address, 0);
+		neighbourlearned(temp);
 	} else if (sumbytes((u_int8_t *)(temp->mac_address), ETH_ALEN) == 0){
 		/*
 		 * If the MAC address as held is 0, we've never seen a reply from this machine.
 		 */
-		etherhead = (struct ether_header *) frame;
+		sharedbeginwrite(&temp->sequence);
 		for(loop = 0; loop < ETH_ALEN; loop++){
-			temp->mac_address[loop] = etherhead->ether_shost[loop];
+			temp->mac_address[loop] = seen->ether_mac[loop];
 		}      
+		sharedendwrite(&temp->sequence);
+		raisealert(ALERT_NEWHOST, temp, NULL, temp->mac_address, 0);
+		neighbourlearned(temp);
 	}
+	temp->referenced = 1;
 	*info = temp;
 	addreply(temp);
 	return OK;
@@ -114,150 +120,260 @@ int handlereply(struct ipdetails **info, const char *frame) {
 
 /**
  * Process a raw Ethernet packet. This routine will:
- * - Check the sender MAC in Ethernet frame and ARP packet tally.
- * - Put the ARP packet contained within the Ethernet frame into a 
- *   data structure holding ARP details
- * - Process the ARP packet for IP details.
- * 
+ * - Read what the ARP packet contained within the Ethernet frame says
+ * - Hand that to processobservation(), which does the rest.
+ *
  * ARGUMENTS:
- * \arg \c *frame - A pointer to a raw Ethernet frame.
+ * \arg \c *frame - A pointer to a raw Ethernet frame, without VLAN tags.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ * \arg \c *when - When it was captured.
  *
  * RETURN VALUES:
  * \return ERR_OK
  * \return ERR_NOMEM
  */	
-int processether(const u_char *frame){
-	int tempint;
-	u_int16_t *temp;
+int processether(const u_char *frame, u_int32_t vlan, const struct timeval *when){
+	struct observation seen;
+	struct ether_header *etherhead;
 	struct ether_arp *arpbody;
-	struct arphdr *arpheader;
-	static struct ipdetails *entrypoint = NULL;
-	temp = malloc(sizeof(u_int16_t));
-	if (temp == NULL) {
-		redalert("Cannot allocate memory to store temporary variables");
+	etherhead = (struct ether_header *) frame;
+	arpbody = (struct ether_arp *) (frame + sizeof(struct ether_header));
+	seen.op = ntohs(arpbody->ea_hdr.ar_op);
+	seen.family = AF_INET;
+	memset(seen.key, 0, IP_KEYSIZE);
+	memset(seen.other, 0, IP_KEYSIZE);
+	/* we file a request by its recipient, a reply by its sender */
+	if (seen.op == ARPOP_REQUEST) {
+		memcpy(seen.key, arpbody->arp_tpa, 4);
+		memcpy(seen.other, arpbody->arp_spa, 4);
+	} else {
+		memcpy(seen.key, arpbody->arp_spa, 4);
+		memcpy(seen.other, arpbody->arp_tpa, 4);
+	}
+	seen.ether_mac = etherhead->ether_shost;
+	seen.claimed_mac = arpbody->arp_sha;
+	seen.weight = 1;
+	seen.when = (u_int64_t)when->tv_sec * 1000000 + when->tv_usec;
+	return processobservation(&seen, vlan);
+}
+
+/**
+ * Deal with what one frame says - an ARP request or reply, or a neighbour
+ * solicitation or advertisement taken as one (see ndisc.c). This routine will:
+ * - Check the sender MAC in Ethernet frame and the one claimed tally.
+ * - Find, or make, the record for the address concerned
+ * - Count the request or reply against it.
+ * 
+ * Each VLAN has its own partitions of the IP table (see vlan.c), one for each
+ * address family, and the frame only ever touches the one for the VLAN it came
+ * in on and the family it's in.
+ *
+ * While we're overloaded, most requests are shed here, and the ones that are
+ * kept are weighted to stand for them - see overload.c. Replies never are.
+ *
+ * ARGUMENTS:
+ * \arg \c *seen - What the frame says. Its weight is set here.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ *
+ * RETURN VALUES:
+ * \return ERR_OK
+ * \return ERR_NOMEM
+ */	
+int processobservation(struct observation *seen, u_int32_t vlan){
+	int tempint, mayadd;
+	long latency = CORRELATE_UNKNOWN;
+	struct partition *table;
+/*
+ * Floods and sweeps are spotted here, before they get anywhere near the IP
+ * table - see sketch.c - and so are scans, counted by who's asking, so that
+ * a scanner's targets don't each get a record - see scan.c. Requests are
+ * matched with replies here too, so that none are missed when requests are
+ * shed - see correlate.c.
+ */
+	mayadd = (sketchframe(seen) == OK);
+	if (seen->op == ARPOP_REQUEST) {
+		if (scanrequest(seen, vlan) != OK)
+			mayadd = 0;
+		correlaterequest(seen, vlan);
+	} else if (seen->op == ARPOP_REPLY)
+		latency = correlatereply(seen, vlan);
+	seen->weight = shedweight(seen);
+	if (seen->weight == 0)
+		return OK;
+	/* nothing but a request or a reply gets a record, or a partition */
+	if ((seen->op != ARPOP_REQUEST) && (seen->op != ARPOP_REPLY)) {
+		notice("Unrecognised ARP type detected (RARP not currently supported)");
+		return OK;
+	}
+	table = findpartition(vlan, seen->family, 1);
+	if (table == NULL) {
+		redalert("Cannot allocate memory to store IP details");
 		return ERR_NOMEM;
 	}
 /* Start our data structure */
 
-	if (entrypoint == NULL) // the data structure is empty.
-	       entrypoint = createipspace();
-	if (entrypoint == NULL) {
+	if (table->entrypoint == NULL) { // the data structure is empty.
+		/* filled in before it's linked, so it goes into the index under its address */
+		makeroom(table, NULL);
+		table->entrypoint = createipspace(table);
+		if (table->entrypoint != NULL) {
+			populateipspace(table->entrypoint, seen);
+			linkip(NULL, table->entrypoint);
+			neighbourlearned(table->entrypoint);
+		}
+	}
+	if (table->entrypoint == NULL) {
 		redalert("Cannot allocate memory to store IP details");
-		free(temp);
 		return ERR_NOMEM;
 	}
-        if (entrypoint->ip_address[0] == 0) { // only used 1st time routine called.
-		populateipspace(entrypoint, frame);
-	}
 
-	frame += sizeof(struct ether_header);
-	arpheader = (struct arphdr *) frame;
-  	arpbody = (struct ether_arp *) frame;  /* we'll need ether_arp->arp_sha later */
-	frame -= sizeof(struct ether_header);  /* we also need frame to point to where it started */
-	*temp = (u_int16_t)arpheader->ar_op;
-	*temp = ntohs(*temp);
-
-	if (*temp == ARPOP_REQUEST){
-		tempint = handlerequest(&entrypoint, frame);
+	if (seen->op == ARPOP_REQUEST){
+		tempint = handlerequest(&table->entrypoint, seen, mayadd);
 		if (tempint == ERR_NOMEM)
 			redalert("Out of Memory for IP details");
-		else{		
+		else if (tempint == OK) {		
 			/*
 			 * Strikes me that there's not much point checking for IP->MAC changes
 			 * when examining ARP *requests*.
 			 */
 			//if (checkmacchanges(entrypoint, arpbody->arp_sha) != OK)
 			// populateipspacereq(entrypoint, frame); // totally unnecessary - handlerequest() (above) does that & we're not checking for changes.
-			processip(&entrypoint);
+			baselineframe(table->entrypoint, 0, seen->weight);
 		}
 	}
-	else if (*temp == ARPOP_REPLY){
-		tempint = handlereply(&entrypoint, frame);
+	else {
+		tempint = handlereply(&table->entrypoint, seen, mayadd);
 		if (tempint == ERR_NOMEM)
 			redalert("Out of Memory for IP details");
-	        else {
-			if (checkmacchanges(entrypoint, arpbody->arp_sha) != OK)
-				populateipspacerep(entrypoint, frame);
-			processip(&entrypoint);
+	        else if (tempint == OK) {
+			/* a DHCP lease, if there is one, says whose address it is - see dhcp.c */
+			if ((checkbinding(table->entrypoint, seen, vlan) == DHCP_UNBOUND)
+					&& (checkmacchanges(table->entrypoint, (u_int8_t *)seen->claimed_mac) != OK))
+				populateipspacerep(table->entrypoint, seen);
+			correlaterecord(table->entrypoint, latency);
+			baselineframe(table->entrypoint, 1, 1);
 		}
 	}
-	else notice("Unrecognised ARP type detected (RARP not currently supported)");
-/* Remove this after debugging */
-	dumpdata(entrypoint,"DETAILS.csv");
+	publiship(table->entrypoint); /* whatever this frame changed, readers can see now */
+	/*
+	 * That's all a frame costs: the counts are judged, alerts flushed and the
+	 * table dumped by the event loop - see scanrecords() and eventloop.c.
+	 */
 	return OK;
 }
 
+/**
+ * \return The first record in a VLAN's partition of the IP table (0 for
+ * untagged frames) for a family (AF_INET or AF_INET6), or NULL if it's empty.
+ * The rest follow on through ->next.
+ */
+struct ipdetails *firstrecord(u_int32_t vlan, int family){
+	struct partition *table;
+	table = findpartition(vlan, family, 0);
+	if (table == NULL)
+		return NULL;
+	return table->head;
+}
+
+/**
+ * Go through the whole IP table - every VLAN's partition - every
+ * options.scan_interval seconds, removing anything which has timed out (by its
+ * partition's timeout) and checking the rest with processip().
+ *
+ * Frames only ever add to a record's counts; this is the one place they're
+ * judged. So an alert is raised at most one scan after the frame which earned
+ * it, however busy things are, and a machine which goes quiet is still
+ * forgotten on time.
+ *
+ * Called from the event loop every tick, which is also when the table is
+ * dumped for debugging.
+ */
+void scanrecords(){
+	static long lastscan = 0;
+	struct ipdetails *current, *following;
+	struct partition *table;
+	long now;
+	now = time(NULL);
+	if ((firstpartition() == NULL) || (now - lastscan < options.scan_interval))
+		return;
+	lastscan = now;
+	for (table = firstpartition(); table != NULL; table = table->next) {
+		current = table->head;
+		while (current != NULL) {
+			following = current->next;
+			/* removeip() moves the entry point on if it was this one */
+			if (checktimeouts(current) == current)
+				processip(current);
+			current = following;
+		}
+	}
+/* Remove this after debugging */
+	dumpdata("DETAILS.csv");
+}
+
 /**
  * Process a given set of details referring to an IP.
  * Processing tdfo include:
  * - Checking for unusual, unbalanced numbers of ARPs
- * - Checking timeframe on the details to ensure we're not looking at ancient info.
  *
- * Sets info to a pointer to the resulting IP details - useful if the details are old
- * enough to be removed. 
+ * The record is known to be current: scanrecords() checks the timeout first.
+ * If either threshold has been crossed, the counts start again from nothing.
+ * The thresholds are the record's subnet's - see policy.c.
  *
  * ARGUMENTS:
- * \arg \c **info - A pointer to an ipdetails struct to process.
+ * \arg \c *ip - The ipdetails struct to process.
  *
  * \todo Tidy up removing IP details from the data structure - if the network
  * this is on uses fixed IP addressing it might be desirable to never remove
  * details, and if it uses DHCP, there's no point in keeping details too long.
  * That being said, how the blazes is anyone supposed to spot an odd
- * machine on the network if the network is using DHCP?!
- */
-
-void processip(struct ipdetails **info){
-
-	struct ipdetails *temp1 = NULL, *temp2;
-	char *msg;
-/*
- * First, out with the old. We're not too bothered about unusual
- * numbers of ARP requests if thery're only sent once every couple of hours - it's
- * unlikely to be a serious poisoning attempt.
+ * machine on the network if the network is using DHCP?! (Answer: ask the
+ * DHCP server, by snooping its DHCPACKs - see dhcp.c.)
  */
-	temp2 = *info;
-	temp1 = checktimeouts(*info);
-	if (temp1 != temp2) {
-		// info has been removed, no further checking.
-		*info = temp1;
-		return;
-	}
 
+void processip(struct ipdetails *ip){
+	int net, margin;
 /* 
  * Unbalanced ARP numbers : Update to give MAC details of poisoner.
+ *
+ * If replies are being matched with requests (see correlate.c) we know
+ * exactly how many replies nobody asked for and how many requests went
+ * unanswered, and judge on those. If not, all we have is the difference; and
+ * if some of the requests were estimated while shedding, the thresholds are
+ * that much further out - see overload.c.
  */
-
-	if (checknetarps(*info) > POISON_THRESHOLD){
-		msg = malloc(ADOTE_ERR_BUFF); // D'oh!
-		if (msg != NULL) {
-			sprintf(msg,"Suspected poisoner impersonating IP address: %d.%d.%d.%d", (*info)->ip_address[0], (*info)->ip_address[1], (*info)->ip_address[2], (*info)->ip_address[3]);
-			redalert(msg);
-			free(msg);
-		} else {
-			redalert("Suspected poisoner detected. Unable to allocate memory for details.");
-		} 
-	} else if (checknetarps(*info) < options.badnet_threshold){
-		msg = malloc(ADOTE_ERR_BUFF); 
-		if (msg != NULL) {
-			sprintf(msg,"An unusual number of ARP requests for: %d.%d.%d.%d have not been replied to", (*info)->ip_address[0], (*info)->ip_address[1], (*info)->ip_address[2], (*info)->ip_address[3]);
-			redalert(msg);
-			free(msg);
-		} else {
-			redalert("An unusual number of ARP requests have not been replied to. Unable to allocate memory for details.");
-		} 
-	}
-	if ((checknetarps(*info) > options.poison_threshold) || (checknetarps(*info)< options.badnet_threshold)){
-		blanknetarps(*info);
-		resettimer(*info);
+	if (options.correlate > 0) {
+		if (ip->unsolicited > (unsigned int)ip->policy->poison_threshold)
+			raisealert(ALERT_POISONER, ip, NULL, ip->mac_address, ip->unsolicited);
+		else if ((ip->policy->badnet_threshold < 0) && (ip->timedout > (unsigned int)-ip->policy->badnet_threshold))
+			raisealert(ALERT_BADNET, ip, NULL, NULL, ip->timedout);
+		else
+			return;
+		blanknetarps(ip);
+		resettimer(ip);
+		publiship(ip);
+		return;
 	}
-	//removeip(*info); // on second thoughts, that's stupid.
+	net = checknetarps(ip);
+	margin = shedmargin(ip);
+	if (net > ip->policy->poison_threshold + margin){
+		raisealert(ALERT_POISONER, ip, NULL, ip->mac_address, 0);
+	} else if (net < ip->policy->badnet_threshold - margin){
+		raisealert(ALERT_BADNET, ip, NULL, NULL, 0);
+	} else
+		return;
+	blanknetarps(ip);
+	resettimer(ip);
+	publiship(ip);
+	//removeip(ip); // on second thoughts, that's stupid.
 }
 	
 /**
- * This routine will be called repeatedly, every time an ARP is detected.
+ * This routine will be called repeatedly, every time an ARP (or a neighbour
+ * solicitation or advertisement) is detected.
  * 
- * It is nothing more than a wrapper around processether, which does most of the hard
- * work.
+ * It is nothing more than a wrapper around processether (or, for IPv6,
+ * processobservation), which does most of the hard work.
  *
  * I'm wrapping it purely so that all the routines I use receive only what they need, and to stop me
  * having to worry about other baggage introduced by callback.
@@ -271,7 +387,42 @@ void processip(struct ipdetails **info){
  */
 void my_callback(u_char *useless,const struct pcap_pkthdr* framehdr,const u_char* frame)
 {
-	processether(frame);
+	struct timeval when;
+	struct observation seen;
+	u_char untagged[sizeof(struct ether_header) + sizeof(struct ether_arp)];
+	const u_char *arpframe;
+	u_int32_t vlan = 0;
+	/* a second copy from another mirrored port goes nowhere - see dedup.c */
+	if (duplicateframe(framehdr, frame))
+		return;
+	/* everything after this wants microseconds, whatever capture gives us */
+	when = framehdr->ts;
+	if (capturenanoseconds())
+		when.tv_usec /= 1000;
+	/*
+	 * Past any VLAN tags, there must be a whole ARP packet; CAPTURE_SNAPLEN
+	 * has room for that behind VLAN_TAGS tags, so anything shorter is
+	 * truncated. Everything but the evidence ring sees the frame untagged.
+	 *
+	 * Anything else is neighbour discovery, a DHCP server's reply, or nothing
+	 * we want. Neighbour discovery is only kept as evidence and counted - the
+	 * journal and the aggregator only deal in ARP - and DHCP only tells us
+	 * who holds which lease (see dhcp.c).
+	 */
+	arpframe = untagframe(frame, framehdr->caplen, untagged, &vlan);
+	if (arpframe == NULL) {
+		if (parsend(frame, framehdr->caplen, &seen, &vlan)) {
+			evidenceframe(framehdr, frame);
+			seen.when = (u_int64_t)when.tv_sec * 1000000 + when.tv_usec;
+			processobservation(&seen, vlan);
+		} else
+			snoopdhcp(frame, framehdr->caplen, &when);
+	} else {
+		evidenceframe(framehdr, frame);
+		forwardframe(arpframe, vlan, &when);
+		journalframe(arpframe, &when);
+		processether(arpframe, vlan, &when);
+	}
 	/**
 	 * I suspect libpcap uses the same piece of memory for each frame it passes
 	 * to callback, so I'm not going to free that memory pointer.
@@ -293,15 +444,15 @@ void my_callback(u_char *useless,const struct pcap_pkthdr* framehdr,const u_char
  * \return ERR_OPENLIVE  
  * \return ERR_COMPILEBPF
  * \return ERR_SETFILTER 
+ * \return ERR_EVENTLOOP
  *
- * In use, this routine shouldn't actually return anything, because the last call is one to
- * pcap_loop, which loops eternally, but hey... shit happens.
+ * In use, this routine only returns when we're told to stop (SIGTERM or
+ * SIGINT), because the last call is to runeventloop(), but hey... shit happens.
  */
 int initether(char *devopen){
 	char *dev; 
 	char errbuf[PCAP_ERRBUF_SIZE];
-	pcap_t* descr;
-	struct bpf_program fp;      /* hold compiled program     */
+	int result;
 	bpf_u_int32 maskp;          /* subnet mask               */
 	bpf_u_int32 netp;           /* ip                        */
 	
@@ -313,24 +464,14 @@ int initether(char *devopen){
 	if (dev == NULL) {
 		return ERR_LOOKUPDEV;
 	}
+	if (dev != options.device) // so alerts and events can say where they came from
+		strncpy(options.device, dev, MAX_OPT_LENGTH - 1);
 	if (pcap_lookupnet(dev,&netp,&maskp,errbuf) == -1){
 		return ERR_LOOKUPNET;
 	}
-/*
- * pcap 0.5 doesn't like a -1 read timeout
- */
-	descr = pcap_open_live(dev,BUFSIZ,options.promiscuous,10,errbuf);
-	if (descr == NULL){
-		return ERR_OPENLIVE;
-	}
-	if(pcap_compile(descr,&fp,options.bpf_program,0,netp) == -1){
-		return ERR_COMPILEBPF;
-	}
-	if(pcap_setfilter(descr,&fp) == -1) {
-		return ERR_SETFILTER;
-	}
-	pcap_loop(descr,-1,my_callback,NULL);
-	return OK;
+	if ((result = opencapture(dev, netp)) != OK)
+		return result;
+	return runeventloop();
 }
 
 void showusage(int argc, char **argv){
@@ -351,7 +492,55 @@ int main(int argc,char **argv)
 	if ((init = processarguments(argc, argv)) != OK)
 		exit(init);
 	loadoptions();
-	init = initether(options.device); /* should NEVER return */
+	if ((init = buildpolicies()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if (openeventlog() != OK)
+		bluealert("Cannot open the event log. Structured events will not be written.");
+	if ((init = openrsyslog()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = opensharedstate()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = opencontrol()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = openforward()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = openaggregate()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = openjournal()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = openneighbour()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = openevidence()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = opencorrelate()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if ((init = opendhcp()) != OK) {
+		decodeerror(init, error);
+		bluealert(error);
+	}
+	if (opendump() != OK)
+		bluealert("Cannot start the dump thread. The capture thread will write DETAILS.csv itself.");
+	init = initether(options.device); /* only returns on a signal, or failure */
 	if (init != OK){
 		decodeerror(init, error);
 		bluealert(error);
@@ -6,6 +6,7 @@
 
 #include "includes.h"
 #include "errors.h"
+#include "sharedstate.h"
 
 #if ! ETH_ALEN
 /* BSD doesn't define this. Don't know about others. */
@@ -43,10 +44,140 @@
 #define POISON_THRESHOLD 10
 #define BADNET_THRESHOLD -10
 #define TIMEOUT 1500 /* max seconds details are stored for. */
-#define BPF_PROGRAM "arp"
+#define MAXRECORDS 65536 /* most IP records held at once. */
+#define MINRECORDS 2 /* the entry point plus at least one other. */
+#define SKETCHWINDOW 10 /* seconds per flood/sweep detection window. */
+#define FLOODTHRESHOLD 1000 /* frames from one MAC per window. */
+#define SWEEPTHRESHOLD 256 /* distinct addresses from one MAC per window. */
+#define SCANTHRESHOLD 128 /* distinct addresses one requester asks for per window. */
+#define EVENTLOG "" /* no JSON event log unless asked for. */
+#define EVENTLOGFLUSH 5 /* most seconds an event sits in the buffer. */
+#define EVENTLOGSIZE (10 * 1024 * 1024) /* bytes before the event log is rotated. */
+#define EVENTLOGKEEP 5 /* rotated event logs kept. */
+#define REMOTESYSLOG "" /* no remote syslog unless asked for. */
+#define REMOTESYSLOGPORT 514
+#define REMOTESYSLOGQUEUE 4096 /* alerts held for the remote syslog server. */
+#define EMAILDIGEST 0 /* seconds per digest email (set in minutes); 0 for one email per alert. */
+#define EMAILDIGESTMAX 1000 /* alerts in a digest before it's sent early. */
+#define CAPTUREBUFFER (4 * 1024 * 1024) /* bytes of kernel capture buffer to start with. */
+#define CAPTUREBUFFERMAX (64 * 1024 * 1024) /* most it'll be grown to if frames are dropped. */
+#define CAPTURESTATS 60 /* seconds between checks for dropped frames. */
+#define SHAREDSTATE "" /* no shared-memory view unless asked for. */
+#define CONTROLSOCKET "" /* no control socket unless asked for. */
+#define FORWARD "" /* events aren't forwarded to an aggregator unless asked. */
+#define FORWARDQUEUE (4 * 1024 * 1024) /* bytes of batches held while the aggregator is away. */
+#define SENSORNAME "" /* how this sensor introduces itself; the host name if empty. */
+#define AGGREGATE "" /* not an aggregator unless asked. */
+#define JOURNAL "" /* no journal of frames unless asked. */
+#define JOURNALFLUSH 60 /* most seconds a frame waits before it's written to the journal. */
+#define EVIDENCE "" /* no pcap files of the frames behind alerts unless asked. */
+#define EVIDENCEFRAMES 65536 /* recent frames kept in memory in case an alert wants them. */
+#define EVIDENCESECONDS 10 /* frames this long either side of an alert are saved. */
+#define VLANPARTITIONS 256 /* VLANs given an IP table of their own; the rest share one. */
+#define SHEDRATE 8 /* while overloaded, 1 in this many ARP requests is counted - see overload.c. */
+#define OVERLOADBATCHES 4 /* full batches of frames in a row which mean we're overloaded. */
+#define OVERLOADHOLD 30 /* seconds without drops or a backlog before we stop shedding. */
+#define DEDUPWINDOW 5 /* milliseconds within which a copy of a frame is a duplicate - see dedup.c. */
+#define CORRELATE 16384 /* outstanding requests remembered, to be matched with replies - see correlate.c. */
+#define REQUESTTIMEOUT 3 /* seconds before a request nobody has answered has timed out. */
+#define LATENCY_BUCKETS 12 /* of each record's latency histogram: under 1ms, then doubling to 1024ms and over. */
+#define CORRELATE_UNSOLICITED -1 /* from correlatereply(): a reply nobody asked for */
+#define CORRELATE_UNKNOWN -2 /* ...or one it can't say anything about */
+#define DHCPSNOOP 0 /* DHCP server replies aren't snooped unless asked. */
+#define DHCPBINDINGS 65536 /* DHCP leases remembered - see dhcp.c. */
+#define DHCP_UNBOUND 0 /* from checkbinding(): nobody has a lease for the address */
+#define DHCP_MATCH 1 /* ...the reply came from the MAC with the lease */
+#define DHCP_MISMATCH 2 /* ...it didn't */
+#define EVICT_SCAN 64 /* records examined per eviction before giving up on finding the ideal victim. */
+#define SCANINTERVAL 1 /* seconds between checks of every record's counts. */
+#define BASELINELEARNING (10 * 60) /* seconds a new record spends learning what's normal for it. */
+#define BASELINEDEVIATION 4.0 /* standard deviations from its baseline before a host is alerted on. */
+#define BASELINE_WINDOW 10 /* seconds of a host's traffic summed into each baseline sample. */
+#define BASELINE_ALPHA 0.05 /* weight of the newest sample once the baseline has settled. */
+#define BASELINE_MINSD 1.0 /* smallest standard deviation believed, so a quiet host isn't hair-trigger. */
+#define EPOCH_READERS 64 /* reader threads which may look at the IP table at once - see epoch.c. */
+#define EPOCH_LIMBO 1024 /* removed records held before we insist on trying to free them. */
+/* neighbour solicitations and advertisements - see ndisc.c */
+#define BPF_ND "(icmp6 and ip6[40] >= 135 and ip6[40] <= 136)"
+#define BPF_PROGRAM "arp or " BPF_ND " or (vlan and (arp or " BPF_ND " or (vlan and (arp or " BPF_ND "))))" /* untagged, 802.1Q or QinQ */
+/* the same, and DHCP servers' replies (and clients' releases) too - see dhcp.c */
+#define BPF_DHCP "(udp src port 67 and udp dst port 68) or (udp src port 68 and udp dst port 67)"
+#define BPF_PROGRAM_DHCP "arp or " BPF_ND " or " BPF_DHCP " or (vlan and (arp or " BPF_ND " or " BPF_DHCP \
+	" or (vlan and (arp or " BPF_ND " or " BPF_DHCP "))))"
 #define PROGNAME "ANTIDOTE"
 #define MAX_OPT_LENGTH 255
 
+/**
+ * VLANs. Frames may carry up to VLAN_TAGS tags (see vlan.c); the VLAN a frame
+ * was on is kept as VLAN_KEY(service VLAN, customer VLAN) for QinQ, as just
+ * the VLAN ID for a single tag, and as 0 for none.
+ */
+#define VLAN_TAGS 2
+#define VLAN_TAGSIZE 4
+#define VLAN_KEY(outer, inner) (((u_int32_t)(outer) << 12) | (inner))
+#define VLAN_OUTER(vlan) ((vlan) >> 12)
+#define VLAN_INNER(vlan) ((vlan) & 0x0fff)
+#define VLAN_OVERFLOW 0xffffffffu /* the partition shared by VLANs beyond options.vlan_partitions */
+#define VLAN_NAMESIZE 12 /* "4095.4095" or "other", and the null */
+#define VLAN_LIMITS 64 /* VlanTable lines */
+#define DHCP_SERVERS 16 /* DhcpServer lines */
+
+/**
+ * Addresses. Every record is keyed on IP_KEYSIZE bytes: an IPv6 address fills
+ * them, an IPv4 address takes the first four and leaves the rest zero. Which
+ * it is is up to the partition the record is in (see vlan.c) - IPv4 and IPv6
+ * never share one - so code which only ever sees IPv4 can go on reading four
+ * bytes.
+ */
+#define IP_KEYSIZE 16
+#define IP_NAMESIZE 46 /* INET6_ADDRSTRLEN */
+#define IP_INDEXSIZE 64 /* hash buckets a partition's index starts with - see handledata.c */
+#define IP6_HEADERSIZE 40
+#define ND_HEADERSIZE 24 /* ICMPv6 type, code, checksum, flags and target */
+#define ND_OPTIONROOM 32 /* bytes of ND options captured: a link-layer address after a nonce or two */
+
+/**
+ * Limits for one VLAN's IP table, from a VlanTable line.
+ */
+struct vlanlimit {
+	u_int32_t vlan;
+	unsigned long max_records;
+	long timeout; /* seconds; 0 for options.timeout */
+};
+
+/**
+ * A DHCP server whose replies are believed, from a DhcpServer line: its IP
+ * address, its MAC, or both, on one VLAN or any.
+ */
+struct dhcpserver {
+	u_int8_t ip_address[4];
+	u_int8_t mac_address[ETH_ALEN];
+	unsigned char hasip;
+	unsigned char hasmac;
+	unsigned char anyvlan; /* no vlan= given */
+	u_int32_t vlan;
+};
+
+/**
+ * Settings for one subnet, from a Policy line - see policy.c. Once
+ * buildpolicies() has run, every field is filled in, inherited if the line
+ * didn't give it.
+ */
+struct subnetpolicy {
+	u_int8_t prefix[IP_KEYSIZE];
+	unsigned int length; /* bits */
+	int family; /* AF_INET or AF_INET6 */
+	u_int32_t vlan;
+	unsigned char anyvlan; /* no vlan= given */
+	unsigned int set; /* which settings the line gave */
+	int poison_threshold;
+	int badnet_threshold;
+	long timeout; /* seconds; 0 for the partition's */
+	unsigned char check_mac_changes;
+	unsigned char ignore; /* no alerts about these addresses */
+	struct subnetpolicy *sibling; /* same prefix, other VLANs */
+};
+
 /**
  * Program options. There are a number of ways of handling this:
  *  - #defined values in this file
@@ -73,7 +204,57 @@
  * poison_threshold : Threshold before alerting to poisoning.
  * badnet_threshold : Threshold before alerting to a dodgy network.
  * timeout : Length of time to store IP details for.
- * check_mac_changes : Check whether an IP address suddenly acquires a new MAC. */
+ * check_mac_changes : Check whether an IP address suddenly acquires a new MAC.
+ * max_records : Most IP records held before old ones are evicted.
+ * sketch_window : Length of a flood/sweep detection window, in seconds.
+ * flood_threshold : Frames one MAC may send per window before it's a flood.
+ * sweep_threshold : Distinct addresses one MAC may mention per window before it's a sweep.
+ * scan_threshold : Distinct addresses one requester may ask for per window before it's a scan (0 for never).
+ * event_log : File to write JSON-lines events to, or empty for none.
+ * event_log_flush : Most seconds an event is buffered before being written.
+ * event_log_size : Size in bytes at which the event log is rotated (0 for never).
+ * event_log_keep : Number of rotated event logs to keep.
+ * remote_syslog : Host to send RFC 5424 syslog messages to, or empty for none.
+ * remote_syslog_port : Port on that host.
+ * remote_syslog_tcp : Use TCP rather than UDP.
+ * remote_syslog_batch : Pack several messages per UDP datagram.
+ * remote_syslog_queue : Alerts held for the remote server before dropping.
+ * email_digest : Seconds to collect alerts for before emailing them as one, or 0.
+ * email_digest_max : Alerts which make a digest go early.
+ * email_digest_immediate : Still email the first alert of each IP/kind at once.
+ * capture_buffer : Kernel capture buffer, in bytes.
+ * capture_buffer_max : Most the capture buffer is grown to when frames are dropped.
+ * capture_stats : Seconds between checks for dropped frames (0 for never).
+ * shared_state : Name of the shared memory segment to publish the table in, or empty.
+ * control_socket : Path of the Unix domain control socket, or empty for none.
+ * baseline_learning : Seconds a record learns its own baseline before it's alerted on (0 for never).
+ * baseline_deviation : Standard deviations from its baseline which make a host worth an alert.
+ * scan_interval : Seconds between checks of every record against the thresholds.
+ * forward : Aggregator to stream events to (host:port or a Unix socket path), or empty.
+ * forward_compress : Compress forwarded batches (if built with zlib).
+ * forward_queue : Bytes of batches held for the aggregator before dropping.
+ * sensor_name : Name this sensor gives the aggregator (the host name if empty).
+ * aggregate : Port or Unix socket path to take sensors' events on, or empty.
+ * journal : Directory to keep a journal of every ARP frame in, or empty.
+ * journal_flush : Most seconds a frame waits in memory before it's journalled.
+ * neighbour_check : Compare the kernel's neighbour table with what's learned from the wire.
+ * evidence : Directory to save the frames around each alert in, as pcap files, or empty.
+ * evidence_frames : Recent frames kept in memory for that.
+ * evidence_seconds : Seconds either side of an alert whose frames are saved.
+ * evidence_filter : Only save frames involving the alert's address or MACs.
+ * vlan_partitions : Most VLANs given IP tables of their own.
+ * vlan_limits : VLANs whose tables are sized or timed out differently (VlanTable lines).
+ * vlan_limit_count : How many of those there are.
+ * shed_rate : While overloaded, count 1 in this many requests (1 to never shed).
+ * overload_batches : Full batches of frames in a row which mean we're overloaded (0 to ignore).
+ * overload_hold : Seconds without drops or a backlog before shedding stops.
+ * dedup_window : Milliseconds within which copies of a frame are counted once (0 to count all).
+ * correlate : Outstanding requests held to be matched with their replies (0 to not correlate).
+ * request_timeout : Seconds an outstanding request waits before it's timed out.
+ * dhcp_snoop : Learn IP to MAC bindings from DHCP servers' DHCPACKs.
+ * dhcp_bindings : Most DHCP leases remembered.
+ * dhcp_servers : The DHCP servers whose DHCPACKs are believed (DhcpServer lines).
+ * dhcp_server_count : How many of those there are. */
  
 struct optiondetails{
 	char config_file[MAX_OPT_LENGTH];
@@ -88,7 +269,56 @@ struct optiondetails{
         int poison_threshold;
 	int badnet_threshold;
 	long timeout;
-	
+	unsigned long max_records;
+	long sketch_window;
+	unsigned long flood_threshold;
+	unsigned long sweep_threshold;
+	unsigned long scan_threshold;
+	char event_log[MAX_OPT_LENGTH];
+	long event_log_flush;
+	off_t event_log_size;
+	int event_log_keep;
+	char remote_syslog[MAX_OPT_LENGTH];
+	unsigned int remote_syslog_port;
+	unsigned char remote_syslog_tcp;
+	unsigned char remote_syslog_batch;
+	unsigned int remote_syslog_queue;
+	long email_digest;
+	unsigned long email_digest_max;
+	unsigned char email_digest_immediate;
+	int capture_buffer;
+	int capture_buffer_max;
+	long capture_stats;
+	char shared_state[MAX_OPT_LENGTH];
+	char control_socket[MAX_OPT_LENGTH];
+	long baseline_learning;
+	double baseline_deviation;
+	long scan_interval;
+	char forward[MAX_OPT_LENGTH];
+	unsigned char forward_compress;
+	unsigned long forward_queue;
+	char sensor_name[MAX_OPT_LENGTH];
+	char aggregate[MAX_OPT_LENGTH];
+	char journal[MAX_OPT_LENGTH];
+	long journal_flush;
+	unsigned char neighbour_check;
+	char evidence[MAX_OPT_LENGTH];
+	unsigned long evidence_frames;
+	long evidence_seconds;
+	unsigned char evidence_filter;
+	unsigned long vlan_partitions;
+	struct vlanlimit vlan_limits[VLAN_LIMITS];
+	unsigned int vlan_limit_count;
+	unsigned int shed_rate;
+	unsigned int overload_batches;
+	long overload_hold;
+	long dedup_window;
+	unsigned long correlate;
+	long request_timeout;
+	unsigned char dhcp_snoop;
+	unsigned long dhcp_bindings;
+	struct dhcpserver dhcp_servers[DHCP_SERVERS];
+	unsigned int dhcp_server_count;
 };
 
 
@@ -96,13 +326,141 @@ struct optiondetails{
  * The structure of information as stored
  */
 struct ipdetails {
-	u_int8_t ip_address[4]; 
+	u_int8_t ip_address[IP_KEYSIZE]; /* the first four for IPv4, the rest zero */
 	u_int8_t mac_address[ETH_ALEN]; 
 	unsigned int requests;
 	unsigned int replies;
+	unsigned int estimated; /* of the requests, how many were scaled up from samples - see overload.c */
+	unsigned int unsolicited; /* replies it sent which answered nothing - see correlate.c */
+	unsigned int timedout; /* requests for it which went unanswered */
 	long lastreset;
+	unsigned char referenced; /* CLOCK bit - set on every lookup, cleared as the eviction hand passes. */
+	unsigned int slot; /* in the shared-memory view, counting from 1; 0 for none. */
+	struct partition *partition; /* the VLAN's table it's in - see vlan.c */
+	long created; /* unlike lastreset, never reset - the baseline's learning period runs from here. */
+	long windowstart; /* start of the baseline window being counted */
+	unsigned short windowrequests, windowreplies; /* in that window */
+	unsigned int samples; /* windows folded into the baseline so far */
+	float balancemean, balancevar; /* replies - requests per window: running mean and variance */
+	float ratemean, ratevar; /* frames per second, likewise */
+	unsigned int latency[LATENCY_BUCKETS]; /* how long its answers took, never reset */
+	u_int8_t neighbour_mac[ETH_ALEN]; /* the kernel's ARP cache's idea of the MAC, if we know it - see neighbour.c */
+	u_int8_t prior_mac[ETH_ALEN]; /* the MAC before it first changed on the wire, until it's reset; zero if it hasn't */
+	volatile u_int32_t sequence; /* odd while the fields above are being changed - see epoch.c. */
 	struct ipdetails *previous;
 	struct ipdetails *next;
+	struct ipdetails *limbo; /* once removed, the next record waiting to be freed */
+	u_int64_t retired; /* and the epoch it was removed in */
+	struct ipdetails *hashnext; /* in the same bucket of its partition's index; capture thread only */
+	const struct subnetpolicy *policy; /* its subnet's settings, found when it's made - see policy.c */
+};
+
+/**
+ * One VLAN's part of the IP table, for one address family - see vlan.c. Each
+ * is a list of ipdetails like the whole table used to be, with its own
+ * book-keeping, and a hash index for finding records in it.
+ */
+struct partition {
+	u_int32_t vlan; /* VLAN_KEY(), 0 for untagged frames */
+	int family; /* AF_INET or AF_INET6 */
+	unsigned long max_records; /* most records held before old ones are evicted */
+	long timeout; /* seconds a record is kept after its last reset */
+	struct ipdetails *entrypoint; /* somewhere in the list - where lookups start */
+	struct ipdetails *head; /* the first record, where readers on other threads start */
+	struct ipdetails *clockhand; /* where the next eviction sweep picks up */
+	unsigned long records;
+	unsigned long evictions;
+	struct ipdetails **index; /* records by address, chained through ->hashnext */
+	unsigned long indexsize; /* buckets in it, a power of 2 */
+	struct partition *next; /* made after this one */
+	struct partition *chain; /* in the same hash bucket */
+};
+
+/**
+ * What one frame says, whichever protocol it says it in: ARP, or IPv6
+ * neighbour discovery (see ndisc.c). A request asks who has key; a reply says
+ * that key is at claimed_mac.
+ */
+struct observation {
+	int op; /* ARPOP_REQUEST or ARPOP_REPLY - solicitations and advertisements are taken as these */
+	int family; /* AF_INET or AF_INET6 */
+	u_int8_t key[IP_KEYSIZE]; /* the target of a request, the sender of a reply; zero-padded for IPv4 */
+	u_int8_t other[IP_KEYSIZE]; /* the other address in the frame: who's asking, or who's told */
+	const u_int8_t *ether_mac; /* the Ethernet source */
+	const u_int8_t *claimed_mac; /* the ARP sender hardware address, or the ND link-layer address */
+	unsigned int weight; /* how many frames it stands for: 1, or more for a request sampled while shedding */
+	u_int64_t when; /* when it was captured, in microseconds */
+};
+
+/**
+ * Kinds of alert. Each has an entry in the table in alertformat.c, which must
+ * be kept in the same order.
+ */
+#define ALERT_UNKNOWN 0
+#define ALERT_MACCHANGED 1
+#define ALERT_MACMISMATCH 2
+#define ALERT_POISONER 3
+#define ALERT_BADNET 4
+#define ALERT_FLOOD 5
+#define ALERT_SWEEP 6
+#define ALERT_NEWHOST 7
+#define ALERT_BASELINE 8
+#define ALERT_CONFLICT 9
+#define ALERT_NEIGHBOUR 10
+#define ALERT_SCAN 11
+#define ALERT_DHCPMISMATCH 12
+#define ALERT_DHCPROGUE 13
+#define ALERT_DHCPREBIND 14
+#define ALERT_KINDS 15
+
+/* Which fields of an alertrecord mean anything. */
+#define ALERTREC_IP 1
+#define ALERTREC_OLDMAC 2
+#define ALERTREC_NEWMAC 4
+#define ALERTREC_COUNTS 8
+#define ALERTREC_VLAN 16
+#define ALERTREC_IPV6 32 /* the IP address is all IP_KEYSIZE bytes of an IPv6 one */
+
+#define ALERT_TEXTSIZE 200 /* longest alert rendered as text */
+#define ALERT_JSONSIZE 376 /* longest alert rendered as JSON, less the interface name */
+#define ALERT_WIRESIZE 54 /* an alert rendered as binary */
+#define ALERTQUEUE 1024 /* alerts held before they must be sent */
+#define CONTROL_CLIENTS 8 /* control socket connections served at once */
+
+/**
+ * Events forwarded from a sensor to an aggregator (see forward.c) go in
+ * batches: a 4 byte length (of everything after it), then version, flags and
+ * a 2 byte event count, then the length of the events once unpacked (4), then
+ * the events - compressed with zlib if flags says so. All in network byte
+ * order. Each event starts with its type.
+ */
+#define FORWARD_VERSION 4 /* 2: alerts carry their VLAN; 3: and IPv6 addresses; 4: observations carry their VLAN */
+#define FORWARD_HEADER 12 /* bytes before the events, length included */
+#define FORWARD_BATCH 16384 /* bytes of events sent as one batch */
+#define FORWARD_MAXBATCH 65536 /* largest batch an aggregator will take, packed or unpacked */
+#define FORWARD_COMPRESSED 1 /* flags: the events are zlib compressed */
+#define FWD_HELLO 1 /* name length (1), name - always the first event on a connection */
+#define FWD_OBSERVATION 2 /* ARP op (1), sender MAC (6), sender IP (4), target IP (4), seconds, microseconds, VLAN (4 each) */
+#define FWD_ALERT 3 /* an alert, as formatalertbinary() renders it */
+#define FWD_OBSERVATIONSIZE 28
+#define AGGREGATE_SENSORS 64 /* sensors connected to an aggregator at once */
+
+/**
+ * An alert, as raised. Everything needed to describe it is copied in at the
+ * time, so it can sit in a queue and be rendered later (and differently) by
+ * each thing that wants to emit it. See alertformat.c.
+ */
+struct alertrecord {
+	u_int8_t kind;
+	u_int8_t flags;
+	u_int8_t ip_address[IP_KEYSIZE]; /* IPv4 in the first four, unless ALERTREC_IPV6 is set */
+	u_int8_t old_mac[ETH_ALEN];
+	u_int8_t new_mac[ETH_ALEN];
+	unsigned int requests;
+	unsigned int replies;
+	unsigned long count; /* frames, addresses... whatever the kind counts */
+	u_int32_t vlan; /* the record's VLAN, if ALERTREC_VLAN is set */
+	struct timeval when;
 };
 
 /*
@@ -123,14 +481,34 @@ void notice(const char *err);
 void alert(const char *err);
 void bluealert(const char *err);
 void redalert(const char *err);
+void redlog(const char *err);
 int netalert(const char *err);
+int netmail(const char *subject, const char *msg);
 void sendalert(int priority, const char *err);
 void alertdodgymacs(struct ipdetails *ip_details, u_int8_t *ether_mac);
 void alertchangedmacs(struct ipdetails *ip_details, u_int8_t *arp_mac);
+void raisealert(int kind, struct ipdetails *ip, const u_int8_t *oldmac, const u_int8_t *newmac, unsigned long count);
+void raiseaddressalert(int kind, const u_int8_t *address, int family, u_int32_t vlan, const u_int8_t *oldmac, const u_int8_t *newmac, unsigned long count);
+void relayalert(const struct alertrecord *record);
+void flushalerts();
 void netsend(char *string, int *len, int recipient);
 int mailalert(const char *recipient, const char *subject, const char *msg);
 int netwait(const char *string, int len, int sender);
 
+/* MAILDIGEST.C */
+void digestalert(const struct alertrecord *record, const char *text);
+void flushdigest(int force);
+void flushdigestatexit();
+
+/* ALERTFORMAT.C */
+const char *alertkindname(int kind);
+int alertkindpriority(int kind);
+int formatalerttext(const struct alertrecord *record, char *dest);
+int formatalertjson(const struct alertrecord *record, const char *device, char *dest);
+int formatalertsd(const struct alertrecord *record, char *dest);
+int formatalertbinary(const struct alertrecord *record, u_int8_t *dest);
+int parsealertbinary(const u_int8_t *src, struct alertrecord *record);
+
 /*
  * AUDIT.C
  */
@@ -142,27 +520,182 @@ struct ipdetails *checktimeouts(struct ipdetails *ip);
 int sumbytes(u_int8_t *start, int count);
 
 /* HANDLEDATA.C */
-struct ipdetails *createipspace();
-int addrequest(struct ipdetails *ip);
+struct ipdetails *createipspace(struct partition *table);
+int addrequest(struct ipdetails *ip, unsigned int count);
 int addreply(struct ipdetails *ip);
-struct ipdetails *searchbackwards(struct ipdetails *startpoint, u_int8_t *ipaddress);
-struct ipdetails *searchforwards(struct ipdetails *startpoint, u_int8_t *ipaddress);
-struct ipdetails *checkip(struct ipdetails *startpoint, u_int8_t *ipaddress);
-int populateipspace(struct ipdetails *ip_space, const u_char *frame);
-int populateipspacereq(struct ipdetails *ip_space, const u_char *frame);
-int populateipspacerep(struct ipdetails *ip_space, const u_char *frame);
+struct ipdetails *searchbackwards(struct ipdetails *startpoint, const u_int8_t *key);
+struct ipdetails *searchforwards(struct ipdetails *startpoint, const u_int8_t *key);
+struct ipdetails *checkip(struct partition *table, const u_int8_t *key);
+struct ipdetails *rewindip(struct ipdetails *ip);
+int populateipspace(struct ipdetails *ip_space, const struct observation *seen);
+int populateipspacereq(struct ipdetails *ip_space, const struct observation *seen);
+int populateipspacerep(struct ipdetails *ip_space, const struct observation *seen);
 u_int8_t *getipaddress(const char *frame);
-void dumpdata(struct ipdetails *entrypoint, char *filename);
+void dumpdata(char *filename);
+int opendump();
+void closedump();
 void removeip(struct ipdetails *victim);
+void linkip(struct ipdetails *before, struct ipdetails *ip);
 void blanknetarps(struct ipdetails *ip);
 void resettimer(struct ipdetails *ip);
+int makeroom(struct partition *table, struct ipdetails *keep);
+unsigned long recordcount();
+unsigned long evictioncount();
+struct ipdetails *readfirst();
+struct ipdetails *readnext(struct ipdetails *ip);
+int readrecord(struct ipdetails *ip, struct ipdetails *copy);
+
+/* VLAN.C */
+const u_char *untagframe(const u_char *frame, bpf_u_int32 caplen, u_char *untagged, u_int32_t *vlan);
+int parsevlan(const char *text, u_int32_t *vlan);
+char *formatvlan(u_int32_t vlan, char *dest);
+const u_char *framepayload(const u_char *frame, bpf_u_int32 caplen, u_int16_t *type, u_int32_t *vlan);
+struct partition *findpartition(u_int32_t vlan, int family, int create);
+struct partition *firstpartition();
+struct partition *nextpartition(struct partition *table);
+
+/* NDISC.C */
+int parsend(const u_char *frame, bpf_u_int32 caplen, struct observation *seen, u_int32_t *vlan);
+int parseip(const char *text, u_int8_t *key, int *family);
+char *formatip(const u_int8_t *key, int family, char *dest);
+
+/* BASELINE.C */
+void baselineframe(struct ipdetails *ip, int reply, unsigned int count);
+
+/* EPOCH.C */
+int epochregister();
+void epochunregister(int reader);
+void epochenter(int reader);
+void epochexit(int reader);
+void retireip(struct ipdetails *ip);
+void epochreclaim();
+
+/* EVENTLOG.C */
+int openeventlog();
+void flusheventlog(int force);
+void closeeventlog();
+void logalert(const struct alertrecord *record);
+
+/* RSYSLOG.C */
+int openrsyslog();
+void flushrsyslog();
+void rsyslogalert(const struct alertrecord *record);
+int rsyslogfd();
+int rsyslogbacklog();
+
+/* CAPTURE.C */
+int opencapture(const char *dev, bpf_u_int32 netp);
+pcap_t *capturehandle();
+int capturenanoseconds();
+void capturestats(int force);
+int regrowcapture();
+int captureregrowing();
+void closecapture();
+
+/* SHAREDSTATE.C */
+int opensharedstate();
+void publiship(struct ipdetails *ip);
+void unpubliship(struct ipdetails *ip);
+void publishstats();
+void closesharedstate();
+
+/* FORWARD.C */
+int openforward();
+void forwardframe(const u_char *frame, u_int32_t vlan, const struct timeval *when);
+void forwardalert(const struct alertrecord *record);
+void flushforward(int force);
+int forwardfd();
+int forwardbacklog();
+
+/* AGGREGATE.C */
+int openaggregate();
+void serviceaggregate(int fd);
+int aggregatefds(int *fds, unsigned int *serial, int *writing, int max);
+
+/* JOURNAL.C */
+int openjournal();
+void journalframe(const u_char *frame, const struct timeval *when);
+void flushjournal(int force);
+
+/* EVIDENCE.C */
+int openevidence();
+void evidenceframe(const struct pcap_pkthdr *framehdr, const u_char *frame);
+void evidencealert(const struct alertrecord *record);
+void flushevidence(int force);
+void closeevidence();
+
+/* NEIGHBOUR.C */
+int openneighbour();
+void serviceneighbour();
+int neighbourfd();
+void neighbourlearned(struct ipdetails *ip);
+
+/* CONTROL.C */
+int opencontrol();
+void servicecontrol();
+int controlfds(int *fds, unsigned int *serial, int *writing, int max);
+
+/* EVENTLOOP.C */
+int runeventloop();
+
+/* CORRELATE.C */
+int opencorrelate();
+void correlaterequest(const struct observation *seen, u_int32_t vlan);
+long correlatereply(const struct observation *seen, u_int32_t vlan);
+void correlaterecord(struct ipdetails *ip, long latency);
+void expirerequests();
+void correlatestats(unsigned long *waiting, unsigned long *replied, unsigned long *expired,
+		    unsigned long *unasked, unsigned long *dropped);
+
+/* DEDUP.C */
+int duplicateframe(const struct pcap_pkthdr *framehdr, const u_char *frame);
+unsigned long duplicatecount();
+
+/* OVERLOAD.C */
+void overloadbatch(int frames, int batch);
+void overloaddrops(unsigned int drops);
+void serviceoverload();
+unsigned int shedweight(const struct observation *seen);
+int shedmargin(const struct ipdetails *ip);
+int overloadstate();
+unsigned long shedcount();
+unsigned long sampledcount();
+unsigned long overloadcount();
+
+/* SKETCH.C */
+u_int32_t hashbytes(const u_int8_t *data, int count, u_int32_t seed);
+void sketchreset(long now);
+int sketchframe(const struct observation *seen);
+
+/* SCAN.C */
+int scanrequest(const struct observation *seen, u_int32_t vlan);
+
+/* DHCP.C */
+int opendhcp();
+int snoopdhcp(const u_char *frame, bpf_u_int32 caplen, const struct timeval *when);
+int leasedmac(u_int32_t vlan, const u_int8_t *address, long now, u_int8_t *mac);
+int checkbinding(struct ipdetails *ip, const struct observation *seen, u_int32_t vlan);
+void expireleases();
+void dhcpstats(unsigned long *leases, unsigned long *acked, unsigned long *ended, unsigned long *mismatched,
+	       unsigned long *rogue, unsigned long *rebound);
+
+/* POLICY.C */
+void clearpolicies();
+int addpolicy(char *optval);
+int buildpolicies();
+const struct subnetpolicy *globalpolicy();
+const struct subnetpolicy *findpolicy(const struct ipdetails *ip);
 
 /* ANTIDOTE.C */
 int initether(char *devopen);
-int handlereply(struct ipdetails **info, const char *frame);
-int processether(const u_char *frame);
-void processip(struct ipdetails **info);
-int handlerequest(struct ipdetails **info, const char *frame);
+int handlereply(struct ipdetails **info, const struct observation *seen, int mayadd);
+int processether(const u_char *frame, u_int32_t vlan, const struct timeval *when);
+int processobservation(struct observation *seen, u_int32_t vlan);
+void scanrecords();
+struct ipdetails *firstrecord(u_int32_t vlan, int family);
+void my_callback(u_char *useless, const struct pcap_pkthdr *framehdr, const u_char *frame);
+void processip(struct ipdetails *ip);
+int handlerequest(struct ipdetails **info, const struct observation *seen, int mayadd);
 void showusage(int argc, char **argv);
 
 /*
@@ -56,7 +56,7 @@ void checkmacs(struct ipdetails *ipdetails, u_int8_t *ether_mac) {
 int checkmacchanges(struct ipdetails *ipdetails, u_int8_t *ether_mac) {
 	int lp, flag = 0;
 	// don't alert if this is the first time we've seen a reply from this machine.
-	if (options.check_mac_changes && (sumbytes((u_int8_t *)(ipdetails->mac_address), ETH_ALEN) != 0)){
+	if (ipdetails->policy->check_mac_changes && (sumbytes((u_int8_t *)(ipdetails->mac_address), ETH_ALEN) != 0)){
 		for (lp = 0; lp < ETH_ALEN; lp++) {
 			if (ipdetails->mac_address[lp] != ether_mac[lp])
 				flag = 1;
@@ -86,30 +86,29 @@ int checknetarps(struct ipdetails *ip) {
 }
 
 /**
- * Checks the timeout value of a given IP.
+ * Checks the timeout value of a given IP, against its subnet's Policy timeout
+ * if it has one, or else its VLAN's partition's timeout (options.timeout
+ * unless a VlanTable line says otherwise).
  * If the record has timed out, remove it an update the pointers of records 
  * each side.
  *
- * Returns a pointer to the next item in the list if the item is removed.
+ * Returns a pointer to the next item in the list if the item is removed, or
+ * the previous one if it was the last - either way, the rest of the list
+ * is still reachable from what comes back.
  */
 
 struct ipdetails *checktimeouts(struct ipdetails *ip) {
 	struct timeval *timer;
-	struct ipdetails *before, *after;
+	struct ipdetails *after;
 	after = NULL;
 	timer = malloc(sizeof(struct timeval));
 	if (timer != NULL) {
 		if (gettimeofday(timer, NULL) == 0) 
 		{
-			if ((ip->lastreset + options.timeout) < (timer->tv_sec)) 
+			if ((ip->lastreset + ((ip->policy->timeout > 0) ? ip->policy->timeout : ip->partition->timeout)) < (timer->tv_sec)) 
 			{
-				before = ip->previous;
-				after = ip->next;
-				if (before)
-					before->next = ip->next;
-				if (after)
-					after->previous = ip->previous;
-				free(ip);
+				after = (ip->next != NULL) ? ip->next : ip->previous;
+				removeip(ip);
 			} else
 				after = ip;
 		}
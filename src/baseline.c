@@ -0,0 +1,107 @@
+/* -*- project-c -*- */
+/**
+ * \file baseline.c
+ * \brief Learning what's normal for each host, and noticing when it isn't.
+ *
+ * PoisonThreshold and BadNetThreshold are the same for every address, which
+ * suits nobody very well: routers and DHCP servers sit a long way from a
+ * balance of zero quite legitimately, and a workstation shouldn't ever send an
+ * unsolicited reply. So each record also keeps its own baseline.
+ *
+ * A host's frames are counted in windows of BASELINE_WINDOW seconds. When the
+ * first frame after a window arrives, the window becomes one sample of two
+ * things - its balance (replies - requests) and its rate (frames per second) -
+ * and each is folded into a running mean and variance. For the first few
+ * samples that's Welford's method, exactly; after that the newest sample
+ * always gets BASELINE_ALPHA of the weight, so the baseline follows a host
+ * whose habits change, but slowly. Either way it's a few multiplications per
+ * window and nothing per frame but a count.
+ *
+ * Once a record is older than options.baseline_learning, a window whose
+ * balance is more than options.baseline_deviation standard deviations from
+ * the mean either way, or whose rate is that far above it, raises
+ * ALERT_BASELINE. The window still goes into the baseline afterwards - if the
+ * new behaviour carries on, it becomes normal, and the alerts stop.
+ */
+
+#include "antidote.h"
+#include <limits.h>
+
+/**
+ * Fold one sample into a running mean and variance.
+ */
+static void fold(float *mean, float *variance, float sample, unsigned int samples){
+	float alpha, delta;
+	alpha = 1.0 / (samples + 1);
+	if (alpha < BASELINE_ALPHA)
+		alpha = BASELINE_ALPHA;
+	delta = sample - *mean;
+	*mean += alpha * delta;
+	*variance = (1 - alpha) * (*variance + alpha * delta * delta);
+}
+
+/**
+ * \return How many standard deviations sample is above the mean (negative
+ * if it's below).
+ */
+static float deviation(float mean, float variance, float sample){
+	float sd;
+	sd = sqrt(variance);
+	if (sd < BASELINE_MINSD)
+		sd = BASELINE_MINSD;
+	return (sample - mean) / sd;
+}
+
+/**
+ * Judge the window that's just finished against the baseline, then add it in.
+ */
+static void closewindow(struct ipdetails *ip, long now){
+	unsigned long frames;
+	float balance, rate;
+	long elapsed;
+	frames = ip->windowrequests + ip->windowreplies;
+	elapsed = now - ip->windowstart;
+	balance = (float)ip->windowreplies - (float)ip->windowrequests;
+	rate = (float)frames / elapsed;
+	if ((options.baseline_learning > 0) && (now - ip->created >= options.baseline_learning)
+			&& (ip->samples > 1)) {
+		if ((fabs(deviation(ip->balancemean, ip->balancevar, balance)) > options.baseline_deviation)
+				|| (deviation(ip->ratemean, ip->ratevar, rate) > options.baseline_deviation))
+			raisealert(ALERT_BASELINE, ip, NULL,
+				   (sumbytes(ip->mac_address, ETH_ALEN) != 0) ? ip->mac_address : NULL, frames);
+	}
+	sharedbeginwrite(&ip->sequence);
+	fold(&ip->balancemean, &ip->balancevar, balance, ip->samples);
+	fold(&ip->ratemean, &ip->ratevar, rate, ip->samples);
+	ip->samples++;
+	ip->windowrequests = ip->windowreplies = 0;
+	ip->windowstart = now;
+	sharedendwrite(&ip->sequence);
+}
+
+/**
+ * Count a frame towards a record's baseline, closing the current window first
+ * if it's over.
+ *
+ * ARGUMENTS:
+ * \arg \c *ip - The record the frame was filed under.
+ * \arg \c reply - Non-zero for an ARP reply, zero for a request.
+ * \arg \c count - How many frames it stands for (see overload.c).
+ */
+void baselineframe(struct ipdetails *ip, int reply, unsigned int count){
+	long now;
+	if (ip == NULL)
+		return;
+	now = time(NULL);
+	if (now - ip->windowstart >= BASELINE_WINDOW)
+		closewindow(ip, now);
+	sharedbeginwrite(&ip->sequence);
+	if (reply) {
+		if (ip->windowreplies < USHRT_MAX)
+			ip->windowreplies++;
+	} else if (ip->windowrequests + count < USHRT_MAX)
+		ip->windowrequests += count;
+	else
+		ip->windowrequests = USHRT_MAX;
+	sharedendwrite(&ip->sequence);
+}
@@ -0,0 +1,256 @@
+/* -*- project-c -*- */
+/**
+ * \file capture.c
+ * \brief Opening the capture device, and keeping an eye on what it loses.
+ *
+ * pcap_open_live() gives us a full BUFSIZ snapshot of every frame, waits for the
+ * kernel to fill a buffer before handing anything over, and uses whatever
+ * buffer size the platform picks. None of that suits a program which only ever
+ * reads the first 42 bytes of an ARP frame (50, behind two VLAN tags), or the
+ * first hundred or so of a neighbour solicitation, and would like to hear
+ * about them promptly. So the device is set up with pcap_create() and
+ * pcap_activate():
+ *
+ * - The snapshot length is CAPTURE_SNAPLEN, an Ethernet header, room for
+ *   VLAN_TAGS VLAN tags, and the longer of an ARP body and the part of a
+ *   neighbour discovery packet we read (see ndisc.c). If we're snooping DHCP
+ *   (see dhcp.c) it's DHCP_SNAPLEN instead, for a DHCPACK's options.
+ * - Immediate mode is on where libpcap has it (1.5 and later), so frames are
+ *   delivered as they arrive; elsewhere, CAPTURE_TIMEOUT bounds the wait.
+ * - The kernel buffer is options.capture_buffer bytes.
+ * - Timestamps are in nanoseconds where the platform can manage it.
+ *
+ * Every options.capture_stats seconds we ask pcap_stats() how many frames have
+ * been dropped, by us (ps_drop) or by the interface (ps_ifdrop), and report any
+ * increase. If we're the ones dropping them and the buffer is still under
+ * options.capture_buffer_max, the capture is reopened with twice the buffer.
+ */
+
+#include "antidote.h"
+
+#define CAPTURE_SNAPLEN (sizeof(struct ether_header) + VLAN_TAGS * VLAN_TAGSIZE + IP6_HEADERSIZE + ND_HEADERSIZE + ND_OPTIONROOM)
+/* an IPv4 header at its longest, UDP, BOOTP and the 312 bytes of options every client must take */
+#define DHCP_SNAPLEN (sizeof(struct ether_header) + VLAN_TAGS * VLAN_TAGSIZE + 60 + 8 + 240 + 312)
+#define CAPTURE_TIMEOUT 10 /* milliseconds - only matters if immediate mode isn't available */
+#define CAPTURE_NAMELEN 64 /* of the device's name, at most, in messages - an interface's is 16 */
+
+static pcap_t *capture = NULL;
+static char capturedevice[MAX_OPT_LENGTH];
+static bpf_u_int32 capturenet = 0;
+static int buffersize = 0;
+static int regrow = 0; /* set when the buffer should be grown at the next opportunity */
+static struct pcap_stat laststats;
+static long laststatstime = 0;
+static unsigned long totaldrop = 0, totalifdrop = 0, lastduplicates = 0;
+
+/**
+ * Report a warning from pcap_activate(). It's still usable, but someone may want
+ * to know why it isn't quite what was asked for.
+ */
+static void capturewarning(int status){
+	char msg[ADOTE_ERR_BUFF];
+	snprintf(msg, sizeof(msg), "Capture on %.*s opened with a warning: %s", CAPTURE_NAMELEN, capturedevice,
+		 (status == PCAP_WARNING) ? pcap_geterr(capture) : pcap_statustostr(status));
+	bluealert(msg);
+}
+
+/**
+ * Create, tune and activate a capture handle on capturedevice, and apply
+ * options.bpf_program to it.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_OPENLIVE
+ * \return ERR_COMPILEBPF
+ * \return ERR_SETFILTER
+ */
+static int activatecapture(){
+	char errbuf[PCAP_ERRBUF_SIZE];
+	char msg[ADOTE_ERR_BUFF];
+	struct bpf_program fp;
+	int status;
+
+	capture = pcap_create(capturedevice, errbuf);
+	if (capture == NULL)
+		return ERR_OPENLIVE;
+	pcap_set_snaplen(capture, options.dhcp_snoop ? DHCP_SNAPLEN : CAPTURE_SNAPLEN);
+	pcap_set_promisc(capture, options.promiscuous);
+	pcap_set_timeout(capture, CAPTURE_TIMEOUT);
+	if (buffersize > 0)
+		pcap_set_buffer_size(capture, buffersize);
+#if HAVE_PCAP_SET_IMMEDIATE_MODE
+	pcap_set_immediate_mode(capture, 1);
+#endif
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+	/* not every platform can do nanoseconds; microseconds will do if not. */
+	pcap_set_tstamp_precision(capture, PCAP_TSTAMP_PRECISION_NANO);
+#endif
+	status = pcap_activate(capture);
+	if (status < 0) {
+		snprintf(msg, sizeof(msg), "Cannot open %.*s for capture: %s", CAPTURE_NAMELEN, capturedevice,
+			 (status == PCAP_ERROR) ? pcap_geterr(capture) : pcap_statustostr(status));
+		bluealert(msg);
+		pcap_close(capture);
+		capture = NULL;
+		return ERR_OPENLIVE;
+	} else if (status > 0) {
+		capturewarning(status);
+	}
+	if (pcap_compile(capture, &fp, options.dhcp_snoop ? BPF_PROGRAM_DHCP : options.bpf_program, 0, capturenet) == -1) {
+		pcap_close(capture);
+		capture = NULL;
+		return ERR_COMPILEBPF;
+	}
+	status = pcap_setfilter(capture, &fp);
+	pcap_freecode(&fp);
+	if (status == -1) {
+		pcap_close(capture);
+		capture = NULL;
+		return ERR_SETFILTER;
+	}
+	memset(&laststats, 0, sizeof(laststats));
+	laststatstime = time(NULL);
+	regrow = 0;
+	return OK;
+}
+
+/**
+ * Open the capture device.
+ *
+ * ARGUMENTS:
+ * \arg \c *dev - The interface to capture on.
+ * \arg \c netp - Its network address, for the BPF compiler.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_OPENLIVE
+ * \return ERR_COMPILEBPF
+ * \return ERR_SETFILTER
+ */
+int opencapture(const char *dev, bpf_u_int32 netp){
+	strncpy(capturedevice, dev, MAX_OPT_LENGTH - 1);
+	capturedevice[MAX_OPT_LENGTH - 1] = '\0';
+	capturenet = netp;
+	buffersize = options.capture_buffer;
+	return activatecapture();
+}
+
+/**
+ * \return The capture handle, or NULL if it isn't open.
+ */
+pcap_t *capturehandle(){
+	return capture;
+}
+
+/**
+ * \return Non-zero if timestamps from the capture handle are in nanoseconds
+ * (that is, tv_usec in each pcap_pkthdr is really nanoseconds).
+ */
+int capturenanoseconds(){
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+	if (capture != NULL)
+		return pcap_get_tstamp_precision(capture) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+	return 0;
+}
+
+/**
+ * Check whether the capture is losing frames, and report it if so.
+ *
+ * ARGUMENTS:
+ * \arg \c force - If zero, only check if options.capture_stats seconds have
+ * passed since the last check. Otherwise check regardless.
+ */
+void capturestats(int force){
+	struct pcap_stat stats;
+	char msg[ADOTE_ERR_BUFF];
+	unsigned int drop, ifdrop;
+	long now;
+	if ((capture == NULL) || (options.capture_stats <= 0))
+		return;
+	now = time(NULL);
+	if ((force == 0) && ((now - laststatstime) < options.capture_stats))
+		return;
+	if (pcap_stats(capture, &stats) != 0)
+		return;
+	/* the counters are 32 bits and may wrap; unsigned subtraction copes. */
+	drop = stats.ps_drop - laststats.ps_drop;
+	ifdrop = stats.ps_ifdrop - laststats.ps_ifdrop;
+	totaldrop += drop;
+	totalifdrop += ifdrop;
+	overloaddrops(drop);
+	if (duplicatecount() != lastduplicates) {
+		snprintf(msg, sizeof(msg), "Capture on %.*s: %lu duplicate frames suppressed in the last %ld seconds (%lu in all).",
+			 CAPTURE_NAMELEN, capturedevice, duplicatecount() - lastduplicates, now - laststatstime, duplicatecount());
+		notice(msg);
+		lastduplicates = duplicatecount();
+	}
+	if ((drop > 0) || (ifdrop > 0)) {
+		snprintf(msg, sizeof(msg), "Capture on %.*s lost %u frames in the last %ld seconds "
+			 "(%u in our buffer, %u at the interface; %u received). %lu lost in all.",
+			 CAPTURE_NAMELEN, capturedevice, drop + ifdrop, now - laststatstime, drop, ifdrop,
+			 stats.ps_recv - laststats.ps_recv, totaldrop + totalifdrop);
+		bluealert(msg);
+	}
+	/*
+	 * Interface drops mean the NIC or driver couldn't keep up, and a bigger
+	 * buffer of ours won't help. Our own drops are another matter.
+	 */
+	if ((drop > 0) && (buffersize < options.capture_buffer_max)) {
+		regrow = 1;
+		pcap_breakloop(capture);
+	} else if (drop > 0) {
+		snprintf(msg, sizeof(msg), "Capture buffer on %.*s is already at CaptureBufferMax (%d bytes) and still dropping frames.",
+			 CAPTURE_NAMELEN, capturedevice, buffersize);
+		bluealert(msg);
+	}
+	laststats = stats;
+	laststatstime = now;
+}
+
+/**
+ * \return Non-zero if capturestats() has asked for a bigger buffer, and
+ * regrowcapture() should be called.
+ */
+int captureregrowing(){
+	return regrow;
+}
+
+/**
+ * If capturestats() has asked for a bigger buffer, reopen the capture with
+ * one. The statistics start again from zero on the new handle.
+ *
+ * RETURN VALUES:
+ * \return OK - The capture is open, bigger or not.
+ * \return ERR_OPENLIVE, ERR_COMPILEBPF or ERR_SETFILTER - It couldn't be
+ * reopened, and we have no capture at all.
+ */
+int regrowcapture(){
+	char msg[ADOTE_ERR_BUFF];
+	int oldsize;
+	if ((regrow == 0) || (capture == NULL))
+		return OK;
+	oldsize = buffersize;
+	if (buffersize <= 0)
+		buffersize = options.capture_buffer > 0 ? options.capture_buffer : CAPTUREBUFFER;
+	buffersize *= 2;
+	if (buffersize > options.capture_buffer_max)
+		buffersize = options.capture_buffer_max;
+	pcap_close(capture);
+	capture = NULL;
+	snprintf(msg, sizeof(msg), "Growing the capture buffer on %.*s from %d to %d bytes.",
+		 CAPTURE_NAMELEN, capturedevice, oldsize, buffersize);
+	bluealert(msg);
+	return activatecapture();
+}
+
+/**
+ * Final statistics, then close the capture.
+ */
+void closecapture(){
+	if (capture == NULL)
+		return;
+	capturestats(1);
+	pcap_close(capture);
+	capture = NULL;
+}
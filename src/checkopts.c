@@ -52,6 +52,56 @@ struct optiondetails options;
  *      int poison_threshold;
  *	int badnet_threshold;
  *	long timeout;
+ *	unsigned long max_records;
+ *	long sketch_window;
+ *	unsigned long flood_threshold;
+ *	unsigned long sweep_threshold;
+ *	unsigned long scan_threshold;
+ *	char event_log;
+ *	long event_log_flush;
+ *	off_t event_log_size;
+ *	int event_log_keep;
+ *	char remote_syslog;
+ *	unsigned int remote_syslog_port;
+ *	unsigned char remote_syslog_tcp;
+ *	unsigned char remote_syslog_batch;
+ *	unsigned int remote_syslog_queue;
+ *	long email_digest;
+ *	unsigned long email_digest_max;
+ *	unsigned char email_digest_immediate;
+ *	int capture_buffer;
+ *	int capture_buffer_max;
+ *	long capture_stats;
+ *	char shared_state[MAX_OPT_LENGTH];
+ *	char control_socket[MAX_OPT_LENGTH];
+ *	long baseline_learning;
+ *	double baseline_deviation;
+ *	long scan_interval;
+ *	char forward[MAX_OPT_LENGTH];
+ *	unsigned char forward_compress;
+ *	unsigned long forward_queue;
+ *	char sensor_name[MAX_OPT_LENGTH];
+ *	char aggregate[MAX_OPT_LENGTH];
+ *	char journal[MAX_OPT_LENGTH];
+ *	long journal_flush;
+ *	unsigned char neighbour_check;
+ *	char evidence[MAX_OPT_LENGTH];
+ *	unsigned long evidence_frames;
+ *	long evidence_seconds;
+ *	unsigned char evidence_filter;
+ *	unsigned long vlan_partitions;
+ *	struct vlanlimit vlan_limits[VLAN_LIMITS];
+ *	unsigned int vlan_limit_count;
+ *	unsigned int shed_rate;
+ *	unsigned int overload_batches;
+ *	long overload_hold;
+ *	long dedup_window;
+ *	unsigned long correlate;
+ *	long request_timeout;
+ *	unsigned char dhcp_snoop;
+ *	unsigned long dhcp_bindings;
+ *	struct dhcpserver dhcp_servers[DHCP_SERVERS];
+ *	unsigned int dhcp_server_count;
  *};
  */
 
@@ -74,6 +124,55 @@ int setdefaults(){
 	options.poison_threshold = POISON_THRESHOLD;
 	options.badnet_threshold = BADNET_THRESHOLD;
 	options.timeout = TIMEOUT;
+	options.max_records = MAXRECORDS;
+	options.sketch_window = SKETCHWINDOW;
+	options.flood_threshold = FLOODTHRESHOLD;
+	options.sweep_threshold = SWEEPTHRESHOLD;
+	options.scan_threshold = SCANTHRESHOLD;
+	strcpy(options.event_log, EVENTLOG);
+	options.event_log_flush = EVENTLOGFLUSH;
+	options.event_log_size = EVENTLOGSIZE;
+	options.event_log_keep = EVENTLOGKEEP;
+	strcpy(options.remote_syslog, REMOTESYSLOG);
+	options.remote_syslog_port = REMOTESYSLOGPORT;
+	options.remote_syslog_tcp = 0;
+	options.remote_syslog_batch = 0;
+	options.remote_syslog_queue = REMOTESYSLOGQUEUE;
+	options.email_digest = EMAILDIGEST;
+	options.email_digest_max = EMAILDIGESTMAX;
+	options.email_digest_immediate = 0;
+	options.capture_buffer = CAPTUREBUFFER;
+	options.capture_buffer_max = CAPTUREBUFFERMAX;
+	options.capture_stats = CAPTURESTATS;
+	strcpy(options.shared_state, SHAREDSTATE);
+	strcpy(options.control_socket, CONTROLSOCKET);
+	options.baseline_learning = BASELINELEARNING;
+	options.baseline_deviation = BASELINEDEVIATION;
+	options.scan_interval = SCANINTERVAL;
+	strcpy(options.forward, FORWARD);
+	options.forward_compress = 0;
+	options.forward_queue = FORWARDQUEUE;
+	strcpy(options.sensor_name, SENSORNAME);
+	strcpy(options.aggregate, AGGREGATE);
+	strcpy(options.journal, JOURNAL);
+	options.journal_flush = JOURNALFLUSH;
+	options.neighbour_check = 0;
+	strcpy(options.evidence, EVIDENCE);
+	options.evidence_frames = EVIDENCEFRAMES;
+	options.evidence_seconds = EVIDENCESECONDS;
+	options.evidence_filter = 1;
+	options.vlan_partitions = VLANPARTITIONS;
+	options.vlan_limit_count = 0;
+	clearpolicies();
+	options.shed_rate = SHEDRATE;
+	options.overload_batches = OVERLOADBATCHES;
+	options.overload_hold = OVERLOADHOLD;
+	options.dedup_window = DEDUPWINDOW;
+	options.correlate = CORRELATE;
+	options.request_timeout = REQUESTTIMEOUT;
+	options.dhcp_snoop = DHCPSNOOP;
+	options.dhcp_bindings = DHCPBINDINGS;
+	options.dhcp_server_count = 0;
 	return OK;
 }
 
@@ -83,7 +182,10 @@ int setdefaults(){
 int loadoptions(){
 	FILE *optsfile;
       	int result = OK;
+	char config_file[MAX_OPT_LENGTH];
+	strcpy(config_file, options.config_file); /* or -f would be forgotten */
 	setdefaults(); /* in case the opts file is being reloaded and a setting has been removed.  */     
+	strcpy(options.config_file, config_file);
 	if ((optsfile = fopen(options.config_file, "r")) == NULL){
 		bluealert("No options file detected - using defaults. This is probably not what you want!");
 		result = ERR_NOOPTSFILE;
@@ -165,6 +267,81 @@ int eatuseless(FILE *filename) {
 	return result;
 }
 
+/**
+ * Take a VlanTable line: "VLAN:records" or "VLAN:records:minutes", the VLAN
+ * written as parsevlan() reads it. A second line for the same VLAN replaces
+ * the first.
+ *
+ * \return OK, or ERR_INOPTS if it doesn't parse or there are too many.
+ */
+static int addvlanlimit(char *optval){
+	struct vlanlimit limit;
+	char *records, *timeout;
+	unsigned int lp;
+	records = strchr(optval, ':');
+	if (records == NULL)
+		return ERR_INOPTS;
+	*records++ = '\0';
+	timeout = strchr(records, ':');
+	if (timeout != NULL)
+		*timeout++ = '\0';
+	if (!parsevlan(optval, &limit.vlan))
+		return ERR_INOPTS;
+	limit.max_records = strtoul(records, NULL, 10);
+	if (limit.max_records < MINRECORDS)
+		limit.max_records = MINRECORDS;
+	limit.timeout = (timeout != NULL) ? 60 * atol(timeout) : 0; /* minutes, like Timeout */
+	if (limit.timeout < 0)
+		limit.timeout = 0;
+	for (lp = 0; (lp < options.vlan_limit_count) && (options.vlan_limits[lp].vlan != limit.vlan); lp++)
+		;
+	if (lp == VLAN_LIMITS)
+		return ERR_INOPTS;
+	options.vlan_limits[lp] = limit;
+	if (lp == options.vlan_limit_count)
+		options.vlan_limit_count++;
+	return OK;
+}
+
+/**
+ * Take a DhcpServer line: "address[,address][,vlan=VLAN]", each address
+ * either the server's IPv4 address or its MAC (or, with a relay, the relay's).
+ * Given both, a reply must come from both; with no vlan=, on any VLAN.
+ *
+ * \return OK, or ERR_INOPTS if it doesn't parse or there are too many.
+ */
+static int adddhcpserver(char *optval){
+	struct dhcpserver server;
+	unsigned int part[ETH_ALEN], lp;
+	char *setting, *next, extra;
+	if (options.dhcp_server_count == DHCP_SERVERS)
+		return ERR_INOPTS;
+	memset(&server, 0, sizeof(server));
+	server.anyvlan = 1;
+	for (next = optval; (setting = next) != NULL; ) {
+		next = strchr(setting, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (strncasecmp(setting, "vlan=", 5) == 0) {
+			if (!parsevlan(setting + 5, &server.vlan))
+				return ERR_INOPTS;
+			server.anyvlan = 0;
+		} else if (inet_pton(AF_INET, setting, server.ip_address) == 1) {
+			server.hasip = 1;
+		} else if (sscanf(setting, "%x:%x:%x:%x:%x:%x%c", &part[0], &part[1], &part[2],
+				  &part[3], &part[4], &part[5], &extra) == ETH_ALEN) {
+			for (lp = 0; lp < ETH_ALEN; lp++)
+				server.mac_address[lp] = part[lp];
+			server.hasmac = 1;
+		} else
+			return ERR_INOPTS;
+	}
+	if (!server.hasip && !server.hasmac)
+		return ERR_INOPTS;
+	options.dhcp_servers[options.dhcp_server_count++] = server;
+	return OK;
+}
+
 int setoption(char *optname, char *optval){
 	int result = OK;
 /**
@@ -204,6 +381,197 @@ int setoption(char *optname, char *optval){
 		options.badnet_threshold = atoi(optval);
 	} else if (strcasecmp(optname, "timeout") == 0) {
 		options.timeout = 60 * (atol(optval));
+	} else if (strcasecmp(optname, "maxrecords") == 0) {
+		options.max_records = strtoul(optval, NULL, 10);
+		if (options.max_records < MINRECORDS)
+			options.max_records = MINRECORDS;
+	} else if (strcasecmp(optname, "maxmemory") == 0) {
+		/* kilobytes, turned into however many records that buys. */
+		options.max_records = (1024 * strtoul(optval, NULL, 10)) / sizeof(struct ipdetails);
+		if (options.max_records < MINRECORDS)
+			options.max_records = MINRECORDS;
+	} else if (strcasecmp(optname, "sketchwindow") == 0) {
+		options.sketch_window = atol(optval);
+		if (options.sketch_window < 1)
+			options.sketch_window = 1;
+	} else if (strcasecmp(optname, "floodthreshold") == 0) {
+		options.flood_threshold = strtoul(optval, NULL, 10);
+	} else if (strcasecmp(optname, "sweepthreshold") == 0) {
+		options.sweep_threshold = strtoul(optval, NULL, 10);
+	} else if (strcasecmp(optname, "scanthreshold") == 0) {
+		options.scan_threshold = strtoul(optval, NULL, 10);
+	} else if (strcasecmp(optname, "eventlog") == 0) {
+		memset(options.event_log, '\0', sizeof(options.event_log));
+		strcpy(options.event_log, optval);
+	} else if (strcasecmp(optname, "eventlogflush") == 0) {
+		options.event_log_flush = atol(optval);
+	} else if (strcasecmp(optname, "eventlogsize") == 0) {
+		/* kilobytes */
+		options.event_log_size = 1024 * (off_t)atol(optval);
+	} else if (strcasecmp(optname, "eventlogkeep") == 0) {
+		options.event_log_keep = atoi(optval);
+	} else if (strcasecmp(optname, "remotesyslog") == 0) {
+		memset(options.remote_syslog, '\0', sizeof(options.remote_syslog));
+		strcpy(options.remote_syslog, optval);
+	} else if (strcasecmp(optname, "remotesyslogport") == 0) {
+		options.remote_syslog_port = (unsigned int)atoi(optval);
+	} else if (strcasecmp(optname, "remotesyslogprotocol") == 0) {
+		if (strcasecmp(optval, "tcp") == 0){
+			options.remote_syslog_tcp = 1;
+		}else if (strcasecmp(optval, "udp") == 0){
+			options.remote_syslog_tcp = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "remotesyslogbatch") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.remote_syslog_batch = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.remote_syslog_batch = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "remotesyslogqueue") == 0) {
+		options.remote_syslog_queue = (unsigned int)atoi(optval);
+		if (options.remote_syslog_queue < 1)
+			options.remote_syslog_queue = 1;
+	} else if (strcasecmp(optname, "emaildigest") == 0) {
+		/* minutes, like timeout */
+		options.email_digest = 60 * atol(optval);
+	} else if (strcasecmp(optname, "emaildigestmax") == 0) {
+		options.email_digest_max = strtoul(optval, NULL, 10);
+		if (options.email_digest_max < 1)
+			options.email_digest_max = 1;
+	} else if (strcasecmp(optname, "emaildigestimmediate") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.email_digest_immediate = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.email_digest_immediate = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "capturebuffer") == 0) {
+		/* kilobytes */
+		options.capture_buffer = 1024 * atoi(optval);
+		if (options.capture_buffer_max < options.capture_buffer)
+			options.capture_buffer_max = options.capture_buffer;
+	} else if (strcasecmp(optname, "capturebuffermax") == 0) {
+		/* kilobytes */
+		options.capture_buffer_max = 1024 * atoi(optval);
+		if (options.capture_buffer_max < options.capture_buffer)
+			options.capture_buffer_max = options.capture_buffer;
+	} else if (strcasecmp(optname, "capturestats") == 0) {
+		options.capture_stats = atol(optval);
+	} else if (strcasecmp(optname, "sharedstate") == 0) {
+		memset(options.shared_state, '\0', sizeof(options.shared_state));
+		strcpy(options.shared_state, optval);
+	} else if (strcasecmp(optname, "controlsocket") == 0) {
+		memset(options.control_socket, '\0', sizeof(options.control_socket));
+		strcpy(options.control_socket, optval);
+	} else if (strcasecmp(optname, "baselinelearning") == 0) {
+		/* minutes, like timeout */
+		options.baseline_learning = 60 * atol(optval);
+	} else if (strcasecmp(optname, "baselinedeviation") == 0) {
+		options.baseline_deviation = atof(optval);
+		if (options.baseline_deviation < 1)
+			options.baseline_deviation = 1;
+	} else if (strcasecmp(optname, "scaninterval") == 0) {
+		options.scan_interval = atol(optval);
+		if (options.scan_interval < 1)
+			options.scan_interval = 1;
+	} else if (strcasecmp(optname, "forward") == 0) {
+		memset(options.forward, '\0', sizeof(options.forward));
+		strcpy(options.forward, optval);
+	} else if (strcasecmp(optname, "forwardcompress") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.forward_compress = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.forward_compress = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "forwardqueue") == 0) {
+		/* kilobytes */
+		options.forward_queue = 1024 * strtoul(optval, NULL, 10);
+		if (options.forward_queue < 2 * FORWARD_MAXBATCH)
+			options.forward_queue = 2 * FORWARD_MAXBATCH;
+	} else if (strcasecmp(optname, "sensorname") == 0) {
+		memset(options.sensor_name, '\0', sizeof(options.sensor_name));
+		strcpy(options.sensor_name, optval);
+	} else if (strcasecmp(optname, "aggregate") == 0) {
+		memset(options.aggregate, '\0', sizeof(options.aggregate));
+		strcpy(options.aggregate, optval);
+	} else if (strcasecmp(optname, "journal") == 0) {
+		memset(options.journal, '\0', sizeof(options.journal));
+		strcpy(options.journal, optval);
+	} else if (strcasecmp(optname, "journalflush") == 0) {
+		options.journal_flush = atol(optval);
+		if (options.journal_flush < 1)
+			options.journal_flush = 1;
+	} else if (strcasecmp(optname, "neighbourcheck") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.neighbour_check = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.neighbour_check = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "evidence") == 0) {
+		memset(options.evidence, '\0', sizeof(options.evidence));
+		strcpy(options.evidence, optval);
+	} else if (strcasecmp(optname, "evidenceframes") == 0) {
+		options.evidence_frames = strtoul(optval, NULL, 10);
+		if (options.evidence_frames < 1024)
+			options.evidence_frames = 1024;
+	} else if (strcasecmp(optname, "evidenceseconds") == 0) {
+		options.evidence_seconds = atol(optval);
+		if (options.evidence_seconds < 1)
+			options.evidence_seconds = 1;
+	} else if (strcasecmp(optname, "evidencefilter") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.evidence_filter = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.evidence_filter = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "vlanpartitions") == 0) {
+		options.vlan_partitions = strtoul(optval, NULL, 10);
+		if (options.vlan_partitions < 1)
+			options.vlan_partitions = 1;
+	} else if (strcasecmp(optname, "vlantable") == 0) {
+		result = addvlanlimit(optval);
+	} else if (strcasecmp(optname, "policy") == 0) {
+		result = addpolicy(optval);
+	} else if (strcasecmp(optname, "shedrate") == 0) {
+		options.shed_rate = strtoul(optval, NULL, 10);
+		if (options.shed_rate < 1)
+			options.shed_rate = 1;
+	} else if (strcasecmp(optname, "overloadbatches") == 0) {
+		options.overload_batches = strtoul(optval, NULL, 10);
+	} else if (strcasecmp(optname, "overloadhold") == 0) {
+		options.overload_hold = atol(optval);
+		if (options.overload_hold < 1)
+			options.overload_hold = 1;
+	} else if (strcasecmp(optname, "dedupwindow") == 0) {
+		options.dedup_window = atol(optval);
+	} else if (strcasecmp(optname, "correlate") == 0) {
+		options.correlate = strtoul(optval, NULL, 10);
+		if (options.correlate > 0x7fffffff)
+			options.correlate = 0x7fffffff;
+	} else if (strcasecmp(optname, "requesttimeout") == 0) {
+		options.request_timeout = atol(optval);
+		if (options.request_timeout < 1)
+			options.request_timeout = 1;
+	} else if (strcasecmp(optname, "dhcpsnoop") == 0) {
+		if (strcasecmp(optval, "yes") == 0){
+			options.dhcp_snoop = 1;
+		}else if (strcasecmp(optval, "no") == 0){
+			options.dhcp_snoop = 0;
+		} else
+			result = ERR_INOPTS;
+	} else if (strcasecmp(optname, "dhcpbindings") == 0) {
+		options.dhcp_bindings = strtoul(optval, NULL, 10);
+		if (options.dhcp_bindings < 1)
+			options.dhcp_bindings = 1;
+		if (options.dhcp_bindings > 0x7fffffff)
+			options.dhcp_bindings = 0x7fffffff;
+	} else if (strcasecmp(optname, "dhcpserver") == 0) {
+		result = adddhcpserver(optval);
 	}
 	return result;
 }
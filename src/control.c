@@ -0,0 +1,480 @@
+/* -*- project-c -*- */
+/**
+ * \file control.c
+ * \brief A Unix domain control socket for asking about the IP table.
+ *
+ * During an incident nobody wants to wait for DETAILS.csv to be rewritten to
+ * find out what MAC 10.0.0.1 has right now. With options.control_socket set,
+ * antidote listens on a Unix domain socket of that name and answers one
+ * command per line:
+ *
+ * - lookup IP       - the record for an IP address, IPv4 or IPv6 (one per
+ *                     VLAN it's in)
+ * - lookup MAC      - every record claiming a MAC (written aa:bb:cc:dd:ee:ff)
+ * - latency IP      - how long the address has taken to answer requests, as
+ *                     a histogram (see correlate.c)
+ * - top [N]         - the N records (default CONTROL_TOP) with the largest
+ *                     imbalance between replies and requests, as checknetarps()
+ *                     sees it
+ * - dump            - every record
+ * - reset IP [VLAN] - zero the counts for an IP and restart its timer, in
+ *                     one VLAN (written 100, or 100.20 for QinQ) or in all
+ * - status          - how many records there are and have been evicted,
+ *                     whether ARP requests are being shed (see overload.c),
+ *                     how many duplicate frames were ignored (dedup.c),
+ *                     how requests and replies have matched (correlate.c),
+ *                     and what DHCP snooping has learned (dhcp.c)
+ * - help, quit
+ *
+ * Each answer comes from a snapshot: the fields we show are copied out of the
+ * table in one go, between frames, so it's consistent with itself and nothing
+ * in the table is locked or held while the client reads. Only the copy happens
+ * inside the event loop's turn; the snapshot is turned into text a buffer at a
+ * time as the client's socket has room, so a slow client, or a dump of a huge
+ * table, never holds up capture. Replies end with a line holding a single ".".
+ * Records from tagged frames say which VLAN they're in.
+ *
+ * Everything is non-blocking and serviced by servicecontrol(), which the event
+ * loop calls whenever any of our descriptors is ready (and every tick, where
+ * there's no epoll).
+ */
+
+#include "antidote.h"
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdarg.h>
+
+#define CONTROL_LINE 256 /* longest command */
+#define CONTROL_OUTSIZE 16384
+#define CONTROL_MAXREPLY 320 /* longest line of any reply */
+#define CONTROL_TOP 10
+
+/**
+ * What we keep of a record in a snapshot.
+ */
+struct snapshotrecord {
+	u_int8_t ip_address[IP_KEYSIZE];
+	int family;
+	u_int8_t mac_address[ETH_ALEN];
+	unsigned int requests;
+	unsigned int replies;
+	unsigned int unsolicited, timedout;
+	unsigned int latency[LATENCY_BUCKETS];
+	long lastreset;
+	u_int32_t vlan;
+};
+
+struct controlclient {
+	int fd; /* -1 if this entry's free */
+	unsigned int serial; /* tells apart clients which reuse a descriptor */
+	char in[CONTROL_LINE];
+	size_t inlen;
+	char out[CONTROL_OUTSIZE];
+	size_t outlen, outsent;
+	struct snapshotrecord *snapshot; /* still to be written out, or NULL */
+	unsigned long snapcount, snapnext;
+	int latency; /* write the snapshot as latency histograms */
+	int closing; /* hang up once the output has gone */
+};
+
+static int listenfd = -1;
+static struct controlclient clients[CONTROL_CLIENTS];
+static unsigned int serials = 0;
+
+/**
+ * Remove the socket file on the way out.
+ */
+static void closecontrol(){
+	int lp;
+	for (lp = 0; lp < CONTROL_CLIENTS; lp++) {
+		if (clients[lp].fd != -1)
+			close(clients[lp].fd);
+		clients[lp].fd = -1;
+	}
+	if (listenfd != -1) {
+		close(listenfd);
+		unlink(options.control_socket);
+	}
+	listenfd = -1;
+}
+
+/**
+ * Start listening on options.control_socket.
+ *
+ * RETURN VALUES:
+ * \return OK - Listening, or no control socket was asked for.
+ * \return ERR_CONTROLSOCKET
+ */
+int opencontrol(){
+	struct sockaddr_un address;
+	mode_t oldmask;
+	int lp, result;
+	for (lp = 0; lp < CONTROL_CLIENTS; lp++)
+		clients[lp].fd = -1;
+	if (options.control_socket[0] == '\0')
+		return OK;
+	if (strlen(options.control_socket) >= sizeof(address.sun_path))
+		return ERR_CONTROLSOCKET;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, options.control_socket);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenfd == -1)
+		return ERR_CONTROLSOCKET;
+	unlink(options.control_socket); /* left over from last time */
+	/* the table's nobody else's business: owner only */
+	oldmask = umask(0177);
+	result = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
+	umask(oldmask);
+	if ((result == -1) || (listen(listenfd, CONTROL_CLIENTS) == -1)) {
+		close(listenfd);
+		listenfd = -1;
+		return ERR_CONTROLSOCKET;
+	}
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+	atexit(closecontrol);
+	return OK;
+}
+
+/**
+ * Copy every record (or just those matching ip, of the given family, or mac,
+ * if not NULL) out of the table, every VLAN's partition of it.
+ * \return The number copied; *result is NULL if there were none (or no memory).
+ */
+static unsigned long snapshottable(struct snapshotrecord **result, const u_int8_t *ip, int family, const u_int8_t *mac){
+	struct ipdetails *current;
+	struct snapshotrecord *snapshot;
+	unsigned long count = 0, size;
+	*result = NULL;
+	size = recordcount();
+	if (size == 0)
+		return 0;
+	snapshot = malloc(size * sizeof(struct snapshotrecord));
+	if (snapshot == NULL)
+		return 0;
+	for (current = readfirst(); (current != NULL) && (count < size); current = readnext(current)) {
+		if ((ip != NULL) && ((current->partition->family != family) || (memcmp(current->ip_address, ip, IP_KEYSIZE) != 0)))
+			continue;
+		if ((mac != NULL) && (memcmp(current->mac_address, mac, ETH_ALEN) != 0))
+			continue;
+		memcpy(snapshot[count].ip_address, current->ip_address, IP_KEYSIZE);
+		snapshot[count].family = current->partition->family;
+		memcpy(snapshot[count].mac_address, current->mac_address, ETH_ALEN);
+		snapshot[count].requests = current->requests;
+		snapshot[count].replies = current->replies;
+		snapshot[count].unsolicited = current->unsolicited;
+		snapshot[count].timedout = current->timedout;
+		memcpy(snapshot[count].latency, current->latency, sizeof(current->latency));
+		snapshot[count].lastreset = current->lastreset;
+		snapshot[count].vlan = current->partition->vlan;
+		count++;
+	}
+	if (count == 0) {
+		free(snapshot);
+		return 0;
+	}
+	*result = snapshot;
+	return count;
+}
+
+static int snapshotnet(const struct snapshotrecord *record){
+	return (int)record->replies - (int)record->requests;
+}
+
+/* biggest imbalance, either way, first */
+static int byimbalance(const void *first, const void *second){
+	int a = abs(snapshotnet(first)), b = abs(snapshotnet(second));
+	return (a < b) - (a > b);
+}
+
+/**
+ * Add to a client's output. Anything that won't fit is dropped, so callers
+ * make sure there's room first.
+ */
+static void reply(struct controlclient *client, const char *format, ...){
+	va_list args;
+	int length;
+	va_start(args, format);
+	length = vsnprintf(client->out + client->outlen, CONTROL_OUTSIZE - client->outlen, format, args);
+	va_end(args);
+	if (length > 0)
+		client->outlen += ((size_t)length < CONTROL_OUTSIZE - client->outlen) ? (size_t)length : CONTROL_OUTSIZE - client->outlen - 1;
+}
+
+/**
+ * Turn as much of a client's snapshot into text as will fit in its buffer.
+ */
+static void fillreply(struct controlclient *client){
+	struct snapshotrecord *record;
+	char vlan[VLAN_NAMESIZE], address[IP_NAMESIZE];
+	long now;
+	int lp;
+	if (client->snapshot == NULL)
+		return;
+	now = time(NULL);
+	while ((client->snapnext < client->snapcount) && (CONTROL_OUTSIZE - client->outlen > CONTROL_MAXREPLY)) {
+		record = &client->snapshot[client->snapnext++];
+		if (client->latency) {
+			/* the buckets are under 1ms, then doubling; the last has no top */
+			reply(client, "%s", formatip(record->ip_address, record->family, address));
+			for (lp = 0; lp < LATENCY_BUCKETS - 1; lp++)
+				reply(client, " <%dms %u", 1 << lp, record->latency[lp]);
+			reply(client, " more %u timedout %u", record->latency[LATENCY_BUCKETS - 1], record->timedout);
+		} else {
+			reply(client, "%s %02x:%02x:%02x:%02x:%02x:%02x requests %u replies %u net %d age %ld",
+			      formatip(record->ip_address, record->family, address),
+			      record->mac_address[0], record->mac_address[1], record->mac_address[2],
+			      record->mac_address[3], record->mac_address[4], record->mac_address[5],
+			      record->requests, record->replies, snapshotnet(record), now - record->lastreset);
+			if (options.correlate > 0)
+				reply(client, " unsolicited %u timedout %u", record->unsolicited, record->timedout);
+		}
+		if (record->vlan != 0)
+			reply(client, " vlan %s", formatvlan(record->vlan, vlan));
+		reply(client, "\n");
+	}
+	if ((client->snapnext == client->snapcount) && (CONTROL_OUTSIZE - client->outlen > 2)) {
+		reply(client, ".\n");
+		free(client->snapshot);
+		client->snapshot = NULL;
+	}
+}
+
+/**
+ * Parse aa:bb:cc:dd:ee:ff.
+ * \return 1 if it's a MAC, 0 if not.
+ */
+static int parsemac(const char *text, u_int8_t *mac){
+	unsigned int part[ETH_ALEN];
+	char extra;
+	int lp;
+	if (sscanf(text, "%x:%x:%x:%x:%x:%x%c", &part[0], &part[1], &part[2], &part[3], &part[4], &part[5], &extra) != ETH_ALEN)
+		return 0;
+	for (lp = 0; lp < ETH_ALEN; lp++) {
+		if (part[lp] > 0xff)
+			return 0;
+		mac[lp] = part[lp];
+	}
+	return 1;
+}
+
+/**
+ * Carry out one command line.
+ */
+static void runcommand(struct controlclient *client, char *line){
+	char *command, *argument, *extra;
+	u_int8_t address[IP_KEYSIZE];
+	int family;
+	struct ipdetails *record;
+	struct partition *table;
+	u_int8_t mac[ETH_ALEN];
+	u_int32_t vlan = 0;
+	long count;
+	unsigned long waiting, replied, expired, unasked, dropped;
+	unsigned long leases, acked, ended, mismatched, rogue, rebound;
+	command = strtok(line, " \t\r");
+	argument = strtok(NULL, " \t\r");
+	extra = strtok(NULL, " \t\r");
+	if (command == NULL)
+		return;
+	client->latency = 0;
+	if (strcasecmp(command, "lookup") == 0) {
+		if ((argument != NULL) && parseip(argument, address, &family))
+			client->snapcount = snapshottable(&client->snapshot, address, family, NULL);
+		else if ((argument != NULL) && parsemac(argument, mac))
+			client->snapcount = snapshottable(&client->snapshot, NULL, 0, mac);
+		else {
+			reply(client, "error: lookup needs an IP address or a MAC\n.\n");
+			return;
+		}
+		if (client->snapshot == NULL)
+			reply(client, "not found\n.\n");
+	} else if (strcasecmp(command, "latency") == 0) {
+		if ((argument == NULL) || !parseip(argument, address, &family)) {
+			reply(client, "error: latency needs an IP address\n.\n");
+			return;
+		}
+		client->snapcount = snapshottable(&client->snapshot, address, family, NULL);
+		if (client->snapshot == NULL)
+			reply(client, "not found\n.\n");
+		client->latency = 1;
+	} else if (strcasecmp(command, "top") == 0) {
+		count = (argument != NULL) ? atol(argument) : CONTROL_TOP;
+		client->snapcount = snapshottable(&client->snapshot, NULL, 0, NULL);
+		if (client->snapshot == NULL) {
+			reply(client, ".\n");
+			return;
+		}
+		qsort(client->snapshot, client->snapcount, sizeof(struct snapshotrecord), byimbalance);
+		if ((count > 0) && ((unsigned long)count < client->snapcount))
+			client->snapcount = count;
+	} else if (strcasecmp(command, "dump") == 0) {
+		client->snapcount = snapshottable(&client->snapshot, NULL, 0, NULL);
+		if (client->snapshot == NULL)
+			reply(client, ".\n");
+	} else if (strcasecmp(command, "reset") == 0) {
+		if ((argument == NULL) || !parseip(argument, address, &family)
+				|| ((extra != NULL) && !parsevlan(extra, &vlan))) {
+			reply(client, "error: reset needs an IP address, and maybe a VLAN\n.\n");
+			return;
+		}
+		count = 0;
+		for (table = firstpartition(); table != NULL; table = table->next) {
+			if ((table->family != family) || ((extra != NULL) && (table->vlan != vlan)))
+				continue;
+			record = checkip(table, address);
+			if (record == NULL)
+				continue;
+			blanknetarps(record);
+			resettimer(record);
+			/* and whatever MAC it has now is its own - see neighbour.c */
+			sharedbeginwrite(&record->sequence);
+			memset(record->prior_mac, 0, ETH_ALEN);
+			sharedendwrite(&record->sequence);
+			publiship(record);
+			count++;
+		}
+		if (count == 0)
+			reply(client, "not found\n.\n");
+		else
+			reply(client, "ok\n.\n");
+	} else if (strcasecmp(command, "status") == 0) {
+		correlatestats(&waiting, &replied, &expired, &unasked, &dropped);
+		dhcpstats(&leases, &acked, &ended, &mismatched, &rogue, &rebound);
+		reply(client, "records %lu evicted %lu\noverloaded %s shedrate %u shed %lu sampled %lu overloads %lu\nduplicates %lu\n"
+		      "outstanding %lu answered %lu timedout %lu unsolicited %lu overflowed %lu\n"
+		      "leases %lu acks %lu ended %lu mismatched %lu rogue %lu rebound %lu\n.\n",
+		      recordcount(), evictioncount(), overloadstate() ? "yes" : "no", options.shed_rate,
+		      shedcount(), sampledcount(), overloadcount(), duplicatecount(),
+		      waiting, replied, expired, unasked, dropped, leases, acked, ended, mismatched, rogue, rebound);
+	} else if (strcasecmp(command, "help") == 0) {
+		reply(client, "lookup IP|MAC\nlatency IP\ntop [N]\ndump\nreset IP [VLAN]\nstatus\nquit\n.\n");
+	} else if (strcasecmp(command, "quit") == 0) {
+		client->closing = 1;
+	} else {
+		reply(client, "error: unknown command (try help)\n.\n");
+	}
+	client->snapnext = 0;
+	fillreply(client);
+}
+
+static void dropclient(struct controlclient *client){
+	close(client->fd);
+	client->fd = -1;
+	free(client->snapshot);
+	client->snapshot = NULL;
+}
+
+/**
+ * Send what we can to a client, and read a command if it's waiting for one.
+ */
+static void serviceclient(struct controlclient *client){
+	ssize_t done;
+	char *end;
+	/* output first: a client gets its whole answer before we read the next command */
+	while (client->outsent < client->outlen) {
+		done = send(client->fd, client->out + client->outsent, client->outlen - client->outsent, MSG_NOSIGNAL);
+		if (done < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return;
+			dropclient(client);
+			return;
+		}
+		client->outsent += done;
+		if (client->outsent == client->outlen) {
+			client->outlen = client->outsent = 0;
+			fillreply(client);
+		}
+	}
+	if (client->closing) {
+		dropclient(client);
+		return;
+	}
+	for (;;) {
+		end = memchr(client->in, '\n', client->inlen);
+		if (end != NULL) {
+			*end = '\0';
+			runcommand(client, client->in);
+			client->inlen -= (end + 1 - client->in);
+			memmove(client->in, end + 1, client->inlen);
+			if ((client->outlen > 0) || client->closing) {
+				serviceclient(client);
+				return;
+			}
+			continue;
+		}
+		if (client->inlen == CONTROL_LINE) {
+			dropclient(client); /* that's not a command */
+			return;
+		}
+		done = recv(client->fd, client->in + client->inlen, CONTROL_LINE - client->inlen, 0);
+		if (done == 0) {
+			dropclient(client);
+			return;
+		} else if (done < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+				dropclient(client);
+			return;
+		}
+		client->inlen += done;
+	}
+}
+
+/**
+ * Accept anyone waiting, and see to every client. Never blocks.
+ */
+void servicecontrol(){
+	struct controlclient *client;
+	int fd, lp;
+	if (listenfd == -1)
+		return;
+	while ((fd = accept(listenfd, NULL, NULL)) != -1) {
+		for (lp = 0; (lp < CONTROL_CLIENTS) && (clients[lp].fd != -1); lp++)
+			;
+		if (lp == CONTROL_CLIENTS) {
+			close(fd); /* busy - try again later */
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		client = &clients[lp];
+		client->fd = fd;
+		client->serial = ++serials;
+		client->inlen = client->outlen = client->outsent = 0;
+		client->snapshot = NULL;
+		client->closing = 0;
+	}
+	for (lp = 0; lp < CONTROL_CLIENTS; lp++) {
+		if (clients[lp].fd != -1)
+			serviceclient(&clients[lp]);
+	}
+}
+
+/**
+ * List the descriptors the event loop should watch for us.
+ *
+ * ARGUMENTS:
+ * \arg \c *fds - Filled in with up to max descriptors.
+ * \arg \c *serial - Filled in with something which changes whenever a
+ * descriptor number is reused for a different client.
+ * \arg \c *writing - Filled in with non-zero for descriptors with output waiting.
+ * \arg \c max - Room in each array; CONTROL_CLIENTS + 1 is always enough.
+ *
+ * \return The number of descriptors.
+ */
+int controlfds(int *fds, unsigned int *serial, int *writing, int max){
+	int lp, count = 0;
+	if ((listenfd == -1) || (max < 1))
+		return 0;
+	fds[count] = listenfd;
+	serial[count] = 0;
+	writing[count++] = 0;
+	for (lp = 0; (lp < CONTROL_CLIENTS) && (count < max); lp++) {
+		if (clients[lp].fd == -1)
+			continue;
+		fds[count] = clients[lp].fd;
+		serial[count] = clients[lp].serial;
+		writing[count++] = (clients[lp].outsent < clients[lp].outlen);
+	}
+	return count;
+}
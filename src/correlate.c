@@ -0,0 +1,285 @@
+/* -*- project-c -*- */
+/**
+ * \file correlate.c
+ * \brief Matching each reply to the request it answers.
+ *
+ * checknetarps() only has replies minus requests to go on, so a host that's
+ * sent ten replies nobody asked for, and been sent ten requests it never
+ * answered, looks perfectly healthy - and nothing says how long anyone waits
+ * for an answer. With options.correlate set, every request waits in a table of
+ * outstanding requests, keyed on who asked (the requester's address), what
+ * for (the target's) and the VLAN and family, until either:
+ *
+ * - a reply from the target to the requester matches it, and how long it took
+ *   goes into the target's latency histogram; or
+ * - options.request_timeout seconds pass, and it's counted against the target
+ *   as timed out.
+ *
+ * A reply that matches nothing outstanding is counted against its sender as
+ * unsolicited. Both counts are exact, and processip() judges poisoners and bad
+ * networks on them instead of on the difference (see antidote.c).
+ *
+ * Some frames aren't part of a conversation and are left out: ARP probes and
+ * duplicate address detection (no requester address), and gratuitous ARP and
+ * unsolicited neighbour advertisements (sent to themselves, or to a multicast
+ * group). A request asked again before it's answered keeps its first time, so
+ * latency is how long the asker actually waited.
+ *
+ * Requests all wait the same time, so the order they arrive in is the order
+ * they expire in: the table is a ring of options.correlate entries, oldest at
+ * the tail, and every tick expirerequests() takes whatever's timed out off the
+ * tail. A chained hash on the key finds the entry a reply answers; an answered
+ * entry is taken out of its chain at once and skipped when the tail reaches
+ * it. Nothing is allocated after opencorrelate(), so memory is bounded.
+ *
+ * If the ring fills, its oldest entry is dropped before it's timed out, and
+ * then for options.request_timeout seconds a reply we can't match might have
+ * been answering it - so it isn't counted as unsolicited.
+ */
+
+#include "antidote.h"
+
+#define CORRELATE_SEED 0x7f4a7c15U
+#define CORRELATE_NONE 0xffffffffU
+
+struct pending {
+	u_int8_t target[IP_KEYSIZE];
+	u_int8_t requester[IP_KEYSIZE];
+	u_int32_t vlan;
+	u_int16_t family;
+	u_int8_t live; /* still waiting for its reply */
+	u_int32_t chain; /* next in its bucket, or CORRELATE_NONE */
+	u_int64_t when; /* microseconds */
+};
+
+static struct pending *ring = NULL;
+static u_int32_t *buckets = NULL;
+static u_int32_t bucketmask = 0;
+static unsigned long capacity = 0, tail = 0, count = 0, outstanding = 0;
+static u_int64_t uncertain = 0; /* replies can't be called unsolicited until then */
+static unsigned long answered = 0, timedout = 0, unsolicited = 0, overflowed = 0;
+
+/**
+ * Make the table of outstanding requests.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or we're not correlating.
+ * \return ERR_NOMEM
+ */
+int opencorrelate(){
+	unsigned long size = 1;
+	if (options.correlate == 0)
+		return OK;
+	while (size < options.correlate)
+		size <<= 1;
+	ring = calloc(options.correlate, sizeof(struct pending));
+	buckets = malloc(size * sizeof(u_int32_t));
+	if ((ring == NULL) || (buckets == NULL)) {
+		free(ring);
+		free(buckets);
+		ring = NULL;
+		buckets = NULL;
+		options.correlate = 0; /* so the counts are judged the old way */
+		return ERR_NOMEM;
+	}
+	memset(buckets, 0xff, size * sizeof(u_int32_t));
+	bucketmask = size - 1;
+	capacity = options.correlate;
+	tail = count = 0;
+	return OK;
+}
+
+static u_int32_t bucketof(const u_int8_t *requester, const u_int8_t *target, u_int32_t vlan, int family){
+	return hashbytes(target, IP_KEYSIZE, hashbytes(requester, IP_KEYSIZE, CORRELATE_SEED ^ vlan ^ family)) & bucketmask;
+}
+
+/**
+ * Find an outstanding request.
+ * \return Its index in the ring, or CORRELATE_NONE.
+ */
+static u_int32_t findpending(const u_int8_t *requester, const u_int8_t *target, u_int32_t vlan, int family){
+	u_int32_t index;
+	struct pending *entry;
+	for (index = buckets[bucketof(requester, target, vlan, family)]; index != CORRELATE_NONE; index = entry->chain) {
+		entry = &ring[index];
+		if ((entry->vlan == vlan) && (entry->family == family)
+				&& (memcmp(entry->target, target, IP_KEYSIZE) == 0)
+				&& (memcmp(entry->requester, requester, IP_KEYSIZE) == 0))
+			return index;
+	}
+	return CORRELATE_NONE;
+}
+
+/**
+ * Take an entry out of its bucket's chain, and mark it done.
+ */
+static void unlinkpending(u_int32_t index){
+	struct pending *entry = &ring[index];
+	u_int32_t *link;
+	link = &buckets[bucketof(entry->requester, entry->target, entry->vlan, entry->family)];
+	while ((*link != CORRELATE_NONE) && (*link != index))
+		link = &ring[*link].chain;
+	if (*link == index)
+		*link = entry->chain;
+	entry->live = 0;
+	outstanding--;
+}
+
+/**
+ * Count a request which went unanswered against its target.
+ */
+static void requesttimedout(const struct pending *entry){
+	struct ipdetails *ip;
+	timedout++;
+	ip = checkip(findpartition(entry->vlan, entry->family, 0), entry->target);
+	if (ip == NULL)
+		return; /* evicted since, or never kept */
+	sharedbeginwrite(&ip->sequence);
+	ip->timedout++;
+	sharedendwrite(&ip->sequence);
+}
+
+/**
+ * \return Non-zero if an address is nobody in particular: all zeroes (a probe,
+ * or duplicate address detection) or, for IPv6, a multicast group.
+ */
+static int anonymous(const u_int8_t *address, int family){
+	if ((family == AF_INET6) && (address[0] == 0xff))
+		return 1;
+	return sumbytes((u_int8_t *)address, IP_KEYSIZE) == 0;
+}
+
+/**
+ * Note a request, to be matched with its reply.
+ *
+ * ARGUMENTS:
+ * \arg \c *seen - What the frame says.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ */
+void correlaterequest(const struct observation *seen, u_int32_t vlan){
+	struct pending *entry, *oldest;
+	u_int32_t bucket;
+	unsigned long index;
+	if ((ring == NULL) || anonymous(seen->other, seen->family)
+			|| (memcmp(seen->key, seen->other, IP_KEYSIZE) == 0))
+		return;
+	if (findpending(seen->other, seen->key, vlan, seen->family) != CORRELATE_NONE)
+		return; /* asked again: the first time is when the wait began */
+	if (count == capacity) {
+		oldest = &ring[tail];
+		if (oldest->live) {
+			unlinkpending(tail);
+			overflowed++;
+			uncertain = seen->when + (u_int64_t)options.request_timeout * 1000000;
+		}
+		tail = (tail + 1) % capacity;
+		count--;
+	}
+	index = (tail + count) % capacity;
+	entry = &ring[index];
+	memcpy(entry->target, seen->key, IP_KEYSIZE);
+	memcpy(entry->requester, seen->other, IP_KEYSIZE);
+	entry->vlan = vlan;
+	entry->family = seen->family;
+	entry->when = seen->when;
+	entry->live = 1;
+	bucket = bucketof(entry->requester, entry->target, vlan, seen->family);
+	entry->chain = buckets[bucket];
+	buckets[bucket] = index;
+	count++;
+	outstanding++;
+}
+
+/**
+ * Match a reply with the request it answers.
+ *
+ * ARGUMENTS:
+ * \arg \c *seen - What the frame says.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ *
+ * RETURN VALUES:
+ * \return Microseconds since the request, if it answers one.
+ * \return CORRELATE_UNSOLICITED - It answers nothing we saw asked.
+ * \return CORRELATE_UNKNOWN - We're not correlating, it's an announcement
+ * rather than an answer, or we can't be sure.
+ */
+long correlatereply(const struct observation *seen, u_int32_t vlan){
+	u_int32_t index;
+	struct pending *entry;
+	if ((ring == NULL) || anonymous(seen->other, seen->family)
+			|| (memcmp(seen->key, seen->other, IP_KEYSIZE) == 0))
+		return CORRELATE_UNKNOWN;
+	index = findpending(seen->other, seen->key, vlan, seen->family);
+	if (index == CORRELATE_NONE) {
+		if (seen->when < uncertain)
+			return CORRELATE_UNKNOWN;
+		unsolicited++;
+		return CORRELATE_UNSOLICITED;
+	}
+	entry = &ring[index];
+	unlinkpending(index);
+	answered++;
+	return (seen->when > entry->when) ? (long)(seen->when - entry->when) : 0;
+}
+
+/**
+ * Count what a reply turned out to be against its sender's record: its
+ * latency, or that it was unsolicited.
+ *
+ * ARGUMENTS:
+ * \arg \c *ip - The sender's record.
+ * \arg \c latency - As correlatereply() gave it.
+ */
+void correlaterecord(struct ipdetails *ip, long latency){
+	int bucket;
+	long limit;
+	if ((ip == NULL) || (latency == CORRELATE_UNKNOWN))
+		return;
+	sharedbeginwrite(&ip->sequence);
+	if (latency == CORRELATE_UNSOLICITED) {
+		ip->unsolicited++;
+	} else {
+		/* under a millisecond, then doubling */
+		for (bucket = 0, limit = 1000; (bucket < LATENCY_BUCKETS - 1) && (latency >= limit); bucket++)
+			limit <<= 1;
+		ip->latency[bucket]++;
+	}
+	sharedendwrite(&ip->sequence);
+}
+
+/**
+ * Count every request which has waited options.request_timeout seconds as
+ * timed out. Called every tick.
+ */
+void expirerequests(){
+	struct timeval now;
+	u_int64_t cutoff;
+	struct pending *entry;
+	if (ring == NULL)
+		return;
+	gettimeofday(&now, NULL);
+	cutoff = (u_int64_t)now.tv_sec * 1000000 + now.tv_usec - (u_int64_t)options.request_timeout * 1000000;
+	while (count > 0) {
+		entry = &ring[tail];
+		if (entry->live) {
+			if (entry->when > cutoff)
+				break;
+			unlinkpending(tail);
+			requesttimedout(entry);
+		}
+		tail = (tail + 1) % capacity;
+		count--;
+	}
+}
+
+/**
+ * Fill in what the control socket's status command says about correlation.
+ */
+void correlatestats(unsigned long *waiting, unsigned long *replied, unsigned long *expired,
+		    unsigned long *unasked, unsigned long *dropped){
+	*waiting = outstanding;
+	*replied = answered;
+	*expired = timedout;
+	*unasked = unsolicited;
+	*dropped = overflowed;
+}
@@ -0,0 +1,129 @@
+/* -*- project-c -*- */
+/**
+ * \file dedup.c
+ * \brief Frames we've just seen, so mirrored copies are only counted once.
+ *
+ * Mirror the uplink and the access ports to the same capture interface and
+ * every ARP frame between them arrives twice, or three times - once as it
+ * came in, once as it went out, maybe once more tagged on a trunk. Each copy
+ * would be counted by addrequest() or addreply(), skewing checknetarps() and
+ * costing as much as a real frame. So before anything else looks at a frame,
+ * duplicateframe() asks whether the same frame went past within the last
+ * options.dedup_window milliseconds, and if it did the frame goes nowhere -
+ * not the detector, the journal, the aggregator or the evidence ring.
+ *
+ * "The same frame" is the same Ethernet addresses and the same ARP packet (or
+ * IPv6 header and neighbour discovery message), whatever VLAN tags it had and
+ * however it was padded: a trunk port adds a tag an access port doesn't, and
+ * the switch pads each to its own minimum length. That's hashed with
+ * hashbytes(), and the hash, the length and the time are remembered.
+ *
+ * The table is a fixed array of DEDUP_BUCKETS buckets of DEDUP_WAYS entries,
+ * each bucket one cache line; the hash picks the bucket. Nothing is ever
+ * removed: an entry older than the window simply doesn't match, and a new
+ * frame takes the oldest entry in its bucket. If frames come so fast that a
+ * bucket's entries are all younger than the window, a duplicate may be missed
+ * - never suppressed wrongly, short of two different frames hashing the same.
+ *
+ * How many duplicates were suppressed is reported with the capture statistics
+ * (see capturestats()), published in the shared state, and given by the
+ * control socket's status command.
+ */
+
+#include "antidote.h"
+
+#ifndef ETHERTYPE_IPV6
+#define ETHERTYPE_IPV6 0x86dd
+#endif
+#define DEDUP_BUCKETS 1024 /* a power of 2 */
+#define DEDUP_WAYS 4
+#define DEDUP_SEED 0x2545f491U
+
+struct dedupentry {
+	u_int32_t hash;
+	u_int32_t length;
+	u_int64_t when; /* microseconds; 0 for never used */
+};
+
+struct dedupbucket {
+	struct dedupentry entry[DEDUP_WAYS];
+} __attribute__((aligned(64)));
+
+static struct dedupbucket table[DEDUP_BUCKETS];
+static unsigned long duplicates = 0;
+
+/**
+ * Work out what of a frame to compare: its length once the tags and padding
+ * are left out, or 0 if it's nothing we understand.
+ */
+static unsigned int framecontent(const u_char *frame, bpf_u_int32 caplen, const u_char **payload){
+	u_int16_t type;
+	u_int32_t vlan;
+	unsigned int length, ip6length;
+	*payload = framepayload(frame, caplen, &type, &vlan);
+	if ((*payload == NULL) || (*payload > frame + caplen))
+		return 0;
+	length = frame + caplen - *payload;
+	if (type == ETHERTYPE_ARP) {
+		if (length > sizeof(struct ether_arp))
+			length = sizeof(struct ether_arp);
+	} else if ((type == ETHERTYPE_IPV6) && (length >= IP6_HEADERSIZE)) {
+		ip6length = IP6_HEADERSIZE + (((*payload)[4] << 8) | (*payload)[5]);
+		if (length > ip6length)
+			length = ip6length;
+	}
+	return length;
+}
+
+/**
+ * Decide whether a frame is a copy of one seen in the last
+ * options.dedup_window milliseconds, and remember it if not.
+ *
+ * ARGUMENTS:
+ * \arg \c *framehdr - Its pcap header, for its length and time.
+ * \arg \c *frame - The frame as captured, VLAN tags and all.
+ *
+ * \return 1 if it's a duplicate, and should be ignored; 0 if not.
+ */
+int duplicateframe(const struct pcap_pkthdr *framehdr, const u_char *frame){
+	struct dedupbucket *bucket;
+	struct dedupentry *entry, *oldest;
+	const u_char *payload;
+	u_int64_t now, window;
+	u_int32_t hash;
+	unsigned int length;
+	int lp;
+	if (options.dedup_window <= 0)
+		return 0;
+	length = framecontent(frame, framehdr->caplen, &payload);
+	if (length == 0)
+		return 0;
+	hash = hashbytes(payload, length, hashbytes(frame, 2 * ETH_ALEN, DEDUP_SEED));
+	now = (u_int64_t)framehdr->ts.tv_sec * 1000000
+		+ (capturenanoseconds() ? framehdr->ts.tv_usec / 1000 : framehdr->ts.tv_usec);
+	window = (u_int64_t)options.dedup_window * 1000;
+	bucket = &table[hash & (DEDUP_BUCKETS - 1)];
+	oldest = &bucket->entry[0];
+	for (lp = 0; lp < DEDUP_WAYS; lp++) {
+		entry = &bucket->entry[lp];
+		/* the copies may come in either order, a little apart */
+		if ((entry->hash == hash) && (entry->length == length) && (entry->when != 0)
+				&& (((now >= entry->when) ? now - entry->when : entry->when - now) <= window)) {
+			duplicates++;
+			return 1;
+		}
+		if (entry->when < oldest->when)
+			oldest = entry;
+	}
+	oldest->hash = hash;
+	oldest->length = length;
+	oldest->when = now;
+	return 0;
+}
+
+/**
+ * \return Frames suppressed as duplicates since we started.
+ */
+unsigned long duplicatecount(){
+	return duplicates;
+}
@@ -0,0 +1,470 @@
+/* -*- project-c -*- */
+/**
+ * \file dhcp.c
+ * \brief DHCP snooping: who the server says an address belongs to.
+ *
+ * On a network where addresses come from DHCP, the MAC handlereply() happens
+ * to see first for an address is just whoever answered first - and when a
+ * lease passes to another machine, the next reply looks exactly like a MAC
+ * change. The DHCP server knows better. With options.dhcp_snoop set, the
+ * capture filter also takes DHCP traffic (UDP between ports 67 and 68, on any
+ * VLAN), and each DHCPACK which hands out an address is kept as a binding -
+ * VLAN, address, client MAC and when the lease ends.
+ *
+ * Anybody can send a DHCPACK, though, so only the servers named on DhcpServer
+ * lines are believed. A reply from anyone else raises ALERT_DHCPROGUE - once
+ * per options.sketch_window for each rogue, remembered in a small table of
+ * DHCP_ROGUES - and is otherwise ignored; with no DhcpServer at all we don't
+ * snoop. Even a trusted server doesn't get to move a lease which hasn't ended
+ * to another MAC: that raises ALERT_DHCPREBIND and the lease stays where it
+ * was, until it ends or its holder gives it back with a DHCPRELEASE (which
+ * only counts from the holder's own MAC).
+ *
+ * Then, for an IPv4 ARP reply from a leased address, checkbinding() decides
+ * instead of checkmacchanges():
+ *
+ * - From the MAC the lease is for, it's the rightful owner, whatever we saw
+ *   before, and the record takes its MAC quietly.
+ * - From any other MAC, it's someone claiming an address the server gave to
+ *   somebody else: ALERT_DHCPMISMATCH, and the record keeps the leased MAC.
+ *
+ * Addresses nobody has a lease for are checked as before.
+ *
+ * The bindings are options.dhcp_bindings entries, found in O(1) by a chained
+ * hash on VLAN and address. Leases last different lengths of time, so unlike
+ * correlate.c's ring they can't simply be expired oldest first: a binary heap
+ * keeps the next lease to end on top, and every tick expireleases() takes off
+ * however many have ended - at most DHCP_PURGE, so a burst of them is spread
+ * over a few ticks, and a lease which has ended but not yet been purged is
+ * never matched anyway. If the table fills, the lease which was going to end
+ * soonest makes way. Nothing is allocated after opendhcp().
+ */
+
+#include "antidote.h"
+#include <limits.h>
+
+#define DHCP_SEED 0x6a09e667U
+#define DHCP_NONE 0xffffffffU
+#define DHCP_PURGE 1024 /* leases purged per tick, at most */
+#define DHCP_SERVERPORT 67
+#define DHCP_CLIENTPORT 68
+#define DHCP_BOOTPSIZE 236 /* the fixed part, before the magic cookie */
+#define DHCP_BOOTREQUEST 1
+#define DHCP_BOOTREPLY 2
+#define DHCP_OPT_PAD 0
+#define DHCP_OPT_LEASETIME 51
+#define DHCP_OPT_MESSAGETYPE 53
+#define DHCP_OPT_END 255
+#define DHCP_ACK 5
+#define DHCP_RELEASE 7
+#define DHCP_ROGUES 16 /* untrusted servers remembered, for rate limiting */
+
+struct binding {
+	u_int8_t ip_address[4];
+	u_int8_t mac_address[ETH_ALEN];
+	u_int32_t vlan;
+	long expires; /* seconds */
+	u_int32_t chain; /* next in its bucket, or the free list; DHCP_NONE at the end */
+	u_int32_t heapslot; /* where it is in the heap */
+};
+
+struct rogue {
+	u_int8_t ip_address[4];
+	u_int8_t mac_address[ETH_ALEN];
+	u_int32_t vlan;
+	long alerted; /* 0 for a free slot */
+	unsigned long replies; /* ignored */
+};
+
+static struct binding *bindings = NULL;
+static u_int32_t *buckets = NULL, *heap = NULL;
+static u_int32_t bucketmask = 0, freelist = DHCP_NONE;
+static unsigned long capacity = 0, count = 0;
+static unsigned long acks = 0, mismatches = 0, purged = 0, ignored = 0, rebinds = 0;
+static struct rogue rogues[DHCP_ROGUES];
+
+static const u_int8_t magiccookie[4] = { 99, 130, 83, 99 };
+
+/**
+ * Make the binding table.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or we're not snooping.
+ * \return ERR_DHCPSERVER - There's no DhcpServer to believe, so we won't.
+ * \return ERR_NOMEM
+ */
+int opendhcp(){
+	unsigned long size = 1, lp;
+	if (!options.dhcp_snoop)
+		return OK;
+	if (options.dhcp_server_count == 0) {
+		options.dhcp_snoop = 0;
+		return ERR_DHCPSERVER;
+	}
+	while (size < options.dhcp_bindings)
+		size <<= 1;
+	bindings = calloc(options.dhcp_bindings, sizeof(struct binding));
+	buckets = malloc(size * sizeof(u_int32_t));
+	heap = malloc(options.dhcp_bindings * sizeof(u_int32_t));
+	if ((bindings == NULL) || (buckets == NULL) || (heap == NULL)) {
+		free(bindings);
+		free(buckets);
+		free(heap);
+		bindings = NULL;
+		buckets = heap = NULL;
+		options.dhcp_snoop = 0; /* so the capture filter leaves DHCP out */
+		return ERR_NOMEM;
+	}
+	memset(buckets, 0xff, size * sizeof(u_int32_t));
+	bucketmask = size - 1;
+	capacity = options.dhcp_bindings;
+	for (lp = 0; lp < capacity; lp++)
+		bindings[lp].chain = (lp + 1 < capacity) ? lp + 1 : DHCP_NONE;
+	freelist = 0;
+	count = 0;
+	return OK;
+}
+
+static u_int32_t bucketof(u_int32_t vlan, const u_int8_t *address){
+	return hashbytes(address, 4, DHCP_SEED ^ vlan) & bucketmask;
+}
+
+/**
+ * \return The index of the binding for an address on a VLAN, ended or not, or
+ * DHCP_NONE.
+ */
+static u_int32_t findbinding(u_int32_t vlan, const u_int8_t *address){
+	u_int32_t index;
+	for (index = buckets[bucketof(vlan, address)]; index != DHCP_NONE; index = bindings[index].chain) {
+		if ((bindings[index].vlan == vlan) && (memcmp(bindings[index].ip_address, address, 4) == 0))
+			return index;
+	}
+	return DHCP_NONE;
+}
+
+/* the heap: heap[0] ends soonest, and each entry ends no later than its children */
+
+static void heapswap(unsigned long first, unsigned long second){
+	u_int32_t temp = heap[first];
+	heap[first] = heap[second];
+	heap[second] = temp;
+	bindings[heap[first]].heapslot = first;
+	bindings[heap[second]].heapslot = second;
+}
+
+static void heapup(unsigned long slot){
+	while ((slot > 0) && (bindings[heap[(slot - 1) / 2]].expires > bindings[heap[slot]].expires)) {
+		heapswap(slot, (slot - 1) / 2);
+		slot = (slot - 1) / 2;
+	}
+}
+
+static void heapdown(unsigned long slot){
+	unsigned long child;
+	while ((child = 2 * slot + 1) < count) {
+		if ((child + 1 < count) && (bindings[heap[child + 1]].expires < bindings[heap[child]].expires))
+			child++;
+		if (bindings[heap[slot]].expires <= bindings[heap[child]].expires)
+			break;
+		heapswap(slot, child);
+		slot = child;
+	}
+}
+
+/**
+ * Take a binding out of its bucket and the heap, and put it on the free list.
+ */
+static void removebinding(u_int32_t index){
+	struct binding *lease = &bindings[index];
+	u_int32_t *link, slot;
+	link = &buckets[bucketof(lease->vlan, lease->ip_address)];
+	while ((*link != DHCP_NONE) && (*link != index))
+		link = &bindings[*link].chain;
+	if (*link == index)
+		*link = lease->chain;
+	slot = lease->heapslot;
+	count--;
+	if (slot != count) {
+		heap[slot] = heap[count];
+		bindings[heap[slot]].heapslot = slot;
+		heapdown(slot);
+		heapup(slot);
+	}
+	lease->chain = freelist;
+	freelist = index;
+}
+
+/**
+ * \return 1 if a DhcpServer line covers a reply from this address and MAC on
+ * this VLAN, 0 if not.
+ */
+static int trustedserver(u_int32_t vlan, const u_int8_t *address, const u_int8_t *mac){
+	const struct dhcpserver *server;
+	unsigned int lp;
+	for (lp = 0; lp < options.dhcp_server_count; lp++) {
+		server = &options.dhcp_servers[lp];
+		if ((server->anyvlan || (server->vlan == vlan))
+				&& (!server->hasip || (memcmp(server->ip_address, address, 4) == 0))
+				&& (!server->hasmac || (memcmp(server->mac_address, mac, ETH_ALEN) == 0)))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Count a reply from a server we don't trust, and raise ALERT_DHCPROGUE if we
+ * haven't for this one in the last options.sketch_window seconds. A new rogue
+ * takes the slot alerted about longest ago.
+ */
+static void rogueserver(u_int32_t vlan, const u_int8_t *address, const u_int8_t *mac, long now){
+	struct rogue *slot = NULL;
+	u_int8_t key[IP_KEYSIZE];
+	int lp;
+	ignored++;
+	for (lp = 0; lp < DHCP_ROGUES; lp++) {
+		if ((rogues[lp].alerted != 0) && (rogues[lp].vlan == vlan)
+				&& (memcmp(rogues[lp].ip_address, address, 4) == 0)
+				&& (memcmp(rogues[lp].mac_address, mac, ETH_ALEN) == 0)) {
+			slot = &rogues[lp];
+			break;
+		}
+		if ((slot == NULL) || (rogues[lp].alerted < slot->alerted))
+			slot = &rogues[lp];
+	}
+	if (lp == DHCP_ROGUES) {
+		memcpy(slot->ip_address, address, 4);
+		memcpy(slot->mac_address, mac, ETH_ALEN);
+		slot->vlan = vlan;
+		slot->alerted = 0;
+		slot->replies = 0;
+	}
+	slot->replies++;
+	if ((slot->alerted != 0) && (now - slot->alerted < options.sketch_window))
+		return;
+	slot->alerted = (now > 0) ? now : 1;
+	memset(key, 0, IP_KEYSIZE);
+	memcpy(key, address, 4);
+	raiseaddressalert(ALERT_DHCPROGUE, key, AF_INET, vlan, NULL, mac, slot->replies);
+}
+
+/**
+ * Keep a lease, and make any record for the address agree with it - unless
+ * the address is still leased to another MAC, when all it does is raise
+ * ALERT_DHCPREBIND.
+ */
+static void bindlease(u_int32_t vlan, const u_int8_t *address, const u_int8_t *mac, long now, long expires){
+	struct binding *lease;
+	struct ipdetails *ip;
+	u_int8_t key[IP_KEYSIZE];
+	u_int32_t index, bucket;
+	memset(key, 0, IP_KEYSIZE);
+	memcpy(key, address, 4);
+	index = findbinding(vlan, address);
+	if ((index != DHCP_NONE) && (bindings[index].expires > now)
+			&& (memcmp(bindings[index].mac_address, mac, ETH_ALEN) != 0)) {
+		rebinds++;
+		raiseaddressalert(ALERT_DHCPREBIND, key, AF_INET, vlan, bindings[index].mac_address, mac, 0);
+		return;
+	}
+	if (index == DHCP_NONE) {
+		if (freelist == DHCP_NONE)
+			removebinding(heap[0]); /* full: the one ending soonest goes */
+		index = freelist;
+		lease = &bindings[index];
+		freelist = lease->chain;
+		memcpy(lease->ip_address, address, 4);
+		lease->vlan = vlan;
+		bucket = bucketof(vlan, address);
+		lease->chain = buckets[bucket];
+		buckets[bucket] = index;
+		lease->heapslot = count;
+		heap[count++] = index;
+	}
+	lease = &bindings[index];
+	memcpy(lease->mac_address, mac, ETH_ALEN);
+	lease->expires = expires;
+	heapdown(lease->heapslot);
+	heapup(lease->heapslot);
+	/* a new lease isn't a MAC change */
+	ip = checkip(findpartition(vlan, AF_INET, 0), key);
+	if ((ip != NULL) && (memcmp(ip->mac_address, mac, ETH_ALEN) != 0)) {
+		sharedbeginwrite(&ip->sequence);
+		memcpy(ip->mac_address, mac, ETH_ALEN);
+		sharedendwrite(&ip->sequence);
+		publiship(ip);
+	}
+}
+
+/**
+ * Give up a lease on a DHCPRELEASE, if it came from the MAC holding it.
+ */
+static void releaselease(u_int32_t vlan, const u_int8_t *address, const u_int8_t *chaddr, const u_int8_t *source){
+	u_int32_t index;
+	index = findbinding(vlan, address);
+	if ((index == DHCP_NONE) || (memcmp(bindings[index].mac_address, chaddr, ETH_ALEN) != 0)
+			|| (memcmp(chaddr, source, ETH_ALEN) != 0))
+		return;
+	removebinding(index);
+	purged++;
+}
+
+/**
+ * Read DHCP from a frame. A DHCPACK giving out an address, from a DhcpServer,
+ * keeps the lease; a reply from anyone else is a rogue server's; a
+ * DHCPRELEASE gives a lease up.
+ *
+ * ARGUMENTS:
+ * \arg \c *frame - The frame as captured, VLAN tags and all.
+ * \arg \c caplen - How much of it there is.
+ * \arg \c *when - When it was captured.
+ *
+ * \return 1 if it was DHCP, 0 if not.
+ */
+int snoopdhcp(const u_char *frame, bpf_u_int32 caplen, const struct timeval *when){
+	const u_char *ip, *udp, *bootp, *option, *end;
+	u_int16_t type, sourceport, destport;
+	u_int32_t vlan, lease = 0;
+	int messagetype = 0, haslease = 0, fromserver;
+	if (bindings == NULL)
+		return 0;
+	ip = framepayload(frame, caplen, &type, &vlan);
+	if ((ip == NULL) || (type != ETHERTYPE_IP) || (ip + 20 > frame + caplen)
+			|| ((ip[0] >> 4) != 4) || (ip[9] != IPPROTO_UDP)
+			|| (((ip[6] & 0x3f) | ip[7]) != 0)) /* a fragment, or the first of several */
+		return 0;
+	udp = ip + (ip[0] & 0x0f) * 4;
+	if (udp + 8 > frame + caplen)
+		return 0;
+	sourceport = (udp[0] << 8) | udp[1];
+	destport = (udp[2] << 8) | udp[3];
+	if ((sourceport == DHCP_SERVERPORT) && (destport == DHCP_CLIENTPORT))
+		fromserver = 1;
+	else if ((sourceport == DHCP_CLIENTPORT) && (destport == DHCP_SERVERPORT))
+		fromserver = 0;
+	else
+		return 0;
+	bootp = udp + 8;
+	end = udp + ((udp[4] << 8) | udp[5]);
+	if (end > frame + caplen)
+		end = frame + caplen;
+	if ((bootp + DHCP_BOOTPSIZE + sizeof(magiccookie) > end)
+			|| (bootp[0] != (fromserver ? DHCP_BOOTREPLY : DHCP_BOOTREQUEST))
+			|| (bootp[1] != ARPHRD_ETHER) || (bootp[2] != ETH_ALEN)
+			|| (memcmp(bootp + DHCP_BOOTPSIZE, magiccookie, sizeof(magiccookie)) != 0))
+		return 1;
+	/* offers and NAKs count too: a rogue has to start somewhere */
+	if (fromserver && !trustedserver(vlan, ip + 12, frame + ETH_ALEN)) {
+		rogueserver(vlan, ip + 12, frame + ETH_ALEN, when->tv_sec);
+		return 1;
+	}
+	for (option = bootp + DHCP_BOOTPSIZE + sizeof(magiccookie); (option < end) && (*option != DHCP_OPT_END); ) {
+		if (*option == DHCP_OPT_PAD) {
+			option++;
+			continue;
+		}
+		if ((option + 2 > end) || (option + 2 + option[1] > end))
+			break;
+		if ((option[0] == DHCP_OPT_MESSAGETYPE) && (option[1] == 1))
+			messagetype = option[2];
+		else if ((option[0] == DHCP_OPT_LEASETIME) && (option[1] == 4)) {
+			lease = ((u_int32_t)option[2] << 24) | (option[3] << 16) | (option[4] << 8) | option[5];
+			haslease = 1;
+		}
+		option += 2 + option[1];
+	}
+	if (!fromserver) {
+		if (messagetype == DHCP_RELEASE)
+			releaselease(vlan, bootp + 12, bootp + 28, frame + ETH_ALEN);
+		return 1;
+	}
+	/* an ACK for a DHCPINFORM gives no address and no lease */
+	if ((messagetype != DHCP_ACK) || !haslease || (sumbytes((u_int8_t *)bootp + 16, 4) == 0))
+		return 1;
+	acks++;
+	/* an infinite lease (0xffffffff) just never ends */
+	bindlease(vlan, bootp + 16, bootp + 28, when->tv_sec,
+		  (lease > (u_int32_t)(LONG_MAX - when->tv_sec)) ? LONG_MAX : when->tv_sec + (long)lease);
+	return 1;
+}
+
+/**
+ * Check an ARP reply against the lease for its address, if there is one.
+ * Called instead of checkmacchanges() when there is.
+ *
+ * ARGUMENTS:
+ * \arg \c *ip - The record for the address.
+ * \arg \c *seen - What the reply says.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ *
+ * RETURN VALUES:
+ * \return DHCP_UNBOUND - We're not snooping, or nobody has a lease for it.
+ * \return DHCP_MATCH - It came from the MAC with the lease.
+ * \return DHCP_MISMATCH - It didn't, and ALERT_DHCPMISMATCH has been raised.
+ * Either way, the record now has the lease's MAC.
+ */
+int checkbinding(struct ipdetails *ip, const struct observation *seen, u_int32_t vlan){
+	struct binding *lease;
+	u_int32_t index;
+	if ((bindings == NULL) || (seen->family != AF_INET))
+		return DHCP_UNBOUND;
+	index = findbinding(vlan, seen->key);
+	if (index == DHCP_NONE)
+		return DHCP_UNBOUND;
+	lease = &bindings[index];
+	if (lease->expires <= (long)(seen->when / 1000000))
+		return DHCP_UNBOUND; /* ended; expireleases() will be along */
+	if (memcmp(ip->mac_address, lease->mac_address, ETH_ALEN) != 0) {
+		sharedbeginwrite(&ip->sequence);
+		memcpy(ip->mac_address, lease->mac_address, ETH_ALEN);
+		sharedendwrite(&ip->sequence);
+	}
+	if (memcmp(seen->claimed_mac, lease->mac_address, ETH_ALEN) == 0)
+		return DHCP_MATCH;
+	mismatches++;
+	raisealert(ALERT_DHCPMISMATCH, ip, lease->mac_address, seen->claimed_mac, 0);
+	return DHCP_MISMATCH;
+}
+
+/**
+ * Find the MAC an address is leased to on a VLAN, if its lease hasn't ended.
+ *
+ * \return 1, with *mac filled in, if there's a lease; 0 if not.
+ */
+int leasedmac(u_int32_t vlan, const u_int8_t *address, long now, u_int8_t *mac){
+	u_int32_t index;
+	if (bindings == NULL)
+		return 0;
+	index = findbinding(vlan, address);
+	if ((index == DHCP_NONE) || (bindings[index].expires <= now))
+		return 0;
+	memcpy(mac, bindings[index].mac_address, ETH_ALEN);
+	return 1;
+}
+
+/**
+ * Purge leases which have ended - up to DHCP_PURGE of them. Called every tick.
+ */
+void expireleases(){
+	long now;
+	int lp;
+	if ((bindings == NULL) || (count == 0))
+		return;
+	now = time(NULL);
+	for (lp = 0; (lp < DHCP_PURGE) && (count > 0) && (bindings[heap[0]].expires <= now); lp++) {
+		removebinding(heap[0]);
+		purged++;
+	}
+}
+
+/**
+ * Fill in what the control socket's status command says about DHCP snooping.
+ */
+void dhcpstats(unsigned long *leases, unsigned long *acked, unsigned long *ended, unsigned long *mismatched,
+	       unsigned long *rogue, unsigned long *rebound){
+	*leases = count;
+	*acked = acks;
+	*ended = purged;
+	*mismatched = mismatches;
+	*rogue = ignored;
+	*rebound = rebinds;
+}
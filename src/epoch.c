@@ -0,0 +1,158 @@
+/* -*- project-c -*- */
+/**
+ * \file epoch.c
+ * \brief Letting other threads read the IP table without locks.
+ *
+ * Only the capture thread ever changes the IP table. Anything else which wants
+ * to look at it - a stats exporter, a snapshot writer, a query interface -
+ * used to be stuck, because removeip() freed records the moment they were
+ * unlinked, and a reader on another thread could be standing on one.
+ *
+ * So the table is now read-mostly in the RCU style:
+ *
+ * - linkip() and removeip() fill in a record completely before making it
+ *   reachable, and change each ->next pointer (and the head of the list) with
+ *   a single release store. A reader following ->next with readnext() sees
+ *   either the old list or the new one, never half of either.
+ * - changes to a record's own fields happen under its sequence number, the
+ *   same seqlock the shared-memory view uses (sharedstate.h), so readrecord()
+ *   can take a consistent copy of one without stopping the writer.
+ * - removed records aren't freed; removeip() hands them to retireip(), which
+ *   notes the current epoch and puts them in limbo. A record in limbo keeps its
+ *   ->next pointer, so a reader standing on it can carry on walking.
+ *
+ * Readers take a slot with epochregister() once, and bracket each walk of the
+ * table with epochenter() and epochexit(). epochreclaim() moves the epoch on,
+ * and frees everything retired before the oldest epoch a reader is still in.
+ * It's run from the event loop every tick, and straight away by retireip() if
+ * limbo is getting long - or if no reader is registered at all, in which case
+ * records are freed just as promptly as they always were.
+ *
+ * A reader which stays inside for ever holds back reclamation for ever, so
+ * don't do anything slow between epochenter() and epochexit(). The dump thread
+ * (see dumpdata()) shows how: it copies what it wants inside, and only writes
+ * it out once it's left.
+ *
+ * epochbench.c measures what all this costs, against a rwlock.
+ */
+
+#include "antidote.h"
+
+/* one per cache line, so readers coming and going don't trip over each other */
+struct epochreader {
+	volatile u_int64_t epoch; /* the epoch it entered in, 0 when outside */
+	volatile u_int32_t taken;
+	char pad[64 - sizeof(u_int64_t) - sizeof(u_int32_t)];
+};
+
+static struct epochreader readers[EPOCH_READERS];
+static volatile u_int32_t registered = 0;
+static volatile u_int64_t epoch = 1;
+static struct ipdetails *limbo = NULL; /* most recently retired first */
+static unsigned long limbocount = 0;
+static unsigned long reclaimat = EPOCH_LIMBO; /* limbocount at which retireip() tries again */
+
+/**
+ * Take a reader slot, for a thread which is going to read the IP table.
+ *
+ * RETURN VALUES:
+ * \return The slot, to be handed to epochenter(), epochexit() and
+ * epochunregister().
+ * \return ERR_BADUSAGE - All EPOCH_READERS slots are taken.
+ */
+int epochregister(){
+	u_int32_t vacant;
+	int reader;
+	for (reader = 0; reader < EPOCH_READERS; reader++) {
+		vacant = 0;
+		if (__atomic_compare_exchange_n(&readers[reader].taken, &vacant, 1, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&registered, 1, __ATOMIC_SEQ_CST);
+			return reader;
+		}
+	}
+	return ERR_BADUSAGE;
+}
+
+/**
+ * Give a reader slot back. The reader must be outside.
+ */
+void epochunregister(int reader){
+	if ((reader < 0) || (reader >= EPOCH_READERS))
+		return;
+	__atomic_store_n(&readers[reader].epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&readers[reader].taken, 0, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&registered, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Start reading the table. Nothing the reader can reach from here until
+ * epochexit() will be freed under it.
+ *
+ * The fence matters: either epochreclaim() sees that we're inside, or we see
+ * every record it's about to free already unlinked.
+ */
+void epochenter(int reader){
+	__atomic_store_n(&readers[reader].epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Finish reading the table. Any pointers into it are no good after this.
+ */
+void epochexit(int reader){
+	__atomic_store_n(&readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Put a record which has just been unlinked by removeip() in limbo until no
+ * reader can be looking at it. Capture thread only.
+ */
+void retireip(struct ipdetails *ip){
+	ip->retired = __atomic_load_n(&epoch, __ATOMIC_RELAXED);
+	ip->limbo = limbo;
+	limbo = ip;
+	limbocount++;
+	if ((limbocount >= reclaimat) || (__atomic_load_n(&registered, __ATOMIC_SEQ_CST) == 0))
+		epochreclaim();
+}
+
+/**
+ * Move the epoch on and free whatever no reader can still be looking at.
+ * Capture thread only.
+ */
+void epochreclaim(){
+	struct ipdetails **link, *victim;
+	u_int64_t oldest, entered;
+	int reader;
+	if (limbo == NULL)
+		return;
+	/* anything retired from now on is in a later epoch than anything in limbo */
+	__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	oldest = (u_int64_t)-1;
+	for (reader = 0; reader < EPOCH_READERS; reader++) {
+		entered = __atomic_load_n(&readers[reader].epoch, __ATOMIC_ACQUIRE);
+		if ((entered != 0) && (entered < oldest))
+			oldest = entered;
+	}
+	/*
+	 * A reader which entered in epoch E may have found anything retired in E
+	 * or later, but nothing retired before E - that was unlinked before the
+	 * epoch it read was reached.
+	 */
+	link = &limbo;
+	while (*link != NULL) {
+		victim = *link;
+		if (victim->retired < oldest) {
+			*link = victim->limbo;
+			free(victim);
+			limbocount--;
+		} else {
+			link = &victim->limbo;
+		}
+	}
+	/* if a slow reader is holding things up, don't go over the same list on every removal */
+	reclaimat = limbocount + EPOCH_LIMBO;
+}
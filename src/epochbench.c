@@ -0,0 +1,135 @@
+/* -*- project-c -*- */
+/**
+ * \file epochbench.c
+ * \brief How much the epoch scheme costs the capture thread, and its readers.
+ *
+ * Debug code, built with "make BENCH_epoch" - not part of antidote.
+ *
+ * One writer churns a table of BENCH_TABLE records the way the capture thread
+ * does: it makes a record, links it in, removes an old one and counts a
+ * request and a reply. Alongside it, 0 to BENCH_READERS readers walk the
+ * whole table again and again, copying every record. Each run lasts
+ * BENCH_SECONDS, first with the readers inside epochenter()/epochexit() (see
+ * epoch.c), then with everyone taking a pthread rwlock instead, which is what
+ * the IP table would need without epochs.
+ *
+ * What it prints is writer operations and reader walks per second. Run it on
+ * as many cores as there are readers plus one, or all it measures is the
+ * scheduler.
+ */
+
+#include "antidote.h"
+#include <pthread.h>
+
+#define BENCH_TABLE 1000
+#define BENCH_READERS 8
+#define BENCH_SECONDS 2.0
+
+static volatile int stop = 0, locking = 0;
+static pthread_rwlock_t lock;
+static unsigned long walks[BENCH_READERS];
+
+/* antidote.c isn't linked in, having a main() of its own; nothing here calls these */
+void my_callback(u_char *useless, const struct pcap_pkthdr *framehdr, const u_char *frame){
+}
+void scanrecords(){
+}
+void showusage(int argc, char **argv){
+}
+
+static void *reader(void *arg){
+	long id = (long)arg;
+	int slot;
+	struct ipdetails *current, copy;
+	slot = epochregister();
+	while (!stop) {
+		if (locking)
+			pthread_rwlock_rdlock(&lock);
+		else
+			epochenter(slot);
+		for (current = readfirst(); current != NULL; current = readnext(current))
+			readrecord(current, &copy);
+		if (locking)
+			pthread_rwlock_unlock(&lock);
+		else
+			epochexit(slot);
+		walks[id]++;
+	}
+	epochunregister(slot);
+	return NULL;
+}
+
+static double seconds(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(){
+	static const int readercounts[] = { 0, 1, 2, 4, BENCH_READERS };
+	struct ipdetails *records[BENCH_TABLE], *first, *ip;
+	struct partition *table;
+	pthread_rwlockattr_t attributes;
+	pthread_t threads[BENCH_READERS];
+	unsigned long operations, walked;
+	double start, elapsed;
+	int run, lp, count, victim;
+	setdefaults();
+	options.max_records = 1 << 30;
+	buildpolicies();
+	/* or the writer never gets a look in */
+	pthread_rwlockattr_init(&attributes);
+	pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&lock, &attributes);
+	table = findpartition(0, AF_INET, 1);
+	if (table == NULL)
+		return 1;
+	first = createipspace(table);
+	linkip(NULL, first);
+	for (lp = 0; lp < BENCH_TABLE; lp++) {
+		records[lp] = createipspace(table);
+		records[lp]->ip_address[0] = 10;
+		records[lp]->ip_address[2] = lp >> 8;
+		records[lp]->ip_address[3] = lp & 0xff;
+		linkip(first, records[lp]);
+	}
+	printf("%d records; %ld CPUs online\n", BENCH_TABLE + 1, sysconf(_SC_NPROCESSORS_ONLN));
+	for (run = 0; run < 2 * (int)(sizeof(readercounts) / sizeof(int)); run++) {
+		locking = run / (sizeof(readercounts) / sizeof(int));
+		count = readercounts[run % (sizeof(readercounts) / sizeof(int))];
+		stop = 0;
+		memset(walks, 0, sizeof(walks));
+		for (lp = 0; lp < count; lp++)
+			pthread_create(&threads[lp], NULL, reader, (void *)(long)lp);
+		operations = 0;
+		start = seconds();
+		while ((elapsed = seconds() - start) < BENCH_SECONDS) {
+			for (lp = 0; lp < 1000; lp++, operations++) {
+				victim = operations % BENCH_TABLE;
+				if (locking)
+					pthread_rwlock_wrlock(&lock);
+				ip = createipspace(table);
+				memcpy(ip->ip_address, records[victim]->ip_address, IP_KEYSIZE);
+				linkip(first, ip);
+				removeip(records[victim]);
+				records[victim] = ip;
+				addreply(ip);
+				addrequest(records[(victim * 7) % BENCH_TABLE], 1);
+				if (locking)
+					pthread_rwlock_unlock(&lock);
+			}
+			if (!locking)
+				epochreclaim(); /* the event loop's tick */
+		}
+		stop = 1;
+		walked = 0;
+		for (lp = 0; lp < count; lp++) {
+			pthread_join(threads[lp], NULL);
+			walked += walks[lp];
+		}
+		printf("%s readers %d: writer %.2f Mops/s, walks %.0f/s (%.0f/s each)\n",
+		       locking ? "rwlock" : "epoch ", count, operations / elapsed / 1e6,
+		       walked / elapsed, count ? walked / elapsed / count : 0.0);
+	}
+	return 0;
+}
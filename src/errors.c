@@ -42,6 +42,26 @@ void decodeerror(int errnum, char *result){
 		break;
 	case ERR_CONNECTMAILSERVER : strcpy(result,"ERR_CONNECTMAILSERVER: Cannot connect to mail server.\n");
 		break;
+	case ERR_CANNOTGETSYSLOGSERVER : strcpy(result,"ERR_CANNOTGETSYSLOGSERVER: Cannot resolve remote syslog server hostname.\n");
+		break;
+	case ERR_EVENTLOOP : strcpy(result,"ERR_EVENTLOOP: Cannot set up the event loop (epoll, timerfd or signalfd).\n");
+		break;
+	case ERR_SHAREDSTATE : strcpy(result,"ERR_SHAREDSTATE: Cannot create the shared memory segment for SharedState.\n");
+		break;
+	case ERR_CONTROLSOCKET : strcpy(result,"ERR_CONTROLSOCKET: Cannot listen on ControlSocket.\n");
+		break;
+	case ERR_FORWARD : strcpy(result,"ERR_FORWARD: Cannot resolve the aggregator named in Forward.\n");
+		break;
+	case ERR_AGGREGATE : strcpy(result,"ERR_AGGREGATE: Cannot listen for sensors on Aggregate.\n");
+		break;
+	case ERR_JOURNAL : strcpy(result,"ERR_JOURNAL: Cannot write a journal in the Journal directory.\n");
+		break;
+	case ERR_NEIGHBOUR : strcpy(result,"ERR_NEIGHBOUR: Cannot watch the kernel's neighbour table (Linux rtnetlink only).\n");
+		break;
+	case ERR_EVIDENCE : strcpy(result,"ERR_EVIDENCE: Cannot save evidence in the Evidence directory (or no threads).\n");
+		break;
+	case ERR_DHCPSERVER : strcpy(result,"ERR_DHCPSERVER: DhcpSnoop needs at least one DhcpServer to believe. Not snooping.\n");
+		break;
 	case ERR_CONNECTCLOSED : strcpy(result,"ERR_CONNECTCLOSED: Connection unexpectedly closed.\n");
 		break;
 	case ERR_WRONGREPLY: strcpy(result,"ERR_WRONGREPLY: Server returned an unexpected reply.\n"); 
@@ -53,6 +73,12 @@ void decodeerror(int errnum, char *result){
 		break;
 	case ERR_MACCHANGED: strcpy(result,"ERR_MACCHANGED: A MAC address has changed.\n");
 		break;
+	case ERR_HEAVYHITTER: strcpy(result,"ERR_HEAVYHITTER: Sender is flooding or sweeping.\n");
+		break;
+	case ERR_NORECORD: strcpy(result,"ERR_NORECORD: No record held for this address.\n");
+		break;
+	case ERR_OPENLOG: strcpy(result,"ERR_OPENLOG: Cannot open log file.\n");
+		break;
 	default: strcpy(result,"ERR_ID10T: Non-existent error code.\n");
 		break;
 	}
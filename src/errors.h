@@ -20,6 +20,19 @@
  * \c ERR_INOPTS - Error parsing options file
  * \c ERR_CANNOTGETMAILSERVER - Cannot find mail server
  * \c ERR_CONNECTMAILSERVER - Cannot connect to mail server.
+ * \c ERR_HEAVYHITTER - The sender of a frame is flooding or sweeping.
+ * \c ERR_NORECORD - No record exists, and we weren't allowed to make one.
+ * \c ERR_OPENLOG - Cannot open a log file.
+ * \c ERR_CANNOTGETSYSLOGSERVER - Cannot find the remote syslog server.
+ * \c ERR_EVENTLOOP - Cannot set up (or keep running) the event loop.
+ * \c ERR_SHAREDSTATE - Cannot create the shared-memory view of the table.
+ * \c ERR_CONTROLSOCKET - Cannot listen on the control socket.
+ * \c ERR_FORWARD - Cannot find the aggregator to forward to.
+ * \c ERR_AGGREGATE - Cannot listen for sensors.
+ * \c ERR_JOURNAL - Cannot keep a journal in the directory given.
+ * \c ERR_NEIGHBOUR - Cannot watch the kernel's neighbour table.
+ * \c ERR_EVIDENCE - Cannot save evidence in the directory given.
+ * \c ERR_DHCPSERVER - DhcpSnoop is on, but no DhcpServer is given.
  *
  * *Most* functions will only return OK and ERR_NOMEM.
  */
@@ -39,3 +52,16 @@
 #define ERR_CONNECTCLOSED 13
 #define ERR_WRONGREPLY 14
 #define ERR_EOF 15
+#define ERR_HEAVYHITTER 16
+#define ERR_NORECORD 17
+#define ERR_OPENLOG 18
+#define ERR_CANNOTGETSYSLOGSERVER 19
+#define ERR_EVENTLOOP 20
+#define ERR_SHAREDSTATE 21
+#define ERR_CONTROLSOCKET 22
+#define ERR_FORWARD 23
+#define ERR_AGGREGATE 24
+#define ERR_JOURNAL 25
+#define ERR_NEIGHBOUR 26
+#define ERR_EVIDENCE 27
+#define ERR_DHCPSERVER 28
@@ -0,0 +1,173 @@
+/* -*- project-c -*- */
+/**
+ * \file eventlog.c
+ * \brief A structured, buffered event log: one JSON object per line.
+ *
+ * syslog is fine for a human, but anything that wants to act on antidote's
+ * alerts has to pick the text apart with regular expressions. This module writes
+ * the same events as JSON lines to options.event_log, so a SIEM (or grep, or a
+ * ten line script) can take them as they are.
+ *
+ * Events are formatted straight into a handful of fixed chunks of memory, and
+ * the chunks go to disk together with a single writev() when they are all full
+ * or options.event_log_flush seconds have passed, whichever is sooner. An alert
+ * storm therefore costs one system call per EVENTLOG_CHUNKS * EVENTLOG_CHUNKSIZE
+ * bytes rather than one per alert.
+ *
+ * When the file grows past options.event_log_size bytes it is rotated: event.log
+ * becomes event.log.1, event.log.1 becomes event.log.2 and so on, up to
+ * options.event_log_keep old files.
+ */
+
+#include "antidote.h"
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define EVENTLOG_CHUNKS 8
+#define EVENTLOG_CHUNKSIZE 16384
+#define EVENTLOG_MAXLINE (ALERT_JSONSIZE + 2 * MAX_OPT_LENGTH) /* longest single event we'll ever write */
+
+static char chunks[EVENTLOG_CHUNKS][EVENTLOG_CHUNKSIZE];
+static size_t chunkused[EVENTLOG_CHUNKS];
+static int currentchunk = 0;
+static int eventlogfd = -1;
+static off_t eventlogsize = 0;
+static long lastflush = 0;
+static char device[2 * MAX_OPT_LENGTH]; /* options.device, escaped for JSON */
+
+/**
+ * Copy a string into a JSON string body, escaping as we go. Never writes more
+ * than size bytes, including the terminating null.
+ */
+static void jsonescape(char *dest, size_t size, const char *src){
+	static const char hex[] = "0123456789abcdef";
+	size_t used = 0;
+	while ((*src != '\0') && (used + 7 < size)) {
+		if ((*src == '"') || (*src == '\\')) {
+			dest[used++] = '\\';
+			dest[used++] = *src;
+		} else if ((unsigned char)*src < 0x20) {
+			dest[used++] = '\\';
+			dest[used++] = 'u';
+			dest[used++] = '0';
+			dest[used++] = '0';
+			dest[used++] = hex[((unsigned char)*src) >> 4];
+			dest[used++] = hex[((unsigned char)*src) & 0xf];
+		} else {
+			dest[used++] = *src;
+		}
+		src++;
+	}
+	dest[used] = '\0';
+}
+
+/**
+ * Open (or reopen) the event log named in options.event_log, appending to
+ * whatever is there already.
+ *
+ * RETURN VALUES:
+ * \return OK - The log is open, or no log was asked for.
+ * \return ERR_OPENLOG - The file can't be opened.
+ */
+int openeventlog(){
+	struct stat details;
+	if (options.event_log[0] == '\0')
+		return OK;
+	if (eventlogfd != -1)
+		close(eventlogfd);
+	eventlogfd = open(options.event_log, O_WRONLY | O_APPEND | O_CREAT, 0640);
+	if (eventlogfd == -1)
+		return ERR_OPENLOG;
+	if (fstat(eventlogfd, &details) == 0)
+		eventlogsize = details.st_size;
+	else
+		eventlogsize = 0;
+	jsonescape(device, sizeof(device), options.device);
+	if (lastflush == 0)
+		atexit(closeeventlog);
+	lastflush = time(NULL);
+	return OK;
+}
+
+/**
+ * Shuffle the old logs along one place and start a new one.
+ */
+static void rotateeventlog(){
+	char from[MAX_OPT_LENGTH + 16], to[MAX_OPT_LENGTH + 16];
+	int lp;
+	for (lp = options.event_log_keep - 1; lp > 0; lp--) {
+		snprintf(from, sizeof(from), "%s.%d", options.event_log, lp);
+		snprintf(to, sizeof(to), "%s.%d", options.event_log, lp + 1);
+		rename(from, to);
+	}
+	if (options.event_log_keep > 0) {
+		snprintf(to, sizeof(to), "%s.1", options.event_log);
+		rename(options.event_log, to);
+	} else {
+		unlink(options.event_log);
+	}
+	if (openeventlog() != OK)
+		bluealert("Cannot reopen the event log after rotating it. Events will be lost.");
+}
+
+/**
+ * Write everything buffered so far to the event log.
+ *
+ * ARGUMENTS:
+ * \arg \c force - If zero, only flush if options.event_log_flush seconds have
+ * passed since the last flush. Otherwise flush regardless.
+ */
+void flusheventlog(int force){
+	struct iovec vector[EVENTLOG_CHUNKS];
+	ssize_t written;
+	long now;
+	int lp, count = 0;
+	now = time(NULL);
+	if ((force == 0) && ((now - lastflush) < options.event_log_flush))
+		return;
+	lastflush = now;
+	for (lp = 0; lp <= currentchunk; lp++) {
+		if (chunkused[lp] > 0) {
+			vector[count].iov_base = chunks[lp];
+			vector[count].iov_len = chunkused[lp];
+			count++;
+		}
+		chunkused[lp] = 0;
+	}
+	currentchunk = 0;
+	if ((count == 0) || (eventlogfd == -1))
+		return;
+	written = writev(eventlogfd, vector, count);
+	if (written > 0)
+		eventlogsize += written;
+	if ((options.event_log_size > 0) && (eventlogsize >= options.event_log_size))
+		rotateeventlog();
+}
+
+/**
+ * Flush and close the event log. Registered with atexit() when the log is
+ * first opened, so nothing buffered is lost on a normal exit.
+ */
+void closeeventlog(){
+	flusheventlog(1);
+	if (eventlogfd != -1)
+		close(eventlogfd);
+	eventlogfd = -1;
+}
+
+/**
+ * Append an alert (or event) to the log, as a line of JSON.
+ */
+void logalert(const struct alertrecord *record){
+	if (eventlogfd == -1)
+		return;
+	if (EVENTLOG_CHUNKSIZE - chunkused[currentchunk] < EVENTLOG_MAXLINE) {
+		if (currentchunk == EVENTLOG_CHUNKS - 1)
+			flusheventlog(1);
+		else
+			currentchunk++;
+	}
+	chunkused[currentchunk] += formatalertjson(record, device, chunks[currentchunk] + chunkused[currentchunk]);
+	flusheventlog(0);
+}
@@ -0,0 +1,437 @@
+/* -*- project-c -*- */
+/**
+ * \file eventloop.c
+ * \brief The main loop: frames, timers, signals and alert sockets in one place.
+ *
+ * pcap_loop() only ever calls us back when a frame arrives, so on a quiet
+ * network nothing else happened either: records didn't expire, the event log
+ * sat unflushed, a remote syslog server that had come back stayed unsent to,
+ * and a SIGTERM simply killed us with alerts still in the queue.
+ *
+ * Where the platform has them (Linux, at the moment), everything now waits on a
+ * single epoll set:
+ *
+ * - the capture, through pcap_get_selectable_fd(), in non-blocking mode. Up to
+ *   EVENTLOOP_BATCH frames are handled per wakeup, and alerts are flushed once
+ *   per batch rather than once per frame.
+ * - a timerfd, ticking every EVENTLOOP_TICK seconds, which runs periodicwork().
+ *   Nothing on the per-frame path has to keep checking the clock.
+ * - a signalfd for SIGTERM and SIGINT (stop cleanly) and SIGHUP (reopen the
+ *   event log, for logrotate). Signals are handled in the loop like anything
+ *   else, so there's nothing to worry about in a handler.
+ * - the remote syslog socket, and the connection to the aggregator if we're a
+ *   sensor, each watched for writing only while it has a backlog.
+ * - the control socket and its clients (see control.c), and the sensors'
+ *   connections if we're an aggregator (see aggregate.c).
+ * - the rtnetlink socket the kernel reports neighbour table changes on, if
+ *   we're checking it (see neighbour.c).
+ *
+ * Elsewhere we fall back to pcap_loop(), with the periodic work done at most
+ * once per tick from the frame callback, and a signal handler that breaks the
+ * loop.
+ */
+
+#include "antidote.h"
+
+#if HAVE_SYS_EPOLL_H && HAVE_SYS_TIMERFD_H && HAVE_SYS_SIGNALFD_H
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
+
+#define EVENTLOOP_TICK 1 /* seconds between runs of periodicwork() */
+#define EVENTLOOP_BATCH 256 /* most frames handled per wakeup */
+
+static volatile sig_atomic_t running = 1;
+
+/**
+ * Everything that needs doing now and then, whether or not frames are arriving.
+ */
+static void periodicwork(){
+	expirerequests(); /* before the counts are judged */
+	expireleases();
+	scanrecords(); /* thresholds and timeouts, every ScanInterval - first, so its alerts go now */
+	flushalerts(); /* also moves the remote syslog and email digest along */
+	flusheventlog(0);
+	flushjournal(0);
+	flushevidence(0);
+	epochreclaim(); /* records removed since the last tick, if readers have moved on */
+	capturestats(0);
+	serviceoverload(); /* after capturestats(), which may have just found drops */
+	publishstats();
+	servicecontrol(); /* the event loop does these as soon as there's anything, where it can */
+	serviceaggregate(-1);
+	serviceneighbour();
+}
+
+/**
+ * Shut down tidily: send what's queued, close the capture and write out the
+ * event log. The email digest goes from its atexit() handler on the way out.
+ */
+static void shutdownloop(){
+	flushalerts();
+	flushforward(1);
+	flushjournal(1);
+	flushevidence(1);
+	closecapture();
+	flusheventlog(1);
+}
+
+#ifdef USE_EPOLL
+
+/*
+ * epoll_event.data.u32 values, so we know which descriptor woke us. Sensors'
+ * connections also carry the descriptor, above the bottom 8 bits.
+ */
+#define EV_CAPTURE 1
+#define EV_TIMER 2
+#define EV_SIGNAL 3
+#define EV_SINK 4
+#define EV_CONTROL 5
+#define EV_FORWARD 6
+#define EV_AGGREGATE 7
+#define EV_NEIGHBOUR 8
+#define WATCHSET_MAX (AGGREGATE_SENSORS + 1)
+
+/**
+ * A descriptor watched for writing only while it has something to send.
+ */
+struct watchedoutput {
+	int fd;
+	u_int32_t events;
+	u_int32_t tag;
+};
+
+/**
+ * A changing set of descriptors, such as a listening socket and its clients.
+ */
+struct watchset {
+	int fds[WATCHSET_MAX], writing[WATCHSET_MAX];
+	unsigned int serial[WATCHSET_MAX];
+	int count;
+	u_int32_t tag;
+	int tagfds; /* put the descriptor in the tag too */
+};
+
+static int epollfd = -1, timerfd = -1, signalfd_ = -1;
+static int capturefd = -1;
+static struct watchedoutput sink = { -1, 0, EV_SINK }, forward = { -1, 0, EV_FORWARD };
+static struct watchset control = { .tag = EV_CONTROL }, aggregate = { .tag = EV_AGGREGATE, .tagfds = 1 };
+
+/**
+ * Add, change or remove a descriptor in the epoll set.
+ */
+static int watchfd(int operation, int fd, u_int32_t events, u_int32_t tag){
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.u32 = tag;
+	return epoll_ctl(epollfd, operation, fd, &event);
+}
+
+/**
+ * Put the capture handle's descriptor in the epoll set.
+ */
+static int watchcapture(){
+	char errbuf[PCAP_ERRBUF_SIZE];
+	int fd;
+	if (capturehandle() == NULL)
+		return ERR_OPENLIVE;
+	fd = pcap_get_selectable_fd(capturehandle());
+	if ((fd == -1) || (pcap_setnonblock(capturehandle(), 1, errbuf) == -1))
+		return ERR_EVENTLOOP;
+	if (watchfd(EPOLL_CTL_ADD, fd, EPOLLIN, EV_CAPTURE) == -1)
+		return ERR_EVENTLOOP;
+	capturefd = fd;
+	return OK;
+}
+
+/**
+ * Keep an outgoing socket (the remote syslog's, or the aggregator's) in the
+ * epoll set, asking to hear when it's writable only while there's something
+ * waiting to go. The socket comes and goes as the connection does, so this is
+ * checked after every wakeup.
+ */
+static void watchoutput(struct watchedoutput *output, int fd, int backlog){
+	u_int32_t events;
+	events = (backlog > 0) ? EPOLLOUT : 0;
+	if (fd != output->fd) {
+		/* a closed descriptor leaves the set by itself, so failure here is fine */
+		if (output->fd != -1)
+			watchfd(EPOLL_CTL_DEL, output->fd, 0, output->tag);
+		output->fd = -1;
+		if ((fd != -1) && (watchfd(EPOLL_CTL_ADD, fd, events, output->tag) == 0)) {
+			output->fd = fd;
+			output->events = events;
+		}
+	} else if ((fd != -1) && (events != output->events)) {
+		if (watchfd(EPOLL_CTL_MOD, fd, events, output->tag) == 0)
+			output->events = events;
+	}
+}
+
+/**
+ * Keep a set of descriptors - the control socket and its clients, say - in
+ * the epoll set. They come and go, and only want EPOLLOUT while there's output
+ * waiting. fds, serial and writing are as controlfds() fills them in.
+ */
+static void watchset(struct watchset *set, int *fds, unsigned int *serial, int *writing, int count){
+	int lp, old;
+	/* first forget anything that's gone, or whose descriptor now means someone else */
+	for (old = 0; old < set->count; old++) {
+		for (lp = 0; lp < count; lp++) {
+			if ((fds[lp] == set->fds[old]) && (serial[lp] == set->serial[old]))
+				break;
+		}
+		if (lp == count)
+			watchfd(EPOLL_CTL_DEL, set->fds[old], 0, set->tag);
+	}
+	for (lp = 0; lp < count; lp++) {
+		for (old = 0; old < set->count; old++) {
+			if ((fds[lp] == set->fds[old]) && (serial[lp] == set->serial[old]))
+				break;
+		}
+		if (old == set->count)
+			watchfd(EPOLL_CTL_ADD, fds[lp], EPOLLIN | (writing[lp] ? EPOLLOUT : 0),
+				set->tag | (set->tagfds ? (fds[lp] << 8) : 0));
+		else if (writing[lp] != set->writing[old])
+			watchfd(EPOLL_CTL_MOD, fds[lp], EPOLLIN | (writing[lp] ? EPOLLOUT : 0),
+				set->tag | (set->tagfds ? (fds[lp] << 8) : 0));
+	}
+	memcpy(set->fds, fds, count * sizeof(int));
+	memcpy(set->serial, serial, count * sizeof(unsigned int));
+	memcpy(set->writing, writing, count * sizeof(int));
+	set->count = count;
+}
+
+/**
+ * Bring everything that comes and goes up to date in the epoll set.
+ */
+static void watchchanging(){
+	int fds[WATCHSET_MAX], writing[WATCHSET_MAX];
+	unsigned int serial[WATCHSET_MAX];
+	watchoutput(&sink, rsyslogfd(), rsyslogbacklog());
+	watchoutput(&forward, forwardfd(), forwardbacklog());
+	watchset(&control, fds, serial, writing, controlfds(fds, serial, writing, WATCHSET_MAX));
+	watchset(&aggregate, fds, serial, writing, aggregatefds(fds, serial, writing, WATCHSET_MAX));
+}
+
+/**
+ * Set up the epoll set, timer and signals.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_EVENTLOOP
+ */
+static int openeventloop(){
+	struct itimerspec tick;
+	sigset_t signals;
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollfd == -1)
+		return ERR_EVENTLOOP;
+
+	memset(&tick, 0, sizeof(tick));
+	tick.it_value.tv_sec = EVENTLOOP_TICK;
+	tick.it_interval.tv_sec = EVENTLOOP_TICK;
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if ((timerfd == -1) || (timerfd_settime(timerfd, 0, &tick, NULL) == -1)
+			|| (watchfd(EPOLL_CTL_ADD, timerfd, EPOLLIN, EV_TIMER) == -1))
+		return ERR_EVENTLOOP;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) == -1)
+		return ERR_EVENTLOOP;
+	signalfd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if ((signalfd_ == -1) || (watchfd(EPOLL_CTL_ADD, signalfd_, EPOLLIN, EV_SIGNAL) == -1))
+		return ERR_EVENTLOOP;
+	if ((neighbourfd() != -1) && (watchfd(EPOLL_CTL_ADD, neighbourfd(), EPOLLIN, EV_NEIGHBOUR) == -1))
+		return ERR_EVENTLOOP;
+	return watchcapture();
+}
+
+/**
+ * Tear down what openeventloop() set up, and let signals through again.
+ */
+static void closeeventloop(){
+	sigset_t signals;
+	if (timerfd != -1)
+		close(timerfd);
+	if (signalfd_ != -1)
+		close(signalfd_);
+	if (epollfd != -1)
+		close(epollfd);
+	timerfd = signalfd_ = epollfd = capturefd = sink.fd = forward.fd = -1;
+	control.count = aggregate.count = 0;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGHUP);
+	sigprocmask(SIG_UNBLOCK, &signals, NULL);
+}
+
+/**
+ * Read whatever signals are waiting and act on them.
+ */
+static void handlesignals(){
+	struct signalfd_siginfo info;
+	while (read(signalfd_, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+		case SIGTERM:
+		case SIGINT:
+			running = 0;
+			break;
+		case SIGHUP:
+			flusheventlog(1);
+			if (openeventlog() != OK)
+				bluealert("Cannot reopen the event log. Structured events will not be written.");
+			break;
+		}
+	}
+}
+
+/**
+ * A tick of the timer: run the periodic work, and reopen the capture if
+ * capturestats() decided it needs a bigger buffer.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return Anything regrowcapture() or watchcapture() returns.
+ */
+static int handletimer(){
+	u_int64_t expirations;
+	int result;
+	/* several missed ticks only need one run */
+	if (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return OK;
+	periodicwork();
+	if (captureregrowing() == 0)
+		return OK;
+	/* the new handle may well get the same descriptor number, so start afresh */
+	watchfd(EPOLL_CTL_DEL, capturefd, 0, EV_CAPTURE);
+	capturefd = -1;
+	if ((result = regrowcapture()) != OK)
+		return result;
+	return watchcapture();
+}
+
+/**
+ * Run until told to stop, or until the capture fails.
+ *
+ * RETURN VALUES:
+ * \return OK - Stopped by a signal.
+ * \return ERR_EVENTLOOP - The loop couldn't be set up, or epoll failed.
+ * \return ERR_OPENLIVE, ERR_COMPILEBPF, ERR_SETFILTER - The capture couldn't
+ * be reopened.
+ */
+int runeventloop(){
+	struct epoll_event events[8];
+	int count, lp, result, frames;
+	if ((result = openeventloop()) != OK) {
+		closeeventloop();
+		return result;
+	}
+	while (running && (result == OK)) {
+		count = epoll_wait(epollfd, events, 8, -1);
+		if (count == -1) {
+			if (errno == EINTR)
+				continue;
+			result = ERR_EVENTLOOP;
+			break;
+		}
+		for (lp = 0; (lp < count) && (result == OK); lp++) {
+			switch (events[lp].data.u32 & 0xff) {
+			case EV_CAPTURE:
+				/* -2 just means capturestats() wants a bigger buffer; the timer deals with it. */
+				frames = pcap_dispatch(capturehandle(), EVENTLOOP_BATCH, my_callback, NULL);
+				if (frames == -1) {
+					bluealert(pcap_geterr(capturehandle()));
+					result = ERR_OPENLIVE;
+				} else
+					overloadbatch(frames, EVENTLOOP_BATCH); /* a full batch means more were waiting */
+				flushalerts();
+				break;
+			case EV_TIMER:
+				result = handletimer();
+				break;
+			case EV_SIGNAL:
+				handlesignals();
+				break;
+			case EV_SINK:
+				flushrsyslog();
+				break;
+			case EV_CONTROL:
+				servicecontrol();
+				break;
+			case EV_NEIGHBOUR:
+				serviceneighbour();
+				flushalerts();
+				break;
+			case EV_FORWARD:
+				flushforward(0);
+				break;
+			case EV_AGGREGATE:
+				serviceaggregate(events[lp].data.u32 >> 8);
+				flushalerts(); /* whatever the sensors sent us */
+				break;
+			}
+		}
+		watchchanging();
+	}
+	shutdownloop();
+	closeeventloop();
+	return result;
+}
+
+#else /* no epoll - fall back on pcap_loop() */
+
+static long lasttick = 0;
+
+/**
+ * Stop pcap_loop() from a signal handler. pcap_breakloop() is documented as
+ * safe to call from one.
+ */
+static void stopsignal(int signum){
+	running = 0;
+	if (capturehandle() != NULL)
+		pcap_breakloop(capturehandle());
+}
+
+/**
+ * my_callback(), plus the alert flushing and periodic work that has nowhere
+ * else to go without a proper event loop.
+ */
+static void loopcallback(u_char *useless, const struct pcap_pkthdr *framehdr, const u_char *frame){
+	long now;
+	my_callback(useless, framehdr, frame);
+	flushalerts();
+	now = time(NULL);
+	if (now - lasttick >= EVENTLOOP_TICK) {
+		lasttick = now;
+		periodicwork();
+	}
+}
+
+/**
+ * See the other runeventloop(). Periodic work only happens when frames arrive.
+ */
+int runeventloop(){
+	struct sigaction action;
+	int result = OK;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = stopsignal;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	/* capturestats() also breaks the loop, when the capture buffer needs to grow. */
+	while (running && (pcap_loop(capturehandle(), -1, loopcallback, NULL) == PCAP_ERROR_BREAK)) {
+		if (running && ((result = regrowcapture()) != OK))
+			break;
+	}
+	shutdownloop();
+	return result;
+}
+
+#endif
@@ -0,0 +1,362 @@
+/* -*- project-c -*- */
+/**
+ * \file evidence.c
+ * \brief Keeping the frames behind an alert.
+ *
+ * An alert says something happened; by the time anyone reads it, the frames
+ * that made it happen are long gone. With options.evidence set, we keep the
+ * most recent options.evidence_frames ARP (and neighbour discovery) frames in
+ * a ring, and when an alert is raised, the frames from
+ * options.evidence_seconds before it to options.evidence_seconds after it are
+ * written to a pcap file in that directory - only those involving the alert's
+ * address and MACs, if options.evidence_filter is set - for Wireshark or
+ * tcpdump to look at.
+ *
+ * The ring is allocated once. Each frame is copied into the next slot, header
+ * and all, under the slot's sequence number (the seqlock from sharedstate.h):
+ * a copy of a few dozen bytes, and no allocation, on the capture thread.
+ *
+ * Writing the file is left to a thread of its own. An alert just notes what's
+ * wanted; once the window after it has passed, flushevidence() hands a job to
+ * the writer, which reads the slots it needs straight out of the ring. The
+ * capture thread never waits for the disk. If capture laps the writer and a
+ * slot it wanted has been reused, that frame is left out - so the ring should
+ * hold a good deal more than twice evidence_seconds of ARP traffic.
+ *
+ * Bursts of alerts don't become bursts of files: an alert of the same kind,
+ * for the same address, as one already waiting is covered by that one, and at
+ * most EVIDENCE_JOBS wait at once.
+ */
+
+#include "antidote.h"
+#include <sys/stat.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#define EVIDENCE_SNAPLEN 128 /* bytes kept of each frame - CAPTURE_SNAPLEN, with room to spare */
+#define EVIDENCE_JOBS 16 /* alerts waiting for their files at once */
+
+struct evidenceslot {
+	volatile u_int32_t sequence; /* odd while the slot is being written */
+	u_int32_t caplen;
+	u_int32_t len;
+	u_int64_t serial; /* which frame this is, counting from 0 */
+	struct timeval ts; /* exactly as pcap gave it */
+	u_char data[EVIDENCE_SNAPLEN];
+};
+
+struct evidencejob {
+	struct alertrecord record;
+	long due; /* when the window after the alert is over */
+	u_int64_t last; /* serial of the last frame that might be wanted */
+	char filename[MAX_OPT_LENGTH + 64];
+};
+
+#if HAVE_LIBPTHREAD
+
+static struct evidenceslot *ring = NULL;
+static unsigned long slots = 0;
+static volatile u_int64_t written = 0; /* frames put in the ring */
+static int nanoseconds = 0;
+
+/* alerts whose windows are still open; capture thread only */
+static struct evidencejob waiting[EVIDENCE_JOBS];
+static int waitingcount = 0;
+
+/* jobs handed to the writer */
+static struct evidencejob jobs[EVIDENCE_JOBS];
+static unsigned int jobhead = 0, jobtail = 0;
+static int stopping = 0;
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobready = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int writing = 0;
+
+static volatile u_int32_t failures = 0; /* files the writer couldn't write */
+static u_int32_t reportedfailures = 0;
+static unsigned long skipped = 0, reportedskipped = 0;
+
+/**
+ * \return Non-zero if frame involves the alert's address or either of its
+ * MACs (or if the alert has neither, so anything might be relevant), and was
+ * on the alert's VLAN.
+ */
+static int relevant(const struct alertrecord *record, const struct evidenceslot *slot){
+	u_char untagged[sizeof(struct ether_header) + sizeof(struct ether_arp)];
+	const u_char *frame;
+	const struct ether_header *ethhdr;
+	const struct ether_arp *arpbody;
+	struct observation seen;
+	const u_int8_t *sender, *target, *claimed;
+	u_int32_t vlan;
+	int length, ipv6;
+	if (!(record->flags & (ALERTREC_IP | ALERTREC_OLDMAC | ALERTREC_NEWMAC)))
+		return 1;
+	frame = untagframe(slot->data, slot->caplen, untagged, &vlan);
+	if (frame != NULL) {
+		ethhdr = (const struct ether_header *)frame;
+		arpbody = (const struct ether_arp *)(frame + sizeof(struct ether_header));
+		sender = arpbody->arp_spa;
+		target = arpbody->arp_tpa;
+		claimed = arpbody->arp_sha;
+		length = 4;
+		ipv6 = 0;
+	} else if (parsend(slot->data, slot->caplen, &seen, &vlan)) {
+		ethhdr = (const struct ether_header *)slot->data;
+		sender = seen.key;
+		target = seen.other;
+		claimed = seen.claimed_mac;
+		length = IP_KEYSIZE;
+		ipv6 = ALERTREC_IPV6;
+	} else {
+		return 0;
+	}
+	/* the same address in another VLAN is another host */
+	if ((record->flags & ALERTREC_VLAN) && (record->vlan != VLAN_OVERFLOW) && (record->vlan != vlan))
+		return 0;
+	if ((record->flags & ALERTREC_IP) && ((record->flags & ALERTREC_IPV6) == ipv6)
+			&& ((memcmp(sender, record->ip_address, length) == 0) || (memcmp(target, record->ip_address, length) == 0)))
+		return 1;
+	if ((record->flags & ALERTREC_OLDMAC) && ((memcmp(ethhdr->ether_shost, record->old_mac, ETH_ALEN) == 0)
+						  || (memcmp(claimed, record->old_mac, ETH_ALEN) == 0)))
+		return 1;
+	if ((record->flags & ALERTREC_NEWMAC) && ((memcmp(ethhdr->ether_shost, record->new_mac, ETH_ALEN) == 0)
+						  || (memcmp(claimed, record->new_mac, ETH_ALEN) == 0)))
+		return 1;
+	return 0;
+}
+
+/**
+ * Write one job's frames out. Writer thread only: reads the ring, and nothing
+ * else the capture thread changes.
+ */
+static void writejob(const struct evidencejob *job){
+	struct evidenceslot copy;
+	struct pcap_pkthdr header;
+	pcap_t *dead;
+	pcap_dumper_t *dumper;
+	u_int64_t serial, first;
+	long long alerted, stamp, window;
+	alerted = (long long)job->record.when.tv_sec * 1000000 + job->record.when.tv_usec;
+	window = (long long)options.evidence_seconds * 1000000;
+	first = (job->last + 1 > slots) ? job->last + 1 - slots : 0;
+
+#ifdef PCAP_TSTAMP_PRECISION_NANO
+	dead = pcap_open_dead_with_tstamp_precision(DLT_EN10MB, EVIDENCE_SNAPLEN,
+						    nanoseconds ? PCAP_TSTAMP_PRECISION_NANO : PCAP_TSTAMP_PRECISION_MICRO);
+#else
+	dead = pcap_open_dead(DLT_EN10MB, EVIDENCE_SNAPLEN);
+#endif
+	if (dead == NULL) {
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	dumper = pcap_dump_open(dead, job->filename);
+	if (dumper == NULL) {
+		__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+		pcap_close(dead);
+		return;
+	}
+	for (serial = first; serial <= job->last; serial++) {
+		if (!sharedread(&ring[serial % slots].sequence, &ring[serial % slots], &copy, sizeof(copy))
+				|| (copy.serial != serial))
+			continue; /* capture has been round again since */
+		stamp = (long long)copy.ts.tv_sec * 1000000 + (nanoseconds ? copy.ts.tv_usec / 1000 : copy.ts.tv_usec);
+		if ((stamp < alerted - window) || (stamp > alerted + window))
+			continue;
+		if (options.evidence_filter && !relevant(&job->record, &copy))
+			continue;
+		header.ts = copy.ts;
+		header.caplen = copy.caplen;
+		header.len = copy.len;
+		pcap_dump((u_char *)dumper, &header, copy.data);
+	}
+	pcap_dump_close(dumper);
+	pcap_close(dead);
+}
+
+static void *evidencewriter(void *unused){
+	struct evidencejob job;
+	pthread_mutex_lock(&joblock);
+	for (;;) {
+		while ((jobhead == jobtail) && !stopping)
+			pthread_cond_wait(&jobready, &joblock);
+		if (jobhead == jobtail)
+			break;
+		job = jobs[jobtail % EVIDENCE_JOBS];
+		pthread_mutex_unlock(&joblock);
+		writejob(&job);
+		pthread_mutex_lock(&joblock);
+		jobtail++;
+	}
+	pthread_mutex_unlock(&joblock);
+	return NULL;
+}
+
+/**
+ * Let the writer finish what it's been given, and stop it. Run at exit.
+ */
+void closeevidence(){
+	if (!writing)
+		return;
+	flushevidence(1);
+	pthread_mutex_lock(&joblock);
+	stopping = 1;
+	pthread_cond_signal(&jobready);
+	pthread_mutex_unlock(&joblock);
+	pthread_join(writer, NULL);
+	writing = 0;
+}
+
+/**
+ * Set up the ring and start the writer, if options.evidence says where the
+ * files go.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or we're not keeping evidence.
+ * \return ERR_NOMEM
+ * \return ERR_EVIDENCE - The directory can't be made or written to, or the
+ * writer can't be started.
+ */
+int openevidence(){
+	if (options.evidence[0] == '\0')
+		return OK;
+	if ((mkdir(options.evidence, 0750) != 0) && (errno != EEXIST))
+		return ERR_EVIDENCE;
+	if (access(options.evidence, W_OK | X_OK) != 0)
+		return ERR_EVIDENCE;
+	slots = options.evidence_frames;
+	ring = calloc(slots, sizeof(struct evidenceslot));
+	if (ring == NULL)
+		return ERR_NOMEM;
+	if (pthread_create(&writer, NULL, evidencewriter, NULL) != 0) {
+		free(ring);
+		ring = NULL;
+		return ERR_EVIDENCE;
+	}
+	writing = 1;
+	atexit(closeevidence);
+	return OK;
+}
+
+/**
+ * Keep a frame in the ring. Capture thread only.
+ */
+void evidenceframe(const struct pcap_pkthdr *framehdr, const u_char *frame){
+	struct evidenceslot *slot;
+	if (ring == NULL)
+		return;
+	slot = &ring[written % slots];
+	sharedbeginwrite(&slot->sequence);
+	slot->serial = written;
+	slot->ts = framehdr->ts;
+	slot->len = framehdr->len;
+	slot->caplen = (framehdr->caplen < EVIDENCE_SNAPLEN) ? framehdr->caplen : EVIDENCE_SNAPLEN;
+	memcpy(slot->data, frame, slot->caplen);
+	sharedendwrite(&slot->sequence);
+	__atomic_store_n(&written, written + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Note that an alert wants its evidence kept. Capture thread only - this is
+ * called as each alert is raised.
+ */
+void evidencealert(const struct alertrecord *record){
+	struct evidencejob *job;
+	struct tm when;
+	char address[IP_NAMESIZE + 5 + VLAN_NAMESIZE], name[VLAN_NAMESIZE];
+	int lp;
+	if ((ring == NULL) || (alertkindpriority(record->kind) == 0))
+		return; /* only for real alerts, not events which are just logged */
+	nanoseconds = capturenanoseconds();
+	for (lp = 0; lp < waitingcount; lp++) {
+		if ((waiting[lp].record.kind == record->kind)
+				&& (memcmp(waiting[lp].record.ip_address, record->ip_address, IP_KEYSIZE) == 0)
+				&& (waiting[lp].record.vlan == record->vlan))
+			return; /* that one's file will show this too */
+	}
+	if (waitingcount == EVIDENCE_JOBS) {
+		skipped++;
+		return;
+	}
+	job = &waiting[waitingcount++];
+	job->record = *record;
+	job->due = record->when.tv_sec + options.evidence_seconds + 1;
+	localtime_r(&record->when.tv_sec, &when);
+	if (record->flags & ALERTREC_IP)
+		formatip(record->ip_address, (record->flags & ALERTREC_IPV6) ? AF_INET6 : AF_INET, address);
+	else
+		strcpy(address, "all");
+	if ((record->flags & ALERTREC_VLAN) && (record->vlan != 0)) {
+		strcat(address, "-vlan");
+		strcat(address, formatvlan(record->vlan, name));
+	}
+	snprintf(job->filename, sizeof(job->filename), "%s/%04d%02d%02d-%02d%02d%02d-%s-%s.pcap", options.evidence,
+		 when.tm_year + 1900, when.tm_mon + 1, when.tm_mday, when.tm_hour, when.tm_min, when.tm_sec,
+		 alertkindname(record->kind), address);
+}
+
+/**
+ * Hand the writer every job whose window has closed (every job, if force is
+ * set), and report anything that's gone wrong. Called every tick.
+ */
+void flushevidence(int force){
+	char msg[ADOTE_ERR_BUFF];
+	u_int32_t failed;
+	long now;
+	int lp, kept = 0;
+	if (ring == NULL)
+		return;
+	now = time(NULL);
+	for (lp = 0; lp < waitingcount; lp++) {
+		if (!force && (now < waiting[lp].due)) {
+			waiting[kept++] = waiting[lp];
+			continue;
+		}
+		if (__atomic_load_n(&written, __ATOMIC_ACQUIRE) == 0)
+			continue; /* nothing to show for it */
+		waiting[lp].last = __atomic_load_n(&written, __ATOMIC_ACQUIRE) - 1;
+		pthread_mutex_lock(&joblock);
+		if (jobhead - jobtail < EVIDENCE_JOBS) {
+			jobs[jobhead++ % EVIDENCE_JOBS] = waiting[lp];
+			pthread_cond_signal(&jobready);
+			pthread_mutex_unlock(&joblock);
+			snprintf(msg, sizeof(msg), "Evidence for the %s alert is being saved in %s",
+				 alertkindname(waiting[lp].record.kind), waiting[lp].filename);
+			notice(msg);
+		} else {
+			pthread_mutex_unlock(&joblock);
+			skipped++;
+		}
+	}
+	waitingcount = kept;
+	failed = __atomic_load_n(&failures, __ATOMIC_RELAXED);
+	if ((failed != reportedfailures) || (skipped != reportedskipped)) {
+		snprintf(msg, sizeof(msg), "Evidence not saved: %u files could not be written, %lu alerts were skipped while the writer was busy.",
+			 failed - reportedfailures, skipped - reportedskipped);
+		bluealert(msg);
+		reportedfailures = failed;
+		reportedskipped = skipped;
+	}
+}
+
+#else /* no threads */
+
+int openevidence(){
+	return (options.evidence[0] == '\0') ? OK : ERR_EVIDENCE;
+}
+
+void evidenceframe(const struct pcap_pkthdr *framehdr, const u_char *frame){
+}
+
+void evidencealert(const struct alertrecord *record){
+}
+
+void flushevidence(int force){
+}
+
+void closeevidence(){
+}
+
+#endif
@@ -0,0 +1,403 @@
+/* -*- project-c -*- */
+/**
+ * \file forward.c
+ * \brief Streaming observations and alerts to a central aggregator.
+ *
+ * With options.forward set, antidote is a sensor: as well as doing everything
+ * it normally does, it sends every ARP frame it sees (as a compact
+ * observation) and every alert it raises to an antidote running with
+ * Aggregate set (see aggregate.c), which can see across all the segments its
+ * sensors are on.
+ *
+ * Events are packed into batches (the layout is described with FORWARD_HEADER
+ * in antidote.h) of up to FORWARD_BATCH bytes. A batch goes when it's full,
+ * when it holds an alert, or when it's a second old - whichever comes first -
+ * and, if options.forward_compress is set and we were built with zlib, it's
+ * compressed on the way.
+ *
+ * The aggregator may be given as host:port (TCP) or as the path of a Unix
+ * socket. The connection is like the remote syslog's: never blocking, retried
+ * with a backoff if it drops, and with options.forward_queue bytes of batches
+ * held while it's away. If that fills, whole batches are dropped and counted -
+ * capture never waits for the aggregator. Every connection starts with a hello
+ * giving options.sensor_name, so the aggregator knows who's talking.
+ */
+
+#include "antidote.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#if HAVE_LIBZ && HAVE_ZLIB_H
+#include <zlib.h>
+#define USE_ZLIB 1
+#endif
+
+#define FORWARD_DELAY 1 /* most seconds an event waits in an unfinished batch */
+#define FORWARD_RETRY_MIN 1
+#define FORWARD_RETRY_MAX 60
+#define FORWARD_REPORT 60 /* seconds between complaints about dropped events */
+
+#define FW_DOWN 0
+#define FW_CONNECTING 1
+#define FW_UP 2
+
+static struct sockaddr_storage destination;
+static socklen_t destinationlen = 0;
+static int remotefd = -1;
+static int state = FW_DOWN;
+static long nextattempt = 0, retry = FORWARD_RETRY_MIN;
+
+/* the batch being filled: events go in after room for the header */
+static u_int8_t batch[FORWARD_HEADER + FORWARD_BATCH];
+static size_t batchlen = 0;
+static unsigned int batchcount = 0;
+static long batchstarted = 0;
+static int urgent = 0;
+
+/* finished batches, back to back, waiting to be sent */
+static u_int8_t *queue = NULL;
+static size_t queuesize = 0, queuestart = 0, queueend = 0;
+static size_t firstsent = 0; /* bytes of the batch at queuestart already sent */
+
+static u_int8_t hello[FORWARD_HEADER + 2 + 255];
+static size_t hellolen = 0, hellosent = 0;
+
+static unsigned long sent = 0, dropped = 0, reported = 0;
+static long lastreport = 0;
+
+static u_int8_t *put16(u_int8_t *dest, u_int16_t value){
+	*dest++ = (value >> 8) & 0xff;
+	*dest++ = value & 0xff;
+	return dest;
+}
+
+static u_int8_t *put32(u_int8_t *dest, u_int32_t value){
+	*dest++ = (value >> 24) & 0xff;
+	*dest++ = (value >> 16) & 0xff;
+	*dest++ = (value >> 8) & 0xff;
+	*dest++ = value & 0xff;
+	return dest;
+}
+
+static u_int32_t get32(const u_int8_t *src){
+	return ((u_int32_t)src[0] << 24) | ((u_int32_t)src[1] << 16) | ((u_int32_t)src[2] << 8) | src[3];
+}
+
+/**
+ * Fill in a batch header in front of length bytes of events.
+ */
+static void putheader(u_int8_t *dest, size_t length, int flags, unsigned int count, size_t unpacked){
+	dest = put32(dest, FORWARD_HEADER - 4 + length);
+	*dest++ = FORWARD_VERSION;
+	*dest++ = flags;
+	dest = put16(dest, count);
+	put32(dest, unpacked);
+}
+
+/**
+ * Work out where the aggregator is, and get the queue and hello ready. Doesn't
+ * connect - that happens the first time there's something to send.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or we're not forwarding.
+ * \return ERR_NOMEM
+ * \return ERR_FORWARD - The aggregator's address makes no sense.
+ */
+int openforward(){
+	struct addrinfo hints, *found;
+	struct sockaddr_un *local;
+	char host[MAX_OPT_LENGTH], name[256];
+	char *port;
+	size_t namelen;
+	if (options.forward[0] == '\0')
+		return OK;
+	memset(&destination, 0, sizeof(destination));
+	if (options.forward[0] == '/') {
+		local = (struct sockaddr_un *)&destination;
+		if (strlen(options.forward) >= sizeof(local->sun_path))
+			return ERR_FORWARD;
+		local->sun_family = AF_UNIX;
+		strcpy(local->sun_path, options.forward);
+		destinationlen = sizeof(struct sockaddr_un);
+	} else {
+		strcpy(host, options.forward);
+		port = strrchr(host, ':');
+		if (port == NULL)
+			return ERR_FORWARD;
+		*port++ = '\0';
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host, port, &hints, &found) != 0)
+			return ERR_FORWARD;
+		memcpy(&destination, found->ai_addr, found->ai_addrlen);
+		destinationlen = found->ai_addrlen;
+		freeaddrinfo(found);
+	}
+
+	free(queue);
+	queuesize = options.forward_queue;
+	queue = malloc(queuesize);
+	if (queue == NULL) {
+		queuesize = 0;
+		return ERR_NOMEM;
+	}
+	queuestart = queueend = firstsent = 0;
+
+	strncpy(name, options.sensor_name, sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+#if HAVE_GETHOSTNAME
+	if ((name[0] == '\0') && (gethostname(name, sizeof(name)) != 0))
+#else
+	if (name[0] == '\0')
+#endif
+		strcpy(name, "-");
+	name[sizeof(name) - 1] = '\0';
+	namelen = strlen(name);
+	if (namelen > 255)
+		namelen = 255;
+	hello[FORWARD_HEADER] = FWD_HELLO;
+	hello[FORWARD_HEADER + 1] = namelen;
+	memcpy(hello + FORWARD_HEADER + 2, name, namelen);
+	putheader(hello, 2 + namelen, 0, 1, 2 + namelen);
+	hellolen = FORWARD_HEADER + 2 + namelen;
+	return OK;
+}
+
+/**
+ * Move the batch being filled into the queue, compressing it if asked to. If
+ * there's no room, it's dropped.
+ */
+static void closebatch(){
+#ifdef USE_ZLIB
+	static u_int8_t packed[FORWARD_HEADER + FORWARD_BATCH + FORWARD_BATCH / 100 + 64];
+	uLongf packedlen;
+#endif
+	u_int8_t *finished = batch;
+	size_t length = batchlen;
+	int flags = 0;
+	if (batchcount == 0)
+		return;
+#ifdef USE_ZLIB
+	if (options.forward_compress) {
+		packedlen = sizeof(packed) - FORWARD_HEADER;
+		if ((compress2(packed + FORWARD_HEADER, &packedlen, batch + FORWARD_HEADER, batchlen, Z_BEST_SPEED) == Z_OK)
+				&& (packedlen < batchlen)) {
+			finished = packed;
+			length = packedlen;
+			flags = FORWARD_COMPRESSED;
+		}
+	}
+#endif
+	putheader(finished, length, flags, batchcount, batchlen);
+	length += FORWARD_HEADER;
+	if ((queueend + length > queuesize) && (queuestart > 0)) {
+		/* slide what's left to the front */
+		memmove(queue, queue + queuestart, queueend - queuestart);
+		queueend -= queuestart;
+		queuestart = 0;
+	}
+	if (queueend + length > queuesize) {
+		dropped += batchcount;
+	} else {
+		memcpy(queue + queueend, finished, length);
+		queueend += length;
+	}
+	batchlen = batchcount = 0;
+	urgent = 0;
+}
+
+/**
+ * Make room in the batch for an event of size bytes, sending the batch on if
+ * it's full. \return Where to put the event.
+ */
+static u_int8_t *addevent(size_t size){
+	u_int8_t *event;
+	if (batchlen + size > FORWARD_BATCH)
+		closebatch();
+	if (batchcount == 0)
+		batchstarted = time(NULL);
+	event = batch + FORWARD_HEADER + batchlen;
+	batchlen += size;
+	batchcount++;
+	return event;
+}
+
+/**
+ * Note an ARP frame for the aggregator, with the VLAN it came in on - an
+ * address in one VLAN has nothing to do with the same address in another. The
+ * frame must be long enough to hold an ARP packet, untagged - my_callback()
+ * makes sure of that.
+ */
+void forwardframe(const u_char *frame, u_int32_t vlan, const struct timeval *when){
+	struct ether_arp *arpbody;
+	u_int8_t *event;
+	if (queue == NULL)
+		return;
+	arpbody = (struct ether_arp *)(frame + sizeof(struct ether_header));
+	event = addevent(FWD_OBSERVATIONSIZE);
+	*event++ = FWD_OBSERVATION;
+	*event++ = ntohs(arpbody->ea_hdr.ar_op) & 0xff;
+	memcpy(event, arpbody->arp_sha, ETH_ALEN);
+	event += ETH_ALEN;
+	memcpy(event, arpbody->arp_spa, 4);
+	event += 4;
+	memcpy(event, arpbody->arp_tpa, 4);
+	event += 4;
+	event = put32(event, (u_int32_t)when->tv_sec);
+	event = put32(event, (u_int32_t)when->tv_usec);
+	put32(event, vlan);
+}
+
+/**
+ * Send an alert to the aggregator. The batch it's in goes at the next flush.
+ */
+void forwardalert(const struct alertrecord *record){
+	u_int8_t *event;
+	if (queue == NULL)
+		return;
+	event = addevent(1 + ALERT_WIRESIZE);
+	*event = FWD_ALERT;
+	formatalertbinary(record, event + 1);
+	urgent = 1;
+}
+
+/**
+ * Give up on the connection and schedule another attempt. A batch which was
+ * only partly sent is lost - the aggregator can't use half of one.
+ */
+static void dropconnection(){
+	if (remotefd != -1)
+		close(remotefd);
+	remotefd = -1;
+	state = FW_DOWN;
+	if (firstsent > 0) {
+		dropped += (queue[queuestart + 6] << 8) | queue[queuestart + 7];
+		queuestart += 4 + get32(queue + queuestart);
+		firstsent = 0;
+	}
+	hellosent = 0;
+	nextattempt = time(NULL) + retry;
+	retry *= 2;
+	if (retry > FORWARD_RETRY_MAX)
+		retry = FORWARD_RETRY_MAX;
+}
+
+/**
+ * Start a non-blocking connection if we haven't got one and it's time to try.
+ */
+static void startconnection(){
+	if ((state != FW_DOWN) || (time(NULL) < nextattempt))
+		return;
+	remotefd = socket(destination.ss_family, SOCK_STREAM, 0);
+	if (remotefd == -1) {
+		dropconnection();
+		return;
+	}
+	fcntl(remotefd, F_SETFL, fcntl(remotefd, F_GETFL, 0) | O_NONBLOCK);
+	if (connect(remotefd, (struct sockaddr *)&destination, destinationlen) == 0) {
+		state = FW_UP;
+		retry = FORWARD_RETRY_MIN;
+	} else if (errno == EINPROGRESS) {
+		state = FW_CONNECTING;
+	} else {
+		dropconnection();
+	}
+}
+
+/**
+ * See whether a connection in progress has finished, one way or the other.
+ */
+static void checkconnection(){
+	struct pollfd waiting;
+	int error = 0;
+	socklen_t errorlen = sizeof(error);
+	if (state != FW_CONNECTING)
+		return;
+	waiting.fd = remotefd;
+	waiting.events = POLLOUT;
+	if (poll(&waiting, 1, 0) <= 0)
+		return;
+	if ((getsockopt(remotefd, SOL_SOCKET, SO_ERROR, &error, &errorlen) != 0) || (error != 0)) {
+		dropconnection();
+		return;
+	}
+	state = FW_UP;
+	retry = FORWARD_RETRY_MIN;
+}
+
+/**
+ * Finish the current batch if it's been waiting long enough (or if force is
+ * set), and send as much as the socket will take without blocking. Called
+ * whenever alerts are flushed, and whenever the socket may have room.
+ */
+void flushforward(int force){
+	u_int8_t *data;
+	size_t length, first;
+	ssize_t written;
+	char msg[ADOTE_ERR_BUFF];
+	if (queue == NULL)
+		return;
+	if ((dropped != reported) && (time(NULL) - lastreport >= FORWARD_REPORT)) {
+		snprintf(msg, sizeof(msg), "The aggregator is not keeping up: %lu events dropped (%lu sent).", dropped, sent);
+		bluealert(msg);
+		reported = dropped;
+		lastreport = time(NULL);
+	}
+	if ((batchcount > 0) && (force || urgent || (time(NULL) - batchstarted >= FORWARD_DELAY)))
+		closebatch();
+	if (queuestart == queueend)
+		return;
+	startconnection();
+	checkconnection();
+	while (state == FW_UP) {
+		if (hellosent < hellolen) {
+			data = hello + hellosent;
+			length = hellolen - hellosent;
+		} else if (queuestart + firstsent < queueend) {
+			data = queue + queuestart + firstsent;
+			length = queueend - queuestart - firstsent;
+		} else {
+			queuestart = queueend = 0;
+			return;
+		}
+		written = send(remotefd, data, length, MSG_NOSIGNAL);
+		if (written < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return;
+			dropconnection();
+			return;
+		}
+		if (hellosent < hellolen) {
+			hellosent += written;
+			continue;
+		}
+		/* step over every batch that's now gone completely */
+		firstsent += written;
+		while (queuestart < queueend) {
+			first = 4 + get32(queue + queuestart);
+			if (firstsent < first)
+				break;
+			sent += (queue[queuestart + 6] << 8) | queue[queuestart + 7];
+			queuestart += first;
+			firstsent -= first;
+		}
+	}
+}
+
+/**
+ * \return The socket to the aggregator, or -1 if there isn't one.
+ */
+int forwardfd(){
+	return remotefd;
+}
+
+/**
+ * \return Bytes waiting to go to the aggregator (0 if there are no batches
+ * waiting, even if the hello hasn't gone yet).
+ */
+int forwardbacklog(){
+	if (queuestart == queueend)
+		return 0;
+	return (queueend - queuestart - firstsent) + (hellolen - hellosent);
+}
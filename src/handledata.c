@@ -9,26 +9,249 @@
  */
 
 #include "antidote.h"
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Book-keeping for the IP table as a whole. records is the number of ipdetails
+ * structures currently allocated - never more than options.max_records - and
+ * evictions the number thrown away by makeroom() to keep it so, and each
+ * VLAN's partition under its own limit. Each partition
+ * keeps the same two counts for itself, its own first record (where readers
+ * on other threads start - see readfirst()) and its own eviction hand.
+ */
+static unsigned long records = 0;
+static unsigned long evictions = 0;
+
+/**
+ * \return Non-zero if two IP_KEYSIZE byte keys are the same. One compare of
+ * sixteen bytes where SSE2 has it, two of eight where it doesn't; either way
+ * no slower for an IPv4 key than comparing its four bytes was.
+ */
+static inline int samekey(const u_int8_t *first, const u_int8_t *second){
+#ifdef __SSE2__
+	__m128i a, b;
+	a = _mm_loadu_si128((const __m128i *)first);
+	b = _mm_loadu_si128((const __m128i *)second);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+#else
+	u_int64_t a[2], b[2];
+	memcpy(a, first, IP_KEYSIZE);
+	memcpy(b, second, IP_KEYSIZE);
+	return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+#endif
+}
+
+/**
+ * Hash a key for a partition's index: both halves multiplied in, and the high
+ * bits folded down, so that the low bits the bucket is taken from depend on
+ * every byte - IPv4 keys differ only in their first four.
+ */
+static inline unsigned long hashkey(const u_int8_t *key){
+	u_int64_t half[2], hash;
+	memcpy(half, key, IP_KEYSIZE);
+	hash = (half[0] ^ (half[1] * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+	return (unsigned long)(hash ^ (hash >> 29) ^ (hash >> 47));
+}
+
+/**
+ * Put a record in its partition's index, doubling the index first if it's
+ * holding more records than it has buckets. If the index can't be made or
+ * grown, it just gets fuller - lookups slow down, but nothing is lost.
+ */
+static void indexip(struct ipdetails *ip){
+	struct partition *table = ip->partition;
+	struct ipdetails **bigger, *current, *following;
+	unsigned long size, lp, slot;
+	if ((table->index == NULL) || (table->records > table->indexsize)) {
+		size = (table->index == NULL) ? IP_INDEXSIZE : table->indexsize * 2;
+		bigger = calloc(size, sizeof(struct ipdetails *));
+		if (bigger != NULL) {
+			for (lp = 0; lp < table->indexsize; lp++) {
+				for (current = table->index[lp]; current != NULL; current = following) {
+					following = current->hashnext;
+					slot = hashkey(current->ip_address) & (size - 1);
+					current->hashnext = bigger[slot];
+					bigger[slot] = current;
+				}
+			}
+			free(table->index);
+			table->index = bigger;
+			table->indexsize = size;
+		} else if (table->index == NULL) {
+			return;
+		}
+	}
+	slot = hashkey(ip->ip_address) & (table->indexsize - 1);
+	ip->hashnext = table->index[slot];
+	table->index[slot] = ip;
+}
+
+/**
+ * Take a record out of its partition's index.
+ */
+static void unindexip(struct ipdetails *ip){
+	struct partition *table = ip->partition;
+	struct ipdetails **link;
+	if (table->index == NULL)
+		return;
+	for (link = &table->index[hashkey(ip->ip_address) & (table->indexsize - 1)]; *link != NULL; link = &(*link)->hashnext) {
+		if (*link == ip) {
+			*link = ip->hashnext;
+			break;
+		}
+	}
+	ip->hashnext = NULL;
+}
 
 /** 
  * \return Returns a pointer to a memory space suitable for
- * storing an ipdetails structure.
+ * storing an ipdetails structure, in the partition *table (it still has to be
+ * linked in, with linkip()).
  * 
- * Automatically fills in the lastreset value at the same time.
+ * Automatically fills in the lastreset value (and when the record was created,
+ * for its baseline - see baseline.c) at the same time. Its policy is the
+ * global one until linkip() finds its own, so it never has none.
  */
-struct ipdetails *createipspace() {
+struct ipdetails *createipspace(struct partition *table) {
 	struct ipdetails *result;
 	struct timeval *timer;
 	timer = malloc(sizeof(struct timeval));
 	if (timer == NULL)
 		return NULL;
 	result = calloc(1, sizeof(struct ipdetails));
+	if (result == NULL) {
+		free(timer);
+		return NULL;
+	}
 	if (gettimeofday(timer, NULL) == 0)
-		result->lastreset = timer->tv_sec;
+		result->lastreset = result->created = result->windowstart = timer->tv_sec;
 	free(timer);
+	result->partition = table;
+	result->policy = globalpolicy();
+	table->records++;
+	records++;
 	return result;
 }
 
+/**
+ * \return The number of IP records currently held.
+ */
+unsigned long recordcount(){
+	return records;
+}
+
+/**
+ * \return The number of IP records evicted to keep partitions under their limits.
+ */
+unsigned long evictioncount(){
+	return evictions;
+}
+
+/**
+ * Throw one record out of a partition, to make room. This is a CLOCK (second
+ * chance) sweep: the hand walks the list, clearing the referenced bit on
+ * anything that's been looked up since it last passed, and anything without
+ * the bit set is a candidate. Records which have only ever been requested and
+ * never replied to are thrown out in preference to the rest, since a request
+ * sweep across a large subnet fills the table with exactly those and they
+ * carry no MAC worth keeping.
+ *
+ * The hand never looks at more than EVICT_SCAN records per eviction, so however
+ * the table's been filled a single call is cheap. If nothing in that window is
+ * ideal, the first unreferenced record goes, and failing that the first record
+ * we saw at all - memory stays bounded whatever the traffic looks like.
+ *
+ * \return OK, or ERR_BADUSAGE if there's nothing but *keep to evict.
+ */
+static int evictone(struct partition *table, struct ipdetails *keep){
+	struct ipdetails *current, *victim, *unreferenced, *fallback;
+	char msg[ADOTE_ERR_BUFF], name[VLAN_NAMESIZE];
+	int scanned;
+	victim = unreferenced = fallback = NULL;
+	if (table->clockhand == NULL)
+		table->clockhand = table->head;
+	current = table->clockhand;
+	for (scanned = 0; (current != NULL) && (scanned < EVICT_SCAN) && (victim == NULL); scanned++) {
+		if (current != keep) {
+			if (fallback == NULL)
+				fallback = current;
+			if (current->referenced) {
+				current->referenced = 0;
+			} else if ((current->replies == 0)
+					&& (sumbytes(current->mac_address, ETH_ALEN) == 0)) {
+				victim = current;
+			} else if (unreferenced == NULL) {
+				unreferenced = current;
+			}
+		}
+		current = (current->next != NULL) ? current->next : table->head;
+	}
+	table->clockhand = current;
+	if (victim == NULL)
+		victim = (unreferenced != NULL) ? unreferenced : fallback;
+	if (victim == NULL)
+		return ERR_BADUSAGE;
+	removeip(victim);
+	evictions++;
+	if ((++table->evictions == 1) && (table->vlan == 0)) {
+		snprintf(msg, sizeof(msg), "%s table full - evicting old records. Consider raising MaxRecords.",
+			 (table->family == AF_INET6) ? "IPv6" : "IP");
+		notice(msg);
+	} else if (table->evictions == 1) {
+		snprintf(msg, sizeof(msg), "%s table for VLAN %s full - evicting old records. Consider raising MaxRecords, or its VlanTable limit.",
+			 (table->family == AF_INET6) ? "IPv6" : "IP", formatvlan(table->vlan, name));
+		notice(msg);
+	}
+	return OK;
+}
+
+/**
+ * Make sure there is room for one more IP record in a partition.
+ *
+ * Two limits apply. A partition may hold its own max_records (options.max_records,
+ * unless a VlanTable line says otherwise), and if it's already holding that
+ * many, one of its own records goes. And the whole table, every VLAN and both
+ * families together, may hold options.max_records; when it's full, the record
+ * that goes comes from whichever partition is to blame. That's this one if it
+ * holds more than its share - options.max_records / options.vlan_partitions -
+ * so a storm in one VLAN, once the table's full, only churns its own records.
+ * Otherwise it's the biggest partition: a VLAN still under its share always
+ * gets its record, at the expense of whoever has taken the most.
+ *
+ * ARGUMENTS:
+ * \arg \c *table - The partition the new record's going into.
+ * \arg \c *keep - A record which must not be evicted (usually the entry point),
+ * or NULL for the first record of an empty partition.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_BADUSAGE - table is NULL, or there's nothing else to evict.
+ */
+int makeroom(struct partition *table, struct ipdetails *keep){
+	struct partition *biggest, *other;
+	if (table == NULL)
+		return ERR_BADUSAGE;
+	while (table->records >= table->max_records) {
+		if (evictone(table, keep) != OK)
+			return ERR_BADUSAGE;
+	}
+	while (records >= options.max_records) {
+		biggest = table;
+		if (table->records <= options.max_records / options.vlan_partitions) {
+			for (other = firstpartition(); other != NULL; other = other->next) {
+				if (other->records > biggest->records)
+					biggest = other;
+			}
+		}
+		if (evictone(biggest, keep) != OK)
+			return ERR_BADUSAGE;
+	}
+	return OK;
+}
+
 /**
  * Pull the IP address from a frame and return a pointer to it.
  * \return Returns a null pointer if handed a null frame.
@@ -51,55 +274,38 @@ u_int8_t *getipaddress(const char *frame){
 }
 
 /**
- * Populates a given IP space with data from a given frame, first checking
- * to see if it's an ARP reply or a request.
+ * Populates a given IP space with what a frame says, first checking to see if
+ * it's a reply or a request.
  */
-int populateipspace(struct ipdetails *ip_space, const u_char *frame){
-	u_int16_t temp;
+int populateipspace(struct ipdetails *ip_space, const struct observation *seen){
 	int result = ERR_BADUSAGE;
-	struct arphdr *arpheader;
-	if ((arpheader = (struct arphdr *)malloc(sizeof(struct arphdr))) == NULL)
-		return ERR_NOMEM;
-	frame += sizeof(struct ether_header);
-	arpheader = (struct arphdr *) frame;
-	frame -= sizeof(struct ether_header); /* AAARGH! */
-	temp = (u_int16_t)arpheader->ar_op;
-	temp = ntohs(temp);
-	switch (temp){
-	case (ARPOP_REQUEST): result = populateipspacereq(ip_space, frame);
+	switch (seen->op){
+	case (ARPOP_REQUEST): result = populateipspacereq(ip_space, seen);
 		break;
-	case (ARPOP_REPLY): result = populateipspacerep(ip_space, frame);
+	case (ARPOP_REPLY): result = populateipspacerep(ip_space, seen);
 		break;
 	}
 	return result;
 }
 /**
- * Populates a given IP space with data from the given ethernet frame.
+ * Populates a given IP space with what a frame says.
  * Should correctly fill everything which it reasonably can in.
  *
  * This routine is used if the IP space is being filled with details taken 
- * from an ARP request : for a routine for details coming from an ARP reply,
- * see populateipspacerep(). For a generic wrapper which decides which 
- * routine to use, see populateipspace().
+ * from an ARP request (or a neighbour solicitation): for a routine for details
+ * coming from a reply, see populateipspacerep(). For a generic wrapper which
+ * decides which routine to use, see populateipspace().
  *
  * Does not link with other ipspaces or affect any other details.
  *
- * Does check that MACS in header & ARP packet tally.
- *
  * WHEN LOOKING AT A REQUEST, WE FILE ACCORDING TO RECIPIENT.
  */
-int populateipspacereq(struct ipdetails *ip_space, const u_char *frame){
-	struct ether_arp *arpbody;
-	struct ether_header *etherhead;
-	int lp;
-	if ((ip_space == NULL) || (frame == NULL))
+int populateipspacereq(struct ipdetails *ip_space, const struct observation *seen){
+	if ((ip_space == NULL) || (seen == NULL))
 		return ERR_BADUSAGE;
-	etherhead = (struct ether_header *) frame;
-	frame += sizeof(struct ether_header);
-	arpbody = (struct ether_arp *) frame;
-	for (lp = 0; lp <= 3; lp++) {
-	        ip_space->ip_address[lp] = arpbody->arp_tpa[lp];	      
-	}
+	sharedbeginwrite(&ip_space->sequence);
+	memcpy(ip_space->ip_address, seen->key, IP_KEYSIZE);
+	sharedendwrite(&ip_space->sequence);
 	/*
 	 * If it's a request, we are less likely to have the recipients MAC
 	 *
@@ -117,36 +323,35 @@ int populateipspacereq(struct ipdetails *ip_space, const u_char *frame){
 	return OK;
 }
 /**
- * Populates a given IP space with data from the given ethernet frame.
+ * Populates a given IP space with what a frame says.
  * Should correctly fill everything which it reasonably can in.
  *
  * Does not link with other ipspaces or affect any other details.
  *
- * Does check that MACS in header & ARP packet
+ * Does check that the MAC in the Ethernet header tallies with the one the
+ * ARP packet (or neighbour advertisement) claims.
  *
  * WHEN LOOKING AT A REPLY, WE FILE ACCORDING TO SENDER.
  */
-int populateipspacerep(struct ipdetails *ip_space, const u_char *frame){
-	struct ether_arp *arpbody;
-	struct ether_header *etherhead;
-	int lp;
-	if ((ip_space == NULL) || (frame == NULL))
+int populateipspacerep(struct ipdetails *ip_space, const struct observation *seen){
+	if ((ip_space == NULL) || (seen == NULL))
 		return ERR_BADUSAGE;
-	etherhead = (struct ether_header *) frame;
-	frame += sizeof(struct ether_header);
-	arpbody = (struct ether_arp *) frame;
-	for (lp = 0; lp <= 3; lp++) {
-	        ip_space->ip_address[lp] = arpbody->arp_spa[lp];	      
-	}
-	for (lp = 0; lp <= ETH_ALEN; lp++) {
-		ip_space->mac_address[lp] = etherhead->ether_shost[lp];
-	}
-	checkmacs(ip_space, arpbody->arp_sha);
+	sharedbeginwrite(&ip_space->sequence);
+	memcpy(ip_space->ip_address, seen->key, IP_KEYSIZE);
+	/* what it was before it first changed is what the kernel should still have - see neighbour.c */
+	if ((sumbytes(ip_space->prior_mac, ETH_ALEN) == 0) && (sumbytes(ip_space->mac_address, ETH_ALEN) != 0)
+			&& (memcmp(ip_space->mac_address, seen->ether_mac, ETH_ALEN) != 0))
+		memcpy(ip_space->prior_mac, ip_space->mac_address, ETH_ALEN);
+	memcpy(ip_space->mac_address, seen->ether_mac, ETH_ALEN);
+	sharedendwrite(&ip_space->sequence);
+	checkmacs(ip_space, (u_int8_t *)seen->claimed_mac);
 	return OK;
 }
 
 /**
- * Add 1 to the request field for a specified IP
+ * Add to the request field for a specified IP: 1, usually, but while we're
+ * shedding requests one that's kept stands for several (see overload.c), and
+ * those are also counted as estimated.
  *
  * Ideally I'd like to be able to do this by specifying an IP address rather 
  * than a data structure. However, since we have a routine to find the structure
@@ -159,21 +364,27 @@ int populateipspacerep(struct ipdetails *ip_space, const u_char *frame){
  *
  * And for my next trick I shall walk on the moon.
  */
-int addrequest(struct ipdetails *ip){
+int addrequest(struct ipdetails *ip, unsigned int count){
 	if (ip == NULL)
 		return (int)NULL;
-	ip->requests++;
+	sharedbeginwrite(&ip->sequence);
+	ip->requests += count;
+	if (count > 1)
+		ip->estimated += count;
+	sharedendwrite(&ip->sequence);
 	return ip->requests;
 }
 
 /**
  * Add 1 to the reply field for a specified IP.
- * See also: addrequest(struct ipdetails *ip)
+ * See also: addrequest(struct ipdetails *ip, unsigned int count)
  */
 int addreply(struct ipdetails *ip){
 	if (ip == NULL)
 		return (int)NULL;
+	sharedbeginwrite(&ip->sequence);
 	ip->replies++;
+	sharedendwrite(&ip->sequence);
 	return ip->replies;
 }
 
@@ -183,18 +394,15 @@ int addreply(struct ipdetails *ip){
  * \return Returns NULL if the item is not found, otherwise returns the address at which
  * the item occurs.
  */
-struct ipdetails *searchforwards(struct ipdetails *startpoint, u_int8_t *ipaddress) {
+struct ipdetails *searchforwards(struct ipdetails *startpoint, const u_int8_t *key) {
 	if (startpoint == NULL) 
 		return NULL;
-	if (startpoint->ip_address[0] == *(ipaddress)\
-			&& (startpoint->ip_address[1] == *(ipaddress+1))\
-			&& (startpoint->ip_address[2] == *(ipaddress+2))\
-			&& (startpoint->ip_address[3] == *(ipaddress+3))){
+	if (samekey(startpoint->ip_address, key)){
 		// we've got it!
 		return startpoint;
 	}
 	else 
-		return searchforwards(startpoint->next, ipaddress);
+		return searchforwards(startpoint->next, key);
 	
 }
 
@@ -205,57 +413,47 @@ struct ipdetails *searchforwards(struct ipdetails *startpoint, u_int8_t *ipaddre
  * Identical to searchforwards(), except the direction it goes in.
  * And the fact that I'm an idiot.
  */
-struct ipdetails *searchbackwards(struct ipdetails *startpoint, u_int8_t *ipaddress) {
+struct ipdetails *searchbackwards(struct ipdetails *startpoint, const u_int8_t *key) {
 	if (startpoint == NULL) 
 		return NULL;
-	if (startpoint->ip_address[0] == *(ipaddress)\
-			&& (startpoint->ip_address[1] == *(ipaddress+1))\
-			&& (startpoint->ip_address[2] == *(ipaddress+2))\
-			&& (startpoint->ip_address[3] == *(ipaddress+3))){
+	if (samekey(startpoint->ip_address, key)){
 		// we've got it!
 		return startpoint;
 	}
 	else 
-		return searchbackwards(startpoint->previous, ipaddress);
+		return searchbackwards(startpoint->previous, key);
 	
 }
 
 /**
- * Check to see whether or not a record for a given IP already exists.
- * Return a pointer to it if it does, otherwise return NULL.
+ * Check to see whether or not a record for a given IP already exists in a
+ * partition. Return a pointer to it if it does, otherwise return NULL.
  *
- * In terms of complexity, it makes virtually no difference where
- * in the list we start searching. However, in the case of this program,
- * there is a reasonably high probability that our entry point is
- * the item we want to find. Rewinding the list to the beginning would
- * make things a little slower as the rewinding would take some time.
- * It also means that, if we are given a pointer to somewhere in the
- * middle of the list, we may be better off searching inside out rather
- * than from beginning to end.
+ * This used to search the list outwards from the entry point, which was fine
+ * for a few dozen hosts and hopeless for a few thousand. Now each partition
+ * keeps a hash index of its records (see indexip()), so a lookup costs a hash
+ * and a compare or two however big the table is. The entry point is still
+ * tried first, since it's very often the record we want.
  *
- * This routine is quite broken up - with any luck, this will make
- * multi-threading the app relatively easy in future.
+ * ARGUMENTS:
+ * \arg \c *table - The partition to look in. May be NULL, in which case
+ * there's nothing to find.
+ * \arg \c *key - IP_KEYSIZE bytes: an IPv6 address, or an IPv4 one padded
+ * with zeros.
  */
-	
-struct ipdetails *checkip(struct ipdetails *startpoint, u_int8_t *ipaddress){	
-	struct ipdetails *searchagain;
-	if (startpoint == NULL || ipaddress == NULL)
+struct ipdetails *checkip(struct partition *table, const u_int8_t *key){	
+	struct ipdetails *current;
+	if ((table == NULL) || (key == NULL))
 		return NULL; /* No such position */
-	if ((*ipaddress == startpoint->ip_address[0])\
-			&& (*(ipaddress+1) == startpoint->ip_address[1])\
-			&& (*(ipaddress+2) == startpoint->ip_address[2])\
-			&& (*(ipaddress+3) == startpoint->ip_address[3]))
-	{
-		return startpoint; /* item given is the correct item. */
-	} else {
-		/* likely to get a list near the end, so search forwards first. Should
-		 be quicker. */
-		searchagain = searchforwards(startpoint->next, ipaddress);
-		/* search the next item(s) in the list */
-		if (searchagain == NULL)
-			searchagain = searchbackwards(startpoint->previous, ipaddress);
-		return searchagain;
+	if ((table->entrypoint != NULL) && samekey(table->entrypoint->ip_address, key))
+		return table->entrypoint; /* item given is the correct item. */
+	if (table->index == NULL)
+		return searchforwards(table->head, key); /* never managed to make the index */
+	for (current = table->index[hashkey(key) & (table->indexsize - 1)]; current != NULL; current = current->hashnext) {
+		if (samekey(current->ip_address, key))
+			return current;
 	}
+	return NULL;
 }
 
 /**
@@ -274,17 +472,73 @@ struct ipdetails *rewindip(struct ipdetails *ip){
 }
 
 /**
- * added for debugging - dumps internal data to a CSV file specified by *filename.
+ * One record's line in the dump, copied out of the table by the dump thread.
  */
-void dumpdata(struct ipdetails *entrypoint, char *filename){
-	struct ipdetails *current;
+struct dumprow {
+	u_int8_t ip_address[IP_KEYSIZE];
+	u_int8_t mac_address[ETH_ALEN];
+	int family;
+	u_int32_t vlan;
+	int requests;
+	int replies;
+	long lastreset;
+};
+
+/*
+ * The dump is written by a thread of its own - the one reader of the table
+ * on another thread (see epoch.c) - so the capture thread doesn't sit waiting
+ * on the disk while it's written. The capture thread only says which file.
+ */
+static pthread_mutex_t dumplock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumpready = PTHREAD_COND_INITIALIZER;
+static pthread_t dumper;
+static char dumpname[MAX_OPT_LENGTH];
+static int dumpwanted = 0, dumpstopping = 0, dumping = 0;
+static int dumpreader = ERR_BADUSAGE; /* the dump thread's epoch slot */
+
+/**
+ * Write the table to a CSV file. With a reader slot, the records are copied
+ * out between epochenter() and epochexit() and only written once we're out,
+ * so the disk never holds back reclamation; on the capture thread itself
+ * (slot ERR_BADUSAGE) they're copied just the same.
+ */
+static void writedump(const char *filename, int reader){
+	static struct dumprow *rows = NULL;
+	static unsigned long room = 0;
+	struct dumprow *grown;
+	struct ipdetails *current, copy;
+	unsigned long count = 0, row;
 	FILE *dumpfile;
+	char name[VLAN_NAMESIZE], address[IP_NAMESIZE];
 	int lp;
+	if (reader >= 0)
+		epochenter(reader);
+	for (current = readfirst(); current != NULL; current = readnext(current)) {
+		if (readrecord(current, &copy) != OK)
+			continue; /* it'll be in the next one */
+		if (count == room) {
+			grown = realloc(rows, (room + 1024) * sizeof(struct dumprow));
+			if (grown == NULL)
+				break;
+			rows = grown;
+			room += 1024;
+		}
+		memcpy(rows[count].ip_address, copy.ip_address, IP_KEYSIZE);
+		memcpy(rows[count].mac_address, copy.mac_address, ETH_ALEN);
+		/* a partition is never freed, and never changes its VLAN or family */
+		rows[count].family = copy.partition->family;
+		rows[count].vlan = copy.partition->vlan;
+		rows[count].requests = copy.requests;
+		rows[count].replies = copy.replies;
+		rows[count].lastreset = copy.lastreset;
+		count++;
+	}
+	if (reader >= 0)
+		epochexit(reader);
 	dumpfile = fopen(filename, "w");
-	current = rewindip(entrypoint);
 	if (dumpfile != NULL){
-		fprintf(dumpfile, "\"IP Address\",\"MAC Address\",\"Requests\",\"Replies\",\"Last Reset\"\n");
-		while (current != NULL){
+		fprintf(dumpfile, "\"IP Address\",\"MAC Address\",\"Requests\",\"Replies\",\"Last Reset\",\"VLAN\"\n");
+		for (row = 0; row < count; row++) {
 		/** 
 		 * Format of a CSV is dead simple:
 		 * <data>,[<data>, .....] <CR> 
@@ -293,45 +547,228 @@ void dumpdata(struct ipdetails *entrypoint, char *filename){
 		 * I don't believe it. A file format wich can be expressed in 2 lines and
 		 * I still ballsed it up.
 		 */
-			fprintf(dumpfile, "%d.%d.%d.%d,",current->ip_address[0],current->ip_address[1],current->ip_address[2],current->ip_address[3]);
+			fprintf(dumpfile, "%s,", formatip(rows[row].ip_address, rows[row].family, address));
 			for (lp = 0; lp < ETH_ALEN; lp++){
-				fprintf(dumpfile, "%0X:", current->mac_address[lp]);
+				fprintf(dumpfile, "%0X:", rows[row].mac_address[lp]);
 			}
 			//fprintf(dumpfile, "%X,", current->mac_address[lp+1]);
-			fprintf(dumpfile, "%d,%d,%ld\n", current->requests, current->replies, current->lastreset); 
-			current = current->next; 
+			fprintf(dumpfile, "%d,%d,%ld,", rows[row].requests, rows[row].replies, rows[row].lastreset); 
+			fprintf(dumpfile, "%s\n", (rows[row].vlan == 0) ? "" : formatvlan(rows[row].vlan, name));
 		}
 		fclose(dumpfile);
 	}
 }
 
+static void *dumpwriter(void *unused){
+	char filename[MAX_OPT_LENGTH];
+	pthread_mutex_lock(&dumplock);
+	for (;;) {
+		while (!dumpwanted && !dumpstopping)
+			pthread_cond_wait(&dumpready, &dumplock);
+		if (!dumpwanted)
+			break;
+		strcpy(filename, dumpname);
+		dumpwanted = 0;
+		pthread_mutex_unlock(&dumplock);
+		writedump(filename, dumpreader);
+		pthread_mutex_lock(&dumplock);
+	}
+	pthread_mutex_unlock(&dumplock);
+	return NULL;
+}
+
+/**
+ * Stop the dump thread, once it's written anything it's been asked for. Run
+ * at exit.
+ */
+void closedump(){
+	if (!dumping)
+		return;
+	pthread_mutex_lock(&dumplock);
+	dumpstopping = 1;
+	pthread_cond_signal(&dumpready);
+	pthread_mutex_unlock(&dumplock);
+	pthread_join(dumper, NULL);
+	epochunregister(dumpreader);
+	dumpreader = ERR_BADUSAGE;
+	dumping = 0;
+}
+
+/**
+ * Start the dump thread, with an epoch slot to read the table from.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_BADUSAGE - No slot or no thread, so dumpdata() will have to
+ * write the file itself.
+ */
+int opendump(){
+	dumpreader = epochregister();
+	if (dumpreader < 0)
+		return ERR_BADUSAGE;
+	if (pthread_create(&dumper, NULL, dumpwriter, NULL) != 0) {
+		epochunregister(dumpreader);
+		dumpreader = ERR_BADUSAGE;
+		return ERR_BADUSAGE;
+	}
+	dumping = 1;
+	atexit(closedump);
+	return OK;
+}
+
+/**
+ * added for debugging - dumps internal data to a CSV file specified by *filename.
+ * Every VLAN's partition goes in, one after another.
+ *
+ * If the dump thread's running, it's only asked to, and does it when it next
+ * can; if it's still busy with the last one, that's the one you get.
+ */
+void dumpdata(char *filename){
+	if (!dumping) {
+		writedump(filename, ERR_BADUSAGE);
+		return;
+	}
+	pthread_mutex_lock(&dumplock);
+	strncpy(dumpname, filename, sizeof(dumpname) - 1);
+	dumpwanted = 1;
+	pthread_cond_signal(&dumpready);
+	pthread_mutex_unlock(&dumplock);
+}
+
+/**
+ * Link a new record into its partition's list immediately after an existing
+ * one, or at the front if before is NULL (which is how the very first record
+ * gets in).
+ *
+ * The record which used to follow *before has its previous pointer fixed up
+ * too - without that, searchbackwards() and removeip() go wandering off
+ * round records which aren't where they think they are.
+ *
+ * The new record must be filled in already, address and all, since it goes
+ * into its partition's index here too, and its policy is looked up from its
+ * address (see policy.c). The last thing we do is the release
+ * store which lets readers on other threads reach it (see epoch.c).
+ */
+void linkip(struct ipdetails *before, struct ipdetails *ip){
+	struct ipdetails *after;
+	after = (before != NULL) ? before->next : ip->partition->head;
+	indexip(ip);
+	ip->policy = findpolicy(ip);
+	ip->previous = before;
+	ip->next = after;
+	if (after != NULL)
+		after->previous = ip;
+	if (before != NULL)
+		__atomic_store_n(&before->next, ip, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&ip->partition->head, ip, __ATOMIC_RELEASE);
+}
+
 /**
  * Remove IP details from the data structure.
  *
- * WARNING: THIS ROUTINE DOES NOT RETURN A POINTER BACK INTO THE STRUCTURE, AND SETS
- * ITS ARGUMENT TO NULL. IF YOU NEED TO RETAIN AN ENTRY POINT TO THE DATA STRUCTURE,
+ * WARNING: THIS ROUTINE DOES NOT RETURN A POINTER BACK INTO THE STRUCTURE, AND FREES
+ * ITS ARGUMENT. IF YOU NEED TO RETAIN AN ENTRY POINT TO THE DATA STRUCTURE,
  * CREATE ANOTHER POINT BEFORE CALLING THIS ROUTINE.
+ *
+ * Every record must leave through here, so the record counts and the eviction
+ * hand stay honest.
+ *
+ * The free happens later, once no reader can be standing on the record -
+ * retireip() sees to that. Its next pointer is left alone so that a reader
+ * which is can still find its way on.
  */
-/*
 void removeip(struct ipdetails *victim) {
 	struct ipdetails *before, *after;
+	struct partition *table;
+	table = victim->partition;
 	before = victim->previous;
 	after = victim->next;
 	if (before)
-		before->next = victim->next;
+		__atomic_store_n(&before->next, after, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&table->head, after, __ATOMIC_RELEASE);
 	if (after)
-		after->previous = victim->previous;
-	free(victim);
+		after->previous = before;
+	if (table->clockhand == victim)
+		table->clockhand = (after != NULL) ? after : before;
+	if (table->entrypoint == victim)
+		table->entrypoint = (after != NULL) ? after : before;
+	unindexip(victim);
+	unpubliship(victim);
+	table->records--;
+	records--;
+	retireip(victim);
+}
+
+/**
+ * The first record of the first partition after *table (or of the first
+ * partition of all, if table is NULL) which has any.
+ */
+static struct ipdetails *readpartitions(struct partition *table){
+	struct ipdetails *first;
+	for (table = (table == NULL) ? firstpartition() : nextpartition(table); table != NULL; table = nextpartition(table)) {
+		first = __atomic_load_n(&table->head, __ATOMIC_ACQUIRE);
+		if (first != NULL)
+			return first;
+	}
+	return NULL;
+}
+
+/**
+ * Walking the table from another thread - between epochenter() and
+ * epochexit(), see epoch.c. Only ever go forwards: previous pointers are the
+ * capture thread's business. Each VLAN's partition is walked in turn.
+ *
+ * \return The first record in the table, or NULL if it's empty.
+ */
+struct ipdetails *readfirst(){
+	return readpartitions(NULL);
+}
+
+/**
+ * \return The record after *ip, or NULL at the end of the table.
+ */
+struct ipdetails *readnext(struct ipdetails *ip){
+	struct ipdetails *next;
+	next = __atomic_load_n(&ip->next, __ATOMIC_ACQUIRE);
+	if (next != NULL)
+		return next;
+	return readpartitions(ip->partition);
+}
+
+/**
+ * Take a consistent copy of a record from another thread. Only the addresses,
+ * counts and lastreset (and its partition's VLAN) are worth looking at in the
+ * copy.
+ *
+ * The copy is of the whole structure, but only those fields are written
+ * under the record's sequence number. The rest - referenced, previous, next,
+ * hashnext, limbo and the like - are changed by the capture thread whenever
+ * it likes, so in the copy they may be torn or already stale. Don't use them:
+ * walk the table with readnext() on the record itself, not the copy.
+ *
+ * RETURN VALUES:
+ * \return OK
+ * \return ERR_BADUSAGE - The capture thread kept changing the record; try
+ * again later.
+ */
+int readrecord(struct ipdetails *ip, struct ipdetails *copy){
+	if (sharedread(&ip->sequence, ip, copy, sizeof(struct ipdetails)) == 0)
+		return ERR_BADUSAGE;
+	return OK;
 }
-*/
 
 void resettimer(struct ipdetails *ip){
 	struct timeval *timer;
 	timer = malloc(sizeof(struct timeval));
 	if (timer == NULL)
 		return;
-	if (gettimeofday(timer, NULL) == 0)
+	if (gettimeofday(timer, NULL) == 0) {
+		sharedbeginwrite(&ip->sequence);
 		ip->lastreset = timer->tv_sec;
+		sharedendwrite(&ip->sequence);
+	}
 	free(timer);
 }
 
@@ -342,7 +779,12 @@ void resettimer(struct ipdetails *ip){
 
 void blanknetarps(struct ipdetails *ip){
 	if (ip != NULL){
+		sharedbeginwrite(&ip->sequence);
 		ip->replies = 0;
 		ip->requests = 0;
+		ip->estimated = 0;
+		ip->unsolicited = 0;
+		ip->timedout = 0;
+		sharedendwrite(&ip->sequence);
 	}
 }
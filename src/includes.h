@@ -18,3 +18,4 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
+#include <math.h>
@@ -0,0 +1,252 @@
+/* -*- project-c -*- */
+/**
+ * \file journal.c
+ * \brief Keeping every ARP frame, for looking into things afterwards.
+ *
+ * The IP table only knows what each address is doing now. When something is
+ * investigated days later, the question is more like "which MAC answered for
+ * 10.1.2.3 between 14:00 and 14:05 on Tuesday?", so with options.journal set
+ * we also append every frame to a journal in that directory. The layout is
+ * described in journal.h, and antidote-journal answers questions from it.
+ *
+ * Frames are collected into a block of up to JOURNAL_BLOCK bytes, which is
+ * written when it's full, when it's options.journal_flush seconds old, when
+ * the UTC day changes, or when we stop. Each block is compressed (if we were
+ * built with zlib), written in one go at an aligned offset, and then indexed.
+ * That's one write of at most 64K every few thousand frames, so it can be
+ * done on the capture thread like the event log is.
+ *
+ * If the journal can't be written, we say so once and carry on without it
+ * until the next block; capture is never held up for the journal's sake.
+ */
+
+#include "antidote.h"
+#include "journal.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#if HAVE_LIBZ && HAVE_ZLIB_H
+#include <zlib.h>
+#define USE_ZLIB 1
+#endif
+
+#define JOURNAL_RECORDS (JOURNAL_BLOCK / sizeof(struct journalrecord))
+#define JOURNAL_NAMESIZE (MAX_OPT_LENGTH + 48) /* a JOURNAL_NAME, whatever the date fields hold */
+
+static struct journalrecord *records = NULL; /* the block being filled */
+static unsigned int pending = 0;
+static u_int8_t bloom[JOURNAL_BLOOM / 8];
+static long blockstarted = 0;
+static u_int8_t *block = NULL; /* the block being written, header and all */
+static size_t blocksize = 0;
+
+static int datafd = -1, indexfd = -1;
+static off_t dataend = 0;
+static long openday = -1; /* days since the epoch of the files that are open */
+static int complained = 0;
+static unsigned long lost = 0;
+
+/**
+ * Get ready to keep a journal, if options.journal says where.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or there's no journal.
+ * \return ERR_NOMEM
+ * \return ERR_JOURNAL - The directory isn't there and can't be made, or
+ * isn't writable.
+ */
+int openjournal(){
+	if (options.journal[0] == '\0')
+		return OK;
+	if ((mkdir(options.journal, 0750) != 0) && (errno != EEXIST))
+		return ERR_JOURNAL;
+	if (access(options.journal, W_OK | X_OK) != 0)
+		return ERR_JOURNAL;
+	records = malloc(JOURNAL_RECORDS * sizeof(struct journalrecord));
+	/* room for zlib's worst case, rounded up to whole pages */
+	blocksize = sizeof(struct journalblock) + JOURNAL_BLOCK + JOURNAL_BLOCK / 100 + 64;
+	blocksize = (blocksize + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+	block = malloc(blocksize);
+	if ((records == NULL) || (block == NULL)) {
+		free(records);
+		free(block);
+		records = NULL;
+		block = NULL;
+		return ERR_NOMEM;
+	}
+	pending = 0;
+	memset(bloom, 0, sizeof(bloom));
+	return OK;
+}
+
+/**
+ * Open the day files for the day seconds falls in (UTC), closing any others.
+ * On failure both descriptors are left at -1.
+ */
+static void opendayfiles(time_t seconds){
+	char name[JOURNAL_NAMESIZE], msg[JOURNAL_NAMESIZE + 64];
+	struct tm day;
+	struct stat details;
+	if (datafd != -1)
+		close(datafd);
+	if (indexfd != -1)
+		close(indexfd);
+	datafd = indexfd = -1;
+	openday = seconds / 86400;
+	gmtime_r(&seconds, &day);
+
+	snprintf(name, sizeof(name), JOURNAL_NAME, options.journal, day.tm_year + 1900, day.tm_mon + 1, day.tm_mday, "jnl");
+	datafd = open(name, O_WRONLY | O_CREAT, 0640);
+	if (datafd != -1) {
+		/* anything after the last whole block is from a write we never indexed */
+		dataend = lseek(datafd, 0, SEEK_END);
+		dataend = (dataend + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+		snprintf(name, sizeof(name), JOURNAL_NAME, options.journal, day.tm_year + 1900, day.tm_mon + 1, day.tm_mday, "idx");
+		indexfd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0640);
+	}
+	if ((datafd == -1) || (indexfd == -1)) {
+		if (!complained) {
+			snprintf(msg, sizeof(msg), "Cannot open the journal file %s: %s", name, strerror(errno));
+			bluealert(msg);
+			complained = 1;
+		}
+		if (datafd != -1)
+			close(datafd);
+		datafd = -1;
+		return;
+	}
+	/* likewise a torn index entry at the end */
+	if ((fstat(indexfd, &details) == 0) && (details.st_size % sizeof(struct journalindex) != 0))
+		ftruncate(indexfd, details.st_size - details.st_size % sizeof(struct journalindex));
+}
+
+/**
+ * Compress, write and index the block being filled, and start another.
+ */
+static void writeblock(){
+	struct journalblock *header;
+	struct journalindex entry;
+	size_t length, unpacked;
+	unsigned int lp;
+	char msg[MAX_OPT_LENGTH + 64];
+#ifdef USE_ZLIB
+	uLongf packedlen;
+#endif
+	if (pending == 0)
+		return;
+	if ((datafd == -1) || (openday != (long)(records[0].seconds / 86400)))
+		opendayfiles(records[0].seconds);
+	if (datafd == -1) {
+		lost += pending;
+		pending = 0;
+		memset(bloom, 0, sizeof(bloom));
+		return;
+	}
+
+	header = (struct journalblock *)block;
+	memset(header, 0, sizeof(struct journalblock));
+	header->magic = JOURNAL_MAGIC;
+	header->version = JOURNAL_VERSION;
+	header->count = pending;
+	/* capture timestamps can step back a little, so don't trust the ends */
+	header->first = header->last = records[0].seconds;
+	for (lp = 1; lp < pending; lp++) {
+		if (records[lp].seconds < header->first)
+			header->first = records[lp].seconds;
+		else if (records[lp].seconds > header->last)
+			header->last = records[lp].seconds;
+	}
+	length = strlen(options.device);
+	if (length > sizeof(header->interface) - 1)
+		length = sizeof(header->interface) - 1;
+	memcpy(header->interface, options.device, length);
+	header->interface[length] = '\0';
+	unpacked = pending * sizeof(struct journalrecord);
+	header->unpackedlen = unpacked;
+	header->packedlen = unpacked;
+#ifdef USE_ZLIB
+	packedlen = blocksize - sizeof(struct journalblock);
+	if ((compress2(block + sizeof(struct journalblock), &packedlen, (u_int8_t *)records, unpacked, Z_DEFAULT_COMPRESSION) == Z_OK)
+			&& (packedlen < unpacked)) {
+		header->packedlen = packedlen;
+		header->flags |= JOURNAL_COMPRESSED;
+	}
+#endif
+	if (!(header->flags & JOURNAL_COMPRESSED))
+		memcpy(block + sizeof(struct journalblock), records, unpacked);
+	length = sizeof(struct journalblock) + header->packedlen;
+	length = (length + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+	memset(block + sizeof(struct journalblock) + header->packedlen, 0,
+	       length - sizeof(struct journalblock) - header->packedlen);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.offset = dataend;
+	entry.length = length;
+	entry.count = pending;
+	entry.first = header->first;
+	entry.last = header->last;
+	memcpy(entry.bloom, bloom, sizeof(entry.bloom));
+	if ((pwrite(datafd, block, length, dataend) != (ssize_t)length)
+			|| (write(indexfd, &entry, sizeof(entry)) != sizeof(entry))) {
+		if (!complained) {
+			snprintf(msg, sizeof(msg), "Cannot write to the journal in %s: %s", options.journal, strerror(errno));
+			bluealert(msg);
+			complained = 1;
+		}
+		lost += pending;
+		/* try the files afresh next time */
+		close(datafd);
+		close(indexfd);
+		datafd = indexfd = -1;
+	} else {
+		dataend += length;
+		if (lost > 0) {
+			snprintf(msg, sizeof(msg), "Writing the journal again; %lu frames were not kept.", lost);
+			notice(msg);
+			lost = 0;
+		}
+		complained = 0;
+	}
+	pending = 0;
+	memset(bloom, 0, sizeof(bloom));
+}
+
+/**
+ * Add an ARP frame to the journal. The frame must be long enough to hold an
+ * ARP packet - my_callback() makes sure of that.
+ */
+void journalframe(const u_char *frame, const struct timeval *when){
+	struct ether_arp *arpbody;
+	struct journalrecord *record;
+	if (records == NULL)
+		return;
+	/* a block never spans two days, so each day's files stand alone */
+	if ((pending > 0) && ((long)(when->tv_sec / 86400) != (long)(records[0].seconds / 86400)))
+		writeblock();
+	if (pending == 0)
+		blockstarted = time(NULL);
+	arpbody = (struct ether_arp *)(frame + sizeof(struct ether_header));
+	record = &records[pending++];
+	record->seconds = when->tv_sec;
+	record->microseconds = when->tv_usec;
+	record->op = ntohs(arpbody->ea_hdr.ar_op) & 0xff;
+	record->pad = 0;
+	memcpy(record->sender_mac, arpbody->arp_sha, ETH_ALEN);
+	memcpy(record->sender_ip, arpbody->arp_spa, 4);
+	memcpy(record->target_ip, arpbody->arp_tpa, 4);
+	journalbloomadd(bloom, record->sender_ip);
+	journalbloomadd(bloom, record->target_ip);
+	if (pending == JOURNAL_RECORDS)
+		writeblock();
+}
+
+/**
+ * Write the block being filled if it's been waiting options.journal_flush
+ * seconds, or straight away if force is set. Called every tick, and with
+ * force on the way out.
+ */
+void flushjournal(int force){
+	if ((records == NULL) || (pending == 0))
+		return;
+	if (force || (time(NULL) - blockstarted >= options.journal_flush))
+		writeblock();
+}
@@ -0,0 +1,119 @@
+/* -*- project-c -*- */
+/**
+ * \file journal.h
+ * \brief Layout of the ARP observation journal.
+ *
+ * Shared between antidote (which writes the journal - see journal.c) and
+ * antidote-journal (which answers questions from it). Like sharedstate.h, it
+ * keeps clear of pcap and the rest of antidote.h.
+ *
+ * The journal is a directory of day files, named for the UTC day their frames
+ * were seen on. Each day has two:
+ *
+ * - arp-YYYYMMDD.jnl holds the frames, in blocks. A block is a struct
+ *   journalblock followed by up to JOURNAL_BLOCK bytes of struct
+ *   journalrecord (zlib compressed if JOURNAL_COMPRESSED is set), padded
+ *   with zeros to a multiple of JOURNAL_ALIGN bytes. Blocks are only ever
+ *   appended.
+ * - arp-YYYYMMDD.idx has a struct journalindex for every block: where it is,
+ *   the first and last times in it, and a Bloom filter of every IP address
+ *   that appears in it as sender or target.
+ *
+ * So a question about a time range only needs the index entries of the days
+ * it covers, and a question about an address only needs the blocks whose
+ * filter says it might be there. A block is written before its index entry,
+ * so the index never points at something that isn't there; a block without
+ * an entry (if antidote died between the two) is simply never found.
+ *
+ * Everything is in the writer's byte order.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+
+#define JOURNAL_MAGIC 0x41444a4e /* "ADJN" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_ALIGN 4096 /* blocks start on multiples of this */
+#define JOURNAL_BLOCK 65472 /* bytes of records in a full block, before compression - with the header, 16 pages */
+#define JOURNAL_COMPRESSED 1 /* flags: the records are zlib compressed */
+#define JOURNAL_BLOOM 4096 /* bits in each block's address filter - a few hundred addresses fit well */
+#define JOURNAL_HASHES 3 /* bits set per address */
+#define JOURNAL_NAME "%s/arp-%04d%02d%02d.%s" /* directory, year, month, day, "jnl" or "idx" */
+
+struct journalrecord {
+	u_int32_t seconds;
+	u_int32_t microseconds;
+	u_int8_t op; /* ARPOP_REQUEST, ARPOP_REPLY... */
+	u_int8_t pad;
+	u_int8_t sender_mac[6];
+	u_int8_t sender_ip[4];
+	u_int8_t target_ip[4];
+};
+
+struct journalblock {
+	u_int32_t magic;
+	u_int16_t version;
+	u_int16_t flags;
+	u_int32_t count; /* records */
+	u_int32_t packedlen; /* bytes following this header */
+	u_int32_t unpackedlen; /* count * sizeof(struct journalrecord) */
+	u_int32_t first; /* seconds of the first record */
+	u_int32_t last; /* and of the last */
+	char interface[16]; /* captured on */
+	u_int32_t pad;
+};
+
+struct journalindex {
+	u_int64_t offset; /* of the block in the .jnl file */
+	u_int32_t length; /* of the block, header and padding included */
+	u_int32_t count;
+	u_int32_t first;
+	u_int32_t last;
+	u_int8_t bloom[JOURNAL_BLOOM / 8];
+};
+
+/**
+ * Which bits of a block's filter an address sets: JOURNAL_HASHES of them, as
+ * h1 + i * h2 for two hashes of the four bytes (FNV-1a, and that mixed again).
+ */
+static inline void journalbits(const u_int8_t *address, unsigned int *bits){
+	u_int32_t first = 2166136261u, second;
+	int lp;
+	for (lp = 0; lp < 4; lp++) {
+		first ^= address[lp];
+		first *= 16777619u;
+	}
+	second = first;
+	second ^= second >> 15;
+	second *= 0x2c1b3c6du;
+	second ^= second >> 12;
+	second |= 1; /* so the bits differ */
+	for (lp = 0; lp < JOURNAL_HASHES; lp++)
+		bits[lp] = (first + lp * second) % JOURNAL_BLOOM;
+}
+
+static inline void journalbloomadd(u_int8_t *bloom, const u_int8_t *address){
+	unsigned int bits[JOURNAL_HASHES];
+	int lp;
+	journalbits(address, bits);
+	for (lp = 0; lp < JOURNAL_HASHES; lp++)
+		bloom[bits[lp] / 8] |= 1 << (bits[lp] % 8);
+}
+
+/**
+ * \return 0 if address is certainly not in the block, 1 if it may be.
+ */
+static inline int journalbloomtest(const u_int8_t *bloom, const u_int8_t *address){
+	unsigned int bits[JOURNAL_HASHES];
+	int lp;
+	journalbits(address, bits);
+	for (lp = 0; lp < JOURNAL_HASHES; lp++) {
+		if ((bloom[bits[lp] / 8] & (1 << (bits[lp] % 8))) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+#endif
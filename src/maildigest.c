@@ -0,0 +1,176 @@
+/* -*- project-c -*- */
+/**
+ * \file maildigest.c
+ * \brief Collecting urgent alerts into a periodic digest email.
+ *
+ * Left to itself, netalert() holds a complete SMTP conversation for every
+ * urgent alert. During an incident that's hundreds of emails, which is no use
+ * to anyone reading them and no help to the mail server either.
+ *
+ * With options.email_digest set, alerts are instead grouped by IP address and
+ * kind as they come in, and sent as one message when the digest is
+ * options.email_digest seconds old or holds options.email_digest_max alerts.
+ * Each group shows how many times it happened and when it was first and last
+ * seen. If options.email_digest_immediate is set, the first alert of each group
+ * still goes out straight away, so nobody has to wait to hear that something
+ * has started.
+ */
+
+#include "antidote.h"
+
+#define DIGESTGROUPS 256 /* distinct IP/kind pairs in one digest */
+#define DIGESTLINE (ALERT_TEXTSIZE + IP_NAMESIZE + 96) /* one group, rendered */
+
+/**
+ * Alerts are grouped by kind and IP address, or by kind and MAC for those
+ * (floods and sweeps) which aren't about any one IP address.
+ */
+struct digestgroup {
+	u_int8_t kind;
+	u_int8_t flags;
+	u_int8_t ip_address[IP_KEYSIZE];
+	u_int8_t mac[ETH_ALEN];
+	unsigned long count;
+	time_t first;
+	time_t last;
+	char text[ALERT_TEXTSIZE]; /* the most recent alert of the group */
+};
+
+static struct digestgroup groups[DIGESTGROUPS];
+static int groupcount = 0;
+static unsigned long total = 0, overflow = 0;
+static time_t digeststart = 0;
+static int registered = 0;
+
+/**
+ * Order groups by IP address (or MAC), then kind, so the digest reads sensibly.
+ */
+static int comparegroups(const void *first, const void *second){
+	const struct digestgroup *a = first, *b = second;
+	int result;
+	result = (a->flags & ALERTREC_IPV6) - (b->flags & ALERTREC_IPV6); /* IPv4 first */
+	if (result == 0)
+		result = memcmp(a->ip_address, b->ip_address, IP_KEYSIZE);
+	if (result == 0)
+		result = memcmp(a->mac, b->mac, ETH_ALEN);
+	if (result == 0)
+		result = a->kind - b->kind;
+	return result;
+}
+
+/**
+ * Send the digest, if there's anything in it and it's due.
+ *
+ * ARGUMENTS:
+ * \arg \c force - Send regardless of how old the digest is.
+ */
+void flushdigest(int force){
+	char *body, *p;
+	char first[16], last[16], subject[64], address[IP_NAMESIZE];
+	struct tm brokendown;
+	int lp;
+	if (total == 0)
+		return;
+	if ((force == 0) && (time(NULL) - digeststart < options.email_digest)
+			&& (total < options.email_digest_max))
+		return;
+	qsort(groups, groupcount, sizeof(struct digestgroup), comparegroups);
+	body = malloc(DIGESTLINE * (groupcount + 2));
+	if (body == NULL) {
+		bluealert("Cannot allocate memory for the alert digest. Alerts since the last digest will not be emailed.");
+	} else {
+		p = body;
+		localtime_r(&digeststart, &brokendown);
+		strftime(first, sizeof(first), "%H:%M:%S", &brokendown);
+		p += sprintf(p, "%lu alerts since %s.\r\n\r\n", total, first);
+		for (lp = 0; lp < groupcount; lp++) {
+			localtime_r(&groups[lp].first, &brokendown);
+			strftime(first, sizeof(first), "%H:%M:%S", &brokendown);
+			localtime_r(&groups[lp].last, &brokendown);
+			strftime(last, sizeof(last), "%H:%M:%S", &brokendown);
+			if (groups[lp].flags & ALERTREC_IP)
+				p += sprintf(p, "%s", formatip(groups[lp].ip_address,
+							(groups[lp].flags & ALERTREC_IPV6) ? AF_INET6 : AF_INET, address));
+			else
+				p += sprintf(p, "%02x:%02x:%02x:%02x:%02x:%02x", groups[lp].mac[0], groups[lp].mac[1],
+					     groups[lp].mac[2], groups[lp].mac[3], groups[lp].mac[4], groups[lp].mac[5]);
+			p += sprintf(p, " %s x%lu (first %s, last %s): %s\r\n",
+				     alertkindname(groups[lp].kind), groups[lp].count, first, last,
+				     groups[lp].text);
+		}
+		if (overflow > 0)
+			p += sprintf(p, "...and %lu more alerts which didn't fit in the digest.\r\n", overflow);
+		snprintf(subject, sizeof(subject), "Antidote alert digest: %lu alerts", total);
+		netmail(subject, body);
+		free(body);
+	}
+	groupcount = 0;
+	total = overflow = 0;
+}
+
+/**
+ * Email an alert, either straight away or as part of the next digest,
+ * depending on options.email_digest.
+ *
+ * ARGUMENTS:
+ * \arg \c *record - The alert.
+ * \arg \c *text - The alert, already rendered as text.
+ */
+void digestalert(const struct alertrecord *record, const char *text){
+	struct digestgroup *group = NULL;
+	u_int8_t mac[ETH_ALEN];
+	int lp;
+	if (options.email_digest == 0) {
+		netalert(text);
+		return;
+	}
+	if (registered == 0) {
+		atexit(flushdigestatexit);
+		registered = 1;
+	}
+	if (total == 0)
+		digeststart = record->when.tv_sec;
+	total++;
+	memset(mac, 0, ETH_ALEN);
+	if ((record->flags & ALERTREC_IP) == 0)
+		memcpy(mac, record->new_mac, ETH_ALEN);
+	for (lp = 0; lp < groupcount; lp++) {
+		if ((groups[lp].kind == record->kind)
+				&& ((groups[lp].flags & ALERTREC_IPV6) == (record->flags & ALERTREC_IPV6))
+				&& (memcmp(groups[lp].ip_address, record->ip_address, IP_KEYSIZE) == 0)
+				&& (memcmp(groups[lp].mac, mac, ETH_ALEN) == 0)) {
+			group = &groups[lp];
+			break;
+		}
+	}
+	if (group == NULL) {
+		if (groupcount == DIGESTGROUPS) {
+			overflow++;
+		} else {
+			group = &groups[groupcount++];
+			group->kind = record->kind;
+			group->flags = record->flags;
+			memcpy(group->ip_address, record->ip_address, IP_KEYSIZE);
+			memcpy(group->mac, mac, ETH_ALEN);
+			group->count = 0;
+			group->first = record->when.tv_sec;
+			if (options.email_digest_immediate)
+				netalert(text);
+		}
+	}
+	if (group != NULL) {
+		group->count++;
+		group->last = record->when.tv_sec;
+		strncpy(group->text, text, ALERT_TEXTSIZE - 1);
+		group->text[ALERT_TEXTSIZE - 1] = '\0';
+	}
+	if (total >= options.email_digest_max)
+		flushdigest(1);
+}
+
+/**
+ * Send whatever's left in the digest on the way out.
+ */
+void flushdigestatexit(){
+	flushdigest(1);
+}
@@ -0,0 +1,124 @@
+/* -*- project-c -*- */
+/**
+ * \file ndisc.c
+ * \brief IPv6 neighbour discovery, read as if it were ARP.
+ *
+ * On a dual-stack network, ARP is only half the story: IPv6 hosts find each
+ * other's MACs with ICMPv6 neighbour solicitations and advertisements (RFC
+ * 4861), and spoofing an advertisement poisons a neighbour cache exactly as a
+ * forged ARP reply poisons an ARP cache. So the capture filter takes those
+ * too, and parsend() turns each into the same struct observation an ARP frame
+ * becomes:
+ *
+ * - A solicitation asks who has its target address - an ARP request for it.
+ * - An advertisement says its target address is at the MAC in its target
+ *   link-layer address option (or, without one, the MAC it came from) - an ARP
+ *   reply from it.
+ *
+ * From there on it's the same engine: the same records, in an IPv6 partition
+ * of the VLAN's table (see vlan.c), the same MAC change and mismatch checks,
+ * the same request/reply balance and the same baselines.
+ *
+ * Only what RFC 4861 says a host must accept is taken: a hop limit of 255 (so
+ * it can't have come through a router), ICMP code 0, a target which isn't
+ * multicast, and options which hang together. Options beyond the captured
+ * ND_OPTIONROOM bytes are never seen, which is no loss - the link-layer
+ * address option comes first in practice.
+ */
+
+#include "antidote.h"
+
+#ifndef ETHERTYPE_IPV6
+#define ETHERTYPE_IPV6 0x86dd
+#endif
+#define ND_NEXTHEADER 58 /* ICMPv6 */
+#define ND_HOPLIMIT 255
+#define ND_SOLICITATION 135
+#define ND_ADVERTISEMENT 136
+#define ND_OPT_SOURCELL 1
+#define ND_OPT_TARGETLL 2
+
+/**
+ * Read a neighbour solicitation or advertisement from a frame.
+ *
+ * ARGUMENTS:
+ * \arg \c *frame - The frame as captured, VLAN tags and all.
+ * \arg \c caplen - How much of it there is.
+ * \arg \c *seen - Filled in with what it says. Its MACs point into *frame.
+ * \arg \c *vlan - Set to the VLAN it was on, as untagframe() would.
+ *
+ * \return 1 if it's a solicitation or advertisement we can use, 0 if not.
+ */
+int parsend(const u_char *frame, bpf_u_int32 caplen, struct observation *seen, u_int32_t *vlan){
+	const u_char *ip6, *icmp, *option, *end, *linklayer = NULL;
+	u_int16_t type;
+	unsigned int payload;
+	ip6 = framepayload(frame, caplen, &type, vlan);
+	if ((ip6 == NULL) || (type != ETHERTYPE_IPV6)
+			|| (caplen < (bpf_u_int32)(ip6 - frame) + IP6_HEADERSIZE + ND_HEADERSIZE))
+		return 0;
+	payload = (ip6[4] << 8) | ip6[5];
+	if (((ip6[0] >> 4) != 6) || (ip6[6] != ND_NEXTHEADER) || (ip6[7] != ND_HOPLIMIT) || (payload < ND_HEADERSIZE))
+		return 0;
+	icmp = ip6 + IP6_HEADERSIZE;
+	if (((icmp[0] != ND_SOLICITATION) && (icmp[0] != ND_ADVERTISEMENT)) || (icmp[1] != 0) || (icmp[8] == 0xff))
+		return 0;
+	/* the options, as far as they were sent and as far as we have them */
+	end = icmp + payload;
+	if (end > frame + caplen)
+		end = frame + caplen;
+	for (option = icmp + ND_HEADERSIZE; option + 2 <= end; option += option[1] * 8) {
+		if (option[1] == 0)
+			return 0; /* RFC 4861 says to drop the lot */
+		if ((option + option[1] * 8 <= end) && (option[1] == 1)
+				&& (option[0] == ((icmp[0] == ND_SOLICITATION) ? ND_OPT_SOURCELL : ND_OPT_TARGETLL)))
+			linklayer = option + 2;
+	}
+
+	seen->family = AF_INET6;
+	seen->ether_mac = frame + ETH_ALEN;
+	seen->claimed_mac = (linklayer != NULL) ? linklayer : seen->ether_mac;
+	seen->weight = 1;
+	memcpy(seen->key, icmp + 8, IP_KEYSIZE);
+	if (icmp[0] == ND_SOLICITATION) {
+		seen->op = ARPOP_REQUEST;
+		memcpy(seen->other, ip6 + 8, IP_KEYSIZE); /* who's asking - :: for duplicate address detection */
+	} else {
+		seen->op = ARPOP_REPLY;
+		memcpy(seen->other, ip6 + 24, IP_KEYSIZE); /* who's told */
+	}
+	return 1;
+}
+
+/**
+ * Read an IP address as it's written on the control socket: IPv4 or IPv6.
+ *
+ * ARGUMENTS:
+ * \arg \c *text - The address.
+ * \arg \c *key - IP_KEYSIZE bytes, filled in as records are keyed.
+ * \arg \c *family - Set to AF_INET or AF_INET6.
+ *
+ * \return 1 if it's an address, 0 if not.
+ */
+int parseip(const char *text, u_int8_t *key, int *family){
+	memset(key, 0, IP_KEYSIZE);
+	if (inet_pton(AF_INET, text, key) == 1) {
+		*family = AF_INET;
+		return 1;
+	}
+	if (inet_pton(AF_INET6, text, key) == 1) {
+		*family = AF_INET6;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Write a record's address the way parseip() reads it. *dest must hold
+ * IP_NAMESIZE bytes.
+ */
+char *formatip(const u_int8_t *key, int family, char *dest){
+	if (inet_ntop(family, key, dest, IP_NAMESIZE) == NULL)
+		strcpy(dest, "?");
+	return dest;
+}
@@ -0,0 +1,289 @@
+/* -*- project-c -*- */
+/**
+ * \file neighbour.c
+ * \brief Checking what the kernel's ARP cache actually believes.
+ *
+ * Everything else in antidote is about what's on the wire. That says someone
+ * is trying to poison the network, but not whether it worked - whether this
+ * host has actually taken the poisoner's MAC into its own ARP cache. With
+ * options.neighbour_check set we watch the kernel's neighbour table too.
+ *
+ * At startup we ask for the whole neighbour table over rtnetlink, and
+ * subscribe to RTNLGRP_NEIGH so that the kernel tells us of every change after
+ * that - nothing is ever polled, and /proc/net/arp is never read. Each entry
+ * for the interface we capture on, once it's resolved, is compared with the
+ * MAC the address ought to have, learned from the wire - from ARP for an IPv4
+ * entry, from neighbour discovery for an IPv6 one. If they differ, the
+ * kernel believes something it shouldn't, and ALERT_NEIGHBOUR is raised: the
+ * poisoning has landed.
+ *
+ * The MAC it ought to have isn't simply the record's. A forged reply changes
+ * that too (after ALERT_MACCHANGED), and a kernel which took the forgery
+ * would then agree with it. So it's the MAC the DHCP server leased the
+ * address to, if we're snooping and there's a lease (see dhcp.c), or else the
+ * MAC the record had before it first changed, until the operator resets it
+ * from the control socket, or else the record's MAC.
+ *
+ * The kernel announces an entry every time its state changes (reachable,
+ * stale, probing...), so each record remembers the MAC the kernel last had
+ * for it, and we only look again when that changes.
+ *
+ * An entry for an address with no record yet, or a record which hasn't
+ * learned a MAC - every entry in the startup dump, to begin with - has
+ * nothing to be compared with, so it waits in a table of NEIGHBOUR_PENDING,
+ * indexed by hash (a newer entry taking an older one's slot), until the
+ * record learns its MAC and neighbourlearned() is called.
+ *
+ * If the kernel has more to tell us than the socket will hold, it says so
+ * (ENOBUFS) and we ask for the whole table again.
+ *
+ * Only on Linux; elsewhere NeighbourCheck can't be turned on.
+ */
+
+#include "antidote.h"
+#if HAVE_LINUX_RTNETLINK_H
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+#define NEIGHBOUR_BUFFER 8192 /* bytes read from the socket at a time */
+#define NEIGHBOUR_RCVBUF (1024 * 1024) /* kernel buffer we ask for, so bursts aren't lost */
+/* states in which an entry's MAC is something the kernel will use */
+#define NEIGHBOUR_RESOLVED (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)
+#define NEIGHBOUR_PENDING 4096 /* entries waiting for a record's MAC; must be a power of 2 */
+#define NEIGHBOUR_SEED 0x3c6ef372U
+
+struct pendingentry {
+	u_int8_t address[IP_KEYSIZE];
+	u_int8_t lladdr[ETH_ALEN];
+	u_int8_t family; /* 0 for a free slot */
+};
+
+static int netlinkfd = -1;
+static unsigned int ifindex = 0; /* 0 for every interface */
+static u_int32_t sequence = 0;
+static int dumping = 0, redump = 0;
+static struct pendingentry pending[NEIGHBOUR_PENDING];
+
+/**
+ * Ask for the whole neighbour table, both families. The answer comes in through
+ * serviceneighbour() like any other change.
+ */
+static void requestdump(){
+	struct {
+		struct nlmsghdr header;
+		struct ndmsg neighbour;
+	} request;
+	if (dumping) {
+		/* only one dump at a time; do another once this one's done */
+		redump = 1;
+		return;
+	}
+	memset(&request, 0, sizeof(request));
+	request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	request.header.nlmsg_type = RTM_GETNEIGH;
+	request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.header.nlmsg_seq = ++sequence;
+	request.neighbour.ndm_family = AF_UNSPEC;
+	if (send(netlinkfd, &request, request.header.nlmsg_len, 0) == (ssize_t)request.header.nlmsg_len)
+		dumping = 1;
+	redump = 0;
+}
+
+/**
+ * Open a netlink socket subscribed to neighbour changes, and ask for the
+ * table as it stands.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or we're not checking.
+ * \return ERR_NEIGHBOUR - rtnetlink isn't available.
+ */
+int openneighbour(){
+	struct sockaddr_nl local;
+	int size = NEIGHBOUR_RCVBUF;
+	if (!options.neighbour_check)
+		return OK;
+	netlinkfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netlinkfd == -1)
+		return ERR_NEIGHBOUR;
+	setsockopt(netlinkfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = 1 << (RTNLGRP_NEIGH - 1);
+	if (bind(netlinkfd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+		close(netlinkfd);
+		netlinkfd = -1;
+		return ERR_NEIGHBOUR;
+	}
+	/* an unknown interface (or "any") just means we look at all of them */
+	ifindex = (options.device[0] != '\0') ? if_nametoindex(options.device) : 0;
+	dumping = 0;
+	requestdump();
+	return OK;
+}
+
+/**
+ * \return The slot in the pending table an address would be in.
+ */
+static struct pendingentry *pendingslot(int family, const u_int8_t *key){
+	return &pending[hashbytes(key, IP_KEYSIZE, NEIGHBOUR_SEED ^ family) & (NEIGHBOUR_PENDING - 1)];
+}
+
+/**
+ * Compare the kernel's MAC for a record's address with the one it ought to
+ * have, if the kernel's has changed since we last looked.
+ */
+static void compareneighbour(struct ipdetails *ip, const u_int8_t *lladdr){
+	u_int8_t leased[ETH_ALEN];
+	const u_int8_t *expected;
+	if (memcmp(ip->neighbour_mac, lladdr, ETH_ALEN) == 0)
+		return; /* just a change of state */
+	sharedbeginwrite(&ip->sequence);
+	memcpy(ip->neighbour_mac, lladdr, ETH_ALEN);
+	sharedendwrite(&ip->sequence);
+	if ((ip->partition->family == AF_INET) && leasedmac(ip->partition->vlan, ip->ip_address, time(NULL), leased))
+		expected = leased;
+	else if (sumbytes(ip->prior_mac, ETH_ALEN) != 0)
+		expected = ip->prior_mac;
+	else
+		expected = ip->mac_address;
+	if (memcmp(expected, lladdr, ETH_ALEN) != 0)
+		raisealert(ALERT_NEIGHBOUR, ip, expected, lladdr, 0);
+}
+
+/**
+ * Compare one neighbour table entry with what we've learned from the wire, or
+ * keep it until we've learned something.
+ */
+static void checkneighbour(const struct nlmsghdr *message){
+	const struct ndmsg *neighbour = NLMSG_DATA(message);
+	const struct rtattr *attribute;
+	const u_int8_t *address = NULL, *lladdr = NULL;
+	u_int8_t key[IP_KEYSIZE];
+	struct ipdetails *ip;
+	struct pendingentry *slot;
+	int length, size;
+	if (message->nlmsg_len < NLMSG_LENGTH(sizeof(struct ndmsg)))
+		return;
+	if ((neighbour->ndm_family != AF_INET) && (neighbour->ndm_family != AF_INET6))
+		return;
+	if ((ifindex != 0) && (neighbour->ndm_ifindex != (int)ifindex))
+		return;
+	size = (neighbour->ndm_family == AF_INET6) ? IP_KEYSIZE : 4;
+	length = message->nlmsg_len - NLMSG_LENGTH(sizeof(struct ndmsg));
+	for (attribute = RTM_RTA(neighbour); RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+		if ((attribute->rta_type == NDA_DST) && (RTA_PAYLOAD(attribute) == (unsigned int)size))
+			address = RTA_DATA(attribute);
+		else if ((attribute->rta_type == NDA_LLADDR) && (RTA_PAYLOAD(attribute) == ETH_ALEN))
+			lladdr = RTA_DATA(attribute);
+	}
+	if (address == NULL)
+		return;
+	memset(key, 0, IP_KEYSIZE);
+	memcpy(key, address, size);
+	/* whatever was waiting for this address is superseded */
+	slot = pendingslot(neighbour->ndm_family, key);
+	if ((slot->family == neighbour->ndm_family) && (memcmp(slot->address, key, IP_KEYSIZE) == 0))
+		slot->family = 0;
+	/* this host's interface isn't tagged, so it's the untagged frames' table */
+	ip = checkip(findpartition(0, neighbour->ndm_family, 0), key);
+	if ((message->nlmsg_type == RTM_DELNEIGH) || (lladdr == NULL) || !(neighbour->ndm_state & NEIGHBOUR_RESOLVED)) {
+		/* forgotten, or not resolved yet: whatever it resolves to next is news */
+		if ((ip != NULL) && (sumbytes(ip->neighbour_mac, ETH_ALEN) != 0)) {
+			sharedbeginwrite(&ip->sequence);
+			memset(ip->neighbour_mac, 0, ETH_ALEN);
+			sharedendwrite(&ip->sequence);
+		}
+		return;
+	}
+	if ((ip == NULL) || (sumbytes(ip->mac_address, ETH_ALEN) == 0)) {
+		/* nothing to compare it with yet */
+		memcpy(slot->address, key, IP_KEYSIZE);
+		memcpy(slot->lladdr, lladdr, ETH_ALEN);
+		slot->family = neighbour->ndm_family;
+		return;
+	}
+	compareneighbour(ip, lladdr);
+}
+
+/**
+ * A record has just learned its MAC from the wire. If the kernel told us of
+ * an entry for its address before it had one, now they can be compared. Only
+ * the untagged partitions are this host's.
+ */
+void neighbourlearned(struct ipdetails *ip){
+	struct pendingentry *slot;
+	if ((netlinkfd == -1) || (ip->partition->vlan != 0) || (sumbytes(ip->mac_address, ETH_ALEN) == 0))
+		return;
+	slot = pendingslot(ip->partition->family, ip->ip_address);
+	if ((slot->family != ip->partition->family) || (memcmp(slot->address, ip->ip_address, IP_KEYSIZE) != 0))
+		return;
+	slot->family = 0;
+	compareneighbour(ip, slot->lladdr);
+}
+
+/**
+ * Read everything the kernel has told us about its neighbour table since last
+ * time. Called whenever the socket is readable, and every tick.
+ */
+void serviceneighbour(){
+	u_int8_t buffer[NEIGHBOUR_BUFFER] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct nlmsghdr *message;
+	ssize_t got;
+	int length;
+	if (netlinkfd == -1)
+		return;
+	for (;;) {
+		got = recv(netlinkfd, buffer, sizeof(buffer), 0);
+		if (got < 0) {
+			if (errno == ENOBUFS) {
+				/* we've missed changes, so start again from the whole table */
+				dumping = 0;
+				requestdump();
+				continue;
+			}
+			break; /* EAGAIN, EINTR: nothing more for now */
+		}
+		length = got;
+		for (message = (struct nlmsghdr *)buffer; NLMSG_OK(message, length); message = NLMSG_NEXT(message, length)) {
+			switch (message->nlmsg_type) {
+			case RTM_NEWNEIGH:
+			case RTM_DELNEIGH:
+				checkneighbour(message);
+				break;
+			case NLMSG_DONE:
+			case NLMSG_ERROR:
+				dumping = 0;
+				if (redump)
+					requestdump();
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * \return The netlink socket, or -1 if we're not watching the neighbour table.
+ */
+int neighbourfd(){
+	return netlinkfd;
+}
+
+#else /* no rtnetlink */
+
+int openneighbour(){
+	return options.neighbour_check ? ERR_NEIGHBOUR : OK;
+}
+
+void serviceneighbour(){
+}
+
+int neighbourfd(){
+	return -1;
+}
+
+void neighbourlearned(struct ipdetails *ip){
+}
+
+#endif
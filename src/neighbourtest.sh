@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# neighbourtest.sh - does NeighbourCheck see poisoning land on this host?
+#
+# Debug code, run with "make TEST_neighbour" (as root, on Linux, with iproute2
+# and python3) - not part of antidote.
+#
+# Two network namespaces joined by a veth pair stand in for this host and a
+# neighbour: antidote runs in the host's, capturing on va (10.9.0.1), and the
+# neighbour is vb (10.9.0.2). The neighbour then poisons the host, with ARP
+# replies forged from a raw socket, and neighbour.c should notice both ways it
+# can happen:
+#
+# - 10.9.0.2 is learned from the wire first, then a forged reply gives the
+#   kernel (and antidote's record) another MAC. The record has changed too, so
+#   it's the MAC from before the change the kernel's is compared with.
+# - 10.9.0.3 is already poisoned in the kernel when antidote starts, before
+#   there's any record for it, and its owner's reply comes later. The kernel's
+#   entry has to wait for the record to learn a MAC.
+#
+# Usage: neighbourtest.sh [antidote binary]
+
+ANTIDOTE=${1:-./antidote}
+HOST=antidote-host
+PEER=antidote-peer
+DIR=$(mktemp -d)
+PID=
+FAILED=0
+
+cleanup() {
+	[ -n "$PID" ] && kill $PID 2>/dev/null && wait $PID 2>/dev/null
+	ip netns del $HOST 2>/dev/null
+	ip netns del $PEER 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+# "$1 is-at $2", sent by the neighbour to the host
+forge() {
+	ip netns exec $PEER python3 -c '
+import socket, struct, sys
+ip, mac = sys.argv[1], bytes.fromhex(sys.argv[2].replace(":", ""))
+host = bytes.fromhex("020000000001")
+s = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+s.bind(("vb", 0))
+s.send(host + mac + b"\x08\x06" + struct.pack("!HHBBH", 1, 0x0800, 6, 4, 2)
+       + mac + socket.inet_aton(ip) + host + socket.inet_aton("10.9.0.1"))
+' "$1" "$2"
+}
+
+# $1: should there be a neighbour_mismatch for address $2 by now (yes/no)?
+expect() {
+	sleep 2 # EventLogFlush
+	if grep '"kind":"neighbour_mismatch"' "$DIR/event.log" 2>/dev/null | grep -q "\"ip\":\"$2\""; then
+		FOUND=yes
+	else
+		FOUND=no
+	fi
+	if [ "$FOUND" = "$1" ]; then
+		echo "ok: $3"
+	else
+		echo "FAILED: $3"
+		FAILED=1
+	fi
+}
+
+if [ ! -x "$ANTIDOTE" ]; then
+	echo "No antidote at $ANTIDOTE - build it first, or give its path."
+	exit 1
+fi
+ip netns add $HOST || exit 1
+ip netns add $PEER || exit 1
+ip link add va netns $HOST type veth peer name vb netns $PEER || exit 1
+ip -n $HOST link set va address 02:00:00:00:00:01
+ip -n $PEER link set vb address 02:00:00:00:00:02
+ip -n $HOST addr add 10.9.0.1/24 dev va
+ip -n $PEER addr add 10.9.0.2/24 dev vb
+ip -n $HOST link set va up
+ip -n $PEER link set vb up
+# poisoned already
+ip -n $HOST neigh replace 10.9.0.3 lladdr 02:00:00:00:00:77 dev va nud permanent
+
+cat > "$DIR/antidote.cfg" <<EOF
+EthernetDevice = va
+NeighbourCheck = yes
+EventLog = $DIR/event.log
+EventLogFlush = 1
+EmailRecipient = NO
+EOF
+ip netns exec $HOST "$ANTIDOTE" -f "$DIR/antidote.cfg" > "$DIR/antidote.out" 2>&1 &
+PID=$!
+sleep 2
+
+# any datagram will do, so long as the host has to ask who 10.9.0.2 is
+ip netns exec $HOST python3 -c 'import socket; socket.socket(socket.AF_INET, socket.SOCK_DGRAM).sendto(b"x", ("10.9.0.2", 9))'
+expect no 10.9.0.2 "the kernel agrees with the wire about 10.9.0.2"
+forge 10.9.0.2 02:00:00:00:00:66
+expect yes 10.9.0.2 "a forged reply for 10.9.0.2 reached the kernel"
+forge 10.9.0.3 02:00:00:00:00:03
+expect yes 10.9.0.3 "10.9.0.3 was poisoned in the kernel before antidote knew it"
+
+if [ $FAILED -ne 0 ]; then
+	echo "antidote said:"
+	cat "$DIR/antidote.out"
+	echo "and logged:"
+	cat "$DIR/event.log"
+fi
+exit $FAILED
@@ -0,0 +1,177 @@
+/* -*- project-c -*- */
+/**
+ * \file overload.c
+ * \brief Shedding requests, and only requests, when we can't keep up.
+ *
+ * When frames arrive faster than we can deal with them the kernel throws the
+ * excess away, and it doesn't care which: a reply showing a MAC change is as
+ * likely to go as the thousandth request for the same address. But it's the
+ * replies which carry the evidence - checkmacchanges(), new hosts, poisoners -
+ * and in a flood the requests are nearly all of the traffic. So we decide for
+ * ourselves what to lose.
+ *
+ * We're overloaded once the kernel has dropped frames from our buffer (seen by
+ * capturestats()), or once the event loop has found a full batch of frames
+ * waiting for options.overload_batches turns running - the backlog is growing
+ * faster than we're draining it. (Without epoll there are no batches to go by,
+ * so only drops count.) While overloaded, only one request in options.shed_rate
+ * gets past sketchframe() into the IP table, and it's counted as
+ * options.shed_rate requests; the rest are shed. Every reply is dealt with as
+ * usual. Which requests are kept is decided by a hash of the address asked
+ * for and the frame's timestamp: not by counting, which would fall into step
+ * with traffic that comes round regularly and keep (or shed) the same host's
+ * requests every time, and not at random, so the same frames still give the
+ * same result every time. Once options.overload_hold seconds go by without
+ * drops or a backlog, we stop.
+ *
+ * A count made of samples is only an estimate, so each record remembers how
+ * much of its request count was estimated, and processip() widens both
+ * imbalance thresholds by three standard deviations of that estimate (see
+ * shedmargin()) - a host doesn't earn a "bad network" alert just because its
+ * few real requests happened to land on the sample. Nor a "poisoner" alert
+ * because none of them did: a record which has been around while requests
+ * were shed is allowed a sample more than it got, even if it got none.
+ *
+ * Floods and sweeps are still counted on every frame: the sketches are cheap,
+ * and it's the table that costs.
+ */
+
+#include "antidote.h"
+
+#define OVERLOAD_SEED 0x9e3779b9U
+
+static int overloaded = 0;
+static long lastpressure = 0; /* when we last saw drops or a backlog */
+static unsigned int fullbatches = 0; /* full batches in a row */
+static long lastshed = 0; /* when a request was last shed */
+static unsigned long shed = 0, sampled = 0, periods = 0;
+
+/**
+ * Something says we're falling behind: start shedding, if we weren't.
+ */
+static void overloadpressure(const char *why){
+	char msg[ADOTE_ERR_BUFF];
+	lastpressure = time(NULL);
+	if (overloaded)
+		return;
+	overloaded = 1;
+	periods++;
+	if (options.shed_rate > 1)
+		snprintf(msg, sizeof(msg), "Overloaded (%s) - counting only 1 in %u ARP requests until it passes. Every reply is still examined.",
+			 why, options.shed_rate);
+	else
+		snprintf(msg, sizeof(msg), "Overloaded (%s), but ShedRate is 1, so nothing is being shed.", why);
+	bluealert(msg);
+}
+
+/**
+ * Tell us how a turn of the event loop went.
+ *
+ * ARGUMENTS:
+ * \arg \c frames - How many frames it handled.
+ * \arg \c batch - The most it would handle in one turn.
+ */
+void overloadbatch(int frames, int batch){
+	if (frames < batch) {
+		fullbatches = 0;
+		return;
+	}
+	if ((options.overload_batches > 0) && (++fullbatches >= options.overload_batches))
+		overloadpressure("frames are queueing faster than they are read");
+}
+
+/**
+ * Tell us about frames the kernel has dropped from our capture buffer (not
+ * those the interface dropped - shedding won't help there).
+ */
+void overloaddrops(unsigned int drops){
+	if (drops > 0)
+		overloadpressure("the kernel is dropping frames");
+}
+
+/**
+ * Stop shedding once things have been quiet for options.overload_hold seconds.
+ * Called every tick.
+ */
+void serviceoverload(){
+	char msg[ADOTE_ERR_BUFF];
+	if (!overloaded || (time(NULL) - lastpressure < options.overload_hold))
+		return;
+	overloaded = 0;
+	fullbatches = 0;
+	snprintf(msg, sizeof(msg), "No longer overloaded - counting every ARP request again. %lu requests shed so far.", shed);
+	notice(msg);
+}
+
+/**
+ * Decide what a frame is worth.
+ *
+ * \return 1 for a frame which is dealt with as usual; 0 for a request which
+ * is shed, and should go no further; options.shed_rate for a request which
+ * stands for that many while we're shedding.
+ */
+unsigned int shedweight(const struct observation *seen){
+	u_int8_t frame[IP_KEYSIZE + sizeof(u_int64_t)];
+	if (!overloaded || (seen->op != ARPOP_REQUEST) || (options.shed_rate <= 1))
+		return 1;
+	memcpy(frame, seen->key, IP_KEYSIZE);
+	memcpy(frame + IP_KEYSIZE, &seen->when, sizeof(u_int64_t));
+	if (hashbytes(frame, sizeof(frame), OVERLOAD_SEED) % options.shed_rate != 0) {
+		shed++;
+		lastshed = seen->when / 1000000;
+		return 0;
+	}
+	sampled++;
+	return options.shed_rate;
+}
+
+/**
+ * How far a record's imbalance might be off because some of its requests
+ * were estimated from samples: three standard deviations of the estimate. Each
+ * of the real requests behind it had a 1 in options.shed_rate chance of being
+ * counted, as options.shed_rate, so the estimate's variance is about
+ * estimated * (options.shed_rate - 1).
+ *
+ * That's no help to a record whose requests were all shed - its estimate is
+ * 0, and so would be its margin, while its replies were all counted. So any
+ * record which was about while requests were being shed is taken to have
+ * missed one more sample than it got: a margin of about 3 * options.shed_rate
+ * even with none, which covers all of up to that many requests being shed
+ * (the chance of that is e^-3, about 5%).
+ *
+ * \return 0 if the record's counts are exact.
+ */
+int shedmargin(const struct ipdetails *ip){
+	if ((options.shed_rate <= 1) || ((ip->estimated == 0) && ((lastshed == 0) || (ip->lastreset > lastshed))))
+		return 0;
+	return (int)ceil(3.0 * sqrt((double)(ip->estimated + options.shed_rate) * (options.shed_rate - 1)));
+}
+
+/**
+ * \return Non-zero while requests are being shed.
+ */
+int overloadstate(){
+	return overloaded && (options.shed_rate > 1);
+}
+
+/**
+ * \return Requests shed since we started.
+ */
+unsigned long shedcount(){
+	return shed;
+}
+
+/**
+ * \return Requests kept as samples (each counted as options.shed_rate) since
+ * we started.
+ */
+unsigned long sampledcount(){
+	return sampled;
+}
+
+/**
+ * \return Times we've become overloaded since we started.
+ */
+unsigned long overloadcount(){
+	return periods;
+}
@@ -0,0 +1,335 @@
+/* -*- project-c -*- */
+/**
+ * \file policy.c
+ * \brief Different thresholds for different subnets.
+ *
+ * PoisonThreshold, BadNetThreshold, Timeout and CheckMACChanges are the same
+ * for every address, but a server VLAN, a guest wireless range and the
+ * routers' subnet don't behave alike - and some ranges are best ignored
+ * altogether. So each Policy line gives a prefix (and, if it likes, a VLAN)
+ * settings of its own:
+ *
+ *	Policy = 10.20.0.0/16,poison=5,badnet=-50,timeout=5
+ *	Policy = 10.20.7.0/24,vlan=100,checkmacs=no
+ *	Policy = 192.168.100.0/24,ignore
+ *
+ * An address takes the policy of the longest prefix it's in - for its own
+ * VLAN if there's one, otherwise one for any VLAN - and anything a policy
+ * doesn't say it takes from the one around it, and in the end from the global
+ * options.
+ *
+ * The prefixes are kept in a path-compressed binary trie, one for each
+ * family: a node only where prefixes branch or end, so a lookup visits at
+ * most one node per prefix on the way down, not one per bit. Even so, it's
+ * only looked up once per record - when it's linked into the table, filled
+ * in with its address (see linkip()) - and the record keeps a pointer to its
+ * policy, so however many prefixes there are, a frame costs the same. Until
+ * then it has globalpolicy().
+ *
+ * Policy lines are collected as the options are read, and buildpolicies()
+ * makes the trie once they all have been. Nothing changes after that, so the
+ * pointers records hold stay good.
+ */
+
+#include "antidote.h"
+
+/* which settings a Policy line gave - the rest are inherited */
+#define POLICY_POISON 1
+#define POLICY_BADNET 2
+#define POLICY_TIMEOUT 4
+#define POLICY_CHECKMACS 8
+#define POLICY_IGNORE 16
+
+struct policynode {
+	u_int8_t prefix[IP_KEYSIZE]; /* bits past the length are zero */
+	unsigned int length;
+	struct subnetpolicy *policies; /* for exactly this prefix, chained on ->sibling; NULL where prefixes only branch */
+	struct policynode *child[2];
+};
+
+static struct subnetpolicy *policies = NULL;
+static unsigned int policycount = 0, policyroom = 0;
+static struct policynode *nodes = NULL;
+static unsigned int nodecount = 0;
+static struct policynode *roots[2] = { NULL, NULL }; /* IPv4, IPv6 */
+static struct subnetpolicy defaultpolicy;
+
+/**
+ * \return Bit number \c bit of an address, counting from the most significant.
+ */
+static inline int addressbit(const u_int8_t *address, unsigned int bit){
+	return (address[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/**
+ * \return How many leading bits two addresses share, up to \c most.
+ */
+static unsigned int commonbits(const u_int8_t *first, const u_int8_t *second, unsigned int most){
+	unsigned int bit = 0;
+	while ((bit + 8 <= most) && (first[bit >> 3] == second[bit >> 3]))
+		bit += 8;
+	while ((bit < most) && (addressbit(first, bit) == addressbit(second, bit)))
+		bit++;
+	return bit;
+}
+
+/**
+ * Zero an address's bits past \c length, so it's a prefix.
+ */
+static void maskaddress(u_int8_t *address, unsigned int length){
+	unsigned int lp;
+	for (lp = length; lp < IP_KEYSIZE * 8; lp++)
+		address[lp >> 3] &= ~(0x80 >> (lp & 7));
+}
+
+/**
+ * Forget every Policy line. Called from setdefaults().
+ */
+void clearpolicies(){
+	free(policies);
+	free(nodes);
+	policies = NULL;
+	nodes = NULL;
+	policycount = policyroom = nodecount = 0;
+	roots[0] = roots[1] = NULL;
+}
+
+/**
+ * Take a Policy line: a prefix, then any of vlan=, poison=, badnet=,
+ * timeout= (in minutes, like Timeout), checkmacs=yes|no and ignore, separated
+ * by commas. A second line for the same prefix and VLAN replaces the first.
+ *
+ * \return OK, ERR_INOPTS if it doesn't parse, or ERR_NOMEM.
+ */
+int addpolicy(char *optval){
+	struct subnetpolicy policy, *grown;
+	char *setting, *next, *slash;
+	unsigned int lp, most;
+	memset(&policy, 0, sizeof(policy));
+	policy.anyvlan = 1;
+	next = strchr(optval, ',');
+	if (next != NULL)
+		*next++ = '\0';
+	slash = strchr(optval, '/');
+	if (slash != NULL)
+		*slash++ = '\0';
+	policy.family = (strchr(optval, ':') != NULL) ? AF_INET6 : AF_INET;
+	if (inet_pton(policy.family, optval, policy.prefix) != 1)
+		return ERR_INOPTS;
+	most = (policy.family == AF_INET6) ? 128 : 32;
+	policy.length = (slash != NULL) ? strtoul(slash, NULL, 10) : most;
+	if (policy.length > most)
+		return ERR_INOPTS;
+	maskaddress(policy.prefix, policy.length);
+	while ((setting = next) != NULL) {
+		next = strchr(setting, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (strncasecmp(setting, "vlan=", 5) == 0) {
+			if (!parsevlan(setting + 5, &policy.vlan))
+				return ERR_INOPTS;
+			policy.anyvlan = 0;
+		} else if (strncasecmp(setting, "poison=", 7) == 0) {
+			policy.poison_threshold = atoi(setting + 7);
+			policy.set |= POLICY_POISON;
+		} else if (strncasecmp(setting, "badnet=", 7) == 0) {
+			policy.badnet_threshold = atoi(setting + 7);
+			policy.set |= POLICY_BADNET;
+		} else if (strncasecmp(setting, "timeout=", 8) == 0) {
+			policy.timeout = 60 * atol(setting + 8);
+			if (policy.timeout < 0)
+				policy.timeout = 0;
+			policy.set |= POLICY_TIMEOUT;
+		} else if (strcasecmp(setting, "checkmacs=yes") == 0) {
+			policy.check_mac_changes = 1;
+			policy.set |= POLICY_CHECKMACS;
+		} else if (strcasecmp(setting, "checkmacs=no") == 0) {
+			policy.check_mac_changes = 0;
+			policy.set |= POLICY_CHECKMACS;
+		} else if (strcasecmp(setting, "ignore") == 0) {
+			policy.ignore = 1;
+			policy.set |= POLICY_IGNORE;
+		} else
+			return ERR_INOPTS;
+	}
+	for (lp = 0; lp < policycount; lp++) {
+		if ((policies[lp].family == policy.family) && (policies[lp].length == policy.length)
+				&& (policies[lp].anyvlan == policy.anyvlan) && (policies[lp].vlan == policy.vlan)
+				&& (memcmp(policies[lp].prefix, policy.prefix, IP_KEYSIZE) == 0))
+			break;
+	}
+	if (lp == policyroom) {
+		grown = realloc(policies, (policyroom ? 2 * policyroom : 16) * sizeof(struct subnetpolicy));
+		if (grown == NULL)
+			return ERR_NOMEM;
+		policies = grown;
+		policyroom = policyroom ? 2 * policyroom : 16;
+	}
+	policies[lp] = policy;
+	if (lp == policycount)
+		policycount++;
+	return OK;
+}
+
+/**
+ * Of the policies for one prefix, the one for a VLAN if there is one, or else
+ * the one for any VLAN. With \c anyonly, only the one for any VLAN.
+ */
+static struct subnetpolicy *choosepolicy(struct subnetpolicy *policy, u_int32_t vlan, int anyonly){
+	struct subnetpolicy *any = NULL;
+	for (; policy != NULL; policy = policy->sibling) {
+		if (policy->anyvlan)
+			any = policy;
+		else if (!anyonly && (policy->vlan == vlan))
+			return policy;
+	}
+	return any;
+}
+
+/**
+ * Find the policy of the longest prefix an address is in.
+ * \return It, or NULL if there's none.
+ */
+static struct subnetpolicy *lookuppolicy(int family, const u_int8_t *address, u_int32_t vlan, int anyonly){
+	struct policynode *node;
+	struct subnetpolicy *best = NULL, *found;
+	unsigned int most = (family == AF_INET6) ? 128 : 32;
+	node = roots[family == AF_INET6];
+	while ((node != NULL) && (commonbits(node->prefix, address, node->length) == node->length)) {
+		found = choosepolicy(node->policies, vlan, anyonly);
+		if (found != NULL)
+			best = found;
+		if (node->length == most)
+			break;
+		node = node->child[addressbit(address, node->length)];
+	}
+	return best;
+}
+
+/**
+ * Find, or make, the trie node for exactly a prefix. Each call makes at most
+ * two nodes, so there's room for them all in twice as many as there are
+ * policies.
+ */
+static struct policynode *insertprefix(int family, const u_int8_t *prefix, unsigned int length){
+	struct policynode **link, *node, *branch, *leaf;
+	unsigned int common;
+	link = &roots[family == AF_INET6];
+	while ((node = *link) != NULL) {
+		common = commonbits(node->prefix, prefix, (node->length < length) ? node->length : length);
+		if ((common == node->length) && (node->length == length))
+			return node;
+		if (common == node->length) {
+			/* it's somewhere under this one */
+			link = &node->child[addressbit(prefix, node->length)];
+			continue;
+		}
+		leaf = &nodes[nodecount++];
+		memcpy(leaf->prefix, prefix, IP_KEYSIZE);
+		leaf->length = length;
+		if (common == length) {
+			/* it's above this one */
+			leaf->child[addressbit(node->prefix, length)] = node;
+			*link = leaf;
+			return leaf;
+		}
+		/* they part company at bit "common" */
+		branch = &nodes[nodecount++];
+		memcpy(branch->prefix, prefix, IP_KEYSIZE);
+		maskaddress(branch->prefix, common);
+		branch->length = common;
+		branch->child[addressbit(prefix, common)] = leaf;
+		branch->child[addressbit(node->prefix, common)] = node;
+		*link = branch;
+		return leaf;
+	}
+	leaf = &nodes[nodecount++];
+	memcpy(leaf->prefix, prefix, IP_KEYSIZE);
+	leaf->length = length;
+	*link = leaf;
+	return leaf;
+}
+
+/**
+ * Shortest prefixes first, and for the same prefix the policy for any VLAN
+ * before those for particular ones - so whatever a policy inherits from has
+ * already been filled in by the time it's needed.
+ */
+static int comparepolicies(const void *first, const void *second){
+	const struct subnetpolicy *a = first, *b = second;
+	if (a->family != b->family)
+		return a->family - b->family;
+	if (a->length != b->length)
+		return (a->length < b->length) ? -1 : 1;
+	return b->anyvlan - a->anyvlan;
+}
+
+/**
+ * Make the trie from the Policy lines, once all the options have been read,
+ * filling in what each policy doesn't say from the one around it.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, even if there are no policies.
+ * \return ERR_NOMEM - Every address takes the global options.
+ */
+int buildpolicies(){
+	struct subnetpolicy *policy, *parent;
+	struct policynode *node;
+	unsigned int lp;
+	memset(&defaultpolicy, 0, sizeof(defaultpolicy));
+	defaultpolicy.poison_threshold = options.poison_threshold;
+	defaultpolicy.badnet_threshold = options.badnet_threshold;
+	defaultpolicy.check_mac_changes = options.check_mac_changes;
+	defaultpolicy.anyvlan = 1;
+	free(nodes);
+	nodes = NULL;
+	nodecount = 0;
+	roots[0] = roots[1] = NULL;
+	if (policycount == 0)
+		return OK;
+	nodes = calloc(2 * policycount, sizeof(struct policynode));
+	if (nodes == NULL)
+		return ERR_NOMEM;
+	qsort(policies, policycount, sizeof(struct subnetpolicy), comparepolicies);
+	for (lp = 0; lp < policycount; lp++) {
+		policy = &policies[lp];
+		parent = lookuppolicy(policy->family, policy->prefix, policy->vlan, policy->anyvlan);
+		if (parent == NULL)
+			parent = &defaultpolicy;
+		if (!(policy->set & POLICY_POISON))
+			policy->poison_threshold = parent->poison_threshold;
+		if (!(policy->set & POLICY_BADNET))
+			policy->badnet_threshold = parent->badnet_threshold;
+		if (!(policy->set & POLICY_TIMEOUT))
+			policy->timeout = parent->timeout;
+		if (!(policy->set & POLICY_CHECKMACS))
+			policy->check_mac_changes = parent->check_mac_changes;
+		if (!(policy->set & POLICY_IGNORE))
+			policy->ignore = parent->ignore;
+		node = insertprefix(policy->family, policy->prefix, policy->length);
+		policy->sibling = node->policies;
+		node->policies = policy;
+	}
+	return OK;
+}
+
+/**
+ * \return The policy made from the global options, for addresses no Policy
+ * line covers - and for a record which hasn't been given its own yet.
+ */
+const struct subnetpolicy *globalpolicy(){
+	return &defaultpolicy;
+}
+
+/**
+ * Find the policy for a record, from its address and its partition's VLAN and
+ * family. Called once, when the record's linked in - see linkip().
+ *
+ * \return The policy - the global options' own, if no Policy line covers it.
+ * Never NULL.
+ */
+const struct subnetpolicy *findpolicy(const struct ipdetails *ip){
+	struct subnetpolicy *policy;
+	policy = lookuppolicy(ip->partition->family, ip->ip_address, ip->partition->vlan, 0);
+	return (policy != NULL) ? policy : &defaultpolicy;
+}
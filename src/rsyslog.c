@@ -0,0 +1,301 @@
+/* -*- project-c -*- */
+/**
+ * \file rsyslog.c
+ * \brief Sending alerts straight to a remote syslog server (RFC 5424).
+ *
+ * The local syslog is fine for a single machine, but if you're collecting logs
+ * centrally there's no sense in going through it. This sink sends each alert to
+ * options.remote_syslog as an RFC 5424 message, with the details in
+ * structured data so the collector needn't parse the text.
+ *
+ * - Over UDP, each message is normally a datagram of its own (RFC 5426). Many
+ *   collectors will also take several newline-separated messages per datagram,
+ *   and if options.remote_syslog_batch is set we pack as many as will fit in
+ *   RSYSLOG_DATAGRAM bytes.
+ * - Over TCP, messages are octet-counted (RFC 6587) on one persistent
+ *   connection. If the connection drops we reconnect, backing off from
+ *   RSYSLOG_RETRY_MIN to RSYSLOG_RETRY_MAX seconds between attempts.
+ *
+ * Alerts are queued as records (see alert.c) and only rendered as they go out.
+ * The socket never blocks: anything that can't be sent yet waits in the queue,
+ * and if the queue fills (the collector is down, or slower than the alerts
+ * coming in) new alerts are dropped and counted rather than holding up capture.
+ */
+
+#include "antidote.h"
+#include <fcntl.h>
+#include <poll.h>
+
+#define RSYSLOG_MAXMSG 1024 /* longest single message we'll build */
+#define RSYSLOG_DATAGRAM 1400 /* keep batched datagrams under a typical MTU */
+#define RSYSLOG_RETRY_MIN 1
+#define RSYSLOG_RETRY_MAX 60
+#define RSYSLOG_FACILITY 10 /* authpriv, as used by redalert() */
+#define RSYSLOG_REPORT 60 /* seconds between complaints about dropped alerts */
+
+#define RS_DOWN 0
+#define RS_CONNECTING 1
+#define RS_UP 2
+
+static struct alertrecord *queue = NULL;
+static unsigned int queuesize = 0, head = 0, tail = 0;
+static int remotefd = -1;
+static int state = RS_DOWN;
+static struct sockaddr_storage destination;
+static socklen_t destinationlen = 0;
+static int socktype = SOCK_DGRAM;
+static long nextattempt = 0, retry = RSYSLOG_RETRY_MIN;
+static char hostname[256];
+static char pending[RSYSLOG_DATAGRAM + RSYSLOG_MAXMSG];
+static size_t pendinglen = 0, pendingsent = 0;
+static unsigned int pendingcount = 0; /* messages in the pending buffer */
+static unsigned long sent = 0, dropped = 0, reported = 0;
+static long lastreport = 0;
+
+/**
+ * Work out where we're sending to and set up the queue. Doesn't connect - that
+ * happens the first time there's something to send.
+ *
+ * RETURN VALUES:
+ * \return OK - Ready, or no remote syslog was asked for.
+ * \return ERR_NOMEM
+ * \return ERR_CANNOTGETSYSLOGSERVER - The server name doesn't resolve.
+ */
+int openrsyslog(){
+	struct addrinfo hints, *found;
+	char port[16];
+	char *dot;
+	if (options.remote_syslog[0] == '\0')
+		return OK;
+	socktype = options.remote_syslog_tcp ? SOCK_STREAM : SOCK_DGRAM;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	snprintf(port, sizeof(port), "%u", options.remote_syslog_port);
+	if (getaddrinfo(options.remote_syslog, port, &hints, &found) != 0)
+		return ERR_CANNOTGETSYSLOGSERVER;
+	memcpy(&destination, found->ai_addr, found->ai_addrlen);
+	destinationlen = found->ai_addrlen;
+	freeaddrinfo(found);
+
+	free(queue);
+	queuesize = options.remote_syslog_queue;
+	queue = calloc(queuesize, sizeof(struct alertrecord));
+	if (queue == NULL) {
+		queuesize = 0;
+		return ERR_NOMEM;
+	}
+	head = tail = 0;
+#if HAVE_GETHOSTNAME
+	if (gethostname(hostname, sizeof(hostname)) != 0)
+#endif
+		strcpy(hostname, "-");
+	hostname[sizeof(hostname) - 1] = '\0';
+	/* RFC 5424 prefers the FQDN, but a short name beats nothing. No spaces allowed. */
+	for (dot = hostname; *dot != '\0'; dot++) {
+		if (isspace((unsigned char)*dot))
+			*dot = '_';
+	}
+	return OK;
+}
+
+/**
+ * Give up on the current connection and schedule another attempt.
+ */
+static void dropconnection(){
+	if (remotefd != -1)
+		close(remotefd);
+	remotefd = -1;
+	state = RS_DOWN;
+	dropped += pendingcount;
+	pendinglen = pendingsent = pendingcount = 0;
+	nextattempt = time(NULL) + retry;
+	retry *= 2;
+	if (retry > RSYSLOG_RETRY_MAX)
+		retry = RSYSLOG_RETRY_MAX;
+}
+
+/**
+ * Start a (non-blocking) connection if we haven't got one and it's time to try.
+ * For UDP this is immediate; for TCP it may leave us in RS_CONNECTING.
+ */
+static void startconnection(){
+	int flags;
+	if ((state != RS_DOWN) || (time(NULL) < nextattempt))
+		return;
+	remotefd = socket(destination.ss_family, socktype, 0);
+	if (remotefd == -1) {
+		dropconnection();
+		return;
+	}
+	flags = fcntl(remotefd, F_GETFL, 0);
+	fcntl(remotefd, F_SETFL, flags | O_NONBLOCK);
+	if (connect(remotefd, (struct sockaddr *)&destination, destinationlen) == 0) {
+		state = RS_UP;
+		retry = RSYSLOG_RETRY_MIN;
+	} else if (errno == EINPROGRESS) {
+		state = RS_CONNECTING;
+	} else {
+		dropconnection();
+	}
+}
+
+/**
+ * See whether a TCP connection in progress has finished, one way or the other.
+ */
+static void checkconnection(){
+	struct pollfd waiting;
+	int error = 0;
+	socklen_t errorlen = sizeof(error);
+	if (state != RS_CONNECTING)
+		return;
+	waiting.fd = remotefd;
+	waiting.events = POLLOUT;
+	if (poll(&waiting, 1, 0) <= 0)
+		return;
+	if ((getsockopt(remotefd, SOL_SOCKET, SO_ERROR, &error, &errorlen) != 0) || (error != 0)) {
+		dropconnection();
+		return;
+	}
+	state = RS_UP;
+	retry = RSYSLOG_RETRY_MIN;
+}
+
+/**
+ * Render a record as an RFC 5424 message.
+ * \return The length of the message.
+ */
+static int formatrsyslog(const struct alertrecord *record, char *dest){
+	char text[ALERT_TEXTSIZE], sd[ALERT_JSONSIZE];
+	struct tm brokendown;
+	time_t seconds;
+	char when[32];
+	int severity, length;
+	switch (alertkindpriority(record->kind)) {
+	case HIGHEST: severity = LOG_CRIT;
+		break;
+	case MEDIUM: severity = LOG_ERR;
+		break;
+	case 0: severity = LOG_NOTICE;
+		break;
+	default: severity = LOG_INFO;
+		break;
+	}
+	seconds = record->when.tv_sec;
+	gmtime_r(&seconds, &brokendown);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &brokendown);
+	formatalerttext(record, text);
+	formatalertsd(record, sd);
+	length = snprintf(dest, RSYSLOG_MAXMSG, "<%d>1 %s.%06ldZ %s %s %d %s %s %s",
+			  RSYSLOG_FACILITY * 8 + severity, when, (long)record->when.tv_usec,
+			  hostname, PROGNAME, (int)getpid(), alertkindname(record->kind), sd, text);
+	if (length >= RSYSLOG_MAXMSG)
+		length = RSYSLOG_MAXMSG - 1;
+	return length;
+}
+
+/**
+ * Fill the pending buffer from the queue: one octet-counted message for TCP,
+ * one datagram's worth for UDP.
+ */
+static void fillpending(){
+	char message[RSYSLOG_MAXMSG];
+	int length;
+	pendinglen = pendingsent = pendingcount = 0;
+	while (tail != head) {
+		length = formatrsyslog(&queue[tail % queuesize], message);
+		if (socktype == SOCK_STREAM) {
+			pendinglen = sprintf(pending, "%d ", length);
+			memcpy(pending + pendinglen, message, length);
+			pendinglen += length;
+			pendingcount = 1;
+			tail++;
+			return;
+		}
+		if ((pendinglen > 0) && (pendinglen + 1 + length > RSYSLOG_DATAGRAM))
+			return;
+		if (pendinglen > 0)
+			pending[pendinglen++] = '\n';
+		memcpy(pending + pendinglen, message, length);
+		pendinglen += length;
+		pendingcount++;
+		tail++;
+		if (options.remote_syslog_batch == 0)
+			return;
+	}
+}
+
+/**
+ * Send as much of the queue as the socket will take without blocking.
+ * Called after every batch of alerts, and whenever the socket may have room.
+ */
+void flushrsyslog(){
+	ssize_t written;
+	char msg[ADOTE_ERR_BUFF];
+	if (queue == NULL)
+		return;
+	if ((dropped != reported) && (time(NULL) - lastreport >= RSYSLOG_REPORT)) {
+		snprintf(msg, sizeof(msg), "Remote syslog is not keeping up: %lu alerts dropped (%lu sent).", dropped, sent);
+		bluealert(msg);
+		reported = dropped;
+		lastreport = time(NULL);
+	}
+	startconnection();
+	checkconnection();
+	while (state == RS_UP) {
+		if (pendingsent == pendinglen)
+			fillpending();
+		if (pendinglen == 0)
+			return;
+		written = send(remotefd, pending + pendingsent, pendinglen - pendingsent, MSG_NOSIGNAL);
+		if (written < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return; /* try again later - the queue holds everything else */
+			/*
+			 * A UDP send can fail because nobody's listening (ECONNREFUSED) - the
+			 * datagram is gone either way, so just carry on with the next.
+			 */
+			if (socktype == SOCK_DGRAM) {
+				dropped += pendingcount;
+				pendinglen = pendingsent = pendingcount = 0;
+				continue;
+			}
+			dropconnection();
+			return;
+		}
+		pendingsent += written;
+		if (pendingsent == pendinglen) {
+			sent += pendingcount;
+			pendingcount = 0;
+		}
+	}
+}
+
+/**
+ * Queue an alert for the remote syslog server. If the queue is full the alert
+ * is dropped (and counted) - we never wait for the network.
+ */
+void rsyslogalert(const struct alertrecord *record){
+	if (queue == NULL)
+		return;
+	if (head - tail >= queuesize) {
+		dropped++;
+		return;
+	}
+	queue[head % queuesize] = *record;
+	head++;
+}
+
+/**
+ * \return The socket used for remote syslog, or -1 if there isn't one.
+ */
+int rsyslogfd(){
+	return remotefd;
+}
+
+/**
+ * \return The number of alerts waiting to go to the remote server.
+ */
+int rsyslogbacklog(){
+	return (head - tail) + pendingcount;
+}
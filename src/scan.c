@@ -0,0 +1,208 @@
+/* -*- project-c -*- */
+/**
+ * \file scan.c
+ * \brief Who's asking about everybody: scans, counted by requester.
+ *
+ * The IP table files a request under the address asked for, so one host
+ * sweeping a /16 turns into 65536 records, each asked about once and each
+ * perfectly innocent. The sketches (see sketch.c) count distinct addresses by
+ * source MAC, roughly. Here we count them by requester: for each requester -
+ * its VLAN, its address and its MAC, so a scanner hiding behind 0.0.0.0 is
+ * still told apart from everyone else doing the same - the addresses it has
+ * asked for in the current window.
+ *
+ * The count is a HyperLogLog of SCAN_REGISTERS 4-bit registers, 128 bytes a
+ * requester. Below 2.5 * SCAN_REGISTERS addresses - where the thresholds
+ * worth setting are - it's read by linear counting, which is within a few
+ * percent; above, it only needs to say "lots". It never forgets an address
+ * within the window, so a sweep in random order (nmap's) counts as fast as
+ * one in order, however many /24s it's spread over.
+ *
+ * Hashing every request into it would cost more than the rest of this file,
+ * and most requests are for an address asked about moments ago, so recent
+ * addresses are also kept as bitmaps of /24s (for IPv6, of /120s): 256 bits
+ * for the last byte, under the prefix it shares with its neighbours. Only an
+ * address which isn't in them goes into the count. A requester has room for
+ * SCAN_BLOCKS of them; asking about yet another /24 reuses the block with the
+ * fewest addresses in it. An address forgotten that way and asked for again
+ * is only hashed again - the count already has it.
+ *
+ * Requesters live in a fixed table of SCAN_REQUESTERS, found by hash; a new
+ * one takes a free or stale slot among the SCAN_PROBE it hashes to, or else
+ * the quietest of them, so the busiest requesters - the ones we care about -
+ * stay. Memory never grows.
+ *
+ * Once a requester has asked for more than options.scan_threshold distinct
+ * addresses in options.sketch_window seconds, ALERT_SCAN is raised for it
+ * (once per window), and scanrequest() tells the caller not to make new IP
+ * records for what it asks about.
+ */
+
+#include "antidote.h"
+
+#define SCAN_REQUESTERS 1024 /* must be a power of 2 */
+#define SCAN_PROBE 8 /* slots a requester might be in */
+#define SCAN_BLOCKS 8 /* /24s remembered per requester */
+#define SCAN_INDEXBITS 8
+#define SCAN_REGISTERS (1 << SCAN_INDEXBITS) /* HyperLogLog registers per requester */
+#define SCAN_RANKMAX 15 /* what a 4-bit register can hold */
+#define SCAN_SEED 0x165667b1U
+#define SCAN_HASHSEED 0x27d4eb2fU
+
+struct scanblock {
+	u_int8_t prefix[IP_KEYSIZE]; /* the address with its last byte zeroed */
+	u_int8_t used;
+	u_int16_t count; /* bits set */
+	u_int32_t bits[256 / 32];
+};
+
+struct requester {
+	u_int8_t address[IP_KEYSIZE];
+	u_int8_t mac[ETH_ALEN];
+	u_int8_t family; /* 0 for a free slot */
+	u_int8_t alerted; /* this window */
+	u_int32_t vlan;
+	long windowstart;
+	unsigned long distinct; /* addresses asked for this window, as counted */
+	float harmonic; /* the sum of 2^-register, kept up as they change */
+	u_int16_t zeros; /* registers still 0 */
+	u_int8_t registers[SCAN_REGISTERS / 2]; /* two to a byte */
+	struct scanblock block[SCAN_BLOCKS];
+};
+
+static struct requester requesters[SCAN_REQUESTERS];
+
+/**
+ * Find a requester's slot, or make one.
+ */
+static struct requester *findrequester(const struct observation *seen, u_int32_t vlan, long now){
+	struct requester *slot, *victim = NULL;
+	u_int32_t hash;
+	int lp;
+	hash = hashbytes(seen->other, IP_KEYSIZE, hashbytes(seen->ether_mac, ETH_ALEN, SCAN_SEED ^ vlan));
+	for (lp = 0; lp < SCAN_PROBE; lp++) {
+		slot = &requesters[(hash + lp) & (SCAN_REQUESTERS - 1)];
+		if ((slot->family == seen->family) && (slot->vlan == vlan)
+				&& (memcmp(slot->address, seen->other, IP_KEYSIZE) == 0)
+				&& (memcmp(slot->mac, seen->ether_mac, ETH_ALEN) == 0))
+			return slot;
+		/* free, or last heard from in an earlier window, is as good as free */
+		if ((slot->family == 0) || (now - slot->windowstart >= options.sketch_window))
+			slot->distinct = 0;
+		if ((victim == NULL) || (slot->distinct < victim->distinct))
+			victim = slot;
+	}
+	memcpy(victim->address, seen->other, IP_KEYSIZE);
+	memcpy(victim->mac, seen->ether_mac, ETH_ALEN);
+	victim->family = seen->family;
+	victim->vlan = vlan;
+	victim->windowstart = 0; /* so it's started afresh */
+	return victim;
+}
+
+/**
+ * Set the bit for an address among a requester's blocks.
+ * \return 1 if it wasn't set already - it's new, or was forgotten.
+ */
+static int addtarget(struct requester *slot, const u_int8_t *target){
+	struct scanblock *block = NULL, *fewest = &slot->block[0];
+	u_int8_t prefix[IP_KEYSIZE], last;
+	int lp;
+	/* an IPv4 address is the first four bytes of the key */
+	memcpy(prefix, target, IP_KEYSIZE);
+	lp = (slot->family == AF_INET6) ? IP_KEYSIZE - 1 : 3;
+	last = prefix[lp];
+	prefix[lp] = 0;
+	for (lp = 0; lp < SCAN_BLOCKS; lp++) {
+		if (slot->block[lp].used && (memcmp(slot->block[lp].prefix, prefix, IP_KEYSIZE) == 0)) {
+			block = &slot->block[lp];
+			break;
+		}
+		if (!slot->block[lp].used || (fewest->used && (slot->block[lp].count < fewest->count)))
+			fewest = &slot->block[lp];
+	}
+	if (block == NULL) {
+		/* a new /24 - the smallest one makes way; the count still has its addresses */
+		block = fewest;
+		memset(block, 0, sizeof(struct scanblock));
+		memcpy(block->prefix, prefix, IP_KEYSIZE);
+		block->used = 1;
+	}
+	if (block->bits[last >> 5] & (1U << (last & 31)))
+		return 0;
+	block->bits[last >> 5] |= 1U << (last & 31);
+	block->count++;
+	return 1;
+}
+
+/**
+ * Start a requester's count afresh.
+ */
+static void clearcount(struct requester *slot){
+	memset(slot->registers, 0, sizeof(slot->registers));
+	slot->harmonic = SCAN_REGISTERS;
+	slot->zeros = SCAN_REGISTERS;
+	slot->distinct = 0;
+}
+
+/**
+ * Add an address to a requester's HyperLogLog, and work out the count again
+ * if that changed it.
+ */
+static void counttarget(struct requester *slot, const u_int8_t *target){
+	u_int32_t hash;
+	unsigned int index, rank, old;
+	double count;
+	hash = hashbytes(target, IP_KEYSIZE, SCAN_HASHSEED);
+	index = hash & (SCAN_REGISTERS - 1);
+	hash >>= SCAN_INDEXBITS;
+	for (rank = 1; (rank < SCAN_RANKMAX) && !(hash & 1); rank++)
+		hash >>= 1;
+	old = (slot->registers[index >> 1] >> ((index & 1) * 4)) & 0x0f;
+	if (rank <= old)
+		return;
+	slot->registers[index >> 1] = (slot->registers[index >> 1] & ~(0x0f << ((index & 1) * 4))) | (rank << ((index & 1) * 4));
+	slot->harmonic += 1.0 / (1 << rank) - 1.0 / (1 << old);
+	if (old == 0)
+		slot->zeros--;
+	count = 0.7213 / (1.0 + 1.079 / SCAN_REGISTERS) * SCAN_REGISTERS * SCAN_REGISTERS / slot->harmonic;
+	if ((count <= 2.5 * SCAN_REGISTERS) && (slot->zeros != 0))
+		count = SCAN_REGISTERS * log((double)SCAN_REGISTERS / slot->zeros);
+	slot->distinct = (unsigned long)(count + 0.5);
+}
+
+/**
+ * Count a request against its requester, alerting if it's scanning.
+ *
+ * ARGUMENTS:
+ * \arg \c *seen - What the frame says - a request.
+ * \arg \c vlan - The VLAN it was on, as untagframe() gives it.
+ *
+ * RETURN VALUES:
+ * \return OK - Nothing unusual about the requester.
+ * \return ERR_HEAVYHITTER - It's scanning. What it asks about should still be
+ * checked against records we already hold, but shouldn't make new ones.
+ */
+int scanrequest(const struct observation *seen, u_int32_t vlan){
+	struct requester *slot;
+	long now;
+	if (options.scan_threshold == 0)
+		return OK;
+	now = time(NULL);
+	slot = findrequester(seen, vlan, now);
+	if (now - slot->windowstart >= options.sketch_window) {
+		memset(slot->block, 0, sizeof(slot->block));
+		clearcount(slot);
+		slot->alerted = 0;
+		slot->windowstart = now;
+	}
+	if (addtarget(slot, seen->key))
+		counttarget(slot, seen->key);
+	if (slot->distinct <= options.scan_threshold)
+		return OK;
+	if (!slot->alerted) {
+		slot->alerted = 1;
+		raiseaddressalert(ALERT_SCAN, slot->address, slot->family, vlan, NULL, slot->mac, slot->distinct);
+	}
+	return ERR_HEAVYHITTER;
+}
@@ -0,0 +1,166 @@
+/* -*- project-c -*- */
+/**
+ * \file sharedstate.c
+ * \brief Publishing a live view of the IP table in shared memory.
+ *
+ * DETAILS.csv is rewritten now and then, and is all anyone outside the process
+ * can see of the table. With options.shared_state set, we also keep a POSIX
+ * shared memory segment of that name (see sharedstate.h for the layout) up to
+ * date as we go: every record gets a fixed slot, and every time a frame changes
+ * a record its slot is rewritten under the slot's sequence number (a seqlock).
+ *
+ * Readers map the segment read-only and never make a system call or take a
+ * lock to look at it; if they catch a slot mid-update they simply read it
+ * again. Capture never waits for them - writing a slot is two increments and a
+ * couple of dozen bytes of copying.
+ *
+ * There's a slot for every record options.max_records allows - the whole
+ * table, full. Slots are handed out when a record is first published and
+ * returned when it's removed; records which find none left (there shouldn't
+ * be any) are counted in header->unpublished.
+ */
+
+#include "antidote.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+static struct sharedheader *header = NULL;
+static struct sharedrecord *slots = NULL;
+static size_t segmentsize = 0;
+static u_int32_t *freeslots = NULL; /* stack of free slot numbers */
+static u_int32_t freecount = 0;
+static u_int64_t unpublished = 0;
+
+/**
+ * Create (or recreate) the shared memory segment named in options.shared_state.
+ *
+ * RETURN VALUES:
+ * \return OK - The segment is ready, or none was asked for.
+ * \return ERR_NOMEM
+ * \return ERR_SHAREDSTATE - The segment couldn't be created or mapped.
+ */
+int opensharedstate(){
+	u_int32_t capacity, lp;
+	int fd;
+	void *segment;
+	if (options.shared_state[0] == '\0')
+		return OK;
+	capacity = options.max_records + 1; /* the entry point, and everything makeroom() allows */
+	freeslots = malloc(capacity * sizeof(u_int32_t));
+	if (freeslots == NULL)
+		return ERR_NOMEM;
+	/* hand out low slots first, so readers needn't look far */
+	for (lp = 0; lp < capacity; lp++)
+		freeslots[lp] = capacity - lp;
+	freecount = capacity;
+
+	segmentsize = sizeof(struct sharedheader) + capacity * sizeof(struct sharedrecord);
+	shm_unlink(options.shared_state); /* start clean; old readers keep their old mapping */
+	fd = shm_open(options.shared_state, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1)
+		return ERR_SHAREDSTATE;
+	if (ftruncate(fd, segmentsize) == -1) {
+		close(fd);
+		shm_unlink(options.shared_state);
+		return ERR_SHAREDSTATE;
+	}
+	segment = mmap(NULL, segmentsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		shm_unlink(options.shared_state);
+		return ERR_SHAREDSTATE;
+	}
+	header = segment;
+	slots = (struct sharedrecord *)(header + 1);
+	header->version = SHARED_VERSION;
+	header->capacity = capacity;
+	header->highwater = 0;
+	header->recordsize = sizeof(struct sharedrecord);
+	header->pid = getpid();
+	header->poison_threshold = options.poison_threshold;
+	header->badnet_threshold = options.badnet_threshold;
+	/* the magic number goes last, so a reader never trusts a half-built header */
+	__atomic_store_n(&header->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+	publishstats();
+	atexit(closesharedstate);
+	return OK;
+}
+
+/**
+ * Copy a record into its slot, giving it one first if it hasn't got one.
+ */
+void publiship(struct ipdetails *ip){
+	struct sharedrecord *slot;
+	if ((header == NULL) || (ip == NULL))
+		return;
+	if (ip->slot == 0) {
+		if (freecount == 0) {
+			unpublished++;
+			return;
+		}
+		ip->slot = freeslots[--freecount];
+		if (ip->slot > header->highwater)
+			__atomic_store_n(&header->highwater, ip->slot, __ATOMIC_RELEASE);
+	}
+	slot = &slots[ip->slot - 1];
+	sharedbeginwrite(&slot->sequence);
+	slot->inuse = 1;
+	slot->ipversion = (ip->partition->family == AF_INET6) ? 6 : 4;
+	memcpy(slot->ip_address, ip->ip_address, IP_KEYSIZE);
+	memcpy(slot->mac_address, ip->mac_address, ETH_ALEN);
+	slot->requests = ip->requests;
+	slot->replies = ip->replies;
+	slot->vlan = ip->partition->vlan;
+	slot->lastreset = ip->lastreset;
+	sharedendwrite(&slot->sequence);
+}
+
+/**
+ * Empty a record's slot and take it back, because the record is going away.
+ */
+void unpubliship(struct ipdetails *ip){
+	struct sharedrecord *slot;
+	if ((header == NULL) || (ip == NULL) || (ip->slot == 0))
+		return;
+	slot = &slots[ip->slot - 1];
+	sharedbeginwrite(&slot->sequence);
+	slot->inuse = 0;
+	sharedendwrite(&slot->sequence);
+	freeslots[freecount++] = ip->slot;
+	ip->slot = 0;
+}
+
+/**
+ * Bring the counters in the header up to date. Called every tick.
+ */
+void publishstats(){
+	if (header == NULL)
+		return;
+	sharedbeginwrite(&header->sequence);
+	header->updated = time(NULL);
+	header->records = recordcount();
+	header->evictions = evictioncount();
+	header->unpublished = unpublished;
+	header->overloaded = overloadstate();
+	header->shedrate = options.shed_rate;
+	header->shed = shedcount();
+	header->sampled = sampledcount();
+	header->overloads = overloadcount();
+	header->duplicates = duplicatecount();
+	sharedendwrite(&header->sequence);
+}
+
+/**
+ * Remove the segment on the way out. Readers which still have it mapped can
+ * carry on looking at the last state we left.
+ */
+void closesharedstate(){
+	if (header == NULL)
+		return;
+	publishstats();
+	munmap(header, segmentsize);
+	shm_unlink(options.shared_state);
+	header = NULL;
+	slots = NULL;
+}
@@ -0,0 +1,105 @@
+/* -*- project-c -*- */
+/**
+ * \file sharedstate.h
+ * \brief Layout of the shared-memory view of the IP table.
+ *
+ * Shared between antidote (which writes it - see sharedstate.c) and anything
+ * which wants to read it, such as antidote-top. Deliberately free of pcap and
+ * everything else in antidote.h so that readers don't need them.
+ *
+ * The segment is a struct sharedheader followed by header.capacity
+ * struct sharedrecord slots. Each slot has its own sequence number, and is
+ * read like this:
+ *
+ * - read sequence; if it's odd the slot is being written, so try again
+ * - copy the slot
+ * - read sequence again; if it has changed, the copy may be torn, so try again
+ *
+ * sharedread() does exactly that, and sharedbeginwrite() and sharedendwrite()
+ * are the other side of it. Readers never write to the segment. (antidote
+ * uses the same three for the records of its own table - see epoch.c.)
+ */
+
+#ifndef SHAREDSTATE_H
+#define SHAREDSTATE_H
+
+#include <sys/types.h>
+#include <string.h>
+
+#define SHARED_MAGIC 0x41444f54 /* "ADOT" */
+#define SHARED_VERSION 5 /* 2: records carry their VLAN; 3: and IPv6 addresses; 4: shedding counters; 5: duplicates */
+#define SHAREDSTATENAME "/antidote" /* the name readers look for if not told otherwise */
+
+struct sharedheader {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int32_t capacity; /* record slots following the header */
+	u_int32_t highwater; /* slots at or beyond this have never been used */
+	u_int32_t recordsize; /* sizeof(struct sharedrecord), as the writer saw it */
+	int32_t pid; /* of the writer */
+	int32_t poison_threshold; /* so readers can flag what antidote would */
+	int32_t badnet_threshold;
+	volatile u_int32_t sequence; /* guards the counters below */
+	u_int32_t pad;
+	int64_t updated; /* time the counters were last written */
+	u_int64_t records; /* held in the table */
+	u_int64_t evictions;
+	u_int64_t unpublished; /* records which didn't get a slot */
+	u_int32_t overloaded; /* non-zero while ARP requests are being shed - see overload.c */
+	u_int32_t shedrate; /* 1 in this many is counted while they are */
+	u_int64_t shed; /* requests shed, ever */
+	u_int64_t sampled; /* requests kept, and counted as shedrate, while shedding */
+	u_int64_t overloads; /* times we've become overloaded */
+	u_int64_t duplicates; /* frames ignored as copies of one just seen - see dedup.c */
+};
+
+struct sharedrecord {
+	volatile u_int32_t sequence; /* odd while being written */
+	u_int8_t inuse;
+	u_int8_t ipversion; /* 4, or 6 */
+	u_int8_t mac_address[6];
+	u_int8_t ip_address[16]; /* an IPv4 address is the first 4 */
+	u_int32_t requests;
+	u_int32_t replies;
+	u_int32_t vlan; /* 0 for untagged; see VLAN_KEY() in antidote.h */
+	int64_t lastreset;
+};
+
+/**
+ * Start changing something guarded by *SEQUENCE: make the sequence odd, and
+ * make sure readers see that before they see any of the new contents. Only
+ * ever one writer at a time.
+ */
+static inline void sharedbeginwrite(volatile u_int32_t *sequence){
+	__atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Finish a change: make the sequence even again, after all the new contents.
+ */
+static inline void sharedendwrite(volatile u_int32_t *sequence){
+	__atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Take a consistent copy of COUNT bytes at SRC, guarded by *SEQUENCE.
+ * \return 1 if the copy is good, 0 if the writer kept getting in the way.
+ */
+static inline int sharedread(const volatile u_int32_t *sequence, const void *src, void *dest, size_t count){
+	u_int32_t before, after;
+	int tries;
+	for (tries = 0; tries < 100; tries++) {
+		before = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+		memcpy(dest, src, count);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(sequence, __ATOMIC_RELAXED);
+		if (before == after)
+			return 1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/* -*- project-c -*- */
+/**
+ * \file sketch.c
+ * \brief Fixed-memory flood and sweep detection, ahead of the IP table.
+ *
+ * The IP table keeps exact details for every address it sees, which is exactly
+ * wrong when someone sprays forged ARP with random addresses: each record looks
+ * innocent, and there are far too many of them. This module looks at the same
+ * frames with a couple of probabilistic structures whose size never changes:
+ *
+ * - A count-min sketch, keyed by source MAC, estimating how many frames each
+ *   machine has sent in the current window. It can overestimate (when MACs
+ *   collide in every row) but never underestimates.
+ * - An array of small HyperLogLog counters, again picked by source MAC,
+ *   estimating how many distinct IP addresses those machines have asked about
+ *   or answered for in the current window.
+ *
+ * Both are cleared at the end of every window (options.sketch_window seconds).
+ * A MAC which goes over options.flood_threshold frames, or over
+ * options.sweep_threshold distinct addresses, is alerted on once per window,
+ * and sketchframe() tells the caller not to create new IP records on its behalf.
+ *
+ * ARP and neighbour discovery go through the same sketches: a machine spraying
+ * both is one machine, and its frames and addresses are counted together.
+ */
+
+#include "antidote.h"
+
+#define CMS_DEPTH 4
+#define CMS_WIDTH 2048 /* must be a power of 2 */
+#define HLL_BUCKETS 1024 /* must be a power of 2 */
+#define HLL_BITS 6 /* 64 registers per counter, about 13% error */
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define ALERTED_BITS 4096 /* must be a power of 2 */
+
+static u_int32_t cms[CMS_DEPTH][CMS_WIDTH];
+static u_int8_t hll[HLL_BUCKETS][HLL_REGISTERS];
+static u_int8_t alerted[ALERTED_BITS / 8];
+static long windowstart = 0;
+
+/**
+ * A quick 32 bit hash of COUNT bytes starting at *data. FNV-1a, with the seed
+ * folded into the offset basis and a final avalanche so that every bit of the
+ * result is usable on its own.
+ *
+ * Nothing about this is cryptographic - someone who knows the seed can make
+ * collisions - but it's cheap and spreads MACs and IPs about nicely.
+ */
+u_int32_t hashbytes(const u_int8_t *data, int count, u_int32_t seed){
+	u_int32_t result = 2166136261U ^ seed;
+	int lp;
+	for (lp = 0; lp < count; lp++) {
+		result ^= data[lp];
+		result *= 16777619U;
+	}
+	result ^= result >> 16;
+	result *= 0x85ebca6bU;
+	result ^= result >> 13;
+	result *= 0xc2b2ae35U;
+	result ^= result >> 16;
+	return result;
+}
+
+/**
+ * Add one to the count-min sketch for a MAC, and return the new estimate.
+ * This is the conservative-update variant: only the rows holding the current
+ * minimum are incremented, which keeps collisions from inflating everyone else.
+ */
+static u_int32_t cmsadd(const u_int8_t *mac){
+	u_int32_t *cell[CMS_DEPTH];
+	u_int32_t minimum = 0xffffffffU;
+	int row;
+	for (row = 0; row < CMS_DEPTH; row++) {
+		cell[row] = &cms[row][hashbytes(mac, ETH_ALEN, row) & (CMS_WIDTH - 1)];
+		if (*cell[row] < minimum)
+			minimum = *cell[row];
+	}
+	for (row = 0; row < CMS_DEPTH; row++) {
+		if (*cell[row] == minimum)
+			(*cell[row])++;
+	}
+	return minimum + 1;
+}
+
+/**
+ * Add an IP address to one of the HyperLogLog counters.
+ */
+static void hlladd(u_int8_t *registers, const u_int8_t *ipaddress, int length){
+	u_int32_t hash;
+	u_int8_t rank = 1;
+	hash = hashbytes(ipaddress, length, 0x9e3779b9U);
+	/* low bits pick the register, the rest give the rank. */
+	registers += hash & (HLL_REGISTERS - 1);
+	hash >>= HLL_BITS;
+	while (((hash & 1) == 0) && (rank <= 32 - HLL_BITS)) {
+		rank++;
+		hash >>= 1;
+	}
+	if (*registers < rank)
+		*registers = rank;
+}
+
+/**
+ * Estimate the number of distinct addresses in one of the HyperLogLog counters.
+ * Uses linear counting while there are still empty registers, since the raw
+ * estimate is hopeless for small cardinalities.
+ */
+static unsigned long hllestimate(const u_int8_t *registers){
+	double sum = 0.0, estimate;
+	int lp, empty = 0;
+	for (lp = 0; lp < HLL_REGISTERS; lp++) {
+		sum += 1.0 / (double)(1UL << registers[lp]);
+		if (registers[lp] == 0)
+			empty++;
+	}
+	estimate = 0.709 * HLL_REGISTERS * HLL_REGISTERS / sum;
+	if ((estimate <= 2.5 * HLL_REGISTERS) && (empty > 0))
+		estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / (double)empty);
+	return (unsigned long)(estimate + 0.5);
+}
+
+/**
+ * Test and set the "already alerted this window" bit for a MAC.
+ * \return 1 if the bit was already set, 0 if this is the first time.
+ */
+static int alertedalready(const u_int8_t *mac, u_int32_t salt){
+	u_int32_t bit;
+	bit = hashbytes(mac, ETH_ALEN, 0x51ed270bU ^ salt) & (ALERTED_BITS - 1);
+	if (alerted[bit >> 3] & (1 << (bit & 7)))
+		return 1;
+	alerted[bit >> 3] |= (1 << (bit & 7));
+	return 0;
+}
+
+/**
+ * Throw everything away and start a new window.
+ */
+void sketchreset(long now){
+	memset(cms, 0, sizeof(cms));
+	memset(hll, 0, sizeof(hll));
+	memset(alerted, 0, sizeof(alerted));
+	windowstart = now;
+}
+
+/**
+ * Run a frame through the sketches, alerting if its sender has gone over either
+ * threshold in the current window.
+ *
+ * ARGUMENTS:
+ * \arg \c *seen - What the frame says.
+ *
+ * RETURN VALUES:
+ * \return OK - Nothing unusual about the sender.
+ * \return ERR_HEAVYHITTER - The sender is flooding or sweeping. Its frames
+ * should still be checked against records we already hold, but shouldn't be
+ * allowed to create new ones.
+ */
+int sketchframe(const struct observation *seen){
+	const u_int8_t *mac;
+	u_int8_t *registers;
+	u_int32_t frames;
+	unsigned long distinct;
+	int result = OK;
+	long now;
+
+	now = time(NULL);
+	if ((now - windowstart) >= options.sketch_window)
+		sketchreset(now);
+
+	mac = seen->ether_mac;
+	frames = cmsadd(mac);
+	registers = hll[hashbytes(mac, ETH_ALEN, 0x27d4eb2fU) & (HLL_BUCKETS - 1)];
+	/* the address the IP table files the frame under */
+	hlladd(registers, seen->key, (seen->family == AF_INET6) ? IP_KEYSIZE : 4);
+
+	if ((options.flood_threshold > 0) && (frames > options.flood_threshold)) {
+		result = ERR_HEAVYHITTER;
+		if (alertedalready(mac, 0) == 0)
+			raisealert(ALERT_FLOOD, NULL, NULL, mac, frames);
+	}
+	/*
+	 * Nobody can ask about N distinct addresses in fewer than N frames, so the
+	 * frame count doubles as a check against MACs sharing a counter.
+	 */
+	if ((options.sweep_threshold > 0) && (frames > options.sweep_threshold)) {
+		distinct = hllestimate(registers);
+		if (distinct > options.sweep_threshold) {
+			result = ERR_HEAVYHITTER;
+			if (alertedalready(mac, 1) == 0)
+				raisealert(ALERT_SWEEP, NULL, NULL, mac, distinct);
+		}
+	}
+	return result;
+}
@@ -0,0 +1,238 @@
+/* -*- project-c -*- */
+/**
+ * \file vlan.c
+ * \brief Tagged frames, and an IP table for each VLAN.
+ *
+ * A mirror port on a trunk hands us ARP frames with an 802.1Q tag, or two of
+ * them (QinQ: an 802.1ad or old-style 0x9100 service tag, then the customer's
+ * 802.1Q tag), between the Ethernet addresses and the ARP packet. Everything
+ * that reads frames expects the ARP packet straight after a plain struct
+ * ether_header, so untagframe() takes the tags out: a tagged frame is copied,
+ * less its tags, into a buffer of the caller's, and the VLAN it was on comes
+ * back separately. Untagged frames are used where they are. Neighbour
+ * discovery (see ndisc.c) is read where it lies, past the tags, with
+ * framepayload().
+ *
+ * The same IP address can be in use in any number of VLANs, and in each it's
+ * a different host. So the IP table is partitioned: each VLAN (each pair of
+ * them, for QinQ) has a struct partition with its own list of records, its
+ * own count, its own eviction hand and its own limits - one for IPv4, and
+ * another for IPv6 once any is seen there. Records are only ever
+ * looked up, evicted and timed out within their own partition, so a broadcast
+ * storm in one VLAN fills and churns that VLAN's table and nobody else's.
+ *
+ * A partition holds up to options.max_records records, and forgets them
+ * options.timeout seconds after their last reset, unless a VlanTable line
+ * gives that VLAN limits of its own. But options.max_records is also the most
+ * the whole table holds, all partitions together: once it's full, a partition
+ * holding more than its share of it pays for new records with its own, and
+ * one holding less takes them from the biggest (see makeroom()). So however
+ * many VLANs there are, memory is bounded as it was with one table, and a
+ * storm in one VLAN still only churns that VLAN's records. Partitions are made as VLANs are first
+ * seen, and never freed - readers on other threads may be walking them. Once
+ * options.vlan_partitions of them exist for a family, any more VLANs share one
+ * last partition between them, and we say so (once).
+ */
+
+#include "antidote.h"
+
+#define VLAN_TPID_8021Q 0x8100
+#define VLAN_TPID_8021AD 0x88a8
+#define VLAN_TPID_QINQ 0x9100 /* before 802.1ad, some switches used this */
+#define VLAN_BUCKETS 256
+
+static struct partition *partitions = NULL; /* oldest first, through ->next */
+static struct partition *lastpartition = NULL; /* most recently made */
+static struct partition *buckets[VLAN_BUCKETS];
+static struct partition *lastfound = NULL; /* frames tend to come in runs from one VLAN */
+static unsigned long partitioncount[2] = { 0, 0 }; /* IPv4, IPv6 */
+
+/**
+ * Find what a frame carries, past any VLAN tags.
+ *
+ * ARGUMENTS:
+ * \arg \c *frame - The frame as captured.
+ * \arg \c caplen - How much of it there is.
+ * \arg \c *type - Set to the EtherType after the tags.
+ * \arg \c *vlan - Set to the VLAN the frame was on: VLAN_KEY() of its tags, or
+ * 0 if it had none.
+ *
+ * \return Where the payload starts, just after the EtherType, or NULL if the
+ * frame is too short or has more than VLAN_TAGS tags. Nothing is said about
+ * how much payload was captured.
+ */
+const u_char *framepayload(const u_char *frame, bpf_u_int32 caplen, u_int16_t *type, u_int32_t *vlan){
+	const u_char *field;
+	u_int16_t tpid, outer = 0, inner = 0;
+	int tags = 0;
+	field = frame + 2 * ETH_ALEN;
+	for (;;) {
+		if (caplen < (bpf_u_int32)(field - frame) + 2)
+			return NULL;
+		tpid = (field[0] << 8) | field[1];
+		if ((tpid != VLAN_TPID_8021Q) && (tpid != VLAN_TPID_8021AD) && (tpid != VLAN_TPID_QINQ))
+			break;
+		if ((++tags > VLAN_TAGS) || (caplen < (bpf_u_int32)(field - frame) + VLAN_TAGSIZE))
+			return NULL;
+		outer = inner;
+		inner = ((field[2] << 8) | field[3]) & 0x0fff;
+		field += VLAN_TAGSIZE;
+	}
+	*type = tpid;
+	*vlan = VLAN_KEY(outer, inner);
+	return field + 2;
+}
+
+/**
+ * Find the ARP packet in a frame, past any VLAN tags.
+ *
+ * ARGUMENTS:
+ * \arg \c *frame - The frame as captured.
+ * \arg \c caplen - How much of it there is.
+ * \arg \c *untagged - Room for an Ethernet header and an ARP packet. A tagged
+ * frame is copied here without its tags.
+ * \arg \c *vlan - Set to the VLAN the frame was on: VLAN_KEY() of its tags, or
+ * 0 if it had none.
+ *
+ * \return The frame as everything else expects it - *frame itself if it had
+ * no tags, or *untagged - or NULL if it's too short, has more than VLAN_TAGS
+ * tags, or isn't ARP after all.
+ */
+const u_char *untagframe(const u_char *frame, bpf_u_int32 caplen, u_char *untagged, u_int32_t *vlan){
+	const u_char *payload;
+	u_int16_t type;
+	payload = framepayload(frame, caplen, &type, vlan);
+	if ((payload == NULL) || (type != ETHERTYPE_ARP)
+			|| (caplen < (bpf_u_int32)(payload - frame) + sizeof(struct ether_arp)))
+		return NULL;
+	if (payload == frame + sizeof(struct ether_header))
+		return frame;
+	memcpy(untagged, frame, 2 * ETH_ALEN);
+	memcpy(untagged + 2 * ETH_ALEN, payload - 2, 2 + sizeof(struct ether_arp));
+	return untagged;
+}
+
+/**
+ * Read a VLAN as it's written in the configuration file and on the control
+ * socket: "100", or "100.20" for customer VLAN 20 inside service VLAN 100.
+ * \return 1 if it's a VLAN, 0 if not.
+ */
+int parsevlan(const char *text, u_int32_t *vlan){
+	unsigned int outer, inner;
+	char extra;
+	if (sscanf(text, "%u.%u%c", &outer, &inner, &extra) == 2) {
+		if ((outer > 0x0fff) || (inner > 0x0fff))
+			return 0;
+		*vlan = VLAN_KEY(outer, inner);
+		return 1;
+	}
+	if ((sscanf(text, "%u%c", &inner, &extra) != 1) || (inner > 0x0fff))
+		return 0;
+	*vlan = inner;
+	return 1;
+}
+
+/**
+ * Write a VLAN the way parsevlan() reads it - "other" for the partition shared
+ * by VLANs which didn't get one of their own. *dest must hold VLAN_NAMESIZE
+ * bytes.
+ */
+char *formatvlan(u_int32_t vlan, char *dest){
+	if (vlan == VLAN_OVERFLOW)
+		strcpy(dest, "other");
+	else if (VLAN_OUTER(vlan) != 0)
+		/* each half is 12 bits; masked, so the compiler can see it fits */
+		snprintf(dest, VLAN_NAMESIZE, "%u.%u", VLAN_OUTER(vlan) & 0x0fff, VLAN_INNER(vlan));
+	else
+		snprintf(dest, VLAN_NAMESIZE, "%u", VLAN_INNER(vlan));
+	return dest;
+}
+
+static unsigned int bucket(u_int32_t vlan, int family){
+	return ((vlan ^ ((family == AF_INET6) ? 0x5bd1e995u : 0)) * 2654435761u) >> 24;
+}
+
+/**
+ * Make a partition for a VLAN's addresses of one family, with whatever limits
+ * the options give it.
+ */
+static struct partition *makepartition(u_int32_t vlan, int family){
+	struct partition *table;
+	unsigned int lp;
+	table = calloc(1, sizeof(struct partition));
+	if (table == NULL)
+		return NULL;
+	table->vlan = vlan;
+	table->family = family;
+	table->max_records = options.max_records;
+	table->timeout = options.timeout;
+	for (lp = 0; lp < options.vlan_limit_count; lp++) {
+		if (options.vlan_limits[lp].vlan != vlan)
+			continue;
+		table->max_records = options.vlan_limits[lp].max_records;
+		if (options.vlan_limits[lp].timeout > 0)
+			table->timeout = options.vlan_limits[lp].timeout;
+	}
+	table->chain = buckets[bucket(vlan, family)];
+	buckets[bucket(vlan, family)] = table;
+	/* filled in, so readers on other threads may now find it */
+	if (lastpartition == NULL)
+		__atomic_store_n(&partitions, table, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&lastpartition->next, table, __ATOMIC_RELEASE);
+	lastpartition = table;
+	partitioncount[family == AF_INET6]++;
+	return table;
+}
+
+/**
+ * Find the partition of the IP table for a VLAN's addresses of one family.
+ *
+ * ARGUMENTS:
+ * \arg \c vlan - As untagframe() gives it.
+ * \arg \c family - AF_INET or AF_INET6.
+ * \arg \c create - Non-zero to make the partition if there isn't one yet. If
+ * there are already options.vlan_partitions for the family, its overflow
+ * partition is made (or found) instead.
+ *
+ * \return The partition, or NULL if there isn't one (and create was zero, or
+ * there's no memory).
+ */
+struct partition *findpartition(u_int32_t vlan, int family, int create){
+	struct partition *table;
+	char msg[ADOTE_ERR_BUFF], name[VLAN_NAMESIZE];
+	if ((lastfound != NULL) && (lastfound->vlan == vlan) && (lastfound->family == family))
+		return lastfound;
+	for (table = buckets[bucket(vlan, family)]; table != NULL; table = table->chain) {
+		if ((table->vlan == vlan) && (table->family == family))
+			return lastfound = table;
+	}
+	if (!create)
+		return NULL;
+	if (partitioncount[family == AF_INET6] >= options.vlan_partitions) {
+		table = findpartition(VLAN_OVERFLOW, family, 0);
+		if (table == NULL) {
+			snprintf(msg, sizeof(msg), "More than %lu VLANs seen (VLAN %s is the first left over) - the rest share one %s table. Consider raising VlanPartitions.",
+				 options.vlan_partitions, formatvlan(vlan, name), (family == AF_INET6) ? "IPv6" : "IP");
+			notice(msg);
+			table = makepartition(VLAN_OVERFLOW, family);
+		}
+		return table;
+	}
+	table = makepartition(vlan, family);
+	if (table != NULL)
+		lastfound = table;
+	return table;
+}
+
+/**
+ * \return The oldest partition, or NULL if there are none yet. The rest follow
+ * on through ->next (read with nextpartition() from other threads).
+ */
+struct partition *firstpartition(){
+	return __atomic_load_n(&partitions, __ATOMIC_ACQUIRE);
+}
+
+struct partition *nextpartition(struct partition *table){
+	return __atomic_load_n(&table->next, __ATOMIC_ACQUIRE);
+}